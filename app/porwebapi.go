@@ -2,7 +2,7 @@ package main
 
 /*
 #cgo CFLAGS: -I../include
-#cgo LDFLAGS: -L./ -lpor -lstdc++
+#cgo LDFLAGS: -L./ -lpor -lstdc++ -lpthread -lz
 #include "wrapper.h"
 #include <stdlib.h>
 */
@@ -13,17 +13,47 @@ import (
 	"flag"
 	"path/filepath"
 	"net/http"
+	"runtime"
 	"strconv"
-	"strings"
-	"encoding/json"
+	"sync"
 	"github.com/gin-gonic/gin"
 )
 
 func main() {
 	var path string
+	var sumTree bool
+	var shards int
+	var mapStrategy int
+	var numaInterleave bool
+	var warmup bool
+	var compressedIndex bool
+	var binaryRecords bool
+	var learnedIndex int
+	var idFilter bool
+	var cacheMB int
+	var poolMB int
+	var pruneLevels int
+	var singleFile bool
+	var sharedMemory string
+	var assets int
 	flag.StringVar(&path, "p", "", "path to por db")
+	flag.BoolVar(&sumTree, "sum", false, "build merkle sum tree")
+	flag.IntVar(&shards, "shards", 0, "split por db into shards by user id range")
+	flag.IntVar(&mapStrategy, "map", 0, "0: mmap+mlock, 1: MAP_POPULATE, 2: transparent huge page, 3: hugetlbfs")
+	flag.BoolVar(&numaInterleave, "numa", false, "interleave huge page copies over NUMA nodes")
+	flag.BoolVar(&warmup, "warmup", false, "prefault por db in background, /ready reports 503 until done")
+	flag.BoolVar(&compressedIndex, "compress", false, "store user ids of index in Elias-Fano encoding")
+	flag.BoolVar(&binaryRecords, "binary", false, "store user records as fixed-width binary (id, balance)")
+	flag.IntVar(&learnedIndex, "learned", 0, "locate ids with a learned piecewise-linear model of this error bound, 0 means binary search")
+	flag.BoolVar(&idFilter, "filter", false, "reject unknown ids with an in-memory Bloom filter")
+	flag.IntVar(&cacheMB, "cache", 0, "cache responses of hot users within this many MB, 0 disables")
+	flag.IntVar(&poolMB, "pool", 0, "read por db with pread into a buffer pool of this many MB instead of mmap, 0 disables")
+	flag.IntVar(&pruneLevels, "prune", 0, "drop this many bottom merkle levels from the merkle file and rehash them per proof")
+	flag.BoolVar(&singleFile, "single", false, "keep por db in one file of page-aligned sections, not with -pool")
+	flag.IntVar(&assets, "assets", 1, "balance columns per user record, one per asset, not with -sum")
+	flag.StringVar(&sharedMemory, "shm", "", "attach to the por db por_loader published under this name, -p is not needed")
 	flag.Parse()
-	if path == "" {
+	if path == "" && sharedMemory == "" {
 		fmt.Println("Please specify Proof of Preserve DB path: ./app -p path")
 		return
 	}
@@ -36,7 +66,43 @@ func main() {
 
 	// Load PoR database
 	cStrPath := C.CString(absolutePath)
-    if 0 == C.LoadDB(cStrPath) {
+	var options C.struct_PoRLoadOptions
+	if sumTree {
+		options.sum_tree = 1
+	}
+	options.shards = C.int(shards)
+	options.map_strategy = C.int(mapStrategy)
+	if numaInterleave {
+		options.numa_interleave = 1
+	}
+	if warmup {
+		options.warmup = 1
+	}
+	if compressedIndex {
+		options.compressed_index = 1
+	}
+	if binaryRecords {
+		options.binary_records = 1
+	}
+	if learnedIndex > 0 {
+		options.learned_index = 1
+		options.learned_index_epsilon = C.int(learnedIndex)
+	}
+	if idFilter {
+		options.id_filter = 1
+	}
+	options.response_cache_mb = C.int(cacheMB)
+	options.buffer_pool_mb = C.int(poolMB)
+	options.merkle_dropped_levels = C.int(pruneLevels)
+	if singleFile {
+		options.single_file = 1
+	}
+	options.assets = C.int(assets)
+	if sharedMemory != "" {
+		options.shared_memory = C.CString(sharedMemory)
+		defer C.free(unsafe.Pointer(options.shared_memory))
+	}
+    if 0 == C.LoadDBWithOptions(cStrPath, &options) {
 		fmt.Println("Fail to load Proof of Preserve DB")
 		C.free(unsafe.Pointer(cStrPath))
         return
@@ -46,6 +112,15 @@ func main() {
 
 	// Start web api service
 	r := gin.Default()
+	// readiness probe for load balancer
+	r.GET("/ready", func(c *gin.Context) {
+		if C.DBReady() == 0 {
+			c.JSON(http.StatusServiceUnavailable, gin.H{"ready": false})
+			return
+		}
+
+		c.JSON(http.StatusOK, gin.H{"ready": true})
+	})
     r.GET("/por", func(c *gin.Context) {
 		id := c.Query("id")
 		userID, err := strconv.ParseUint(id, 10, 64)
@@ -59,9 +134,12 @@ func main() {
 		}
 
 	    cUserID := C.uint64_t(userID)
-	    info := C.UserInfo(cUserID)
+		// the library renders the whole response body into a pooled buffer
+		buffer := jsonBuffers.Get().(*jsonBuffer)
+		size := C.UserInfoJSON(cUserID, &buffer.data, &buffer.capacity)
 		// check if we find the user's info
-		if (info == nil) {
+		if (size == 0) {
+			jsonBuffers.Put(buffer)
 			c.JSON(http.StatusNotFound, gin.H{
 				"error_message": "Not Found",
 			})
@@ -69,61 +147,26 @@ func main() {
 			return
 		}
 
-		// assemble user info
-	    gInfo := C.GoString(info)
-	    C.free(unsafe.Pointer(info))
-		u := ParseUserInfo(gInfo)
-		jsonData, _ := json.Marshal(u)
-        c.JSON(http.StatusOK, gin.H{
-		  "error_message": "Success",
-          "user": json.RawMessage(jsonData),
-        })
+		body := C.GoBytes(unsafe.Pointer(buffer.data), C.int(size))
+		jsonBuffers.Put(buffer)
+		c.Data(http.StatusOK, "application/json; charset=utf-8", body)
     })
     r.Run()
 }
 
-// Parse user info
-//(8,8888) 0x6266ab587ef565a55daf01ff5101d1b40b4f4334c9ece68c130fe223a1a37c96
-//(left,0x33471d10e51b83e3419eba1f096203264d1e60de57522402827a4de50dee8375) (left,0x03b6089f6b1adf08e6f1b5c7f2eff348e3bcc97903216a726c62f358e97c1df1)
-//(left,0xfafe4ecc00e37d340d72f581fbbda4e179ad24bdc2f45713dcc2a38ebfc30439) 0xb1231de33da17c23cebd80c104b88198e0914b0463d0e14db163605b904a7ba3
-type user struct {
-	ID      uint64 `json:"id"`
-	Balance uint64 `json:"balance"`
-	Proof   merkleProof `json:"proof"`
+// Response buffer allocated by the library with malloc/realloc and reused
+// across requests, freed when the pool drops it
+type jsonBuffer struct {
+	data     *C.char
+	capacity C.size_t
 }
 
-type merkleNode struct {
-	Sibling string `json:"position"`
-	Hash    string `json:"node_hash"`
+var jsonBuffers = sync.Pool{
+	New: func() interface{} {
+		buffer := &jsonBuffer{}
+		runtime.SetFinalizer(buffer, func(b *jsonBuffer) {
+			C.free(unsafe.Pointer(b.data))
+		})
+		return buffer
+	},
 }
-
-type merkleProof struct {
-	Root     string `json:"merkle_root"`
-	UserHash string `json:"user_hash`
-	Path     []merkleNode `json:"merkle_path"`
-}
-
-func ParseUserInfo(info string) user {
-	var u user
-	// seperate each field by white space
-	fields := strings.Fields(info)
-
-	// parse user id and balance
-	s := strings.Trim(fields[0], "()");
-	id_balance := strings.Split(s, ",")
-	u.ID, _ = strconv.ParseUint(id_balance[0], 10, 64)
-    u.Balance, _ = strconv.ParseUint(id_balance[1], 10, 64)
-
-	// parse user data's hash and merkle root
-	u.Proof.UserHash = fields[1];
-	u.Proof.Root = fields[len(fields)-1]
-
-	// parse merkle proof path
-	for _, s := range fields[2:len(fields)-1] {
-		node := strings.Trim(s, "()")
-		node_fields := strings.Split(node, ",")
-		u.Proof.Path = append(u.Proof.Path, merkleNode{node_fields[0], node_fields[1]})
-	}
-
-	return u
-}
\ No newline at end of file
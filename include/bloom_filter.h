@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace crypto {
+// Split block Bloom filter over 64 bit keys: a key maps to one 256 bit block,
+// aligned within a cache line, and sets one bit in each of the block's eight
+// 32 bit words. A lookup is a single cache line probe. With 10 bits per key
+// the false positive rate is about 1%.
+//
+// serialized format: | block No# (64 bit) | blocks (256 bit each) |
+class BloomFilter {
+ public:
+  BloomFilter();
+  // empty filter sized for n keys
+  BloomFilter(uint64_t n, uint64_t bits_per_key);
+  ~BloomFilter();
+
+  void Add(uint64_t key);
+  bool MayContain(uint64_t key) const;
+
+  // copy blocks from serialized data and lock them in memory, returns false
+  // if size doesn't match the block count
+  bool Assign(const uint8_t* data, size_t size);
+  // drop all blocks, an empty filter may contain every key
+  void Reset();
+  // blocks, Bytes() in total
+  const uint8_t* Data() const;
+  size_t Bytes() const;
+  uint64_t Blocks() const { return blocks_; }
+
+ private:
+  struct block {
+    alignas(32) uint32_t words[8];
+  };
+  struct freer {
+    void operator()(block* p) const;
+  };
+  // allocate zeroed blocks, aligned to cache line
+  void allocate(uint64_t blocks);
+  void unlock();
+  const block& locate(uint64_t key, uint32_t& hash) const;
+
+  uint64_t blocks_;
+  std::unique_ptr<block[], freer> data_;
+  bool locked_;
+};
+}  // namespace crypto
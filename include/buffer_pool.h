@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace crypto {
+// Fixed-size cache of file pages read with pread, for serving files larger
+// than the memory the process may use. Pages are split over lock-striped
+// shards by page number and evicted with CLOCK; a miss reads the page under
+// its shard's lock. Pinned pages are read once up front and never evicted.
+class BufferPool {
+ public:
+  // byte_budget for evictable pages, pinned pages come on top of it
+  BufferPool(size_t byte_budget, size_t page_size = 4096,
+             size_t shard_count = 16);
+
+  // copy size bytes at offset of fd into out, false if they are beyond the
+  // end of file or can't be read
+  bool Read(int fd, uint64_t offset, size_t size, void* out);
+  // read the pages covering [offset, offset + size) of fd and keep them, not
+  // safe against concurrent Read
+  bool Pin(int fd, uint64_t offset, size_t size);
+  void Clear();
+
+  size_t PageSize() const { return page_size_; }
+  // memory held by frames and pinned pages
+  size_t Bytes() const;
+  size_t PinnedBytes() const;
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+  uint64_t Evictions() const { return evictions_; }
+
+ private:
+  struct frame {
+    uint64_t key = 0;
+    // valid bytes, less than a page at end of file
+    uint32_t length = 0;
+    bool used = false;
+    // CLOCK reference bit, set on hit
+    bool referenced = false;
+  };
+  // pinned pages of fd from offset begin, data ends at end of file or at a
+  // page boundary
+  struct pinnedrange {
+    int fd;
+    uint64_t begin;
+    std::vector<uint8_t> data;
+  };
+  struct shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, size_t> slots;
+    std::vector<frame> frames;
+    std::unique_ptr<uint8_t[]> pages;
+    size_t hand = 0;
+  };
+
+  static uint64_t pageKey(int fd, uint64_t page);
+  // pread a whole page, returns bytes read or -1
+  int64_t readPage(int fd, uint64_t page, uint8_t* out) const;
+  // frame holding the page, loaded on a miss, under shard lock
+  const frame* fetch(shard& s, int fd, uint64_t page, const uint8_t*& data);
+  // CLOCK: give referenced frames a second chance, free the first other one
+  size_t evict(shard& s);
+
+  size_t page_size_;
+  size_t frames_per_shard_;
+  std::vector<std::unique_ptr<shard>> shards_;
+  // few ranges, scanned before the shards on every read
+  std::vector<pinnedrange> pinned_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> evictions_{0};
+};
+}  // namespace crypto
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace crypto {
+// Elias-Fano encoding of a non-decreasing sequence of n integers in
+// [0, universe]: each value is split into l = log2(universe / n) low bits,
+// stored verbatim, and high bits, stored in unary in a bitvector of about 2n
+// bits. It takes about 2 + log2(universe / n) bits per value, and with a
+// select sample every 256 ones/zeros, both Get and LowerBound touch only a
+// few cache lines.
+//
+// serialized format, all 64 bit words:
+// | n | l | upper bit No# | lower word No# | upper word No# |
+// | select1 sample No# | select0 sample No# | lower words | upper words |
+// | select1 samples | select0 samples |
+class EliasFano {
+ public:
+  // build the encoding from values added in order
+  class Builder {
+   public:
+    Builder(uint64_t n, uint64_t universe);
+    // returns false if value breaks the order or exceeds universe
+    bool Add(uint64_t value);
+    // serialized words, empty if not all n values are added
+    std::vector<uint64_t> Finish();
+
+   private:
+    uint64_t n_;
+    uint64_t universe_;
+    uint64_t l_;
+    uint64_t added_;
+    uint64_t last_;
+    std::vector<uint64_t> lower_;
+    std::vector<uint64_t> upper_;
+  };
+
+  EliasFano();
+  // view over serialized words, which must outlive this object
+  explicit EliasFano(const uint64_t* data);
+
+  uint64_t Size() const { return n_; }
+  // number of 64 bit words of the serialized form
+  size_t Words() const;
+  uint64_t Get(uint64_t i) const;
+  // position of the first value >= v, Size() if there is none
+  uint64_t LowerBound(uint64_t v) const;
+
+ private:
+  uint64_t lower(uint64_t i) const;
+  // position of i-th one/zero in upper bits
+  uint64_t select1(uint64_t i) const;
+  uint64_t select0(uint64_t i) const;
+
+  const static uint64_t kSampleRate = 256;
+
+  uint64_t n_;
+  uint64_t l_;
+  uint64_t upper_bits_;
+  uint64_t lower_words_;
+  uint64_t upper_words_;
+  uint64_t select1_samples_;
+  uint64_t select0_samples_;
+  const uint64_t* lower_;
+  const uint64_t* upper_;
+  const uint64_t* select1_;
+  const uint64_t* select0_;
+};
+}  // namespace crypto
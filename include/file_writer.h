@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace crypto {
+// Sequential file writer for preprocessing output. Data is gathered in a few
+// large aligned buffers, and a full buffer is submitted through io_uring while
+// the caller keeps hashing and filling the next one. Falls back to pwrite if
+// io_uring isn't available (older kernels, or disabled by seccomp/sysctl).
+class FileWriter {
+ public:
+  FileWriter(size_t buffer_size = 1 << 20, size_t buffer_count = 4);
+  ~FileWriter();
+
+  // create or truncate file, direct_io opens it with O_DIRECT if the file
+  // system supports it
+  bool Open(const std::string& file, bool direct_io, bool use_io_uring);
+  // open an existing file, cut it to size and append after that, used to
+  // resume an interrupted build
+  bool Reopen(const std::string& file, uint64_t size, bool direct_io,
+              bool use_io_uring);
+  // append data at the end of file
+  bool Append(const uint8_t* data, size_t size);
+  bool Append(const std::vector<uint8_t>& data);
+  // wait until all appended data reaches the file, so it can be read back
+  bool Flush();
+  // flush and make written data durable
+  bool Sync();
+  // synchronously overwrite already flushed data, e.g. a header
+  bool WriteAt(uint64_t offset, const std::vector<uint8_t>& data);
+  // flush and close the file
+  bool Close();
+
+  uint64_t Size() const { return size_; }
+  bool UsingIoUring() const { return ring_ != nullptr; }
+
+ private:
+  struct buffer {
+    uint8_t* data;
+    // bytes filled in this buffer
+    size_t used;
+    // file offset of the first byte, aligned in direct io mode
+    uint64_t offset;
+    // submitted to io_uring and not completed yet
+    bool busy;
+  };
+
+  struct uring;
+
+  bool open(const std::string& file, uint64_t size, bool truncate,
+            bool direct_io, bool use_io_uring);
+  bool submit(size_t index);
+  bool writeSync(const uint8_t* data, size_t size, uint64_t offset);
+  // reap at least one io_uring completion
+  bool waitOne();
+  bool waitAll();
+  bool setupRing(unsigned entries);
+  void closeRing();
+
+  size_t buffer_size_;
+  size_t alignment_;
+  std::vector<buffer> buffers_;
+  size_t current_;
+  size_t in_flight_;
+  uint64_t size_;
+  int fd_;
+  // same file without O_DIRECT, for unaligned WriteAt and reading back tail
+  int plain_fd_;
+  bool failed_;
+  std::unique_ptr<uring> ring_;
+};
+}  // namespace crypto
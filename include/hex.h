@@ -0,0 +1,9 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace crypto {
+// Encode size bytes as 2 * size lowercase hex characters at out, without
+// terminating NUL. Uses AVX2 or SSSE3 nibble shuffles when the CPU has them.
+void HexEncode(const uint8_t* data, size_t size, char* out);
+}  // namespace crypto
@@ -0,0 +1,135 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace crypto {
+// Piecewise-linear learned index over a strictly increasing sequence of keys,
+// in the spirit of the PGM-index: keys are covered by segments, each mapping
+// a key to its position with at most epsilon error. Segment first keys are
+// indexed the same way recursively until a single segment remains, so a
+// lookup is one model evaluation per level plus a search over a window of
+// about 2 * epsilon positions. Clustered, sparse key spaces need only a few
+// segments per cluster.
+//
+// serialized format, all 64 bit words:
+// | n | epsilon | level No# | segment No# of each level, bottom-up |
+// | segments of each level, bottom-up: first key, slope bits, position |
+class LearnedIndex {
+ public:
+  // build the model from keys added in order
+  class Builder {
+   public:
+    explicit Builder(uint64_t epsilon);
+    // returns false if key is not greater than the previous one
+    bool Add(uint64_t key);
+    std::vector<uint64_t> Finish();
+
+   private:
+    struct segment {
+      uint64_t key;
+      double slope;
+      uint64_t position;
+    };
+    // greedy shrinking cone: extend the current segment while some slope
+    // keeps every point within epsilon
+    static void addPoint(std::vector<segment>& level, double& lo, double& hi,
+                         uint64_t epsilon, uint64_t key, uint64_t position);
+    static void closeSegment(std::vector<segment>& level, double lo,
+                             double hi);
+
+    uint64_t epsilon_;
+    uint64_t n_;
+    uint64_t last_;
+    double lo_;
+    double hi_;
+    std::vector<segment> segments_;
+  };
+
+  LearnedIndex();
+  // view over serialized words, which must outlive this object
+  explicit LearnedIndex(const uint64_t* data);
+
+  uint64_t Size() const { return n_; }
+  // error bound the model was built with, which may differ from the one
+  // requested when it is loaded
+  uint64_t Epsilon() const { return epsilon_; }
+  // number of 64 bit words of the serialized form
+  size_t Words() const;
+  uint64_t Segments() const;
+
+  // position of the first key >= key in the indexed sequence, key_at(i)
+  // returns the i-th key. Size() if there is none.
+  template <typename KeyAt>
+  uint64_t LowerBound(uint64_t key, KeyAt key_at) const;
+  // predicted position of key, LowerBound searches around it; lets callers
+  // prefetch the keys near it first
+  uint64_t Predict(uint64_t key) const;
+
+ private:
+  // walk the upper levels down to the bottom segment of key, returns the
+  // predicted position and the segment's range [begin, end)
+  uint64_t predictBottom(uint64_t key, uint64_t& begin, uint64_t& end) const;
+  // predicted position of key in the level below the segment, clamped to
+  // the segment's range [begin, end)
+  uint64_t predict(uint64_t level, uint64_t i, uint64_t key, uint64_t& begin,
+                   uint64_t& end) const;
+  uint64_t segmentKey(uint64_t level, uint64_t i) const {
+    return segments_[level][i * 3];
+  }
+  // first position in [begin, end) with key_at(position) > key (upper) or
+  // >= key, searching around predicted position p first
+  template <typename KeyAt>
+  uint64_t search(uint64_t key, bool upper, uint64_t begin, uint64_t end,
+                  uint64_t p, KeyAt key_at) const;
+
+  uint64_t n_;
+  uint64_t epsilon_;
+  uint64_t levels_;
+  const uint64_t* counts_;
+  std::vector<const uint64_t*> segments_;
+};
+
+template <typename KeyAt>
+uint64_t LearnedIndex::search(uint64_t key, bool upper, uint64_t begin,
+                              uint64_t end, uint64_t p, KeyAt key_at) const {
+  auto before = [key, upper](uint64_t k) { return upper ? k <= key : k < key; };
+
+  // the answer is within epsilon of the prediction, widen the window
+  // exponentially in case floating point rounding pushed it out
+  uint64_t w = epsilon_ + 2;
+  uint64_t lo = p > begin + w ? p - w : begin;
+  uint64_t hi = p + w < end ? p + w : end;
+  while (lo > begin && !before(key_at(lo - 1))) {
+    w *= 2;
+    lo = lo > begin + w ? lo - w : begin;
+  }
+  while (hi < end && before(key_at(hi))) {
+    w *= 2;
+    hi = hi + w < end ? hi + w : end;
+  }
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (before(key_at(mid))) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+template <typename KeyAt>
+uint64_t LearnedIndex::LowerBound(uint64_t key, KeyAt key_at) const {
+  if (n_ == 0 || key <= segmentKey(0, 0)) {
+    return 0;
+  }
+
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  uint64_t p = predictBottom(key, begin, end);
+  // the answer may be the first position of the next segment
+  return search(key, false, begin, end < n_ ? end + 1 : end, p, key_at);
+}
+}  // namespace crypto
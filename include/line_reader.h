@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+
+namespace crypto {
+// Sequential line reader for preprocessing input, plain text or gzip
+// compressed (detected by its magic bytes, concatenated members included).
+// A background thread reads, and inflates, blocks ahead of the caller
+// through a bounded queue of queue_depth buffers, so decompression overlaps
+// with parsing and hashing and the plain text never touches the disk.
+// Positions are offsets into the uncompressed text.
+class LineReader {
+ public:
+  LineReader(size_t block_size = 1 << 20, size_t queue_depth = 4);
+  ~LineReader();
+  LineReader(const LineReader&) = delete;
+  LineReader& operator=(const LineReader&) = delete;
+
+  // start reading file at offset, a compressed file is inflated from its
+  // start and the text before offset dropped. False if it can't be opened,
+  // or is compressed in a format that isn't supported (zstd, or gzip in a
+  // build without zlib).
+  bool Open(const std::string& file, uint64_t offset = 0);
+  // next line without its '\n', valid until the next call. The last line
+  // may lack the '\n'. False at the end of the input or if it failed.
+  bool Next(std::string_view& line);
+  // offset after the last line returned
+  uint64_t Position() const { return position_; }
+  // a read error, or corrupt or truncated compressed input
+  bool Failed() const { return failed_; }
+  bool Compressed() const { return compressed_; }
+  void Close();
+
+ private:
+  struct block {
+    std::vector<char> data;
+    size_t size = 0;
+  };
+  struct inflater;
+
+  // background thread: fill free blocks and queue them in order
+  void produce();
+  // up to size bytes of text into out, false at the end or on failure
+  bool read(char* out, size_t size, size_t& n);
+
+  size_t block_size_;
+  size_t queue_depth_;
+  int fd_;
+  bool compressed_;
+  std::unique_ptr<inflater> inflater_;
+  // compressed text before the open offset still to be dropped
+  uint64_t skip_;
+  std::atomic<bool> failed_;
+  std::thread thread_;
+  std::unique_ptr<BoundedQueue<block>> full_;
+  std::unique_ptr<BoundedQueue<block>> free_;
+
+  // block being split into lines, and a line spanning blocks
+  block current_;
+  size_t pos_;
+  std::string carry_;
+  uint64_t position_;
+};
+}  // namespace crypto
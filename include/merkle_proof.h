@@ -9,11 +9,36 @@ class MerkleProof {
  public:
   MerkleProof();
   void AddSibling(const std::vector<uint8_t>& hash, bool left);
+  // sibling of a merkle sum tree, sum is the total balance under the node
+  void AddSibling(const std::vector<uint8_t>& hash, bool left, uint64_t sum);
   std::string GenerateProof(const std::vector<uint8_t>& tag,
                             const std::vector<uint8_t>& root);
+  // proof of a merkle sum tree, each node is serialized as "hash,sum"
+  std::string GenerateProof(const std::vector<uint8_t>& tag,
+                            const std::vector<uint8_t>& root,
+                            uint64_t root_sum);
+  // append the proof as JSON object with merkle_root, UserHash and
+  // merkle_path (and root_sum/node_sum of a sum tree) to out, return false if
+  // the path doesn't lead to root
+  bool RenderJson(const std::vector<uint8_t>& tag,
+                  const std::vector<uint8_t>& root, std::string& out);
+  bool RenderJson(const std::vector<uint8_t>& tag,
+                  const std::vector<uint8_t>& root, uint64_t root_sum,
+                  std::string& out);
 
  private:
+  bool verify(const std::vector<uint8_t>& tag, const std::vector<uint8_t>& root,
+              uint64_t root_sum, bool with_sum) const;
+  bool renderJson(const std::vector<uint8_t>& tag,
+                  const std::vector<uint8_t>& root, uint64_t root_sum,
+                  bool with_sum, std::string& out);
+  static void appendHash(const std::vector<uint8_t>& hash, std::string& out);
+  static void appendNumber(uint64_t number, std::string& out);
+  std::string generateProof(const std::vector<uint8_t>& tag,
+                            const std::vector<uint8_t>& root,
+                            uint64_t root_sum, bool with_sum);
   std::string serializeHash(const std::vector<uint8_t>& hash) const;
   std::vector<std::pair<bool, std::vector<uint8_t>>> raw_data_;
+  std::vector<uint64_t> sums_;
 };
-}  // namespace crypto
\ No newline at end of file
+}  // namespace crypto
@@ -1,44 +1,473 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include "bloom_filter.h"
+#include "buffer_pool.h"
+#include "elias_fano.h"
+#include "learned_index.h"
+#include "merkle_proof.h"
+#include "response_cache.h"
+#include "sha256.h"
+#include "tagged_hash.h"
+
 namespace crypto {
+// How index and merkle file are brought into memory
+enum class MapStrategy {
+  // map the file MAP_PRIVATE and lock pages on first touch
+  kMmapLock,
+  // same as kMmapLock, prefault the whole file with MAP_POPULATE
+  kPopulate,
+  // copy the file into anonymous memory backed by transparent huge pages
+  kHugePage,
+  // copy the file into explicit hugetlbfs pages, falls back to kHugePage if
+  // no huge page is reserved
+  kHugeTlb,
+  // map nothing: read pages on demand with pread into a buffer pool of
+  // PoROptions::buffer_pool_bytes, for a hard memory cap
+  kBufferPool,
+};
+
+// Options to build and load a PoR database
+struct PoROptions {
+  // build a merkle sum tree: every node stores a hash plus the total balance
+  // of the users beneath it, so the root commits to the total liabilities
+  bool sum_tree = false;
+  // persist only the merkle levels at or above this height, a proof rehashes
+  // the 2^k leaves of its subtree from the user records to recover the lower
+  // siblings. Shrinks the merkle file 2^k-fold, fixed when it is built.
+  uint64_t merkle_dropped_levels = 0;
+
+  // write index and merkle file with io_uring, pwrite if not available
+  bool io_uring = true;
+  // write index and merkle file with O_DIRECT, bypassing page cache
+  bool direct_io = false;
+  // record build progress in a journal every this many users/nodes, so that
+  // an interrupted build can resume, 0 disables checkpoints
+  uint64_t checkpoint_lines = 1 << 22;
+  // called once each checkpoint is durable, returning false stops the build
+  // there, e.g. on shutdown. The next Load resumes from the checkpoint.
+  std::function<bool()> on_checkpoint;
+  // store ids and record offsets of index file in Elias-Fano encoding, about
+  // 1-2 bytes per user instead of 16
+  bool compressed_index = false;
+  // store users as fixed-width (id, balance) records instead of text lines,
+  // the text is rendered on lookup. Every line must be in canonical form
+  // "(id,balance)" so that the rendering reproduces the hashed leaf exactly.
+  bool binary_records = false;
+  // balance columns of a user record "(id,balance 1,..,balance N)", one per
+  // asset. Every line must have exactly N, and one lookup returns them all
+  // under a single leaf. Binary records keep the first balance in the index
+  // entry, the other N - 1 of every user follow all records as a row of
+  // words. Not available with sum_tree, and Append refuses N > 1.
+  uint64_t assets = 1;
+  // locate ids with a piecewise-linear model built over the sorted ids
+  // instead of binary search, within learned_index_epsilon positions. Not
+  // used with compressed_index, which has its own lookup structure. The
+  // epsilon is fixed when the index file is built.
+  bool learned_index = false;
+  uint64_t learned_index_epsilon = 8;
+  // build a Bloom filter over all user ids next to the index and keep it
+  // locked in memory, so that lookups of unknown ids don't touch the index
+  bool id_filter = false;
+  uint64_t id_filter_bits = 10;
+  // cache rendered responses of hot users within this many bytes, 0 disables
+  // the cache. It is emptied by every Load, and Append invalidates it.
+  size_t response_cache_bytes = 0;
+  size_t response_cache_shards = 16;
+
+  MapStrategy map_strategy = MapStrategy::kMmapLock;
+  // interleave anonymous copies of index and merkle file over all NUMA nodes,
+  // only takes effect with kHugePage and kHugeTlb
+  bool numa_interleave = false;
+  // memory of kBufferPool: the upper merkle levels, shared by every proof,
+  // are pinned within a quarter of it, the rest caches pages with CLOCK
+  size_t buffer_pool_bytes = 64 << 20;
+
+  // rebuild index and merkle file if they are missing or don't match their
+  // fingerprint, otherwise Load fails on them
+  bool rebuild = true;
+  // keep index, merkle and filter file as page-aligned sections of one file,
+  // users.txt.por, with a section table and per-section checksums, opened
+  // with one mapping. The separate files are packed into it and removed.
+  // Not available with kBufferPool.
+  bool single_file = false;
+  // attach to the single file a loader process published with
+  // PoRDB::Publish under this name instead of loading user_data: the segment
+  // is mapped read-only and shared, its pages are paid once per host. The
+  // tree format options must match the published database. Not available
+  // with kBufferPool, and Append is refused.
+  std::string shared_memory;
+
+  // prefault index and merkle file in background after Load, hottest regions
+  // first. Ready() turns true when it's done.
+  bool warmup = false;
+  // threads to touch pages, 0 means one per CPU core
+  size_t warmup_threads = 0;
+};
+
+// Outcome of PoRDB::Audit
+struct AuditReport {
+  bool ok = false;
+  // first node that doesn't match the records and the nodes beneath it,
+  // height 0 is the leaf level. Record errors point at the user's leaf.
+  uint64_t height = 0;
+  uint64_t index = 0;
+  std::string error;
+
+  uint64_t users = 0;
+  uint64_t nodes = 0;
+  std::vector<uint8_t> root;
+  uint64_t root_sum = 0;
+};
+
+// A user whose record differs between two snapshots, before is empty if the
+// user was added and after if it was removed
+struct UserChange {
+  uint64_t id = 0;
+  std::string before;
+  std::string after;
+};
+
 class PoRDB {
  public:
   static PoRDB& Instance();
   ~PoRDB();
   // 1. read user data file and create index
   // 2. generate and persist merkle tree
-  bool Load(const std::string& user_data);
+  bool Load(const std::string& user_data,
+            const PoROptions& options = PoROptions());
 
   // Query user info by given user id
   std::string UserInfo(uint64_t id, std::string& proof) const;
 
+  // Render user info and proof as the web service's JSON response body into
+  // json, whose capacity is reused. False if the user doesn't exist.
+  bool UserInfoJson(uint64_t id, std::string& json) const;
+
+  // Total balance of all users, read from the root of merkle sum tree. Returns
+  // 0 if the database is not built as a sum tree.
+  uint64_t TotalLiabilities() const;
+
+  // Re-parse every user record and recompute the tree from them with threads
+  // (0 means one per CPU core): leaves are compared with the merkle file,
+  // or the lowest stored level if levels are dropped, and every stored node
+  // with the hash of its stored children, level by level. The lowest
+  // mismatching node is reported. If expected_root isn't empty the root
+  // must match it as well.
+  bool Audit(AuditReport& report, size_t threads = 0,
+             const std::vector<uint8_t>& expected_root = {}) const;
+
+  // Users whose records differ between this snapshot and a newer one of the
+  // same tree format (sum tree or not), in id order. Both trees are descended
+  // from the top in parallel, skipping equal subtrees, and only the records
+  // beneath differing nodes are read and joined by id: O(changes * log N)
+  // as long as users keep their positions. False if either isn't loaded.
+  bool Diff(const PoRDB& newer, std::vector<UserChange>& changes,
+            size_t threads = 0) const;
+
+  // Append users with ids above the largest one, as (id, balance) in
+  // ascending id order, without rebuilding the index and merkle file. The
+  // new records and the tree nodes covering them (the right spine and any
+  // new levels above the old root) are rehashed in O(k log N), written as
+  // one checksummed record at the end of users.txt.append and synced, then
+  // lookups switch to the new root. The users must be added to the user
+  // data file as well to survive a rebuild: after one, Load moves the
+  // append file aside to users.txt.append.merged if all its users are in
+  // the database and fails otherwise. In sum tree mode, a batch that would
+  // overflow the total liabilities is rejected. Audit and Diff refuse
+  // databases with appended users. Only single-asset users can be appended.
+  bool Append(const std::vector<std::pair<uint64_t, uint64_t>>& users);
+
+  // Copy the database, loaded with single_file and without appended users,
+  // into the shared memory segment /dev/shm/name for other processes to
+  // attach with PoROptions::shared_memory. The segment is replaced
+  // atomically, processes attached to the previous one keep it until they
+  // load again. huge_pages advises transparent huge pages for the segment,
+  // which tmpfs honors if shmem_enabled allows it.
+  bool Publish(const std::string& name, bool huge_pages = false) const;
+  // remove a published segment, attached processes keep their mapping
+  static bool Unpublish(const std::string& name);
+
+  // Runtime metrics in prometheus text format, e.g. the mapping strategy that
+  // took effect for index and merkle file
+  std::string Metrics() const;
+
+  // False while background warm-up is still running, the service should stay
+  // out of the load balancer until it's ready.
+  bool Ready() const;
+
  private:
+  friend class ShardedPoRDB;
+  friend class SnapshotStore;
+  friend class SparseMerkleTree;
+
   PoRDB() = default;
-  bool regularFileExists(const std::string& file);
+  static bool regularFileExists(const std::string& file);
   // we put a sha256 value in the begining of index file and merkle file
-  bool verifyFileFingerPrint(const std::string& file,
-                             const std::vector<uint8_t>& magic);
+  static bool verifyFileFingerPrint(const std::string& file,
+                                    const std::vector<uint8_t>& magic);
   bool preprocessUserFile(const std::string& user_data,
                           const std::string& index, const std::string& merkle);
 
+  // progress of preprocessUserFile, persisted at every checkpoint
+  struct buildjournal {
+    // 1: index entries and leaves, 2: user records, 3: branch levels
+    uint64_t phase;
+    uint64_t user_count;
+    // lines done in current phase and input position after them
+    uint64_t lines_done;
+    uint64_t input_pos;
+    uint64_t first_line_pos;
+    // offset of next user record in index file
+    uint64_t record_offset;
+    uint64_t total_balance;
+    // size of the temporary files at the checkpoint
+    uint64_t index_size;
+    uint64_t merkle_size;
+    // offset and node count of the level being reduced, and pairs reduced
+    uint64_t read_offset;
+    uint64_t level_count;
+    uint64_t pairs_done;
+    // identity of the input file and tree format the journal belongs to
+    uint64_t input_size;
+    int64_t input_mtime;
+    uint64_t node_size;
+    uint64_t binary_records;
+    uint64_t assets;
+    // last node written, needed to pad an odd level
+    uint8_t last_node[40];
+    std::array<uint8_t, sha256::StreamHasher::kStateSize> index_hasher;
+    std::array<uint8_t, sha256::StreamHasher::kStateSize> merkle_hasher;
+  };
+  static bool saveJournal(const std::string& journal, const buildjournal& j);
+  // prepend the sha256 of data, which starts with the magic number, and
+  // replace file atomically with it
+  static bool replaceFile(const std::string& file, std::vector<uint8_t> data);
+  static bool loadJournal(const std::string& journal, buildjournal& j);
+
+  // rewrite a complete index file with Elias-Fano encoded ids and offsets or
+  // with a learned index section in front of the index entries
+  bool rewriteIndex(const std::string& index, const std::string& rewritten);
+  bool learnedIndex() const;
+  // Bloom filter over the ids of a complete, not yet rewritten, index file
+  bool buildFilter(const std::string& index, const std::string& filter);
+  bool loadFilter(const std::string& filter);
+  // locate index sections in the mapped index file
+  void parseIndex();
+  // whether the binary records of an index file of size bytes, starting with
+  // head, have a balance per asset. Head is the first 56 bytes, or 48 if
+  // there are no more.
+  bool columnsMatch(const uint8_t* head, uint64_t size) const;
+
+  // find user's raw record and the order of its merkle leaf, return empty
+  // string if the user doesn't exist
+  std::string findUser(uint64_t id, uint64_t& order) const;
+  // raw record of the user at order
+  std::string recordAt(uint64_t order) const;
+  // look up user and render the proof, without the response cache
+  std::string userInfo(uint64_t id, std::string& proof) const;
+  bool userInfoJson(uint64_t id, std::string& json) const;
+  bool renderUserJson(const std::string& user_info, uint64_t order,
+                      std::string& json) const;
+  // JSON body from user record and its verified proof path
+  static bool renderJson(const std::string& user_info, MerkleProof& generator,
+                         const std::vector<uint8_t>& root, uint64_t root_sum,
+                         bool sum_tree, std::string& json);
+
   // return merkle root, and put the path from leaf to root in the out-parameter
   // path, bool indicates if the node is left/right.
   std::vector<uint8_t> generateProof(
       uint64_t order,
       std::vector<std::pair<bool, std::vector<uint8_t>>>& path) const;
+  // same as above, for merkle sum tree sums[i] is the balance sum of path[i]
+  // and root_sum is the balance sum of the root
+  std::vector<uint8_t> generateProof(
+      uint64_t order, std::vector<std::pair<bool, std::vector<uint8_t>>>& path,
+      std::vector<uint64_t>& sums, uint64_t& root_sum) const;
+
+  // size bytes at offset of index or merkle file: a pointer into the mapping,
+  // or scratch filled from the buffer pool. Nullptr if they can't be read.
+  const uint8_t* indexBytes(uint64_t offset, size_t size,
+                            uint8_t* scratch) const;
+  const uint8_t* merkleBytes(uint64_t offset, size_t size,
+                             uint8_t* scratch) const;
+  // NUL terminated user record at offset of index file
+  std::string readRecord(uint64_t offset) const;
+  // create the buffer pool of kBufferPool and pin the upper merkle levels
+  bool openBufferPool();
+
+  // rewrite a complete merkle file without its bottom merkle_dropped_levels
+  // levels, at least the root is kept
+  bool pruneMerkle(const std::string& merkle, const std::string& pruned);
+  // read the dropped levels of the mapped merkle file
+  void parseMerkle();
+  // rehash the subtree of dropped levels above the leaf at order, append the
+  // leaf and its siblings below the lowest stored level to path and sums
+  bool recomputePath(uint64_t order, uint64_t count,
+                     std::vector<std::pair<bool, std::vector<uint8_t>>>& path,
+                     std::vector<uint64_t>& sums) const;
+  // append the leaf node of a user record to nodes
+  void appendLeaf(const std::string& record, TaggedHasher& hasher,
+                  std::vector<uint8_t>& nodes) const;
+  // pad nodes, the tail of a level of count nodes starting at index first,
+  // if they end an odd level. Returns the padded level size.
+  uint64_t padLevel(std::vector<uint8_t>& nodes, uint64_t first,
+                    uint64_t count) const;
+  // hash pairs of nodes into their parents
+  void hashParents(const uint8_t* nodes, uint64_t pairs, TaggedHasher& hasher,
+                   std::vector<uint8_t>& parents) const;
+  // id of the index entry at order
+  uint64_t idAt(uint64_t order) const;
+  // Audit of users [begin, end) in groups of 2^dropped_levels, returns the
+  // first failing group or end with its error
+  uint64_t auditUsers(uint64_t begin, uint64_t end, uint64_t count,
+                      std::string& error) const;
+  // threads to use for n units of work, 0 threads means one per CPU core
+  static size_t workerCount(uint64_t n, size_t threads);
+  // work(worker, begin, end) over [0, n) split into workers ranges, each on
+  // its own thread
+  static void parallelFor(
+      uint64_t n, size_t workers,
+      const std::function<void(size_t, uint64_t, uint64_t)>& work);
+  // users of the mapped merkle file
+  uint64_t userCount() const;
+  // offset and unpadded node count of every stored merkle level of count
+  // users, bottom-up from height dropped_levels
+  std::vector<std::pair<uint64_t, uint64_t>> merkleLevels(
+      uint64_t count) const;
+  // users appended after the index and merkle file. Each Append publishes
+  // a new one, which shares the chunks of the previous one: a snapshot
+  // reads entries below its own sizes and later Appends write only above
+  // them, so an Append copies a pointer per kChunk entries, not the entries.
+  struct appendedusers {
+    static constexpr uint64_t kChunk = 1024;
+    // append-only array of fixed-width entries
+    struct chunks {
+      size_t width = 0;
+      uint64_t size = 0;
+      std::vector<std::shared_ptr<uint8_t[]>> data;
+      const uint8_t* at(uint64_t i) const {
+        return data[i / kChunk].get() + i % kChunk * width;
+      }
+      void push_back(const uint8_t* entry);
+    };
+    // nodes of the whole tree at one height from index base_count >> height,
+    // the first one not complete in the merkle file: those complete in the
+    // whole tree, then the partial one and the padding of the level
+    struct level {
+      chunks complete;
+      std::vector<uint8_t> tail;
+    };
+    uint64_t base_count = 0;
+    // (id, balance) in ascending id order
+    chunks users{16};
+    std::vector<level> levels;
+    // end of the last record in the append file and its sha256
+    uint64_t file_end = 0;
+    std::vector<uint8_t> file_hash;
+
+    uint64_t size() const { return users.size; }
+    uint64_t id(uint64_t i) const {
+      return reinterpret_cast<const uint64_t*>(users.at(i))[0];
+    }
+    uint64_t balance(uint64_t i) const {
+      return reinterpret_cast<const uint64_t*>(users.at(i))[1];
+    }
+    // node of the whole tree, null left of base_count >> height or past the
+    // end of the level
+    const uint8_t* node(uint64_t height, uint64_t index) const;
+  };
+  // null unless users were appended since Load
+  std::shared_ptr<const appendedusers> appendedUsers() const;
+  // read the users of an append file, and the base user count and merkle
+  // sha256 it was appended to. Records of an unfinished Append at the end
+  // are left out. False if the file is damaged.
+  static bool readAppended(const std::string& file, appendedusers& users,
+                           std::vector<uint8_t>& merkle_hash);
+  // false if the append file can't be used with the loaded database and
+  // its users are not all in it
+  bool loadAppended(const std::string& file);
+  // write the users from previous->size() on as one record, to a new file
+  // if previous is null
+  bool saveAppended(const std::string& file, appendedusers& users,
+                    const appendedusers* previous) const;
+  // hash the nodes of users that are not complete in its levels yet
+  bool hashAppended(appendedusers& users) const;
+  // node of a complete subtree of the index and merkle file, rehashed from
+  // the records below the dropped levels
+  bool baseNode(uint64_t height, uint64_t index, uint8_t* node) const;
+  // unpadded node count of the merkle level at height, count leaves below it
+  static uint64_t levelCount(uint64_t count, uint64_t height);
+
+  // size of a merkle node: 32 byte hash, plus 8 byte balance sum in sum tree
+  size_t merkleNodeSize() const;
+  const std::vector<uint8_t>& merkleMagic() const;
+  const std::vector<uint8_t>& indexMagic() const;
 
   struct mmmapinfo {
-    mmmapinfo() : fd(-1), file_size(0), file_map((void*)-1) {}
+    mmmapinfo()
+        : fd(-1),
+          file_size(0),
+          file_map((void*)-1),
+          map_size(0),
+          strategy(MapStrategy::kMmapLock),
+          numa_interleaved(false),
+          shared(false) {}
+
+    // mapped or, with kBufferPool, kept open for pread
+    bool loaded() const { return file_map != (void*)-1 || fd >= 0; }
 
+    // open only with kBufferPool
     int fd;
     size_t file_size;
     const void* file_map;
-  } index_map, merkle_map;
+    // size of the mapping, rounded up to huge page size for anonymous copies
+    size_t map_size;
+    // strategy that actually took effect
+    MapStrategy strategy;
+    bool numa_interleaved;
+    // MAP_SHARED mapping of a published segment
+    bool shared;
+  } index_map, merkle_map, database_map;
 
   struct mmmapinfo mmapFile(const std::string& name);
+  // unmap index and merkle file, or the single file they are sections of
+  void unmapFiles();
+  // check index, merkle and filter file, rebuild them from the user data
+  // file if one is missing or invalid and rebuilding is allowed
+  bool buildFiles(const std::string& user_data_file);
+  // single file: pack the mapped index and merkle file and the filter file
+  // into database, and map it with index_map and merkle_map as views of its
+  // sections. mapDatabase fails without mapping anything if a checksum, the
+  // tree format or the level directory doesn't match. A shared segment is
+  // attached with attachFile, its section checksums were verified by the
+  // publisher and aren't rehashed.
+  bool packDatabase(const std::string& database,
+                    const std::string& filter_file) const;
+  bool mapDatabase(const std::string& database, bool shared = false);
+  // map a published segment read-only and MAP_SHARED
+  struct mmmapinfo attachFile(const std::string& name);
+  // path of a shared memory segment, empty if name isn't a plain file name
+  static std::string segmentPath(const std::string& name);
+  // copy file into anonymous memory, huge_tlb to use hugetlbfs pages
+  bool copyFileToAnonymous(const std::string& name, bool huge_tlb,
+                           struct mmmapinfo& info);
+  // prefault mapped files in a background thread
+  void startWarmUp();
+  void stopWarmUp();
+
+  // label is inserted into every metric, e.g. shard="1"
+  std::string metrics(const std::string& label) const;
+  static const char* mapStrategyName(MapStrategy strategy);
 
   void unmmapFile(struct mmmapinfo& info);
 
@@ -47,11 +476,83 @@ class PoRDB {
     uint64_t offset;
   };
 
+  struct binaryrecord {
+    uint64_t id;
+    uint64_t balance;
+  };
+  // canonical text of a user record, which is what leaf hashes commit to
+  static std::string renderRecord(uint64_t id, uint64_t balance);
+  static std::string renderRecord(uint64_t id, const uint64_t* balances,
+                                  size_t assets);
+  // parse "(id,balance 1,..,balance N)", blanks around the fields are
+  // skipped and so is anything after the closing parenthesis. False if the
+  // record is malformed.
+  static bool parseRecord(std::string_view record, uint64_t& id,
+                          std::vector<uint64_t>& balances);
+
+  PoROptions db_options;
+
+  // offset of user records in index file, everything before it is the id
+  // lookup structure
+  uint64_t records_offset = 0;
+  // offset of index entries, or binary records, for binary search or the
+  // learned index
+  uint64_t entries_offset = 0;
+  // binary records of more than one asset: offset of the balance rows after
+  // the records, assets - 1 words per user
+  uint64_t columns_offset = 0;
+  LearnedIndex index_model;
+  // compressed index: user ids and record offsets relative to records_offset
+  EliasFano index_ids;
+  EliasFano index_offsets;
+
+  BloomFilter filter;
+
+  // bottom merkle levels not stored in the merkle file, and offset of the
+  // lowest stored one
+  uint64_t dropped_levels = 0;
+  uint64_t merkle_offset = 48;
+
+  // kBufferPool: index and merkle pages, and the lookup structures in front
+  // of the index entries or records, which stay in memory
+  std::unique_ptr<BufferPool> buffer_pool;
+  std::vector<uint64_t> index_head;
+
+  // incremented by every Load and Append, cached responses belong to one
+  // snapshot. Text and JSON responses of a user are cached apart.
+  std::atomic<uint64_t> snapshot{0};
+  std::unique_ptr<ResponseCache> response_cache;
+  // swapped by Append, read with std::atomic_load once has_appended is set
+  std::shared_ptr<const appendedusers> appended;
+  // empty when attached to a shared segment
+  std::string append_file;
+  std::atomic<bool> has_appended{false};
+  // serializes Append calls
+  std::mutex append_mutex;
+  mutable std::atomic<uint64_t> filter_rejects{0};
+
+  std::thread warmup_thread;
+  std::atomic<bool> warm{true};
+  std::atomic<bool> stop_warmup{false};
+  std::atomic<uint64_t> warmup_us{0};
+
   const static std::vector<uint8_t> kIndexMagic;
+  const static std::vector<uint8_t> kCompressedIndexMagic;
+  const static std::vector<uint8_t> kBinaryIndexMagic;
+  const static std::vector<uint8_t> kCompressedBinaryIndexMagic;
+  const static std::vector<uint8_t> kLearnedIndexMagic;
+  const static std::vector<uint8_t> kLearnedBinaryIndexMagic;
+  const static std::vector<uint8_t> kFilterMagic;
   const static std::vector<uint8_t> kMerkleMagic;
+  const static std::vector<uint8_t> kSumMerkleMagic;
+  const static std::vector<uint8_t> kPrunedMerkleMagic;
+  const static std::vector<uint8_t> kPrunedSumMerkleMagic;
+  const static std::vector<uint8_t> kJournalMagic;
+  const static std::vector<uint8_t> kAppendMagic;
+  const static std::vector<uint8_t> kDatabaseMagic;
   const static std::string kLeafHashTagStr;
   const static std::vector<uint8_t> kLeafTag;
   const static std::string kBranchHashTagStr;
   const static std::vector<uint8_t> kBranchTag;
 };
-}  // namespace crypto
\ No newline at end of file
+}  // namespace crypto
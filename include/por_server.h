@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace crypto {
+struct PoRServerOptions {
+  // listen address, port 0 binds an ephemeral port, see PoRServer::Port
+  std::string address = "0.0.0.0";
+  uint16_t port = 8080;
+  // one epoll loop and SO_REUSEPORT listen socket per reactor, 0 means one
+  // per hardware thread
+  size_t reactors = 0;
+  // requests whose headers exceed this size are rejected
+  size_t max_header_bytes = 8192;
+  // keep-alive connections idle this long are closed, 0 never
+  uint32_t idle_timeout_ms = 60000;
+};
+
+// HTTP/1.1 frontend serving GET /por?id= and GET /ready with the JSON
+// contract of app/porwebapi.go. Each reactor thread owns a listen socket
+// bound with SO_REUSEPORT (the kernel spreads connections over them) and
+// all connections it accepted, requests are served inline on the reactor.
+// Connections are kept alive and pipelined requests answered in order.
+class PoRServer {
+ public:
+  // renders the response body of a user, false if the user doesn't exist
+  using Lookup = std::function<bool(uint64_t id, std::string& json)>;
+  using Ready = std::function<bool()>;
+
+  PoRServer(Lookup lookup, Ready ready);
+  ~PoRServer();
+  PoRServer(const PoRServer&) = delete;
+  PoRServer& operator=(const PoRServer&) = delete;
+
+  // binds listen sockets and starts reactor threads, false if any socket
+  // can't be bound
+  bool Start(const PoRServerOptions& options);
+  // stops reactors and closes all connections
+  void Stop();
+  // bound port, valid after Start
+  uint16_t Port() const { return port_; }
+
+  uint64_t Requests() const { return requests_; }
+  uint64_t Connections() const { return connections_; }
+
+ private:
+  struct connection {
+    int fd = -1;
+    // received bytes not yet served
+    std::string in;
+    // responses not yet sent, from out_offset on
+    std::string out;
+    size_t out_offset = 0;
+    // close once out is sent
+    bool close_after = false;
+    // waiting for EPOLLOUT, reading paused until out is drained
+    bool writing = false;
+    uint64_t last_active_ms = 0;
+  };
+  struct reactor {
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    // wakes the loop on Stop
+    int event_fd = -1;
+    std::unordered_map<int, std::unique_ptr<connection>> connections;
+    // every read lands here, connections only keep unserved input
+    std::vector<char> read_buffer;
+    std::thread thread;
+  };
+
+  bool openReactor(reactor& r, const PoRServerOptions& options);
+  void run(reactor& r);
+  void acceptConnections(reactor& r);
+  // reads and serves all complete requests, false when the connection is
+  // to be closed
+  bool onReadable(reactor& r, connection& c);
+  // sends pending output, false when the connection is to be closed
+  bool flush(reactor& r, connection& c);
+  void closeConnection(reactor& r, int fd);
+  // serves the request at the front of input, returns bytes consumed, 0 if
+  // the request is incomplete
+  size_t serve(connection& c, std::string_view input);
+  void respond(connection& c, int status, std::string_view content_type,
+               std::string_view body, bool keep_alive);
+
+  Lookup lookup_;
+  Ready ready_;
+  PoRServerOptions options_;
+  uint16_t port_ = 0;
+  std::vector<std::unique_ptr<reactor>> reactors_;
+  std::atomic<bool> running_{false};
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> connections_{0};
+};
+}  // namespace crypto
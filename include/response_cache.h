@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace crypto {
+// Cache of rendered lookup responses (user info and proof) for hot users.
+// Entries are keyed by (id, format) and versioned by snapshot, split over
+// lock-striped shards by id and evicted with CLOCK once a shard exceeds its
+// share of the byte budget. Concurrent misses of the same key and snapshot
+// are coalesced: one caller renders the response, the others wait for it.
+class ResponseCache {
+ public:
+  ResponseCache(size_t byte_budget, size_t shard_count = 16);
+
+  // response formats
+  static constexpr uint32_t kText = 0;
+  static constexpr uint32_t kJson = 1;
+
+  // renders the response with load(proof) -> user info on a miss, empty user
+  // info (unknown id) is returned but not cached. Responses of different
+  // formats (text, JSON) of the same id are cached side by side.
+  std::string Get(uint64_t snapshot, uint64_t id, std::string& proof,
+                  const std::function<std::string(std::string&)>& load,
+                  uint32_t format = kText);
+  void Clear();
+
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+  // misses served by another caller's rendering
+  uint64_t Coalesced() const { return coalesced_; }
+  uint64_t Evictions() const { return evictions_; }
+  size_t Bytes() const;
+
+ private:
+  struct key {
+    uint64_t id;
+    uint32_t format;
+    bool operator==(const key& other) const {
+      return id == other.id && format == other.format;
+    }
+  };
+  struct keyhash {
+    size_t operator()(const key& k) const {
+      return std::hash<uint64_t>()(k.id) ^ k.format;
+    }
+  };
+  struct entry {
+    uint64_t snapshot;
+    key id;
+    std::string info;
+    std::string proof;
+    // CLOCK reference bit, set on hit
+    bool referenced;
+  };
+  // a rendering in progress, shared only by callers of the same snapshot
+  struct flight {
+    uint64_t snapshot = 0;
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    bool done = false;
+    std::string info;
+    std::string proof;
+  };
+  struct shard {
+    std::mutex mutex;
+    std::unordered_map<key, size_t, keyhash> slots;
+    std::vector<entry> entries;
+    std::vector<size_t> free_slots;
+    std::unordered_map<key, std::shared_ptr<flight>, keyhash> flights;
+    size_t hand = 0;
+    size_t bytes = 0;
+  };
+
+  static size_t entrySize(const std::string& info, const std::string& proof);
+  // insert under shard lock, evicting until the shard fits its budget
+  void insert(shard& s, uint64_t snapshot, const key& id,
+              const std::string& info, const std::string& proof);
+  void evict(shard& s);
+
+  size_t shard_budget_;
+  std::vector<std::unique_ptr<shard>> shards_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> coalesced_{0};
+  std::atomic<uint64_t> evictions_{0};
+};
+}  // namespace crypto
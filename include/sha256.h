@@ -1,5 +1,6 @@
 #pragma once
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 // Implement sha256 hash algorithm(https://en.wikipedia.org/wiki/SHA-2)
@@ -14,15 +15,26 @@ class StreamHasher {
  public:
   StreamHasher();
   size_t Append(const std::vector<uint8_t>& data_chunk);
+  size_t Append(const uint8_t* data, size_t size);
   std::vector<uint8_t> Hash();
   void Reset();
 
+  // Snapshot of the intermediate state, so that hashing a long stream can be
+  // resumed later, e.g. after the process restarts.
+  constexpr static size_t kStateSize = 32 + 64 + 8;
+  std::array<uint8_t, kStateSize> State() const;
+  void Restore(const std::array<uint8_t, kStateSize>& state);
+
  private:
   std::array<uint32_t, 8> h_;
   std::array<uint8_t, 64> chunk_cache_;
   size_t total_bytes_;
 };
 
+// Process count 64 byte chunks at data into hash value hv, with the SHA
+// extensions when the CPU has them.
+void Compress(std::array<uint32_t, 8>& hv, const uint8_t* data, size_t count);
+
 // Subprocedures and constants used in sha256 algorithm:
 // https://en.wikipedia.org/wiki/SHA-2
 void PreProcess(std::vector<uint8_t>& data, size_t total_bits);
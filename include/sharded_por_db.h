@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "por_db.h"
+
+namespace crypto {
+// PoR database partitioned by user id range. Every shard is an independent
+// PoRDB with its own index and merkle file, and a small top merkle tree is
+// built over the shard roots. A user's proof is the path inside its shard
+// followed by the path from the shard root to the top root.
+class ShardedPoRDB {
+ public:
+  static ShardedPoRDB& Instance();
+  ShardedPoRDB() = default;
+
+  // 1. split user data file into shard_count files by user id range
+  // 2. build/load each shard in parallel
+  // 3. build top merkle tree over the shard roots
+  bool Load(const std::string& user_data, size_t shard_count,
+            const PoROptions& options = PoROptions());
+
+  // Query user info by given user id
+  std::string UserInfo(uint64_t id, std::string& proof) const;
+
+  // Query user info rendered as JSON response body, see PoRDB::UserInfoJson
+  bool UserInfoJson(uint64_t id, std::string& json) const;
+
+  // Total balance of all users in sum tree mode, 0 otherwise
+  uint64_t TotalLiabilities() const;
+
+  // Runtime metrics of all shards in prometheus text format
+  std::string Metrics() const;
+
+  // True when all shards finished background warm-up
+  bool Ready() const;
+
+  // Drop and rebuild the index and merkle file of one shard, e.g. after its
+  // user data file is replaced. Other shards stay untouched. False, with
+  // the old shard still loaded, if the rebuilt users leave the shard's id
+  // range. Like Load, not safe against concurrent lookups: the shard and
+  // the top tree are replaced without synchronization.
+  bool RebuildShard(size_t shard);
+
+  size_t ShardCount() const { return shards.size(); }
+
+ private:
+  // split user data file into shard files, record the first user id of
+  // each shard in first_ids
+  bool splitUserFile(const std::string& user_data, size_t shard_count,
+                     std::vector<uint64_t>& first_ids);
+  bool writeManifest(const std::string& manifest, size_t shard_count,
+                     const std::vector<uint64_t>& first_ids);
+  static bool readManifest(const std::string& manifest,
+                           std::vector<uint64_t>& first_ids);
+  std::string shardFile(size_t shard) const;
+  // options of the shards, which don't cache responses themselves
+  PoROptions shardOptions() const;
+
+  // build the top merkle tree from the roots of all shards
+  void buildTopTree();
+
+  // find user and add its path up to the top root to generator, returns
+  // user's record, empty if the user doesn't exist
+  std::string findUser(uint64_t id, MerkleProof& generator) const;
+  std::string userInfo(uint64_t id, std::string& proof) const;
+  bool userInfoJson(uint64_t id, std::string& json) const;
+
+  std::string user_data_file;
+  PoROptions db_options;
+  std::vector<std::unique_ptr<PoRDB>> shards;
+  // first user id of each shard, used to route lookups
+  std::vector<uint64_t> shard_first_ids;
+
+  // top tree levels from shard roots up to the root, each node is a hash and
+  // its balance sum (always 0 if not in sum tree mode)
+  std::vector<std::vector<std::pair<std::vector<uint8_t>, uint64_t>>>
+      top_levels;
+
+  // responses are cached for the whole database rather than per shard,
+  // incremented by every Load and shard rebuild
+  uint64_t snapshot = 0;
+  std::unique_ptr<ResponseCache> response_cache;
+
+  const static std::vector<uint8_t> kManifestMagic;
+};
+}  // namespace crypto
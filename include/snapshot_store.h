@@ -0,0 +1,122 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "por_db.h"
+
+namespace crypto {
+// Copy-on-write store of the merkle trees of many PoR snapshots. Every node
+// is stored once under its hash, with the offsets of its children or, for a
+// leaf, with its user record. Subtrees and records that don't change from
+// one snapshot to the next are shared, and a snapshot is a pointer to its
+// root. A lookup descends from the root by user id, one node per level like
+// the merkle path of a PoRDB, and returns the same record and proof as the
+// PoRDB the snapshot was added from.
+class SnapshotStore {
+ public:
+  SnapshotStore() = default;
+  ~SnapshotStore();
+  SnapshotStore(const SnapshotStore&) = delete;
+  SnapshotStore& operator=(const SnapshotStore&) = delete;
+
+  // open the node file at path and the snapshot table at path.roots, both
+  // created if missing. Nodes appended after the last published snapshot are
+  // discarded. False if the store was created with the other tree format.
+  bool Open(const std::string& path, bool sum_tree = false);
+  void Close();
+
+  // add the merkle tree of a loaded PoRDB of the same tree format, without
+  // appended users, as snapshot name, appending only the subtrees the store
+  // doesn't hold yet. The snapshot is published atomically once its nodes
+  // are durable. Not safe against concurrent lookups.
+  bool AddSnapshot(const std::string& name, const PoRDB& db);
+
+  // names of the snapshots in the order they were added
+  std::vector<std::string> Snapshots() const;
+  // merkle root of a snapshot, empty if it doesn't exist or has no users
+  std::vector<uint8_t> Root(const std::string& name) const;
+  // Query user info by given user id in a snapshot, see PoRDB::UserInfo
+  std::string UserInfo(const std::string& name, uint64_t id,
+                       std::string& proof) const;
+
+  uint64_t NodeCount() const { return node_count; }
+  // size of the node file up to the last published snapshot
+  uint64_t Bytes() const { return committed_size; }
+
+ private:
+  struct snapshot {
+    std::string name;
+    // offset of the root node, 0 if there are no users
+    uint64_t root;
+    uint64_t users;
+  };
+  // entry of the node file, followed by a branchlinks of a branch or by the
+  // record of a leaf padded to 8 bytes
+  struct nodeheader {
+    uint8_t hash[32];
+    // balance sum beneath the node, 0 if not in sum tree mode
+    uint64_t sum;
+    // smallest user id beneath the node
+    uint64_t first_id;
+    // record size of a leaf, 0 for a branch
+    uint64_t record_size;
+  };
+  // children of a branch. The padding right child of an odd level is the
+  // left child itself, or 0 for the all-zero node of a sum tree.
+  struct branchlinks {
+    uint64_t left;
+    uint64_t right;
+    uint64_t right_first_id;
+  };
+  // tree of a PoRDB being added
+  struct ingest;
+
+  bool loadRoots();
+  bool saveRoots() const;
+  bool remap();
+  // entry at offset of a published snapshot
+  const nodeheader* nodeAt(uint64_t offset) const;
+
+  // offset of the stored node of this hash, 0 if there is none
+  uint64_t find(const uint8_t* hash) const;
+  void readHash(uint64_t offset, uint8_t* hash) const;
+  // add the entries up to committed_size to nodes_by_hash
+  void indexNodes();
+  // append an entry, returns its offset
+  uint64_t append(const nodeheader& header, const void* body, size_t size);
+  bool flush();
+  // drop everything appended after the last published snapshot, which had
+  // nodes entries
+  void rollback(uint64_t nodes);
+  // store the node at height and index of the tree and the nodes beneath it
+  // that aren't stored yet, returns its offset or 0 on failure
+  uint64_t insert(ingest& tree, uint64_t height, uint64_t index);
+  // rehash the dropped levels of the tree under node index of the lowest
+  // stored level into tree.subtree
+  bool rehashSubtree(ingest& tree, uint64_t index);
+
+  std::string node_file;
+  int fd = -1;
+  size_t node_size = 32;
+  std::vector<snapshot> snapshots;
+
+  const uint8_t* node_map = nullptr;
+  uint64_t map_size = 0;
+  uint64_t committed_size = 0;
+  uint64_t node_count = 0;
+
+  // first 8 bytes of a node hash to the offsets of nodes with that prefix,
+  // built on the first AddSnapshot
+  std::unordered_multimap<uint64_t, uint64_t> nodes_by_hash;
+  bool indexed = false;
+  // entries not written yet, starting at offset pending_offset
+  std::vector<uint8_t> pending;
+  uint64_t pending_offset = 0;
+
+  const static std::vector<uint8_t> kNodeMagic;
+  const static std::vector<uint8_t> kRootsMagic;
+};
+}  // namespace crypto
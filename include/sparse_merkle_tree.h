@@ -0,0 +1,72 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "por_db.h"
+#include "tagged_hash.h"
+
+namespace crypto {
+// Merkle tree over the whole 64 bit id space: the leaf of a user sits at its
+// id, every other leaf is empty. Unlike the positional tree of a PoRDB, adding
+// or removing a user changes the 64 nodes above its leaf only, the proofs of
+// all other users keep their shape, and the proof of an unknown id shows its
+// leaf is empty. Leaves and branches are hashed like those of a PoRDB, and
+// proofs have the same format with 64 siblings.
+//
+// Only nodes with users beneath them are stored, an empty subtree is one of
+// 65 precomputed default nodes. Not safe against lookups during Update.
+class SparseMerkleTree {
+ public:
+  explicit SparseMerkleTree(bool sum_tree = false);
+
+  // insert or update users as (id, balance) and remove the users of removed,
+  // which is applied first. Changed leaves and then the nodes above them are
+  // hashed a level at a time with threads, 0 means one per hardware thread.
+  // In sum tree mode, a batch that would overflow the root sum is rejected
+  // with false and changes nothing.
+  bool Update(const std::vector<std::pair<uint64_t, uint64_t>>& users,
+              const std::vector<uint64_t>& removed = {}, size_t threads = 0);
+  // replace the tree with the users of a loaded single-asset PoRDB, an
+  // empty tree if their balances overflow the root sum
+  bool Build(const PoRDB& db, size_t threads = 0);
+
+  // Query user info by given user id, see PoRDB::UserInfo. The record of an
+  // unknown id is empty, its proof starts with the empty leaf.
+  std::string UserInfo(uint64_t id, std::string& proof) const;
+
+  std::vector<uint8_t> Root() const;
+  // total balance of a sum tree, 0 otherwise
+  uint64_t RootSum() const;
+  uint64_t Users() const { return balances.size(); }
+  // stored nodes of all levels, leaves included
+  uint64_t NodeCount() const;
+
+  // leaf hash of an unknown id
+  const static std::vector<uint8_t> kEmptyLeaf;
+
+ private:
+  struct node {
+    std::array<uint8_t, 32> hash;
+    // balance sum beneath the node, 0 if not in sum tree mode
+    uint64_t sum;
+  };
+  const static uint64_t kHeight = 64;
+
+  // stored node at height and index (id >> height), or the default node
+  const node& nodeAt(uint64_t height, uint64_t index) const;
+  node hashLeaf(uint64_t id, uint64_t balance, TaggedHasher& hasher) const;
+  node hashBranch(const node& left, const node& right,
+                  TaggedHasher& hasher) const;
+
+  bool sum_tree;
+  std::unordered_map<uint64_t, uint64_t> balances;
+  // levels[h] maps index to the node at height h with users beneath it
+  std::vector<std::unordered_map<uint64_t, node>> levels;
+  // default node of an empty subtree of every height
+  std::vector<node> empty;
+};
+}  // namespace crypto
@@ -9,6 +9,7 @@ class TaggedHasher {
  public:
   explicit TaggedHasher(const std::vector<uint8_t>& tag);
   size_t Append(const std::vector<uint8_t>& data_chunk);
+  size_t Append(const uint8_t* data, size_t size);
   std::vector<uint8_t> Hash();
   void Reset();
 
@@ -1,13 +1,66 @@
 #ifndef POR_LIB_H
 #define POR_LIB_H
+#include <stddef.h>
 #include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
+// Options of LoadDBWithOptions, zero-initialize for default behavior
+struct PoRLoadOptions {
+  // build merkle sum tree, proofs carry balance sums of sibling nodes
+  int sum_tree;
+  // split the database into this many shards by user id range, 0 or 1 means
+  // a single database
+  int shards;
+  // 0: mmap and mlock on fault, 1: mmap with MAP_POPULATE, 2: copy into
+  // transparent huge pages, 3: copy into hugetlbfs pages
+  int map_strategy;
+  // interleave huge page copies over all NUMA nodes
+  int numa_interleave;
+  // prefault the database in background after load, see DBReady
+  int warmup;
+  // Elias-Fano compressed id index
+  int compressed_index;
+  // fixed-width binary user records
+  int binary_records;
+  // piecewise-linear learned id index, with this error bound if not 0
+  int learned_index;
+  int learned_index_epsilon;
+  // Bloom filter rejecting unknown ids before the index is searched
+  int id_filter;
+  // cache rendered responses of hot users within this many MB, 0 disables
+  int response_cache_mb;
+  // read index and merkle pages with pread into a buffer pool of this many
+  // MB instead of mapping the files, overrides map_strategy. 0 maps them.
+  int buffer_pool_mb;
+  // store merkle levels from this height up, proofs rehash the lower ones
+  int merkle_dropped_levels;
+  // keep the database in one file of page-aligned sections, users.txt.por,
+  // not with buffer_pool_mb
+  int single_file;
+  // balance columns per user record, one per asset, 0 means 1
+  int assets;
+  // attach to the segment por_loader published under this name instead of
+  // loading path, not with shards. NULL or empty loads path.
+  const char* shared_memory;
+};
+
 int LoadDB(const char* path);
+int LoadDBWithOptions(const char* path, const struct PoRLoadOptions* options);
 const char* UserInfo(uint64_t id);
+// render user info and proof as JSON response body into *buffer, which is
+// grown with realloc to *capacity bytes if needed and can be reused for the
+// next call. Returns body length (no NUL), 0 if the user doesn't exist.
+// Caller frees *buffer.
+size_t UserInfoJSON(uint64_t id, char** buffer, size_t* capacity);
+// total balance of all users, 0 if the database is not a merkle sum tree
+uint64_t TotalLiabilities();
+// 1 when background warm-up after load is done (or not requested)
+int DBReady();
+// runtime metrics in prometheus text format, caller frees the result
+const char* DBMetrics();
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,116 @@
+#include "bloom_filter.h"
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <cstring>
+
+namespace crypto {
+namespace {
+// odd constants from the split block Bloom filter of Apache Parquet, each
+// picks the bit set in one word of the block
+const uint32_t kSalt[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                           0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                           0x9efc4947U, 0x5c6bfb31U};
+
+// murmur3 finalizer, ids are often sequential
+uint64_t mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+}  // namespace
+
+void BloomFilter::freer::operator()(block* p) const { std::free(p); }
+
+BloomFilter::BloomFilter() : blocks_(0), locked_(false) {}
+
+BloomFilter::BloomFilter(uint64_t n, uint64_t bits_per_key)
+    : blocks_(0), locked_(false) {
+  allocate((n * bits_per_key + 255) / 256);
+}
+
+BloomFilter::~BloomFilter() { unlock(); }
+
+void BloomFilter::unlock() {
+  if (locked_) {
+    munlock(data_.get(), Bytes());
+    locked_ = false;
+  }
+}
+
+void BloomFilter::Reset() {
+  unlock();
+  data_.reset();
+  blocks_ = 0;
+}
+
+void BloomFilter::allocate(uint64_t blocks) {
+  unlock();
+
+  // at least one block so that lookups need no check
+  blocks_ = blocks > 0 ? blocks : 1;
+  size_t size = (blocks_ * sizeof(block) + 63) / 64 * 64;
+  data_.reset(static_cast<block*>(std::aligned_alloc(64, size)));
+  std::memset(data_.get(), 0, size);
+}
+
+const BloomFilter::block& BloomFilter::locate(uint64_t key,
+                                              uint32_t& hash) const {
+  uint64_t h = mix(key);
+  hash = static_cast<uint32_t>(h);
+  // map the upper 32 bits to a block without division
+  return data_[((h >> 32) * blocks_) >> 32];
+}
+
+void BloomFilter::Add(uint64_t key) {
+  uint32_t hash;
+  block& b = const_cast<block&>(locate(key, hash));
+  for (int i = 0; i < 8; ++i) {
+    b.words[i] |= uint32_t(1) << ((hash * kSalt[i]) >> 27);
+  }
+}
+
+bool BloomFilter::MayContain(uint64_t key) const {
+  if (blocks_ == 0) {
+    return true;
+  }
+
+  uint32_t hash;
+  const block& b = locate(key, hash);
+  for (int i = 0; i < 8; ++i) {
+    if ((b.words[i] & (uint32_t(1) << ((hash * kSalt[i]) >> 27))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool BloomFilter::Assign(const uint8_t* data, size_t size) {
+  uint64_t blocks;
+  if (size < sizeof blocks) {
+    return false;
+  }
+
+  std::memcpy(&blocks, data, sizeof blocks);
+  if (blocks == 0 || size != sizeof blocks + blocks * sizeof(block)) {
+    return false;
+  }
+
+  allocate(blocks);
+  std::memcpy(data_.get(), data + sizeof blocks, blocks * sizeof(block));
+  // misses are rejected without faults, best effort under RLIMIT_MEMLOCK
+  locked_ = mlock(data_.get(), Bytes()) == 0;
+  return true;
+}
+
+const uint8_t* BloomFilter::Data() const {
+  return reinterpret_cast<const uint8_t*>(data_.get());
+}
+
+size_t BloomFilter::Bytes() const { return blocks_ * sizeof(block); }
+}  // namespace crypto
@@ -0,0 +1,180 @@
+#include "buffer_pool.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace crypto {
+BufferPool::BufferPool(size_t byte_budget, size_t page_size,
+                       size_t shard_count)
+    : page_size_(page_size > 0 ? page_size : 4096) {
+  if (shard_count == 0) {
+    shard_count = 1;
+  }
+  // at least one frame per shard, a read never needs two frames of the same
+  // shard at once
+  frames_per_shard_ =
+      std::max<size_t>(1, byte_budget / page_size_ / shard_count);
+  for (size_t i = 0; i < shard_count; ++i) {
+    auto s = std::make_unique<shard>();
+    s->frames.resize(frames_per_shard_);
+    s->pages.reset(new uint8_t[frames_per_shard_ * page_size_]);
+    shards_.push_back(std::move(s));
+  }
+}
+
+uint64_t BufferPool::pageKey(int fd, uint64_t page) {
+  return static_cast<uint64_t>(fd) << 40 | page;
+}
+
+int64_t BufferPool::readPage(int fd, uint64_t page, uint8_t* out) const {
+  size_t done = 0;
+  while (done < page_size_) {
+    ssize_t n = pread(fd, out + done, page_size_ - done,
+                      page * page_size_ + done);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+bool BufferPool::Read(int fd, uint64_t offset, size_t size, void* out) {
+  uint8_t* dst = static_cast<uint8_t*>(out);
+  while (size > 0) {
+    size_t n = 0;
+    for (const auto& range : pinned_) {
+      if (range.fd == fd && offset >= range.begin &&
+          offset < range.begin + range.data.size()) {
+        n = std::min<uint64_t>(size, range.begin + range.data.size() - offset);
+        std::memcpy(dst, range.data.data() + (offset - range.begin), n);
+        ++hits_;
+        break;
+      }
+    }
+
+    if (n == 0) {
+      uint64_t page = offset / page_size_;
+      size_t in_page = offset % page_size_;
+      n = std::min(size, page_size_ - in_page);
+      uint64_t key = pageKey(fd, page);
+      // sequential pages spread over shards
+      shard& s = *shards_[(key * 0x9e3779b97f4a7c15ULL >> 32) % shards_.size()];
+      std::lock_guard<std::mutex> lock(s.mutex);
+      const uint8_t* data = nullptr;
+      const frame* f = fetch(s, fd, page, data);
+      if (f == nullptr || in_page + n > f->length) {
+        return false;
+      }
+      std::memcpy(dst, data + in_page, n);
+    }
+
+    dst += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+const BufferPool::frame* BufferPool::fetch(shard& s, int fd, uint64_t page,
+                                           const uint8_t*& data) {
+  uint64_t key = pageKey(fd, page);
+  auto it = s.slots.find(key);
+  if (it != s.slots.end()) {
+    frame& f = s.frames[it->second];
+    f.referenced = true;
+    data = s.pages.get() + it->second * page_size_;
+    ++hits_;
+    return &f;
+  }
+
+  ++misses_;
+  size_t slot = evict(s);
+  uint8_t* page_data = s.pages.get() + slot * page_size_;
+  int64_t length = readPage(fd, page, page_data);
+  if (length <= 0) {
+    return nullptr;
+  }
+
+  frame& f = s.frames[slot];
+  f = frame{key, static_cast<uint32_t>(length), true, false};
+  s.slots.emplace(key, slot);
+  data = page_data;
+  return &f;
+}
+
+size_t BufferPool::evict(shard& s) {
+  while (true) {
+    if (s.hand >= s.frames.size()) {
+      s.hand = 0;
+    }
+
+    size_t slot = s.hand++;
+    frame& f = s.frames[slot];
+    if (!f.used) {
+      return slot;
+    }
+    if (f.referenced) {
+      f.referenced = false;
+      continue;
+    }
+
+    s.slots.erase(f.key);
+    f.used = false;
+    ++evictions_;
+    return slot;
+  }
+}
+
+bool BufferPool::Pin(int fd, uint64_t offset, size_t size) {
+  if (size == 0) {
+    return true;
+  }
+
+  pinnedrange range{fd, offset / page_size_ * page_size_, {}};
+  uint64_t end = (offset + size + page_size_ - 1) / page_size_ * page_size_;
+  range.data.resize(end - range.begin);
+  size_t done = 0;
+  while (done < range.data.size()) {
+    ssize_t n = pread(fd, range.data.data() + done, range.data.size() - done,
+                      range.begin + done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  if (done <= offset - range.begin) {
+    return false;
+  }
+  range.data.resize(done);
+  pinned_.push_back(std::move(range));
+  return true;
+}
+
+void BufferPool::Clear() {
+  for (auto& s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->slots.clear();
+    std::fill(s->frames.begin(), s->frames.end(), frame());
+    s->hand = 0;
+  }
+  pinned_.clear();
+}
+
+size_t BufferPool::PinnedBytes() const {
+  size_t bytes = 0;
+  for (const auto& range : pinned_) {
+    bytes += range.data.size();
+  }
+  return bytes;
+}
+
+size_t BufferPool::Bytes() const {
+  return shards_.size() * frames_per_shard_ * page_size_ + PinnedBytes();
+}
+}  // namespace crypto
@@ -0,0 +1,213 @@
+#include "elias_fano.h"
+
+namespace crypto {
+EliasFano::Builder::Builder(uint64_t n, uint64_t universe)
+    : n_(n), universe_(universe), l_(0), added_(0), last_(0) {
+  // an empty sequence needs no upper bits whatever the universe is
+  if (n_ == 0) {
+    universe_ = 0;
+  }
+
+  // l = floor(log2(universe / n))
+  if (n_ > 0) {
+    for (uint64_t q = universe_ / n_; q > 1; q >>= 1) {
+      ++l_;
+    }
+  }
+
+  uint64_t upper_bits = n_ + (universe_ >> l_) + 1;
+  lower_.assign((n_ * l_ + 63) / 64, 0);
+  upper_.assign((upper_bits + 63) / 64, 0);
+}
+
+bool EliasFano::Builder::Add(uint64_t value) {
+  if (added_ >= n_ || value < last_ || value > universe_) {
+    return false;
+  }
+
+  // low bits may straddle 2 words
+  if (l_ > 0) {
+    uint64_t low = value & ((uint64_t(1) << l_) - 1);
+    uint64_t bit = added_ * l_;
+    lower_[bit / 64] |= low << (bit % 64);
+    if (bit % 64 + l_ > 64) {
+      lower_[bit / 64 + 1] |= low >> (64 - bit % 64);
+    }
+  }
+
+  // high bits in unary: the i-th value sets bit (value >> l) + i
+  uint64_t pos = (value >> l_) + added_;
+  upper_[pos / 64] |= uint64_t(1) << (pos % 64);
+
+  last_ = value;
+  ++added_;
+  return true;
+}
+
+std::vector<uint64_t> EliasFano::Builder::Finish() {
+  if (added_ != n_) {
+    return {};
+  }
+
+  // sample the position of every kSampleRate-th one and zero
+  uint64_t upper_bits = n_ + (universe_ >> l_) + 1;
+  std::vector<uint64_t> select1;
+  std::vector<uint64_t> select0;
+  uint64_t ones = 0;
+  uint64_t zeros = 0;
+  for (uint64_t pos = 0; pos < upper_bits; ++pos) {
+    if ((upper_[pos / 64] >> (pos % 64)) & 0x01) {
+      if (ones % kSampleRate == 0) {
+        select1.push_back(pos);
+      }
+      ++ones;
+    } else {
+      if (zeros % kSampleRate == 0) {
+        select0.push_back(pos);
+      }
+      ++zeros;
+    }
+  }
+
+  std::vector<uint64_t> words = {n_,
+                                 l_,
+                                 upper_bits,
+                                 lower_.size(),
+                                 upper_.size(),
+                                 select1.size(),
+                                 select0.size()};
+  words.insert(words.end(), lower_.cbegin(), lower_.cend());
+  words.insert(words.end(), upper_.cbegin(), upper_.cend());
+  words.insert(words.end(), select1.cbegin(), select1.cend());
+  words.insert(words.end(), select0.cbegin(), select0.cend());
+  return words;
+}
+
+EliasFano::EliasFano()
+    : n_(0),
+      l_(0),
+      upper_bits_(0),
+      lower_words_(0),
+      upper_words_(0),
+      select1_samples_(0),
+      select0_samples_(0),
+      lower_(nullptr),
+      upper_(nullptr),
+      select1_(nullptr),
+      select0_(nullptr) {}
+
+EliasFano::EliasFano(const uint64_t* data)
+    : n_(data[0]),
+      l_(data[1]),
+      upper_bits_(data[2]),
+      lower_words_(data[3]),
+      upper_words_(data[4]),
+      select1_samples_(data[5]),
+      select0_samples_(data[6]) {
+  lower_ = data + 7;
+  upper_ = lower_ + lower_words_;
+  select1_ = upper_ + upper_words_;
+  select0_ = select1_ + select1_samples_;
+}
+
+size_t EliasFano::Words() const {
+  if (upper_ == nullptr) {
+    return 0;
+  }
+
+  return 7 + lower_words_ + upper_words_ + select1_samples_ + select0_samples_;
+}
+
+uint64_t EliasFano::Get(uint64_t i) const {
+  return ((select1(i) - i) << l_) | lower(i);
+}
+
+uint64_t EliasFano::LowerBound(uint64_t v) const {
+  if (n_ == 0) {
+    return 0;
+  }
+
+  // values with high part h sit between the (h-1)-th and h-th zero
+  uint64_t h = v >> l_;
+  if (h > (upper_bits_ - n_ - 1)) {
+    return n_;
+  }
+
+  uint64_t first = (h == 0 ? 0 : select0(h - 1) + 1) - h;
+  uint64_t last = select0(h) - h;
+
+  // binary search the low bits within the bucket, skewed ids (a dense
+  // cluster and a far outlier) can put almost all values in one bucket. If
+  // all of them are smaller, the next value is the first of a later bucket.
+  uint64_t low = v & ((uint64_t(1) << l_) - 1);
+  while (first < last) {
+    uint64_t mid = first + (last - first) / 2;
+    if (lower(mid) < low) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
+
+uint64_t EliasFano::lower(uint64_t i) const {
+  if (l_ == 0) {
+    return 0;
+  }
+
+  uint64_t bit = i * l_;
+  uint64_t low = lower_[bit / 64] >> (bit % 64);
+  if (bit % 64 + l_ > 64) {
+    low |= lower_[bit / 64 + 1] << (64 - bit % 64);
+  }
+
+  return low & ((uint64_t(1) << l_) - 1);
+}
+
+uint64_t EliasFano::select1(uint64_t i) const {
+  uint64_t pos = select1_[i / kSampleRate];
+  uint64_t remaining = i % kSampleRate;
+
+  // scan words from the sample, the first word is masked below pos
+  uint64_t w = pos / 64;
+  uint64_t word = upper_[w] & (~uint64_t(0) << (pos % 64));
+  while (true) {
+    uint64_t ones = __builtin_popcountll(word);
+    if (remaining < ones) {
+      break;
+    }
+    remaining -= ones;
+    word = upper_[++w];
+  }
+
+  // drop the lowest set bits until the wanted one is the lowest
+  for (; remaining > 0; --remaining) {
+    word &= word - 1;
+  }
+
+  return w * 64 + __builtin_ctzll(word);
+}
+
+uint64_t EliasFano::select0(uint64_t i) const {
+  uint64_t pos = select0_[i / kSampleRate];
+  uint64_t remaining = i % kSampleRate;
+
+  uint64_t w = pos / 64;
+  uint64_t word = ~upper_[w] & (~uint64_t(0) << (pos % 64));
+  while (true) {
+    uint64_t zeros = __builtin_popcountll(word);
+    if (remaining < zeros) {
+      break;
+    }
+    remaining -= zeros;
+    word = ~upper_[++w];
+  }
+
+  for (; remaining > 0; --remaining) {
+    word &= word - 1;
+  }
+
+  return w * 64 + __builtin_ctzll(word);
+}
+}  // namespace crypto
@@ -0,0 +1,414 @@
+#include "file_writer.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace crypto {
+// minimal io_uring setup with raw syscalls, only IORING_OP_WRITE is used
+struct FileWriter::uring {
+  int fd = -1;
+  unsigned* sq_head = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_mask = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned* cq_mask = nullptr;
+  struct io_uring_sqe* sqes = nullptr;
+  struct io_uring_cqe* cqes = nullptr;
+  void* sq_ptr = (void*)-1;
+  size_t sq_len = 0;
+  void* cq_ptr = (void*)-1;
+  size_t cq_len = 0;
+  size_t sqes_len = 0;
+};
+
+FileWriter::FileWriter(size_t buffer_size, size_t buffer_count)
+    : buffer_size_(buffer_size),
+      alignment_(1),
+      buffers_(buffer_count, buffer{nullptr, 0, 0, false}),
+      current_(0),
+      in_flight_(0),
+      size_(0),
+      fd_(-1),
+      plain_fd_(-1),
+      failed_(false) {
+  // O_DIRECT needs buffer address, size and file offset aligned to block size
+  buffer_size_ = std::max<size_t>(4096, buffer_size_ & ~size_t(4095));
+  for (auto& b : buffers_) {
+    void* p = nullptr;
+    if (posix_memalign(&p, 4096, buffer_size_) == 0) {
+      b.data = reinterpret_cast<uint8_t*>(p);
+    } else {
+      failed_ = true;
+    }
+  }
+}
+
+FileWriter::~FileWriter() {
+  Close();
+  for (auto& b : buffers_) {
+    free(b.data);
+  }
+}
+
+bool FileWriter::Open(const std::string& file, bool direct_io,
+                      bool use_io_uring) {
+  return open(file, 0, true, direct_io, use_io_uring);
+}
+
+bool FileWriter::Reopen(const std::string& file, uint64_t size,
+                        bool direct_io, bool use_io_uring) {
+  return open(file, size, false, direct_io, use_io_uring);
+}
+
+bool FileWriter::open(const std::string& file, uint64_t size, bool truncate,
+                      bool direct_io, bool use_io_uring) {
+  Close();
+
+  int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0);
+  alignment_ = 1;
+  fd_ = -1;
+  if (direct_io) {
+    fd_ = ::open(file.c_str(), flags | O_DIRECT, 0644);
+    // some file systems, e.g. tmpfs, don't support O_DIRECT
+    if (fd_ >= 0) {
+      alignment_ = 4096;
+    }
+  }
+
+  if (fd_ < 0) {
+    fd_ = ::open(file.c_str(), flags, 0644);
+  }
+
+  plain_fd_ = ::open(file.c_str(), O_RDWR);
+  if (fd_ < 0 || plain_fd_ < 0 || ftruncate(plain_fd_, size) != 0) {
+    return false;
+  }
+
+  for (auto& b : buffers_) {
+    b.used = 0;
+    b.offset = 0;
+    b.busy = false;
+  }
+  current_ = 0;
+  in_flight_ = 0;
+  size_ = size;
+  failed_ = failed_ || buffers_.empty();
+
+  // appending starts from the last aligned block, read its head back
+  auto& b = buffers_[current_];
+  b.offset = size / alignment_ * alignment_;
+  b.used = size - b.offset;
+  if (b.used > 0 &&
+      pread(plain_fd_, b.data, b.used, b.offset) != static_cast<ssize_t>(b.used)) {
+    failed_ = true;
+  }
+
+  if (use_io_uring && !setupRing(buffers_.size())) {
+    closeRing();
+  }
+
+  return !failed_;
+}
+
+bool FileWriter::Append(const std::vector<uint8_t>& data) {
+  return Append(data.data(), data.size());
+}
+
+bool FileWriter::Append(const uint8_t* data, size_t size) {
+  while (size > 0 && !failed_) {
+    auto& b = buffers_[current_];
+    size_t n = std::min(size, buffer_size_ - b.used);
+    std::memcpy(b.data + b.used, data, n);
+    b.used += n;
+    size_ += n;
+    data += n;
+    size -= n;
+
+    // submit the full buffer and move on to next one, it may still be in
+    // flight from last round
+    if (b.used == buffer_size_) {
+      uint64_t next_offset = b.offset + buffer_size_;
+      if (!submit(current_)) {
+        return false;
+      }
+
+      current_ = (current_ + 1) % buffers_.size();
+      while (buffers_[current_].busy) {
+        if (!waitOne()) {
+          return false;
+        }
+      }
+
+      buffers_[current_].used = 0;
+      buffers_[current_].offset = next_offset;
+    }
+  }
+
+  return !failed_;
+}
+
+bool FileWriter::Flush() {
+  if (failed_ || fd_ < 0) {
+    return false;
+  }
+
+  auto& b = buffers_[current_];
+  if (b.used > 0) {
+    if (!submit(current_)) {
+      return false;
+    }
+  }
+
+  if (!waitAll()) {
+    return false;
+  }
+
+  // in direct io mode, the unaligned tail was written padded. Keep it in the
+  // next buffer, later data is appended to it and the block is rewritten.
+  size_t aligned = b.used / alignment_ * alignment_;
+  size_t next = (current_ + 1) % buffers_.size();
+  auto& n = buffers_[next];
+  n.used = b.used - aligned;
+  n.offset = b.offset + aligned;
+  std::memcpy(n.data, b.data + aligned, n.used);
+  current_ = next;
+  return true;
+}
+
+bool FileWriter::Sync() {
+  return Flush() && fdatasync(plain_fd_) == 0;
+}
+
+bool FileWriter::WriteAt(uint64_t offset, const std::vector<uint8_t>& data) {
+  if (!Flush()) {
+    return false;
+  }
+
+  // in direct io mode the unaligned tail block stays buffered and is written
+  // again by the next flush, patch it too or it restores the old bytes
+  auto& b = buffers_[current_];
+  uint64_t begin = std::max(offset, b.offset);
+  uint64_t end = std::min(offset + data.size(), b.offset + b.used);
+  if (begin < end) {
+    std::memcpy(b.data + (begin - b.offset), data.data() + (begin - offset),
+                end - begin);
+  }
+
+  return pwrite(plain_fd_, data.data(), data.size(), offset) ==
+         static_cast<ssize_t>(data.size());
+}
+
+bool FileWriter::Close() {
+  if (fd_ < 0) {
+    return false;
+  }
+
+  bool ok = Flush();
+
+  // cut the padding of the last block written with O_DIRECT
+  if (ok && alignment_ > 1) {
+    ok = ftruncate(plain_fd_, size_) == 0;
+  }
+
+  closeRing();
+  close(fd_);
+  close(plain_fd_);
+  fd_ = -1;
+  plain_fd_ = -1;
+  return ok;
+}
+
+bool FileWriter::submit(size_t index) {
+  auto& b = buffers_[index];
+  size_t len = (b.used + alignment_ - 1) / alignment_ * alignment_;
+  std::memset(b.data + b.used, 0, len - b.used);
+
+  if (ring_ == nullptr) {
+    if (!writeSync(b.data, len, b.offset)) {
+      failed_ = true;
+    }
+    return !failed_;
+  }
+
+  unsigned tail = *ring_->sq_tail;
+  unsigned slot = tail & *ring_->sq_mask;
+  struct io_uring_sqe* sqe = &ring_->sqes[slot];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(b.data);
+  sqe->len = len;
+  sqe->off = b.offset;
+  sqe->user_data = index;
+  ring_->sq_array[slot] = slot;
+  __atomic_store_n(ring_->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (syscall(__NR_io_uring_enter, ring_->fd, 1, 0, 0, nullptr, 0) != 1) {
+    // give up io_uring, the request was not consumed
+    __atomic_store_n(ring_->sq_tail, tail, __ATOMIC_RELEASE);
+    if (!waitAll()) {
+      return false;
+    }
+    closeRing();
+    return submit(index);
+  }
+
+  b.busy = true;
+  ++in_flight_;
+  return true;
+}
+
+bool FileWriter::writeSync(const uint8_t* data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd_, data, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    data += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+bool FileWriter::waitOne() {
+  if (ring_ == nullptr || in_flight_ == 0) {
+    return !failed_;
+  }
+
+  unsigned head = *ring_->cq_head;
+  while (head == __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, ring_->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0) < 0 &&
+        errno != EINTR) {
+      failed_ = true;
+      return false;
+    }
+  }
+
+  while (head != __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &ring_->cqes[head & *ring_->cq_mask];
+    auto& b = buffers_[cqe->user_data];
+    size_t len = (b.used + alignment_ - 1) / alignment_ * alignment_;
+    if (cqe->res < 0) {
+      // kernel knows io_uring but not IORING_OP_WRITE (< 5.6), write it here
+      failed_ = failed_ || !writeSync(b.data, len, b.offset);
+    } else if (static_cast<size_t>(cqe->res) < len) {
+      // complete a short write synchronously
+      failed_ = failed_ || !writeSync(b.data + cqe->res, len - cqe->res,
+                                      b.offset + cqe->res);
+    }
+
+    b.busy = false;
+    --in_flight_;
+    ++head;
+  }
+
+  __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+  return !failed_;
+}
+
+bool FileWriter::waitAll() {
+  while (in_flight_ > 0) {
+    if (!waitOne()) {
+      return false;
+    }
+  }
+
+  return !failed_;
+}
+
+bool FileWriter::setupRing(unsigned entries) {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    return false;
+  }
+
+  ring_.reset(new uring());
+  auto& r = *ring_;
+  r.fd = ring_fd;
+  r.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    r.sq_len = r.cq_len = std::max(r.sq_len, r.cq_len);
+  }
+
+  r.sq_ptr = mmap(0, r.sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (r.sq_ptr == (void*)-1) {
+    return false;
+  }
+
+  if (single_mmap) {
+    r.cq_ptr = r.sq_ptr;
+  } else {
+    r.cq_ptr = mmap(0, r.cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (r.cq_ptr == (void*)-1) {
+      return false;
+    }
+  }
+
+  r.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(0, r.sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == (void*)-1) {
+    r.sqes_len = 0;
+    return false;
+  }
+
+  uint8_t* sq = reinterpret_cast<uint8_t*>(r.sq_ptr);
+  uint8_t* cq = reinterpret_cast<uint8_t*>(r.cq_ptr);
+  r.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  r.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  r.sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  r.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  r.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  r.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  r.cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  r.sqes = reinterpret_cast<struct io_uring_sqe*>(sqes);
+  r.cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+void FileWriter::closeRing() {
+  if (ring_ == nullptr) {
+    return;
+  }
+
+  waitAll();
+  auto& r = *ring_;
+  if (r.sqes_len > 0) {
+    munmap(r.sqes, r.sqes_len);
+  }
+  if (r.cq_ptr != (void*)-1 && r.cq_ptr != r.sq_ptr) {
+    munmap(r.cq_ptr, r.cq_len);
+  }
+  if (r.sq_ptr != (void*)-1) {
+    munmap(r.sq_ptr, r.sq_len);
+  }
+  if (r.fd >= 0) {
+    close(r.fd);
+  }
+  ring_.reset();
+}
+}  // namespace crypto
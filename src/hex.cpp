@@ -0,0 +1,87 @@
+#include "hex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POR_HEX_X86 1
+#endif
+
+namespace crypto {
+namespace {
+const char kDigits[] = "0123456789abcdef";
+
+void hexEncodeScalar(const uint8_t* data, size_t size, char* out) {
+  for (size_t i = 0; i < size; ++i) {
+    out[2 * i] = kDigits[data[i] >> 4];
+    out[2 * i + 1] = kDigits[data[i] & 0x0f];
+  }
+}
+
+#ifdef POR_HEX_X86
+// split each byte into high and low nibble, map nibbles to digits with one
+// shuffle, then interleave high/low digits into output order
+__attribute__((target("ssse3"))) void hexEncodeSsse3(const uint8_t* data,
+                                                     size_t size, char* out) {
+  const __m128i digits = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kDigits));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i low = _mm_and_si128(bytes, mask);
+    high = _mm_shuffle_epi8(digits, high);
+    low = _mm_shuffle_epi8(digits, low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i),
+                     _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16),
+                     _mm_unpackhi_epi8(high, low));
+  }
+  hexEncodeScalar(data + i, size - i, out + 2 * i);
+}
+
+// same as SSSE3 on 32 bytes, a sha256 digest in one iteration. unpack works
+// within 128 bit lanes, so lanes are swapped back in order before storing.
+__attribute__((target("avx2"))) void hexEncodeAvx2(const uint8_t* data,
+                                                   size_t size, char* out) {
+  const __m256i digits = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kDigits)));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask);
+    __m256i low = _mm256_and_si256(bytes, mask);
+    high = _mm256_shuffle_epi8(digits, high);
+    low = _mm256_shuffle_epi8(digits, low);
+    __m256i first = _mm256_unpacklo_epi8(high, low);
+    __m256i second = _mm256_unpackhi_epi8(high, low);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i),
+                        _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i + 32),
+                        _mm256_permute2x128_si256(first, second, 0x31));
+  }
+  hexEncodeSsse3(data + i, size - i, out + 2 * i);
+}
+#endif
+
+using encoder = void (*)(const uint8_t*, size_t, char*);
+
+encoder selectEncoder() {
+#ifdef POR_HEX_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return hexEncodeAvx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return hexEncodeSsse3;
+  }
+#endif
+  return hexEncodeScalar;
+}
+}  // namespace
+
+void HexEncode(const uint8_t* data, size_t size, char* out) {
+  static const encoder encode = selectEncoder();
+  encode(data, size, out);
+}
+}  // namespace crypto
@@ -0,0 +1,154 @@
+#include "learned_index.h"
+
+#include <cstring>
+#include <limits>
+
+namespace crypto {
+LearnedIndex::Builder::Builder(uint64_t epsilon)
+    : epsilon_(epsilon), n_(0), last_(0), lo_(0), hi_(0) {}
+
+bool LearnedIndex::Builder::Add(uint64_t key) {
+  if (n_ > 0 && key <= last_) {
+    return false;
+  }
+
+  addPoint(segments_, lo_, hi_, epsilon_, key, n_);
+  last_ = key;
+  ++n_;
+  return true;
+}
+
+void LearnedIndex::Builder::addPoint(std::vector<segment>& level, double& lo,
+                                     double& hi, uint64_t epsilon, uint64_t key,
+                                     uint64_t position) {
+  if (!level.empty()) {
+    // slopes that keep this point within epsilon of the line through the
+    // segment's first point, slope is never negative so that predictions
+    // grow with the key
+    const segment& s = level.back();
+    double dx = static_cast<double>(key - s.key);
+    double dy = static_cast<double>(position - s.position);
+    double a = (dy - static_cast<double>(epsilon)) / dx;
+    double b = (dy + static_cast<double>(epsilon)) / dx;
+    double new_lo = a > lo ? a : lo;
+    double new_hi = b < hi ? b : hi;
+    if (new_lo <= new_hi) {
+      lo = new_lo;
+      hi = new_hi;
+      return;
+    }
+
+    closeSegment(level, lo, hi);
+  }
+
+  level.push_back({key, 0, position});
+  lo = 0;
+  hi = std::numeric_limits<double>::infinity();
+}
+
+void LearnedIndex::Builder::closeSegment(std::vector<segment>& level,
+                                         double lo, double hi) {
+  level.back().slope = hi == std::numeric_limits<double>::infinity()
+                           ? lo
+                           : lo + (hi - lo) / 2;
+}
+
+std::vector<uint64_t> LearnedIndex::Builder::Finish() {
+  std::vector<std::vector<segment>> levels;
+  if (n_ > 0) {
+    closeSegment(segments_, lo_, hi_);
+    levels.push_back(segments_);
+  }
+
+  // index first keys of the level below until one segment is left
+  while (!levels.empty() && levels.back().size() > 1) {
+    std::vector<segment> upper;
+    double lo = 0;
+    double hi = 0;
+    const auto& lower = levels.back();
+    for (uint64_t i = 0; i < lower.size(); ++i) {
+      addPoint(upper, lo, hi, epsilon_, lower[i].key, i);
+    }
+    closeSegment(upper, lo, hi);
+    levels.push_back(upper);
+  }
+
+  std::vector<uint64_t> words = {n_, epsilon_, levels.size()};
+  for (const auto& level : levels) {
+    words.push_back(level.size());
+  }
+  for (const auto& level : levels) {
+    for (const auto& s : level) {
+      uint64_t slope;
+      std::memcpy(&slope, &s.slope, sizeof slope);
+      words.push_back(s.key);
+      words.push_back(slope);
+      words.push_back(s.position);
+    }
+  }
+  return words;
+}
+
+LearnedIndex::LearnedIndex()
+    : n_(0), epsilon_(0), levels_(0), counts_(nullptr) {}
+
+LearnedIndex::LearnedIndex(const uint64_t* data)
+    : n_(data[0]), epsilon_(data[1]), levels_(data[2]), counts_(data + 3) {
+  const uint64_t* p = counts_ + levels_;
+  for (uint64_t level = 0; level < levels_; ++level) {
+    segments_.push_back(p);
+    p += counts_[level] * 3;
+  }
+}
+
+size_t LearnedIndex::Words() const {
+  size_t words = 3 + levels_;
+  for (uint64_t level = 0; level < levels_; ++level) {
+    words += counts_[level] * 3;
+  }
+  return words;
+}
+
+uint64_t LearnedIndex::Segments() const {
+  return levels_ > 0 ? counts_[0] : 0;
+}
+
+uint64_t LearnedIndex::Predict(uint64_t key) const {
+  if (n_ == 0 || key <= segmentKey(0, 0)) {
+    return 0;
+  }
+
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  return predictBottom(key, begin, end);
+}
+
+uint64_t LearnedIndex::predictBottom(uint64_t key, uint64_t& begin,
+                                     uint64_t& end) const {
+  // walk down from the single root segment, at each level find the last
+  // segment whose first key is <= key
+  uint64_t i = 0;
+  for (uint64_t level = levels_ - 1; level > 0; --level) {
+    uint64_t p = predict(level, i, key, begin, end);
+    i = search(key, true, begin, end, p,
+               [this, level](uint64_t j) { return segmentKey(level - 1, j); }) -
+        1;
+  }
+  return predict(0, i, key, begin, end);
+}
+
+uint64_t LearnedIndex::predict(uint64_t level, uint64_t i, uint64_t key,
+                               uint64_t& begin, uint64_t& end) const {
+  const uint64_t* s = segments_[level] + i * 3;
+  double slope;
+  std::memcpy(&slope, s + 1, sizeof slope);
+
+  begin = s[2];
+  end = i + 1 < counts_[level] ? s[5] : (level == 0 ? n_ : counts_[level - 1]);
+  double offset = slope * static_cast<double>(key - s[0]);
+  if (offset >= static_cast<double>(end - begin)) {
+    return end - 1;
+  }
+  return begin + static_cast<uint64_t>(offset);
+}
+}  // namespace crypto
@@ -0,0 +1,229 @@
+#include "line_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#ifdef POR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace crypto {
+#ifdef POR_HAVE_ZLIB
+struct LineReader::inflater {
+  z_stream stream;
+  std::vector<unsigned char> input;
+  // a member ended, another one may follow
+  bool member_end = false;
+};
+#else
+struct LineReader::inflater {};
+#endif
+
+LineReader::LineReader(size_t block_size, size_t queue_depth)
+    : block_size_(std::max<size_t>(1, block_size)),
+      queue_depth_(std::max<size_t>(1, queue_depth)),
+      fd_(-1),
+      compressed_(false),
+      skip_(0),
+      failed_(false),
+      pos_(0),
+      position_(0) {}
+
+LineReader::~LineReader() { Close(); }
+
+bool LineReader::Open(const std::string& file, uint64_t offset) {
+  Close();
+  fd_ = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  unsigned char magic[4] = {0, 0, 0, 0};
+  ssize_t n = pread(fd_, magic, sizeof magic, 0);
+  compressed_ = n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+  const bool zstd = n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+                    magic[2] == 0x2f && magic[3] == 0xfd;
+  bool supported = !zstd;
+#ifdef POR_HAVE_ZLIB
+  if (compressed_) {
+    inflater_ = std::make_unique<inflater>();
+    std::memset(&inflater_->stream, 0, sizeof inflater_->stream);
+    inflater_->input.resize(std::min<size_t>(block_size_, 1 << 18));
+    // gzip wrapper only
+    supported = inflateInit2(&inflater_->stream, 15 + 16) == Z_OK;
+    if (!supported) {
+      inflater_.reset();
+    }
+  }
+#else
+  supported = supported && !compressed_;
+#endif
+  if (!supported) {
+    std::cerr << file << ": compression format is not supported" << std::endl;
+    Close();
+    return false;
+  }
+
+  skip_ = compressed_ ? offset : 0;
+  if (!compressed_ && lseek(fd_, offset, SEEK_SET) < 0) {
+    Close();
+    return false;
+  }
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  failed_ = false;
+  position_ = offset;
+  current_ = block();
+  pos_ = 0;
+  carry_.clear();
+  full_ = std::make_unique<BoundedQueue<block>>(queue_depth_);
+  free_ = std::make_unique<BoundedQueue<block>>(queue_depth_);
+  for (size_t i = 0; i < queue_depth_; ++i) {
+    block b;
+    b.data.resize(block_size_);
+    free_->Push(std::move(b));
+  }
+  thread_ = std::thread(&LineReader::produce, this);
+  return true;
+}
+
+void LineReader::Close() {
+  if (thread_.joinable()) {
+    // wakes the producer wherever it waits
+    free_->Close();
+    full_->Close();
+    thread_.join();
+  }
+  full_.reset();
+  free_.reset();
+#ifdef POR_HAVE_ZLIB
+  if (inflater_) {
+    inflateEnd(&inflater_->stream);
+  }
+#endif
+  inflater_.reset();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool LineReader::Next(std::string_view& line) {
+  carry_.clear();
+  while (true) {
+    if (pos_ < current_.size) {
+      const char* beg = current_.data.data() + pos_;
+      const size_t left = current_.size - pos_;
+      const char* end = static_cast<const char*>(std::memchr(beg, '\n', left));
+      if (end != nullptr) {
+        const size_t size = end - beg;
+        pos_ += size + 1;
+        position_ += size + 1;
+        if (carry_.empty()) {
+          line = std::string_view(beg, size);
+        } else {
+          carry_.append(beg, size);
+          line = carry_;
+        }
+        return true;
+      }
+      carry_.append(beg, left);
+      pos_ += left;
+      position_ += left;
+    }
+
+    // the split block goes back to the producer
+    if (!current_.data.empty()) {
+      free_->Push(std::move(current_));
+    }
+    current_ = block();
+    pos_ = 0;
+    if (!full_ || !full_->Pop(current_)) {
+      // the last line may end without '\n'
+      if (!carry_.empty() && !failed_) {
+        line = carry_;
+        return true;
+      }
+      return false;
+    }
+  }
+}
+
+void LineReader::produce() {
+  block b;
+  bool more = true;
+  while (more && free_->Pop(b)) {
+    b.size = 0;
+    while (more && b.size < block_size_) {
+      size_t n = 0;
+      more = read(b.data.data() + b.size, block_size_ - b.size, n);
+      b.size += n;
+
+      // text in front of the open offset of a compressed file
+      const size_t drop = std::min<uint64_t>(skip_, b.size);
+      if (drop > 0) {
+        std::memmove(b.data.data(), b.data.data() + drop, b.size - drop);
+        b.size -= drop;
+        skip_ -= drop;
+      }
+    }
+    if (b.size > 0 && !full_->Push(std::move(b))) {
+      break;
+    }
+  }
+  full_->Close();
+}
+
+bool LineReader::read(char* out, size_t size, size_t& n) {
+  n = 0;
+  if (!compressed_) {
+    ssize_t r = ::read(fd_, out, size);
+    if (r < 0) {
+      failed_ = true;
+      return false;
+    }
+    n = r;
+    return r > 0;
+  }
+
+#ifdef POR_HAVE_ZLIB
+  z_stream& stream = inflater_->stream;
+  stream.next_out = reinterpret_cast<unsigned char*>(out);
+  stream.avail_out = size;
+  while (stream.avail_out > 0) {
+    if (stream.avail_in == 0) {
+      ssize_t r = ::read(fd_, inflater_->input.data(), inflater_->input.size());
+      if (r <= 0) {
+        // a clean end is the end of a member
+        failed_ = r < 0 || !inflater_->member_end;
+        n = size - stream.avail_out;
+        return false;
+      }
+      stream.next_in = inflater_->input.data();
+      stream.avail_in = r;
+    }
+    if (inflater_->member_end) {
+      inflateReset(&stream);
+      inflater_->member_end = false;
+    }
+    int rc = inflate(&stream, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+      inflater_->member_end = true;
+    } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      failed_ = true;
+      n = size - stream.avail_out;
+      return false;
+    }
+  }
+  n = size;
+  return true;
+#else
+  failed_ = true;
+  return false;
+#endif
+}
+}  // namespace crypto
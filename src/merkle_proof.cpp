@@ -1,70 +1,179 @@
 #include "merkle_proof.h"
 
-#include <iomanip>
-#include <sstream>
+#include <charconv>
 
+#include "hex.h"
 #include "tagged_hash.h"
 
 namespace crypto {
 MerkleProof::MerkleProof() {}
 
 void MerkleProof::AddSibling(const std::vector<uint8_t>& hash, bool left) {
+  AddSibling(hash, left, 0);
+}
+
+void MerkleProof::AddSibling(const std::vector<uint8_t>& hash, bool left,
+                             uint64_t sum) {
   raw_data_.push_back(std::make_pair(left, hash));
+  sums_.push_back(sum);
 }
 
 std::string MerkleProof::GenerateProof(const std::vector<uint8_t>& tag,
                                        const std::vector<uint8_t>& root) {
-  if (raw_data_.empty()) {
+  return generateProof(tag, root, 0, false);
+}
+
+std::string MerkleProof::GenerateProof(const std::vector<uint8_t>& tag,
+                                       const std::vector<uint8_t>& root,
+                                       uint64_t root_sum) {
+  return generateProof(tag, root, root_sum, true);
+}
+
+std::string MerkleProof::generateProof(const std::vector<uint8_t>& tag,
+                                       const std::vector<uint8_t>& root,
+                                       uint64_t root_sum, bool with_sum) {
+  if (raw_data_.empty() || !verify(tag, root, root_sum, with_sum)) {
     return "";
   }
 
-  // verify if the root matches and construct proof path
-  // add the leaf that is to be verified
+  // the leaf that is to be verified
   std::string proof = serializeHash(raw_data_[0].second);
-  std::vector<uint8_t> calculated_root = raw_data_[0].second;
+  if (with_sum) {
+    proof += "," + std::to_string(sums_[0]);
+  }
 
-  // add sibling node of each layer up to merkle root
+  // sibling node of each layer up to merkle root
+  for (size_t i = 1; i < raw_data_.size(); ++i) {
+    proof += raw_data_[i].first ? " (left," : " (right,";
+    proof += serializeHash(raw_data_[i].second);
+    if (with_sum) {
+      proof += "," + std::to_string(sums_[i]);
+    }
+    proof += ")";
+  }
+
+  // merkle root
+  proof += " " + serializeHash(root);
+  if (with_sum) {
+    proof += "," + std::to_string(root_sum);
+  }
+
+  return proof;
+}
+
+bool MerkleProof::RenderJson(const std::vector<uint8_t>& tag,
+                             const std::vector<uint8_t>& root,
+                             std::string& out) {
+  return renderJson(tag, root, 0, false, out);
+}
+
+bool MerkleProof::RenderJson(const std::vector<uint8_t>& tag,
+                             const std::vector<uint8_t>& root,
+                             uint64_t root_sum, std::string& out) {
+  return renderJson(tag, root, root_sum, true, out);
+}
+
+// Layout of the web service's proof object. "UserHash" is the key the Go
+// service has always emitted, its struct tag was malformed.
+bool MerkleProof::renderJson(const std::vector<uint8_t>& tag,
+                             const std::vector<uint8_t>& root,
+                             uint64_t root_sum, bool with_sum,
+                             std::string& out) {
+  if (raw_data_.empty() || !verify(tag, root, root_sum, with_sum)) {
+    return false;
+  }
+
+  out += "{\"merkle_root\":\"";
+  appendHash(root, out);
+  out += "\"";
+  if (with_sum) {
+    out += ",\"root_sum\":";
+    appendNumber(root_sum, out);
+  }
+
+  out += ",\"UserHash\":\"";
+  appendHash(raw_data_[0].second, out);
+  out += "\",\"merkle_path\":";
+  if (raw_data_.size() == 1) {
+    out += "null";
+  } else {
+    out += "[";
+    for (size_t i = 1; i < raw_data_.size(); ++i) {
+      out += i == 1 ? "" : ",";
+      out += raw_data_[i].first ? "{\"position\":\"left\",\"node_hash\":\""
+                                : "{\"position\":\"right\",\"node_hash\":\"";
+      appendHash(raw_data_[i].second, out);
+      out += "\"";
+      if (with_sum) {
+        out += ",\"node_sum\":";
+        appendNumber(sums_[i], out);
+      }
+      out += "}";
+    }
+    out += "]";
+  }
+  out += "}";
+  return true;
+}
+
+// hash the path up to the root and compare it with the expected root
+bool MerkleProof::verify(const std::vector<uint8_t>& tag,
+                         const std::vector<uint8_t>& root, uint64_t root_sum,
+                         bool with_sum) const {
+  std::vector<uint8_t> calculated_root = raw_data_[0].second;
+  uint64_t calculated_sum = sums_[0];
   TaggedHasher hasher(tag);
   for (size_t i = 1; i < raw_data_.size(); ++i) {
     hasher.Reset();
-    proof += " (";
+    // a sum tree branch commits to both children's hashes and sums:
+    // hash(left hash | left sum | right hash | right sum)
+    const uint8_t* p_sibling_sum = reinterpret_cast<const uint8_t*>(&sums_[i]);
+    const uint8_t* p_sum = reinterpret_cast<const uint8_t*>(&calculated_sum);
     if (raw_data_[i].first) {
       hasher.Append(raw_data_[i].second);
+      if (with_sum) hasher.Append(p_sibling_sum, 8);
       hasher.Append(calculated_root);
-      proof += "left,";
+      if (with_sum) hasher.Append(p_sum, 8);
     } else {
       hasher.Append(calculated_root);
+      if (with_sum) hasher.Append(p_sum, 8);
       hasher.Append(raw_data_[i].second);
-      proof += "right,";
+      if (with_sum) hasher.Append(p_sibling_sum, 8);
+    }
+    if (with_sum) {
+      if (calculated_sum + sums_[i] < calculated_sum) {
+        return false;
+      }
+      calculated_sum += sums_[i];
     }
-    proof += serializeHash(raw_data_[i].second);
-    proof += ")";
 
     calculated_root = hasher.Hash();
   }
 
-  // add merkle root
-  proof += " " + serializeHash(calculated_root);
-  if (calculated_root != root) {
-    return "";
-  }
+  return calculated_root == root && (!with_sum || calculated_sum == root_sum);
+}
 
+std::string MerkleProof::serializeHash(const std::vector<uint8_t>& hash) const {
+  std::string proof;
+  appendHash(hash, proof);
   return proof;
 }
 
-std::string MerkleProof::serializeHash(const std::vector<uint8_t>& hash) const {
+void MerkleProof::appendHash(const std::vector<uint8_t>& hash,
+                             std::string& out) {
   if (hash.empty()) {
-    return "";
+    return;
   }
 
-  std::string proof = "0x";
-  std::stringstream ss;
-  ss << std::hex << std::setfill('0');
-  for (auto b : hash) {
-    ss << std::setw(2) << static_cast<unsigned>(b);
-  }
+  size_t size = out.size();
+  out.resize(size + 2 + hash.size() * 2);
+  out[size] = '0';
+  out[size + 1] = 'x';
+  HexEncode(hash.data(), hash.size(), &out[size + 2]);
+}
 
-  proof += ss.str();
-  return proof;
+void MerkleProof::appendNumber(uint64_t number, std::string& out) {
+  char text[20];
+  out.append(text, std::to_chars(text, text + sizeof text, number).ptr);
 }
-}  // namespace crypto
\ No newline at end of file
+}  // namespace crypto
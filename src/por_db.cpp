@@ -2,18 +2,29 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <sstream>
 #include <string>
+#include <string_view>
 
+#include "bounded_queue.h"
+#include "file_writer.h"
+#include "line_reader.h"
 #include "merkle_proof.h"
 #include "sha256.h"
 #include "tagged_hash.h"
@@ -25,8 +36,8 @@ PoRDB& PoRDB::Instance() {
 }
 
 PoRDB::~PoRDB() {
-  unmmapFile(index_map);
-  unmmapFile(merkle_map);
+  stopWarmUp();
+  unmapFiles();
 }
 
 // Preprocess user data file to create index and merkle tree for user data
@@ -35,7 +46,8 @@ PoRDB::~PoRDB() {
 // 15 minutes to preprocess the file, and each query would take
 // approximately 1.8 milliseconds.
 // TODO: boost performance of load and query.
-bool PoRDB::Load(const std::string& user_data_file) {
+bool PoRDB::Load(const std::string& user_data_file,
+                 const PoROptions& options) {
   // ASSUMPTION: orginal user data file: first line total number, following
   // lines are user info, one line for each user.
 
@@ -43,344 +55,2933 @@ bool PoRDB::Load(const std::string& user_data_file) {
   //   sha256    magic      user No#         data offset
   // | 256 bit | 64 bit |    64 bit     | 64 bit id + 64 bit offset | .. |
   // (1,1111) (2,2222)....
+  // compressed index file format, see EliasFano for the encoding:
+  //   sha256    magic     user No#    records offset  id words  offset words
+  // | 256 bit | 64 bit |   64 bit   |     64 bit     |  64 bit  |   64 bit   |
+  // | Elias-Fano ids | Elias-Fano record offsets | (1,1111) (2,2222)....
+  // with binary records, user records are 64 bit id + 64 bit balance and
+  // double as the index entries:
+  //   sha256    magic      user No#
+  // | 256 bit | 64 bit |    64 bit     | 64 bit id + 64 bit balance | .. |
+  // and compressed index keeps no record offsets, the i-th record is at
+  // records offset + 16 * i
+  // learned index file format, see LearnedIndex for the model:
+  //   sha256    magic     user No#    entries offset  model words
+  // | 256 bit | 64 bit |   64 bit   |     64 bit     |   64 bit    |
+  // | model | 64 bit id + 64 bit offset | .. | (1,1111) (2,2222)....
+
+  // filter file format, see BloomFilter for blocks:
+  //   sha256    magic      user No#     block No#
+  // | 256 bit | 64 bit |    64 bit    |   64 bit   | 256 bit block | .. |
 
   // merkle file format
   //   sha256    magic      user No#      leaf hash and branch node hash
   // | 256 bit | 64 bit |    64 bit     | 256 bit | ..
+  // in merkle sum tree mode, each node is followed by its balance sum
+  // | 256 bit | 64 bit |    64 bit     | 256 bit hash + 64 bit sum | ..
+  // with dropped levels, the nodes start at the lowest stored level
+  //   sha256    magic      user No#     dropped No#
+  // | 256 bit | 64 bit |    64 bit     |   64 bit    | node | ..
+
+  // Check if user data file exists and is regular file, it isn't read when
+  // attaching to a shared segment
+  const bool attach = !options.shared_memory.empty();
+  if (!attach && !regularFileExists(user_data_file)) {
+    return false;
+  }
+  // a node carries a single balance sum
+  if (options.assets == 0 || (options.assets > 1 && options.sum_tree)) {
+    return false;
+  }
+
+  db_options = options;
+
+  // release mapping of previously loaded files, they may be rebuilt below
+  stopWarmUp();
+  unmapFiles();
+  buffer_pool.reset();
+  filter.Reset();
+  has_appended = false;
+  std::atomic_store(&appended, std::shared_ptr<const appendedusers>());
+  ++snapshot;
+  response_cache.reset();
+  if (db_options.response_cache_bytes > 0) {
+    response_cache = std::make_unique<ResponseCache>(
+        db_options.response_cache_bytes, db_options.response_cache_shards);
+  }
+
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::string filter_file = user_data_file + ".filter";
+  std::string database_file = user_data_file + ".por";
+  append_file = attach ? "" : user_data_file + ".append";
+  if (attach) {
+    // sections of a segment another process built and verified
+    if (db_options.map_strategy == MapStrategy::kBufferPool ||
+        !mapDatabase(segmentPath(db_options.shared_memory), true)) {
+      return false;
+    }
+  } else if (db_options.single_file) {
+    // the sections are views into one mapping, there are no pages to pread
+    if (db_options.map_strategy == MapStrategy::kBufferPool) {
+      return false;
+    }
+    if (!mapDatabase(database_file)) {
+      if (!buildFiles(user_data_file)) {
+        return false;
+      }
+      index_map = mmapFile(index_file);
+      merkle_map = mmapFile(merkle_file);
+      parseMerkle();
+      bool packed = packDatabase(database_file, filter_file);
+      unmapFiles();
+      if (!packed || !mapDatabase(database_file)) {
+        return false;
+      }
+      for (const std::string& file : {index_file, merkle_file, filter_file}) {
+        std::filesystem::remove(file);
+      }
+    }
+  } else {
+    if (!buildFiles(user_data_file)) {
+      return false;
+    }
 
-  // Check if user data file exists and is regular file
-  if (!regularFileExists(user_data_file)) {
+    // memory map index file, merkle file into process address space
+    index_map = mmapFile(index_file);
+    merkle_map = mmapFile(merkle_file);
+  }
+  parseMerkle();
+  if (db_options.map_strategy == MapStrategy::kBufferPool &&
+      !openBufferPool()) {
+    return false;
+  }
+  parseIndex();
+  if (db_options.id_filter && !db_options.single_file && !attach &&
+      !loadFilter(filter_file)) {
+    return false;
+  }
+  if (!attach && regularFileExists(append_file) &&
+      !loadAppended(append_file)) {
     return false;
   }
+  // pool pages are read on demand, the pinned levels are already in memory
+  if (db_options.warmup && !buffer_pool) {
+    startWarmUp();
+  }
 
+  return true;
+}
+
+bool PoRDB::buildFiles(const std::string& user_data_file) {
   // if index file and merkle file are either non-existent or invalid, rebuild
   // these file
   std::string index_file = user_data_file + ".index";
   std::string merkle_file = user_data_file + ".merkle";
-  if (!regularFileExists(index_file) ||
-      !verifyFileFingerPrint(index_file, kIndexMagic) ||
-      !regularFileExists(merkle_file) ||
-      !verifyFileFingerPrint(merkle_file, kMerkleMagic)) {
-    if (regularFileExists(index_file)) {
-      std::filesystem::remove(index_file);
+  std::string filter_file = user_data_file + ".filter";
+  auto columns_match = [this](const std::string& index) {
+    uint8_t head[56] = {};
+    std::ifstream f(index, std::ios::in | std::ios::binary);
+    f.read(reinterpret_cast<char*>(head), sizeof head);
+    return f.gcount() >= 48 &&
+           columnsMatch(head, std::filesystem::file_size(index));
+  };
+  if (regularFileExists(index_file) &&
+      verifyFileFingerPrint(index_file, indexMagic()) &&
+      columns_match(index_file) && regularFileExists(merkle_file) &&
+      verifyFileFingerPrint(merkle_file, merkleMagic()) &&
+      (!db_options.id_filter ||
+       (regularFileExists(filter_file) &&
+        verifyFileFingerPrint(filter_file, kFilterMagic)))) {
+    return true;
+  }
+  if (!db_options.rebuild) {
+    return false;
+  }
+
+  if (regularFileExists(index_file)) {
+    std::filesystem::remove(index_file);
+  }
+
+  if (regularFileExists(filter_file)) {
+    std::filesystem::remove(filter_file);
+  }
+
+  if (regularFileExists(merkle_file)) {
+    std::filesystem::remove(merkle_file);
+  }
+
+  // preprocess user data file and generate index and merkle
+  return preprocessUserFile(user_data_file, index_file, merkle_file);
+}
+
+bool PoRDB::Ready() const { return warm; }
+
+// After Load, the first queries hit major faults on both mappings. Warm-up
+// touches every page in the background, in the order a query touches them:
+// upper merkle levels (shared by every proof), index entries (binary search),
+// merkle leaf level and finally the user records.
+void PoRDB::startWarmUp() {
+  std::vector<std::pair<const uint8_t*, size_t>> regions;
+  if (merkle_map.file_map != (void*)-1) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(merkle_map.file_map);
+    uint64_t count = levelCount(*reinterpret_cast<const uint64_t*>(p + 40),
+                                dropped_levels);
+    p += merkle_offset;
+
+    const size_t node_size = merkleNodeSize();
+    std::vector<std::pair<const uint8_t*, size_t>> levels;
+    while (count > 1) {
+      count += count & 0x01;
+      levels.push_back(std::make_pair(p, count * node_size));
+      p += count * node_size;
+      count >>= 1;
+    }
+    levels.push_back(std::make_pair(p, count * node_size));
+
+    // from root down to the level above leaves
+    regions.insert(regions.end(), levels.rbegin(), levels.rend() - 1);
+    if (index_map.file_map != (void*)-1) {
+      const uint8_t* index = reinterpret_cast<const uint8_t*>(index_map.file_map);
+      regions.push_back(std::make_pair(index + 48, records_offset - 48));
+      regions.push_back(levels.front());
+      regions.push_back(std::make_pair(index + records_offset,
+                                       index_map.file_size - records_offset));
     }
+  }
+
+  size_t thread_count = db_options.warmup_threads;
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
 
-    if (regularFileExists(merkle_file)) {
-      std::filesystem::remove(index_file);
+  warm = false;
+  stop_warmup = false;
+  warmup_thread = std::thread([this, regions, thread_count]() {
+    auto start = std::chrono::steady_clock::now();
+    const size_t kPageSize = sysconf(_SC_PAGESIZE);
+
+    // ask kernel to read ahead all regions asynchronously
+    for (const auto& [p, size] : regions) {
+      uintptr_t beg = reinterpret_cast<uintptr_t>(p) & ~(kPageSize - 1);
+      uintptr_t end = reinterpret_cast<uintptr_t>(p) + size;
+      madvise(reinterpret_cast<void*>(beg), end - beg, MADV_WILLNEED);
     }
 
-    // preprocess user data file and generate index and merkle
-    if (!preprocessUserFile(user_data_file, index_file, merkle_file)) {
-      return false;
+    // touch one byte per page, each region is split among the threads
+    for (const auto& [p, size] : regions) {
+      std::vector<std::thread> touchers;
+      size_t step = (size + thread_count - 1) / thread_count;
+      for (size_t t = 0; t < thread_count && t * step < size; ++t) {
+        touchers.push_back(std::thread([this, p = p, size = size, step, t,
+                                        kPageSize]() {
+          uint8_t sum = 0;
+          size_t end = std::min(size, (t + 1) * step);
+          for (size_t i = t * step; i < end && !stop_warmup; i += kPageSize) {
+            sum += *reinterpret_cast<const volatile uint8_t*>(p + i);
+          }
+          (void)sum;
+        }));
+      }
+
+      for (auto& t : touchers) {
+        t.join();
+      }
+
+      if (stop_warmup) {
+        return;
+      }
     }
-  }
 
-  // memory map user file, index file, merkle file into process address space
-  index_map = mmapFile(index_file);
-  merkle_map = mmapFile(merkle_file);
-  return true;
+    auto end = std::chrono::steady_clock::now();
+    warmup_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                    .count();
+    warm = true;
+  });
+}
+
+void PoRDB::stopWarmUp() {
+  stop_warmup = true;
+  if (warmup_thread.joinable()) {
+    warmup_thread.join();
+  }
+  warm = true;
 }
 
 std::string PoRDB::UserInfo(uint64_t id, std::string& proof) const {
-  if (index_map.file_map == (void*)-1) {
+  if (response_cache) {
+    return response_cache->Get(
+        snapshot, id, proof,
+        [this, id](std::string& proof) { return userInfo(id, proof); },
+        ResponseCache::kText);
+  }
+
+  return userInfo(id, proof);
+}
+
+bool PoRDB::UserInfoJson(uint64_t id, std::string& json) const {
+  if (response_cache) {
+    std::string unused;
+    json = response_cache->Get(
+        snapshot, id, unused,
+        [this, id](std::string&) {
+          std::string json;
+          userInfoJson(id, json);
+          return json;
+        },
+        ResponseCache::kJson);
+    return !json.empty();
+  }
+
+  return userInfoJson(id, json);
+}
+
+bool PoRDB::userInfoJson(uint64_t id, std::string& json) const {
+  json.clear();
+  uint64_t order = 0;
+  std::string user_info = findUser(id, order);
+  if (user_info.empty()) {
+    return false;
+  }
+  return renderUserJson(user_info, order, json);
+}
+
+bool PoRDB::renderUserJson(const std::string& user_info, uint64_t order,
+                           std::string& json) const {
+  MerkleProof generator;
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  auto root = generateProof(order, path, sums, root_sum);
+  for (size_t i = 0; i < path.size(); ++i) {
+    generator.AddSibling(path[i].second, path[i].first, sums[i]);
+  }
+
+  return renderJson(user_info, generator, root, root_sum, db_options.sum_tree,
+                    json);
+}
+
+// {"error_message":"Success","user":{"id":1,"balance":1111,"proof":{..}}},
+// a multi-asset record has "balances":[1111,2222] instead
+bool PoRDB::renderJson(const std::string& user_info, MerkleProof& generator,
+                       const std::vector<uint8_t>& root, uint64_t root_sum,
+                       bool sum_tree, std::string& json) {
+  // record is "(id,balance)" or "(id,balance 1,..,balance N)"
+  const char* beg = user_info.data();
+  const char* end = beg + user_info.size();
+  beg += beg < end && *beg == '(' ? 1 : 0;
+  uint64_t id = 0;
+  uint64_t balance = 0;
+  const char* p = std::from_chars(beg, end, id).ptr;
+  const bool multi_asset = std::count(p, end, ',') > 1;
+
+  char number[20];
+  json.clear();
+  json += "{\"error_message\":\"Success\",\"user\":{\"id\":";
+  json.append(number, std::to_chars(number, number + sizeof number, id).ptr);
+  json += multi_asset ? ",\"balances\":[" : ",\"balance\":";
+  bool first = true;
+  do {
+    balance = 0;
+    if (p < end && *p == ',') {
+      p = std::from_chars(p + 1, end, balance).ptr;
+    }
+    if (!first) {
+      json += ',';
+    }
+    first = false;
+    json.append(number,
+                std::to_chars(number, number + sizeof number, balance).ptr);
+  } while (multi_asset && p < end && *p == ',');
+  if (multi_asset) {
+    json += ']';
+  }
+  json += ",\"proof\":";
+  bool ok = sum_tree ? generator.RenderJson(kBranchTag, root, root_sum, json)
+                     : generator.RenderJson(kBranchTag, root, json);
+  json += "}}";
+  if (!ok) {
+    json.clear();
+  }
+  return ok;
+}
+
+std::string PoRDB::userInfo(uint64_t id, std::string& proof) const {
+  uint64_t order = 0;
+  std::string user_info = findUser(id, order);
+  if (user_info.empty()) {
+    return "";
+  }
+
+  MerkleProof generator;
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  auto root = generateProof(order, path, sums, root_sum);
+  for (size_t i = 0; i < path.size(); ++i) {
+    generator.AddSibling(path[i].second, path[i].first, sums[i]);
+  }
+
+  if (db_options.sum_tree) {
+    proof = generator.GenerateProof(kBranchTag, root, root_sum);
+  } else {
+    proof = generator.GenerateProof(kBranchTag, root);
+  }
+
+  return user_info;
+}
+
+std::string PoRDB::findUser(uint64_t id, uint64_t& order) const {
+  if (!index_map.loaded()) {
+    return "";
+  }
+
+  // appended ids are above all ids of the index and not in the filter
+  if (auto ext = appendedUsers(); ext && id >= ext->id(0)) {
+    uint64_t low = 0;
+    uint64_t high = ext->size();
+    while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      if (ext->id(mid) < id) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low == ext->size() || ext->id(low) != id) {
+      return "";
+    }
+    order = ext->base_count + low;
+    return renderRecord(id, ext->balance(low));
+  }
+
+  // most probes of unknown ids stop here, in one cache line
+  if (db_options.id_filter && !filter.MayContain(id)) {
+    filter_rejects.fetch_add(1, std::memory_order_relaxed);
     return "";
   }
 
+  const char* index = reinterpret_cast<const char*>(index_map.file_map);
+  if (db_options.compressed_index) {
+    uint64_t i = index_ids.LowerBound(id);
+    if (i == index_ids.Size() || index_ids.Get(i) != id) {
+      return "";
+    }
+
+    order = i;
+    return recordAt(order);
+  }
+
+  if (buffer_pool) {
+    // every probe reads one entry through the pool, until the rest of the
+    // range fits into a page and is searched in one read
+    const uint64_t count = index_head[5];
+    auto id_at = [this](uint64_t i) {
+      struct indexentry entry {UINT64_MAX, 0};
+      buffer_pool->Read(index_map.fd, entries_offset + i * sizeof entry,
+                        sizeof entry, &entry);
+      return entry.id;
+    };
+    uint64_t i = 0;
+    if (learnedIndex()) {
+      i = index_model.LowerBound(id, id_at);
+    } else {
+      const uint64_t kPageEntries = 4096 / sizeof(struct indexentry);
+      uint64_t end = count;
+      while (end - i > kPageEntries) {
+        uint64_t mid = i + (end - i) / 2;
+        if (id_at(mid) < id) {
+          i = mid + 1;
+        } else {
+          end = mid;
+        }
+      }
+      struct indexentry entries[kPageEntries];
+      if (!buffer_pool->Read(index_map.fd,
+                             entries_offset + i * sizeof(struct indexentry),
+                             (end - i) * sizeof(struct indexentry), entries)) {
+        return "";
+      }
+      i += std::lower_bound(entries, entries + (end - i), id,
+                            [](const struct indexentry& entry, uint64_t id) {
+                              return entry.id < id;
+                            }) -
+           entries;
+    }
+    if (i == count || id_at(i) != id) {
+      return "";
+    }
+
+    order = i;
+    return recordAt(order);
+  }
+
   // jump through 32 byte hash and 8 byte magic number
   const uint8_t* p = reinterpret_cast<const uint8_t*>(index_map.file_map);
   p += 40;
 
   const uint64_t* count = reinterpret_cast<const uint64_t*>(p);
   const struct indexentry* beg_index =
-      reinterpret_cast<const struct indexentry*>(count + 1);
+      reinterpret_cast<const struct indexentry*>(index + entries_offset);
   const struct indexentry* end_index =
       reinterpret_cast<const struct indexentry*>(beg_index + *count);
 
-  auto it = std::lower_bound(beg_index, end_index, id,
-                             [this](const struct indexentry entry,
-                                    uint64_t id) { return entry.id < id; });
+  const struct indexentry* it;
+  if (learnedIndex()) {
+    it = beg_index + index_model.LowerBound(
+                         id, [beg_index](uint64_t i) { return beg_index[i].id; });
+  } else {
+    it = std::lower_bound(beg_index, end_index, id,
+                          [this](const struct indexentry entry, uint64_t id) {
+                            return entry.id < id;
+                          });
+  }
 
   if (it == end_index || it->id != id) {
     return "";
   }
 
-  std::string user_info =
-      reinterpret_cast<const char*>(index_map.file_map) + it->offset;
+  order = it - beg_index;
+  return recordAt(order);
+}
 
-  MerkleProof generator;
-  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
-  auto root = generateProof(it - beg_index, path);
-  for (const auto& node : path) {
-    generator.AddSibling(node.second, node.first);
+std::string PoRDB::recordAt(uint64_t order) const {
+  if (auto ext = appendedUsers(); ext && order >= ext->base_count) {
+    order -= ext->base_count;
+    return order < ext->size()
+               ? renderRecord(ext->id(order), ext->balance(order))
+               : "";
   }
 
-  proof = generator.GenerateProof(kBranchTag, root);
+  alignas(8) uint8_t scratch[sizeof(struct indexentry)];
+  if (db_options.binary_records) {
+    // without compressed index the records are the index entries, with the
+    // balance in place of the offset
+    const uint8_t* p =
+        indexBytes(records_offset + order * sizeof(struct binaryrecord),
+                   sizeof(struct binaryrecord), scratch);
+    if (p == nullptr) {
+      return "";
+    }
+    const struct binaryrecord* record =
+        reinterpret_cast<const struct binaryrecord*>(p);
+    if (db_options.assets == 1) {
+      return renderRecord(record->id, record->balance);
+    }
 
-  return user_info;
+    // the other balances are the user's row after the records
+    const uint64_t id = record->id;
+    const size_t row = (db_options.assets - 1) * 8;
+    std::vector<uint64_t> balances(db_options.assets);
+    balances[0] = record->balance;
+    uint8_t* rest = reinterpret_cast<uint8_t*>(balances.data() + 1);
+    p = indexBytes(columns_offset + order * row, row, rest);
+    if (p == nullptr) {
+      return "";
+    }
+    if (p != rest) {
+      std::memcpy(rest, p, row);
+    }
+    return renderRecord(id, balances.data(), balances.size());
+  }
+  if (db_options.compressed_index) {
+    return readRecord(records_offset + index_offsets.Get(order));
+  }
+
+  const uint8_t* p =
+      indexBytes(entries_offset + order * sizeof(struct indexentry),
+                 sizeof(struct indexentry), scratch);
+  if (p == nullptr) {
+    return "";
+  }
+  return readRecord(reinterpret_cast<const struct indexentry*>(p)->offset);
+}
+
+std::string PoRDB::readRecord(uint64_t offset) const {
+  if (!buffer_pool) {
+    return reinterpret_cast<const char*>(index_map.file_map) + offset;
+  }
+
+  std::string record;
+  char chunk[64];
+  while (offset < index_map.file_size) {
+    size_t n = std::min<uint64_t>(sizeof chunk, index_map.file_size - offset);
+    if (!buffer_pool->Read(index_map.fd, offset, n, chunk)) {
+      return "";
+    }
+    const char* end = static_cast<const char*>(std::memchr(chunk, 0, n));
+    if (end != nullptr) {
+      record.append(chunk, end - chunk);
+      return record;
+    }
+    record.append(chunk, n);
+    offset += n;
+  }
+  return record;
+}
+
+const uint8_t* PoRDB::indexBytes(uint64_t offset, size_t size,
+                                 uint8_t* scratch) const {
+  if (!buffer_pool) {
+    return reinterpret_cast<const uint8_t*>(index_map.file_map) + offset;
+  }
+  return buffer_pool->Read(index_map.fd, offset, size, scratch) ? scratch
+                                                                : nullptr;
+}
+
+const uint8_t* PoRDB::merkleBytes(uint64_t offset, size_t size,
+                                  uint8_t* scratch) const {
+  if (!buffer_pool) {
+    return reinterpret_cast<const uint8_t*>(merkle_map.file_map) + offset;
+  }
+  return buffer_pool->Read(merkle_map.fd, offset, size, scratch) ? scratch
+                                                                 : nullptr;
+}
+
+bool PoRDB::openBufferPool() {
+  if (!index_map.loaded() || !merkle_map.loaded()) {
+    return false;
+  }
+
+  uint64_t count = 0;
+  if (pread(merkle_map.fd, &count, sizeof count, 40) != sizeof count) {
+    return false;
+  }
+
+  // levels are stored bottom-up, the upper ones that fit into a quarter of
+  // the budget are the tail of the file
+  count = levelCount(count, dropped_levels);
+  std::vector<std::pair<uint64_t, uint64_t>> levels;
+  const size_t node_size = merkleNodeSize();
+  uint64_t offset = merkle_offset;
+  while (count > 1) {
+    count += count & 0x01;
+    levels.push_back(std::make_pair(offset, count * node_size));
+    offset += count * node_size;
+    count >>= 1;
+  }
+  levels.push_back(std::make_pair(offset, count * node_size));
+
+  const size_t kPageSize = 4096;
+  size_t pin_budget = db_options.buffer_pool_bytes / 4;
+  uint64_t pinned_from = merkle_map.file_size;
+  for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+    uint64_t pages = (merkle_map.file_size - level->first + kPageSize - 1) /
+                         kPageSize +
+                     1;
+    if (pages * kPageSize > pin_budget) {
+      break;
+    }
+    pinned_from = level->first;
+  }
+
+  size_t pinned = merkle_map.file_size - pinned_from;
+  buffer_pool = std::make_unique<BufferPool>(
+      db_options.buffer_pool_bytes > pinned
+          ? db_options.buffer_pool_bytes - pinned
+          : 0,
+      kPageSize);
+  return buffer_pool->Pin(merkle_map.fd, pinned_from, pinned);
+}
+
+void PoRDB::parseIndex() {
+  records_offset = 0;
+  entries_offset = 48;
+  columns_offset = 0;
+  index_ids = EliasFano();
+  index_offsets = EliasFano();
+  index_model = LearnedIndex();
+  index_head.clear();
+  if (!index_map.loaded()) {
+    return;
+  }
+
+  const uint64_t* header = nullptr;
+  if (buffer_pool) {
+    // keep everything in front of the entries (learned model) or records
+    // (Elias-Fano sections) in memory
+    uint64_t words[4] = {0, 0, 0, 0};
+    pread(index_map.fd, words, std::min<uint64_t>(sizeof words,
+                                                  index_map.file_size - 40),
+          40);
+    uint64_t head_size = 48;
+    if (db_options.compressed_index || learnedIndex()) {
+      head_size = std::min<uint64_t>(words[1], index_map.file_size);
+    }
+    index_head.assign((head_size + 7) / 8, 0);
+    pread(index_map.fd, index_head.data(), head_size, 0);
+    header = index_head.data() + 5;
+  } else {
+    header = reinterpret_cast<const uint64_t*>(
+        reinterpret_cast<const uint8_t*>(index_map.file_map) + 40);
+  }
+  if (!db_options.compressed_index) {
+    if (learnedIndex()) {
+      entries_offset = header[1];
+      index_model = LearnedIndex(header + 3);
+    }
+    records_offset = entries_offset +
+                     (db_options.binary_records ? 0 : header[0] * 16);
+  } else {
+    records_offset = header[1];
+    index_ids = EliasFano(header + 4);
+    index_offsets = EliasFano(header + 4 + header[2]);
+  }
+  if (db_options.binary_records) {
+    columns_offset = records_offset + header[0] * sizeof(binaryrecord);
+  }
+}
+
+bool PoRDB::columnsMatch(const uint8_t* head, uint64_t size) const {
+  if (!db_options.binary_records) {
+    return true;
+  }
+  // records follow the 48 byte header, or the offset in the next word
+  uint64_t count = 0;
+  uint64_t records = 48;
+  std::memcpy(&count, head + 40, 8);
+  if (db_options.compressed_index || learnedIndex()) {
+    std::memcpy(&records, head + 48, 8);
+  }
+  return records <= size &&
+         (size - records) / 8 == count * (db_options.assets + 1) &&
+         (size - records) % 8 == 0;
+}
+
+uint64_t PoRDB::TotalLiabilities() const {
+  if (!db_options.sum_tree || !merkle_map.loaded()) {
+    return 0;
+  }
+
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  generateProof(0, path, sums, root_sum);
+  return root_sum;
 }
 
 std::vector<uint8_t> PoRDB::generateProof(
     uint64_t order,
     std::vector<std::pair<bool, std::vector<uint8_t>>>& path) const {
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  return generateProof(order, path, sums, root_sum);
+}
+
+std::vector<uint8_t> PoRDB::generateProof(
+    uint64_t order, std::vector<std::pair<bool, std::vector<uint8_t>>>& path,
+    std::vector<uint64_t>& sums, uint64_t& root_sum) const {
   // jump through 32 byte hash and 8 byte magic number
-  const uint8_t* p = reinterpret_cast<const uint8_t*>(merkle_map.file_map);
-  p += 40;
-  uint64_t count = *reinterpret_cast<const uint64_t*>(p);
-  p += 8;
+  alignas(8) uint8_t scratch[40];
+  const uint8_t* header = merkleBytes(40, 8, scratch);
+  if (header == nullptr) {
+    return {};
+  }
+  uint64_t count = *reinterpret_cast<const uint64_t*>(header);
+  // offset and unpadded node count of the current level of the merkle file
+  uint64_t level = merkle_offset;
+  uint64_t level_count = levelCount(count, dropped_levels);
+  // nodes right of the complete subtrees of the merkle file are appended
+  auto ext = appendedUsers();
+  if (ext) {
+    count += ext->size();
+  }
 
-  // std::cout << reinterpret_cast<uint64_t>(p) << ":" << order << "," << count
-  //           << std::endl;
   if (order >= count) {
     return {};
   }
 
   path.clear();
+  sums.clear();
+  const size_t node_size = merkleNodeSize();
   std::vector<uint8_t> node(32, 0);
-
-  // construct merkle root from leaf to root
-  std::copy(p + order * 32, p + (order + 1) * 32, node.begin());
-  path.push_back(std::make_pair((order & 0x01) == 0x00, node));
+  auto node_sum = [this](const uint8_t* node) -> uint64_t {
+    return db_options.sum_tree
+               ? *reinterpret_cast<const uint64_t*>(node + 32)
+               : 0;
+  };
+  uint64_t height = 0;
+  auto node_at = [&](uint64_t index) -> const uint8_t* {
+    if (ext && index >= ext->base_count >> height) {
+      return ext->node(height, index);
+    }
+    return merkleBytes(level + index * node_size, node_size, scratch);
+  };
+
+  // construct merkle root from leaf to root, the path below the lowest stored
+  // level is recomputed
+  if (dropped_levels > 0) {
+    if (!recomputePath(order, count, path, sums)) {
+      return {};
+    }
+    count = levelCount(count, dropped_levels);
+    order >>= dropped_levels;
+    height = dropped_levels;
+  } else {
+    const uint8_t* leaf = node_at(order);
+    if (leaf == nullptr) {
+      return {};
+    }
+    std::copy(leaf, leaf + 32, node.begin());
+    path.push_back(std::make_pair((order & 0x01) == 0x00, node));
+    sums.push_back(node_sum(leaf));
+  }
   while (count > 1) {
     if ((count & 0x01) == 0x01) {
       ++count;
     }
 
-    if ((order & 0x01) == 0x00) {
-      std::copy(p + (order + 1) * 32, p + (order + 2) * 32, node.begin());
-      path.push_back(std::make_pair(false, node));
-    } else {
-      std::copy(p + (order - 1) * 32, p + (order) * 32, node.begin());
-      path.push_back(std::make_pair(true, node));
+    const uint8_t* sibling = node_at(order ^ 0x01);
+    if (sibling == nullptr) {
+      return {};
     }
+    std::copy(sibling, sibling + 32, node.begin());
+    path.push_back(std::make_pair((order & 0x01) == 0x01, node));
+    sums.push_back(node_sum(sibling));
 
-    p += 32 * count;
+    if (level_count > 1) {
+      level += node_size * (level_count + (level_count & 0x01));
+      level_count = (level_count + 1) >> 1;
+    }
     count >>= 1;
     order >>= 1;
+    ++height;
   }
 
   // read merkle root
+  const uint8_t* top = node_at(0);
+  if (top == nullptr) {
+    return {};
+  }
   std::vector<uint8_t> root(32, 0);
-  std::copy(p, p + 32, root.begin());
+  std::copy(top, top + 32, root.begin());
+  root_sum = node_sum(top);
   return root;
 }
 
-bool PoRDB::regularFileExists(const std::string& file) {
-  std::filesystem::path file_path = file;
-  return std::filesystem::exists(file_path) &&
-         std::filesystem::status(file_path).type() ==
-             std::filesystem::file_type::regular;
-}
-
-bool PoRDB::verifyFileFingerPrint(const std::string& file,
-                                  const std::vector<uint8_t>& magic) {
-  std::filesystem::path path = file;
-
-  // file starts with 32 byte hash, 8 byte magic number, 8 byte as the count of
-  // data entries
-  if (std::filesystem::file_size(path) < 48) {
-    return false;
+void PoRDB::parseMerkle() {
+  dropped_levels = 0;
+  merkle_offset = 48;
+  if (db_options.merkle_dropped_levels == 0 || !merkle_map.loaded()) {
+    return;
   }
 
-  std::vector<uint8_t> hv(32, 0);
-  std::ifstream f(file, std::ios::in | std::ios::binary);
-  f.read(reinterpret_cast<char*>(hv.data()), hv.size());
-
-  std::vector<uint8_t> magic_vec(8, 0);
-  f.read(reinterpret_cast<char*>(magic_vec.data()), magic_vec.size());
-  if (f.gcount() != magic_vec.size() || magic_vec != magic) {
-    return false;
+  merkle_offset = 56;
+  if (merkle_map.file_map != (void*)-1) {
+    dropped_levels = *reinterpret_cast<const uint64_t*>(
+        reinterpret_cast<const uint8_t*>(merkle_map.file_map) + 48);
+  } else if (pread(merkle_map.fd, &dropped_levels, sizeof dropped_levels,
+                   48) != sizeof dropped_levels) {
+    dropped_levels = 0;
   }
+}
 
-  sha256::StreamHasher hasher;
-  hasher.Append(magic_vec);
-
-  // read a block of 512 bytes
-  std::vector<uint8_t> buffer(512, 0);
-  f.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
-  auto size = f.gcount();
-  while (size == buffer.size()) {
-    hasher.Append(buffer);
-    f.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
-    size = f.gcount();
+uint64_t PoRDB::levelCount(uint64_t count, uint64_t height) {
+  for (uint64_t i = 0; i < height && count > 1; ++i) {
+    count = (count + (count & 0x01)) >> 1;
   }
-
-  buffer.resize(size);
-  hasher.Append(buffer);
-
-  return hv == hasher.Hash();
+  return count;
 }
 
-// This function takes quite a while to create index and merkle tree.
-// One thought is: preprocess the file in advance before starting service.
-bool PoRDB::preprocessUserFile(const std::string& user_data,
-                               const std::string& index,
-                               const std::string& merkle) {
-  std::ifstream user_file(user_data, std::ios::in);
-
-  sha256::StreamHasher index_hasher;
-  std::ofstream index_file(index,
-                           std::ios::out | std::ios::binary | std::ios::trunc);
-
-  sha256::StreamHasher merkle_hasher;
-  std::fstream merkle_file(merkle, std::ios::out | std::ios::in |
-                                       std::ios::binary | std::ios::trunc);
-
-  // leave 32 bytes for sha256
-  index_file.seekp(32);
-  merkle_file.seekp(32);
-
-  // write magic to index and merkle file
-  index_file.write(reinterpret_cast<const char*>(kIndexMagic.data()),
-                   kIndexMagic.size());
-  index_hasher.Append(kIndexMagic);
-  merkle_file.write(reinterpret_cast<const char*>(kMerkleMagic.data()),
-                    kMerkleMagic.size());
-  merkle_hasher.Append(kMerkleMagic);
-
-  // get user data item count
-  uint64_t count = 0;
-  user_file >> count;
-
-  // convert count to vector
-  uint8_t* p_count = reinterpret_cast<uint8_t*>(&count);
-  std::vector<uint8_t> count_vec(p_count, p_count + sizeof count);
-
-  // write data count
-  index_file.write(reinterpret_cast<char*>(count_vec.data()), count_vec.size());
-  index_hasher.Append(count_vec);
-  merkle_file.write(reinterpret_cast<char*>(count_vec.data()),
-                    count_vec.size());
-  merkle_hasher.Append(count_vec);
-
-  // I will copy user data to index file after all the index is created
-  uint64_t offset = 32 + 8 + 8 + count * 16;
-
-  // read each line one by one
-  std::string line;
-  std::vector<uint8_t> index_entry(16, 0x00);
-  std::vector<uint8_t> hv;
+// The subtree of the dropped levels above a leaf holds 2^k leaves, its
+// nodes are rebuilt bottom-up with the padding rules of preprocessUserFile.
+bool PoRDB::recomputePath(
+    uint64_t order, uint64_t count,
+    std::vector<std::pair<bool, std::vector<uint8_t>>>& path,
+    std::vector<uint64_t>& sums) const {
+  const size_t node_size = merkleNodeSize();
+  // first node of the subtree at the current level
+  uint64_t first = order >> dropped_levels << dropped_levels;
+  const uint64_t end = std::min(count, first + (uint64_t(1) << dropped_levels));
+
+  std::vector<uint8_t> nodes;
+  nodes.reserve((end - first + 1) * node_size);
   TaggedHasher leaf_tag_hasher(kLeafTag);
-  // consume the first '\n'
-  std::getline(user_file, line);
-  for (size_t i = 0; i < count; ++i) {
-    if (std::getline(user_file, line)) {
-      char unused;
-      uint64_t id;
-      uint64_t balance;
-      std::stringstream ss(line);
-      ss >> unused >> id >> unused >> balance >> unused;
-
-      // assemble id and offset as index entry
-      std::copy(reinterpret_cast<uint8_t*>(&id),
-                reinterpret_cast<uint8_t*>(&id) + 8, index_entry.begin());
-      std::copy(reinterpret_cast<uint8_t*>(&offset),
-                reinterpret_cast<uint8_t*>(&offset) + 8,
-                index_entry.begin() + 8);
-      index_file.write(reinterpret_cast<char*>(index_entry.data()),
-                       index_entry.size());
-      index_hasher.Append(index_entry);
-
-      // put '\0' at the end of string
-      offset += line.size() + 1;
-
-      // calculate leaf hash
-      std::vector<uint8_t> data(line.cbegin(), line.cend());
-      leaf_tag_hasher.Reset();
-      leaf_tag_hasher.Append(data);
-      hv = leaf_tag_hasher.Hash();
-      merkle_file.write(reinterpret_cast<char*>(hv.data()), hv.size());
-      merkle_hasher.Append(hv);
-    } else {
+  for (uint64_t i = first; i < end; ++i) {
+    std::string record = recordAt(i);
+    if (record.empty()) {
       return false;
     }
+    appendLeaf(record, leaf_tag_hasher, nodes);
   }
 
-  // if count is an odd number greater than 1, duplicate the last hash
-  if (!hv.empty() && count > 1 && (count & 0x01) == 0x01) {
-    merkle_file.write(reinterpret_cast<char*>(hv.data()), hv.size());
-    merkle_hasher.Append(hv);
-    ++count;
+  auto node_sum = [this](const uint8_t* node) -> uint64_t {
+    return db_options.sum_tree ? *reinterpret_cast<const uint64_t*>(node + 32)
+                               : 0;
+  };
+  TaggedHasher branch_tag_hasher(kBranchTag);
+  std::vector<uint8_t> parents;
+  for (uint64_t height = 0; height < dropped_levels; ++height) {
+    padLevel(nodes, first, count);
+    const uint64_t n = nodes.size() / node_size;
+    const uint64_t at = order - first;
+    if (height == 0) {
+      const uint8_t* leaf = nodes.data() + at * node_size;
+      path.push_back(std::make_pair((order & 0x01) == 0x00,
+                                    std::vector<uint8_t>(leaf, leaf + 32)));
+      sums.push_back(node_sum(leaf));
+    }
+    if ((at ^ 0x01) >= n) {
+      return false;
+    }
+    const uint8_t* sibling = nodes.data() + (at ^ 0x01) * node_size;
+    path.push_back(std::make_pair((order & 0x01) == 0x01,
+                                  std::vector<uint8_t>(sibling, sibling + 32)));
+    sums.push_back(node_sum(sibling));
+
+    parents.clear();
+    hashParents(nodes.data(), n / 2, branch_tag_hasher, parents);
+    nodes.swap(parents);
+    count = levelCount(count, 1);
+    order >>= 1;
+    first >>= 1;
   }
+  return true;
+}
 
-  // rescan the user data file and copy user data to index
-  user_file.seekg(0);
-  std::getline(user_file, line);
-  for (size_t i = 0; i < count; ++i) {
-    if (std::getline(user_file, line)) {
-      std::vector<uint8_t> data_vec(line.cbegin(), line.cend());
-      data_vec.push_back('\0');
-
-      index_file.write(reinterpret_cast<char*>(data_vec.data()),
-                       data_vec.size());
-      index_hasher.Append(data_vec);
+void PoRDB::appendLeaf(const std::string& record, TaggedHasher& hasher,
+                       std::vector<uint8_t>& nodes) const {
+  hasher.Reset();
+  hasher.Append(reinterpret_cast<const uint8_t*>(record.data()),
+                record.size());
+  auto hash = hasher.Hash();
+  nodes.insert(nodes.end(), hash.begin(), hash.end());
+  if (db_options.sum_tree) {
+    // record is "(id,balance)", parsed as leniently as at preprocessing
+    thread_local std::vector<uint64_t> balances;
+    uint64_t id = 0;
+    uint64_t balance = 0;
+    if (parseRecord(record, id, balances) && !balances.empty()) {
+      balance = balances[0];
     }
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&balance);
+    nodes.insert(nodes.end(), p, p + 8);
   }
+}
 
-  // write sha256 hash to the begining 32 bytes
-  index_file.seekp(0);
-  hv = index_hasher.Hash();
-  index_file.write(reinterpret_cast<char*>(hv.data()), hv.size());
-  index_file.close();
+uint64_t PoRDB::padLevel(std::vector<uint8_t>& nodes, uint64_t first,
+                         uint64_t count) const {
+  const size_t node_size = merkleNodeSize();
+  if (count <= 1 || (count & 0x01) == 0x00 || nodes.empty() ||
+      first + nodes.size() / node_size != count) {
+    return count + (count > 1 ? count & 0x01 : 0);
+  }
 
-  // construct merkle tree
-  TaggedHasher branch_tag_hasher(kBranchTag);
-  uint64_t read_offset = 48;
-  uint64_t write_offset = read_offset + 32 * count;
-  std::vector<uint8_t> left(32, 0);
-  std::vector<uint8_t> right(32, 0);
-  std::vector<uint8_t> branch_hash;
-  while (count > 1) {
-    for (size_t i = 0; i < (count >> 1); ++i) {
-      // read in 2 hashes to calculate branch tagged hash
-      merkle_file.seekp(read_offset + 2 * i * 32);
-      merkle_file.read(reinterpret_cast<char*>(left.data()), left.size());
-      merkle_file.read(reinterpret_cast<char*>(right.data()), right.size());
-      branch_tag_hasher.Reset();
-      branch_tag_hasher.Append(left);
-      branch_tag_hasher.Append(right);
-
-      // write branch tagged hash
-      merkle_file.seekp(write_offset + i * 32);
-      branch_hash = branch_tag_hasher.Hash();
-      merkle_file.write(reinterpret_cast<char*>(branch_hash.data()),
-                        branch_hash.size());
-      merkle_hasher.Append(branch_hash);
-    }
+  // duplicate the last node, or an all-zero node in sum tree
+  std::vector<uint8_t> padding(nodes.end() - node_size, nodes.end());
+  if (db_options.sum_tree) {
+    padding.assign(node_size, 0x00);
+  }
+  nodes.insert(nodes.end(), padding.begin(), padding.end());
+  return count + 1;
+}
 
-    count >>= 1;
-    if (count > 1 && (count & 0x01) == 0x01) {
-      merkle_file.seekp(write_offset + count * 32);
-      merkle_file.write(reinterpret_cast<char*>(branch_hash.data()),
-                        branch_hash.size());
-      merkle_hasher.Append(branch_hash);
-      ++count;
+void PoRDB::hashParents(const uint8_t* nodes, uint64_t pairs,
+                        TaggedHasher& hasher,
+                        std::vector<uint8_t>& parents) const {
+  const size_t node_size = merkleNodeSize();
+  for (uint64_t i = 0; i < pairs; ++i) {
+    const uint8_t* left = nodes + 2 * i * node_size;
+    hasher.Reset();
+    hasher.Append(left, 2 * node_size);
+    auto hash = hasher.Hash();
+    parents.insert(parents.end(), hash.begin(), hash.end());
+    if (db_options.sum_tree) {
+      uint64_t sum = *reinterpret_cast<const uint64_t*>(left + 32) +
+                     *reinterpret_cast<const uint64_t*>(left + node_size + 32);
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(&sum);
+      parents.insert(parents.end(), p, p + 8);
     }
+  }
+}
 
-    read_offset = write_offset;
-    write_offset = read_offset + 32 * count;
+uint64_t PoRDB::idAt(uint64_t order) const {
+  if (auto ext = appendedUsers(); ext && order >= ext->base_count) {
+    order -= ext->base_count;
+    return order < ext->size() ? ext->id(order) : 0;
+  }
+  if (db_options.compressed_index) {
+    return index_ids.Get(order);
   }
 
-  // write sha256 hash to the begining
-  merkle_file.seekp(0);
-  hv = merkle_hasher.Hash();
-  merkle_file.write(reinterpret_cast<char*>(hv.data()), hv.size());
-  merkle_file.close();
-  return true;
+  // index entries and binary records both start with the id
+  alignas(8) uint8_t scratch[8];
+  const uint8_t* p = indexBytes(
+      entries_offset + order * sizeof(struct indexentry), 8, scratch);
+  return p == nullptr ? 0 : *reinterpret_cast<const uint64_t*>(p);
 }
 
-struct PoRDB::mmmapinfo PoRDB::mmapFile(const std::string& name) {
-  PoRDB::mmmapinfo info;
-  struct stat stats;
+bool PoRDB::Audit(AuditReport& report, size_t threads,
+                  const std::vector<uint8_t>& expected_root) const {
+  report = AuditReport();
+  alignas(8) uint8_t scratch[80];
+  const uint8_t* merkle_count =
+      merkle_map.loaded() ? merkleBytes(40, 8, scratch) : nullptr;
+  const uint8_t* index_count =
+      index_map.loaded() ? indexBytes(40, 8, scratch + 8) : nullptr;
+  if (merkle_count == nullptr || index_count == nullptr) {
+    report.error = "database is not loaded";
+    return false;
+  }
+  if (appendedUsers()) {
+    report.error = "users are appended, rebuild the database to audit it";
+    return false;
+  }
+  const uint64_t count = *reinterpret_cast<const uint64_t*>(merkle_count);
+  if (count != *reinterpret_cast<const uint64_t*>(index_count)) {
+    report.error = "index and merkle file have different user counts";
+    return false;
+  }
+  report.users = count;
+
+  // check(begin, end, error) over [0, n) split among the threads, returns
+  // the lowest failing unit or n
+  auto parallel =
+      [threads](uint64_t n, std::string& error,
+                const std::function<uint64_t(uint64_t, uint64_t, std::string&)>&
+                    check) {
+        const size_t workers = workerCount(n, threads);
+        std::vector<uint64_t> failed(workers, n);
+        std::vector<std::string> errors(workers);
+        parallelFor(n, workers, [&](size_t t, uint64_t begin, uint64_t end) {
+          uint64_t at = check(begin, end, errors[t]);
+          failed[t] = at < end ? at : n;
+        });
+        for (size_t t = 0; t < workers; ++t) {
+          if (failed[t] < n) {
+            error = errors[t];
+            return failed[t];
+          }
+        }
+        return n;
+      };
+
+  // records and the nodes hashed from them, a subtree at a time
+  const uint64_t groups =
+      (count + (uint64_t(1) << dropped_levels) - 1) >> dropped_levels;
+  uint64_t failed = parallel(
+      groups, report.error, [this, count](uint64_t begin, uint64_t end,
+                                          std::string& error) {
+        return auditUsers(begin, end, count, error);
+      });
+  report.nodes += groups;
+  if (failed < groups) {
+    report.height = dropped_levels;
+    report.index = failed;
+    return false;
+  }
+
+  // every stored branch against the hash of its stored children
+  const size_t node_size = merkleNodeSize();
+  uint64_t level = merkle_offset;
+  uint64_t level_count = levelCount(count, dropped_levels);
+  uint64_t height = dropped_levels;
+  while (level_count > 1) {
+    const uint64_t padded = level_count + (level_count & 0x01);
+    const uint64_t parents = padded / 2;
+    const uint64_t parent_level = level + padded * node_size;
+
+    if (padded != level_count) {
+      const uint8_t* nodes = merkleBytes(
+          level + (level_count - 1) * node_size, 2 * node_size, scratch);
+      std::vector<uint8_t> expected(nodes, nodes + node_size);
+      if (db_options.sum_tree) {
+        expected.assign(node_size, 0x00);
+      }
+      if (!std::equal(expected.begin(), expected.end(), nodes + node_size)) {
+        report.height = height;
+        report.index = level_count;
+        report.error = "padding node doesn't match the end of its level";
+        return false;
+      }
+    }
+
+    failed = parallel(
+        parents, report.error,
+        [&](uint64_t begin, uint64_t end, std::string& error) -> uint64_t {
+          const uint64_t kChunkPairs = 4096;
+          std::vector<uint8_t> children_scratch(2 * kChunkPairs * node_size);
+          std::vector<uint8_t> stored_scratch(kChunkPairs * node_size);
+          std::vector<uint8_t> expected;
+          TaggedHasher branch_tag_hasher(kBranchTag);
+          for (uint64_t p = begin; p < end; p += kChunkPairs) {
+            uint64_t pairs = std::min(kChunkPairs, end - p);
+            const uint8_t* children =
+                merkleBytes(level + 2 * p * node_size, 2 * pairs * node_size,
+                            children_scratch.data());
+            const uint8_t* stored =
+                merkleBytes(parent_level + p * node_size, pairs * node_size,
+                            stored_scratch.data());
+            if (children == nullptr || stored == nullptr) {
+              error = "can't read merkle file";
+              return p;
+            }
+            expected.clear();
+            hashParents(children, pairs, branch_tag_hasher, expected);
+            for (uint64_t i = 0; i < pairs; ++i) {
+              if (std::memcmp(expected.data() + i * node_size,
+                              stored + i * node_size, node_size) != 0) {
+                error = "branch node doesn't match the hash of its children";
+                return p + i;
+              }
+            }
+          }
+          return end;
+        });
+    report.nodes += parents;
+    if (failed < parents) {
+      report.height = height + 1;
+      report.index = failed;
+      return false;
+    }
+
+    level = parent_level;
+    level_count = parents;
+    ++height;
+  }
+
+  if (level_count == 1) {
+    const uint8_t* root = merkleBytes(level, node_size, scratch);
+    report.root.assign(root, root + 32);
+    report.root_sum = db_options.sum_tree
+                          ? *reinterpret_cast<const uint64_t*>(root + 32)
+                          : 0;
+  }
+  if (!expected_root.empty() && expected_root != report.root) {
+    report.height = height;
+    report.index = 0;
+    report.error = "root doesn't match the expected root";
+    return false;
+  }
+
+  report.ok = true;
+  return true;
+}
+
+size_t PoRDB::workerCount(uint64_t n, size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::max<uint64_t>(1, std::min<uint64_t>(threads, n));
+}
+
+void PoRDB::parallelFor(
+    uint64_t n, size_t workers,
+    const std::function<void(size_t, uint64_t, uint64_t)>& work) {
+  const uint64_t step = (n + workers - 1) / workers;
+  if (workers == 1) {
+    work(0, 0, n);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < workers; ++t) {
+    uint64_t begin = std::min(n, t * step);
+    uint64_t end = std::min(n, begin + step);
+    threads.push_back(std::thread(work, t, begin, end));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+uint64_t PoRDB::userCount() const {
+  alignas(8) uint8_t scratch[8];
+  const uint8_t* p =
+      merkle_map.loaded() ? merkleBytes(40, 8, scratch) : nullptr;
+  return p == nullptr ? 0 : *reinterpret_cast<const uint64_t*>(p);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> PoRDB::merkleLevels(
+    uint64_t count) const {
+  std::vector<std::pair<uint64_t, uint64_t>> levels;
+  const size_t node_size = merkleNodeSize();
+  uint64_t offset = merkle_offset;
+  count = levelCount(count, dropped_levels);
+  while (count > 1) {
+    levels.push_back(std::make_pair(offset, count));
+    count += count & 0x01;
+    offset += count * node_size;
+    count >>= 1;
+  }
+  levels.push_back(std::make_pair(offset, count));
+  return levels;
+}
+
+// Nodes at the same height and index of both trees cover the users at the
+// same orders, equal nodes mean equal records there. Orders under differing
+// nodes are the same for both trees, so an id in one of them is either
+// absent from the other snapshot or under a differing node there too, and
+// joining the records beneath the differing nodes by id finds every change.
+bool PoRDB::Diff(const PoRDB& newer, std::vector<UserChange>& changes,
+                 size_t threads) const {
+  changes.clear();
+  if (!merkle_map.loaded() || !index_map.loaded() ||
+      !newer.merkle_map.loaded() || !newer.index_map.loaded() ||
+      merkleNodeSize() != newer.merkleNodeSize() || appendedUsers() ||
+      newer.appendedUsers()) {
+    return false;
+  }
+
+  const PoRDB* trees[2] = {this, &newer};
+  const uint64_t counts[2] = {userCount(), newer.userCount()};
+  const std::vector<std::pair<uint64_t, uint64_t>> levels[2] = {
+      merkleLevels(counts[0]), newer.merkleLevels(counts[1])};
+  const uint64_t bottom = std::max(dropped_levels, newer.dropped_levels);
+  const uint64_t top =
+      std::max(bottom, std::min(dropped_levels + levels[0].size() - 1,
+                                newer.dropped_levels + levels[1].size() - 1));
+  const uint64_t users = std::max(counts[0], counts[1]);
+  const size_t node_size = merkleNodeSize();
+  // nodes per thread at least, few differences stay on the calling thread
+  const uint64_t kGrain = 256;
+
+  // node at height and index of tree t, null if the tree has none there
+  auto node = [&](int t, uint64_t height, uint64_t index, uint8_t* scratch) {
+    const PoRDB* tree = trees[t];
+    uint64_t level = height - tree->dropped_levels;
+    if (counts[t] == 0 || level >= levels[t].size() ||
+        index >= levels[t][level].second) {
+      return static_cast<const uint8_t*>(nullptr);
+    }
+    return tree->merkleBytes(levels[t][level].first + index * node_size,
+                             node_size, scratch);
+  };
+
+  // differing nodes from the top down to the lowest level both trees store
+  std::vector<uint64_t> differing;
+  for (uint64_t i = 0; i < levelCount(users, top); ++i) {
+    differing.push_back(i);
+  }
+  for (uint64_t height = top;; --height) {
+    const size_t workers =
+        workerCount((differing.size() + kGrain - 1) / kGrain, threads);
+    std::vector<std::vector<uint64_t>> found(workers);
+    parallelFor(differing.size(), workers,
+                [&](size_t t, uint64_t begin, uint64_t end) {
+                  alignas(8) uint8_t scratch[2][40];
+                  for (uint64_t i = begin; i < end; ++i) {
+                    uint64_t index = differing[i];
+                    const uint8_t* a = node(0, height, index, scratch[0]);
+                    const uint8_t* b = node(1, height, index, scratch[1]);
+                    if (a == nullptr || b == nullptr ||
+                        std::memcmp(a, b, node_size) != 0) {
+                      found[t].push_back(index);
+                    }
+                  }
+                });
+    differing.clear();
+    for (const auto& part : found) {
+      differing.insert(differing.end(), part.begin(), part.end());
+    }
+    if (height == bottom || differing.empty()) {
+      break;
+    }
+
+    std::vector<uint64_t> children;
+    const uint64_t child_count = levelCount(users, height - 1);
+    for (uint64_t i : differing) {
+      for (uint64_t child = 2 * i; child < std::min(2 * i + 2, child_count);
+           ++child) {
+        children.push_back(child);
+      }
+    }
+    differing.swap(children);
+  }
+
+  // (id, record) of both snapshots beneath the differing nodes, in id order
+  using entries = std::vector<std::pair<uint64_t, std::string>>;
+  const size_t workers =
+      workerCount((differing.size() + kGrain - 1) / kGrain, threads);
+  std::vector<entries> found[2] = {std::vector<entries>(workers),
+                                   std::vector<entries>(workers)};
+  parallelFor(differing.size(), workers,
+              [&](size_t t, uint64_t begin, uint64_t end) {
+                for (int tree = 0; tree < 2; ++tree) {
+                  for (uint64_t i = begin; i < end; ++i) {
+                    uint64_t first = differing[i] << bottom;
+                    uint64_t last = std::min(counts[tree],
+                                             (differing[i] + 1) << bottom);
+                    for (uint64_t order = first; order < last; ++order) {
+                      found[tree][t].push_back(
+                          std::make_pair(trees[tree]->idAt(order),
+                                         trees[tree]->recordAt(order)));
+                    }
+                  }
+                }
+              });
+  entries before, after;
+  for (size_t t = 0; t < workers; ++t) {
+    before.insert(before.end(), found[0][t].begin(), found[0][t].end());
+    after.insert(after.end(), found[1][t].begin(), found[1][t].end());
+  }
+
+  auto b = before.begin();
+  auto a = after.begin();
+  while (b != before.end() || a != after.end()) {
+    UserChange change;
+    if (a == after.end() || (b != before.end() && b->first < a->first)) {
+      change.id = b->first;
+      change.before = std::move((b++)->second);
+    } else if (b == before.end() || a->first < b->first) {
+      change.id = a->first;
+      change.after = std::move((a++)->second);
+    } else {
+      if (b->second == a->second) {
+        ++a;
+        ++b;
+        continue;
+      }
+      change.id = b->first;
+      change.before = std::move((b++)->second);
+      change.after = std::move((a++)->second);
+    }
+    changes.push_back(std::move(change));
+  }
+  return true;
+}
+
+// The index and merkle file can't grow in place, their levels and entries
+// are contiguous. Appended users are kept in the append file instead, which
+// only grows:
+//   magic    user No#  merkle sha256
+// | 64 bit |  64 bit  |   256 bit    |
+// then one record per Append:
+//   appended No#  id, balance     sha256
+// |    64 bit   | 128 bit | .. | 256 bit |
+// The sha256 of a record covers the sha256 of the record before it (the
+// merkle sha256 for the first one) and the record itself.
+bool PoRDB::Append(const std::vector<std::pair<uint64_t, uint64_t>>& users) {
+  std::lock_guard<std::mutex> lock(append_mutex);
+  // a shared segment is read-only, appended users have a single balance
+  if (users.empty() || !index_map.loaded() || !merkle_map.loaded() ||
+      append_file.empty() || db_options.assets != 1) {
+    return false;
+  }
+
+  // the copy shares the chunks of previous
+  auto previous = appendedUsers();
+  auto next = previous ? std::make_shared<appendedusers>(*previous)
+                       : std::make_shared<appendedusers>();
+  if (!previous) {
+    next->base_count = userCount();
+  }
+  uint64_t count = next->base_count + next->size();
+  uint64_t last_id = count > 0 ? idAt(count - 1) : 0;
+  // no node sum is above the root sum
+  uint64_t total = TotalLiabilities();
+  for (const auto& [id, balance] : users) {
+    if ((count > 0 && id <= last_id) ||
+        (db_options.sum_tree &&
+         balance > std::numeric_limits<uint64_t>::max() - total)) {
+      return false;
+    }
+    total += db_options.sum_tree ? balance : 0;
+    const uint64_t entry[2] = {id, balance};
+    next->users.push_back(reinterpret_cast<const uint8_t*>(entry));
+    last_id = id;
+    ++count;
+  }
+
+  if (!hashAppended(*next) ||
+      !saveAppended(append_file, *next, previous.get())) {
+    return false;
+  }
+  std::atomic_store(&appended,
+                    std::shared_ptr<const appendedusers>(std::move(next)));
+  has_appended = true;
+  ++snapshot;
+  return true;
+}
+
+std::shared_ptr<const PoRDB::appendedusers> PoRDB::appendedUsers() const {
+  return has_appended ? std::atomic_load(&appended) : nullptr;
+}
+
+void PoRDB::appendedusers::chunks::push_back(const uint8_t* entry) {
+  if (size == data.size() * kChunk) {
+    data.emplace_back(new uint8_t[kChunk * width]);
+  }
+  std::copy_n(entry, width, data[size / kChunk].get() + size % kChunk * width);
+  ++size;
+}
+
+const uint8_t* PoRDB::appendedusers::node(uint64_t height,
+                                          uint64_t index) const {
+  if (height >= levels.size() || index < base_count >> height) {
+    return nullptr;
+  }
+  const auto& level = levels[height];
+  index -= base_count >> height;
+  if (index < level.complete.size) {
+    return level.complete.at(index);
+  }
+  uint64_t at = (index - level.complete.size) * level.complete.width;
+  return at + level.complete.width <= level.tail.size()
+             ? level.tail.data() + at
+             : nullptr;
+}
+
+bool PoRDB::readAppended(const std::string& file, appendedusers& users,
+                         std::vector<uint8_t>& merkle_hash) {
+  std::ifstream f(file, std::ios::in | std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() < 48 ||
+      !std::equal(kAppendMagic.begin(), kAppendMagic.end(), data.begin())) {
+    return false;
+  }
+
+  users = appendedusers();
+  users.base_count = *reinterpret_cast<const uint64_t*>(data.data() + 8);
+  merkle_hash.assign(data.begin() + 16, data.begin() + 48);
+  users.file_end = 48;
+  users.file_hash = merkle_hash;
+  while (users.file_end < data.size()) {
+    const uint64_t left = data.size() - users.file_end;
+    const uint8_t* record = data.data() + users.file_end;
+    uint64_t count = 0;
+    if (left >= 8) {
+      count = *reinterpret_cast<const uint64_t*>(record);
+    }
+    // a record reaching the end of the file may be torn by a crash during
+    // its Append, which hadn't returned yet
+    if (count == 0 || count > (left - 8) / 16 ||
+        8 + count * 16 + 32 > left) {
+      break;
+    }
+    const uint64_t size = 8 + count * 16;
+    sha256::StreamHasher hasher;
+    hasher.Append(users.file_hash);
+    hasher.Append(std::vector<uint8_t>(record, record + size));
+    auto hash = hasher.Hash();
+    if (!std::equal(hash.begin(), hash.end(), record + size)) {
+      if (size + 32 == left) {
+        break;
+      }
+      return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+      users.users.push_back(record + 8 + i * 16);
+    }
+    users.file_end += size + 32;
+    users.file_hash = std::move(hash);
+  }
+  if (users.file_end < data.size()) {
+    std::cerr << file << ": ignoring " << data.size() - users.file_end
+              << " bytes of an unfinished Append" << std::endl;
+  }
+  return true;
+}
+
+bool PoRDB::loadAppended(const std::string& file) {
+  auto users = std::make_shared<appendedusers>();
+  std::vector<uint8_t> merkle_hash;
+  if (!readAppended(file, *users, merkle_hash)) {
+    std::cerr << file << " is damaged" << std::endl;
+    return false;
+  }
+
+  alignas(8) uint8_t scratch[32];
+  const uint8_t* hash = merkleBytes(0, 32, scratch);
+  if (hash == nullptr) {
+    return false;
+  }
+  if (users->base_count == userCount() &&
+      std::equal(merkle_hash.begin(), merkle_hash.end(), hash)) {
+    if (users->size() == 0) {
+      return true;
+    }
+    if (!hashAppended(*users)) {
+      return false;
+    }
+    std::atomic_store(&appended,
+                      std::shared_ptr<const appendedusers>(std::move(users)));
+    has_appended = true;
+    return true;
+  }
+
+  // appended to an earlier build, the rebuild must have read the users
+  // from the user data file
+  for (uint64_t i = 0; i < users->size(); ++i) {
+    uint64_t order = 0;
+    uint64_t id = 0;
+    std::vector<uint64_t> balances;
+    if (!parseRecord(findUser(users->id(i), order), id, balances) ||
+        balances.size() != 1 || balances[0] != users->balance(i)) {
+      std::cerr << file << " was appended to another build of the database "
+                << "and user " << users->id(i) << " is not in this one, add "
+                << "the appended users to the user data file" << std::endl;
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(file, file + ".merged", ec);
+  if (ec) {
+    return false;
+  }
+  std::cerr << "the users of " << file << " are in the database, moved it to "
+            << file << ".merged" << std::endl;
+  return true;
+}
+
+bool PoRDB::saveAppended(const std::string& file, appendedusers& users,
+                         const appendedusers* previous) const {
+  std::vector<uint8_t> data;
+  auto append_u64 = [&data](uint64_t value) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+    data.insert(data.end(), p, p + 8);
+  };
+  uint64_t offset = 0;
+  if (previous) {
+    offset = previous->file_end;
+  } else {
+    alignas(8) uint8_t scratch[32];
+    const uint8_t* hash = merkleBytes(0, 32, scratch);
+    if (hash == nullptr) {
+      return false;
+    }
+    data = kAppendMagic;
+    append_u64(users.base_count);
+    data.insert(data.end(), hash, hash + 32);
+    users.file_hash.assign(hash, hash + 32);
+  }
+
+  const size_t record = data.size();
+  const uint64_t first = previous ? previous->size() : 0;
+  append_u64(users.size() - first);
+  for (uint64_t i = first; i < users.size(); ++i) {
+    data.insert(data.end(), users.users.at(i), users.users.at(i) + 16);
+  }
+  sha256::StreamHasher hasher;
+  hasher.Append(users.file_hash);
+  hasher.Append(std::vector<uint8_t>(data.begin() + record, data.end()));
+  users.file_hash = hasher.Hash();
+  data.insert(data.end(), users.file_hash.begin(), users.file_hash.end());
+  users.file_end = offset + data.size();
+
+  // the first record is written with the header to a new file, a crash
+  // leaves no file or both. Later ones are written after the last record,
+  // over the torn one of an unfinished Append, a crash leaves a torn record.
+  std::string target = previous ? file : file + ".tmp";
+  int flags = previous ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = open(target.c_str(), flags, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = pwrite(fd, data.data(), data.size(), offset) ==
+                static_cast<ssize_t>(data.size()) &&
+            ftruncate(fd, users.file_end) == 0 && fdatasync(fd) == 0;
+  close(fd);
+  return ok && (previous || rename(target.c_str(), file.c_str()) == 0);
+}
+
+// A node of the whole tree whose leaves are all in the merkle file is the
+// node stored there. The others lie on the right of every level, from index
+// base_count >> height on, and are hashed here. Those complete before this
+// Append are kept, so only the nodes above the new users and the right spine
+// are hashed.
+bool PoRDB::hashAppended(appendedusers& users) const {
+  const size_t node_size = merkleNodeSize();
+  const uint64_t base = users.base_count;
+  const uint64_t total = base + users.size();
+  TaggedHasher leaf_tag_hasher(kLeafTag);
+  TaggedHasher branch_tag_hasher(kBranchTag);
+  std::vector<uint8_t> children(2 * node_size);
+  std::vector<uint8_t> node;
+
+  for (uint64_t height = 0;; ++height) {
+    const uint64_t first = base >> height;
+    const uint64_t count = levelCount(total, height);
+    if (users.levels.size() <= height) {
+      users.levels.emplace_back();
+      users.levels.back().complete.width = node_size;
+    }
+    auto& level = users.levels[height];
+    level.tail.clear();
+    for (uint64_t i = first + level.complete.size; i < count; ++i) {
+      node.clear();
+      if (height == 0) {
+        appendLeaf(renderRecord(users.id(i - base), users.balance(i - base)),
+                   leaf_tag_hasher, node);
+      } else {
+        for (uint64_t c = 0; c < 2; ++c) {
+          const uint64_t child = 2 * i + c;
+          uint8_t* p = children.data() + c * node_size;
+          if (const uint8_t* below = users.node(height - 1, child)) {
+            std::copy_n(below, node_size, p);
+          } else if (!baseNode(height - 1, child, p)) {
+            return false;
+          }
+        }
+        hashParents(children.data(), 1, branch_tag_hasher, node);
+      }
+      if ((i + 1) << height <= total) {
+        level.complete.push_back(node.data());
+      } else {
+        level.tail.insert(level.tail.end(), node.begin(), node.end());
+      }
+    }
+    if (count <= 1) {
+      return true;
+    }
+    // duplicate the last node, or an all-zero node in sum tree
+    if ((count & 0x01) == 0x01) {
+      std::vector<uint8_t> padding(node_size, 0x00);
+      if (!db_options.sum_tree) {
+        std::copy_n(users.node(height, count - 1), node_size, padding.data());
+      }
+      level.tail.insert(level.tail.end(), padding.begin(), padding.end());
+    }
+  }
+}
+
+bool PoRDB::baseNode(uint64_t height, uint64_t index, uint8_t* node) const {
+  const size_t node_size = merkleNodeSize();
+  if (height >= dropped_levels) {
+    auto levels = merkleLevels(userCount());
+    alignas(8) uint8_t scratch[40];
+    const uint8_t* p = merkleBytes(
+        levels[height - dropped_levels].first + index * node_size, node_size,
+        scratch);
+    if (p == nullptr) {
+      return false;
+    }
+    std::copy_n(p, node_size, node);
+    return true;
+  }
+
+  std::vector<uint8_t> nodes;
+  TaggedHasher leaf_tag_hasher(kLeafTag);
+  for (uint64_t i = index << height; i < (index + 1) << height; ++i) {
+    std::string record = recordAt(i);
+    if (record.empty()) {
+      return false;
+    }
+    appendLeaf(record, leaf_tag_hasher, nodes);
+  }
+  TaggedHasher branch_tag_hasher(kBranchTag);
+  std::vector<uint8_t> parents;
+  for (uint64_t h = 0; h < height; ++h) {
+    parents.clear();
+    hashParents(nodes.data(), nodes.size() / node_size / 2, branch_tag_hasher,
+                parents);
+    nodes.swap(parents);
+  }
+  std::copy_n(nodes.data(), node_size, node);
+  return true;
+}
+
+uint64_t PoRDB::auditUsers(uint64_t begin, uint64_t end, uint64_t count,
+                           std::string& error) const {
+  const size_t node_size = merkleNodeSize();
+  const uint64_t width = uint64_t(1) << dropped_levels;
+  TaggedHasher leaf_tag_hasher(kLeafTag);
+  TaggedHasher branch_tag_hasher(kBranchTag);
+  std::vector<uint8_t> nodes;
+  std::vector<uint8_t> parents;
+  alignas(8) uint8_t scratch[40];
+
+  uint64_t previous_id = begin > 0 ? idAt(begin * width - 1) : 0;
+  std::vector<uint64_t> balances;
+  for (uint64_t group = begin; group < end; ++group) {
+    const uint64_t first = group * width;
+    nodes.clear();
+    for (uint64_t i = first; i < std::min(count, first + width); ++i) {
+      // record is "(id,balance)" of the id in the index, ids ascend
+      const uint64_t id = idAt(i);
+      std::string record = recordAt(i);
+      uint64_t record_id = 0;
+      if (!parseRecord(record, record_id, balances) || record_id != id) {
+        error = "user " + std::to_string(i) + ": record \"" + record +
+                "\" doesn't match index id " + std::to_string(id);
+        return group;
+      }
+      if (balances.size() != db_options.assets) {
+        error = "user " + std::to_string(i) + ": record \"" + record +
+                "\" doesn't have " + std::to_string(db_options.assets) +
+                " balances";
+        return group;
+      }
+      if (i > 0 && id <= previous_id) {
+        error = "user " + std::to_string(i) + ": id " + std::to_string(id) +
+                " doesn't ascend from " + std::to_string(previous_id);
+        return group;
+      }
+      previous_id = id;
+      appendLeaf(record, leaf_tag_hasher, nodes);
+    }
+
+    uint64_t level_count = count;
+    uint64_t level_first = first;
+    for (uint64_t height = 0; height < dropped_levels; ++height) {
+      padLevel(nodes, level_first, level_count);
+      parents.clear();
+      hashParents(nodes.data(), nodes.size() / node_size / 2,
+                  branch_tag_hasher, parents);
+      nodes.swap(parents);
+      level_count = levelCount(level_count, 1);
+      level_first >>= 1;
+    }
+
+    const uint8_t* stored =
+        merkleBytes(merkle_offset + group * node_size, node_size, scratch);
+    if (stored == nullptr || nodes.size() != node_size ||
+        std::memcmp(stored, nodes.data(), node_size) != 0) {
+      error = dropped_levels == 0
+                  ? "leaf doesn't match the hash of user " +
+                        std::to_string(first)
+                  : "node doesn't match the hash of users " +
+                        std::to_string(first) + " to " +
+                        std::to_string(std::min(count, first + width) - 1);
+      return group;
+    }
+  }
+  return end;
+}
+
+size_t PoRDB::merkleNodeSize() const { return db_options.sum_tree ? 40 : 32; }
+
+bool PoRDB::learnedIndex() const {
+  return db_options.learned_index && !db_options.compressed_index;
+}
+
+const std::vector<uint8_t>& PoRDB::indexMagic() const {
+  if (learnedIndex()) {
+    return db_options.binary_records ? kLearnedBinaryIndexMagic
+                                     : kLearnedIndexMagic;
+  }
+  if (db_options.binary_records) {
+    return db_options.compressed_index ? kCompressedBinaryIndexMagic
+                                       : kBinaryIndexMagic;
+  }
+  return db_options.compressed_index ? kCompressedIndexMagic : kIndexMagic;
+}
+
+std::string PoRDB::renderRecord(uint64_t id, uint64_t balance) {
+  char text[48];
+  char* p = text;
+  *p++ = '(';
+  // at most 20 digits each
+  p = std::to_chars(p, p + 20, id).ptr;
+  *p++ = ',';
+  p = std::to_chars(p, p + 20, balance).ptr;
+  *p++ = ')';
+  return std::string(text, p);
+}
+
+std::string PoRDB::renderRecord(uint64_t id, const uint64_t* balances,
+                                size_t assets) {
+  std::string record(2 + 21 * (assets + 1), '\0');
+  char* p = record.data();
+  *p++ = '(';
+  p = std::to_chars(p, p + 20, id).ptr;
+  for (size_t i = 0; i < assets; ++i) {
+    *p++ = ',';
+    p = std::to_chars(p, p + 20, balances[i]).ptr;
+  }
+  *p++ = ')';
+  record.resize(p - record.data());
+  return record;
+}
+
+bool PoRDB::parseRecord(std::string_view record, uint64_t& id,
+                        std::vector<uint64_t>& balances) {
+  const char* p = record.data();
+  const char* end = p + record.size();
+  auto skip = [&p, end]() {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+      ++p;
+    }
+  };
+  // a separator and the number after it
+  auto field = [&](char separator, uint64_t& value) {
+    skip();
+    if (p == end || *p != separator) {
+      return false;
+    }
+    ++p;
+    skip();
+    auto [next, ec] = std::from_chars(p, end, value);
+    p = next;
+    return ec == std::errc();
+  };
+
+  balances.clear();
+  if (!field('(', id)) {
+    return false;
+  }
+  uint64_t balance = 0;
+  while (true) {
+    skip();
+    if (p < end && *p == ')') {
+      return true;
+    }
+    if (!field(',', balance)) {
+      return false;
+    }
+    balances.push_back(balance);
+  }
+}
+
+const std::vector<uint8_t>& PoRDB::merkleMagic() const {
+  if (db_options.merkle_dropped_levels > 0) {
+    return db_options.sum_tree ? kPrunedSumMerkleMagic : kPrunedMerkleMagic;
+  }
+  return db_options.sum_tree ? kSumMerkleMagic : kMerkleMagic;
+}
+
+bool PoRDB::regularFileExists(const std::string& file) {
+  std::filesystem::path file_path = file;
+  return std::filesystem::exists(file_path) &&
+         std::filesystem::status(file_path).type() ==
+             std::filesystem::file_type::regular;
+}
+
+bool PoRDB::verifyFileFingerPrint(const std::string& file,
+                                  const std::vector<uint8_t>& magic) {
+  std::filesystem::path path = file;
+
+  // file starts with 32 byte hash, 8 byte magic number, 8 byte as the count of
+  // data entries
+  if (std::filesystem::file_size(path) < 48) {
+    return false;
+  }
+
+  std::vector<uint8_t> hv(32, 0);
+  std::ifstream f(file, std::ios::in | std::ios::binary);
+  f.read(reinterpret_cast<char*>(hv.data()), hv.size());
+
+  std::vector<uint8_t> magic_vec(8, 0);
+  f.read(reinterpret_cast<char*>(magic_vec.data()), magic_vec.size());
+  if (f.gcount() != magic_vec.size() || magic_vec != magic) {
+    return false;
+  }
+
+  sha256::StreamHasher hasher;
+  hasher.Append(magic_vec);
+
+  // read a block of 512 bytes
+  std::vector<uint8_t> buffer(512, 0);
+  f.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+  auto size = f.gcount();
+  while (size == buffer.size()) {
+    hasher.Append(buffer);
+    f.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    size = f.gcount();
+  }
+
+  buffer.resize(size);
+  hasher.Append(buffer);
+
+  return hv == hasher.Hash();
+}
+
+// This function takes quite a while to create index and merkle tree.
+// One thought is: preprocess the file in advance before starting service.
+//
+// Index and merkle file are built as temporary files and published with
+// fsync + atomic rename once complete. Every checkpoint_lines lines/nodes the
+// build flushes its output and records its progress in a journal, so an
+// interrupted build (OOM kill, deploy, reboot) resumes from the last
+// checkpoint instead of starting over. The build has 3 phases:
+//   1. parse users, write index entries and merkle leaves
+//   2. copy user records to the end of index file
+//   3. build merkle branch levels
+bool PoRDB::preprocessUserFile(const std::string& user_data,
+                               const std::string& index,
+                               const std::string& merkle) {
+  // plain or compressed input, read ahead on its own thread
+  LineReader reader;
+
+  const std::string index_tmp = index + ".tmp";
+  const std::string merkle_tmp = merkle + ".tmp";
+  const std::string journal = index + ".journal";
+
+  // a journal only applies to the same input file and the same tree format
+  struct stat input_stats;
+  if (stat(user_data.c_str(), &input_stats) != 0) {
+    std::memset(&input_stats, 0, sizeof input_stats);
+  }
+  const size_t node_size = merkleNodeSize();
+
+  // output goes through large aligned buffers that are written by io_uring
+  // while we keep parsing and hashing
+  sha256::StreamHasher index_hasher;
+  FileWriter index_file;
+  sha256::StreamHasher merkle_hasher;
+  FileWriter merkle_file;
+
+  // write data to file and feed it to file's fingerprint hasher
+  auto write = [](FileWriter& file, sha256::StreamHasher& hasher,
+                  const uint8_t* data, size_t size) {
+    hasher.Append(data, size);
+    return file.Append(data, size);
+  };
+
+  buildjournal j;
+  bool resume = loadJournal(journal, j) &&
+                j.input_size == static_cast<uint64_t>(input_stats.st_size) &&
+                j.input_mtime == static_cast<int64_t>(input_stats.st_mtime) &&
+                j.node_size == node_size &&
+                j.binary_records == (db_options.binary_records ? 1 : 0) &&
+                j.assets == db_options.assets &&
+                regularFileExists(index_tmp) &&
+                regularFileExists(merkle_tmp) &&
+                std::filesystem::file_size(index_tmp) >= j.index_size &&
+                std::filesystem::file_size(merkle_tmp) >= j.merkle_size;
+  if (resume) {
+    // continue right after the last checkpoint
+    index_hasher.Restore(j.index_hasher);
+    merkle_hasher.Restore(j.merkle_hasher);
+    if ((j.phase < 3 &&
+         !index_file.Reopen(index_tmp, j.index_size, db_options.direct_io,
+                            db_options.io_uring)) ||
+        !merkle_file.Reopen(merkle_tmp, j.merkle_size, db_options.direct_io,
+                            db_options.io_uring)) {
+      return false;
+    }
+  } else {
+    std::memset(&j, 0, sizeof j);
+    j.input_size = input_stats.st_size;
+    j.input_mtime = input_stats.st_mtime;
+    j.node_size = node_size;
+    j.binary_records = db_options.binary_records ? 1 : 0;
+    j.assets = db_options.assets;
+    if (!index_file.Open(index_tmp, db_options.direct_io,
+                         db_options.io_uring) ||
+        !merkle_file.Open(merkle_tmp, db_options.direct_io,
+                          db_options.io_uring)) {
+      return false;
+    }
+    // a missing input is an empty one, input in an unsupported compression
+    // format is an error
+    if (!reader.Open(user_data) && regularFileExists(user_data)) {
+      return false;
+    }
+
+    // leave 32 bytes for sha256
+    const std::vector<uint8_t> placeholder(32, 0x00);
+    index_file.Append(placeholder);
+    merkle_file.Append(placeholder);
+
+    // write magic to index and merkle file
+    const auto& index_magic =
+        db_options.binary_records ? kBinaryIndexMagic : kIndexMagic;
+    write(index_file, index_hasher, index_magic.data(), index_magic.size());
+    const auto& merkle_magic =
+        db_options.sum_tree ? kSumMerkleMagic : kMerkleMagic;
+    write(merkle_file, merkle_hasher, merkle_magic.data(),
+          merkle_magic.size());
+
+    // get user data item count from the first line
+    uint64_t count = 0;
+    std::string_view header;
+    if (reader.Next(header)) {
+      size_t blanks = header.find_first_not_of(" \t");
+      if (blanks != std::string_view::npos) {
+        std::from_chars(header.data() + blanks, header.data() + header.size(),
+                        count);
+      }
+    }
+
+    // write data count
+    const uint8_t* p_count = reinterpret_cast<const uint8_t*>(&count);
+    write(index_file, index_hasher, p_count, sizeof count);
+    write(merkle_file, merkle_hasher, p_count, sizeof count);
+
+    // I will copy user data to index file after all the index is created
+    j.phase = 1;
+    j.user_count = count;
+    j.record_offset = 32 + 8 + 8 + count * 16;
+    j.first_line_pos = reader.Position();
+    j.input_pos = j.first_line_pos;
+  }
+
+  // flush output, make it durable and record progress
+  const uint64_t checkpoint_lines = db_options.checkpoint_lines;
+  auto checkpoint = [&]() {
+    if (checkpoint_lines == 0) {
+      return (j.phase >= 3 || index_file.Flush()) && merkle_file.Flush();
+    }
+
+    if (j.phase < 3) {
+      j.index_size = index_file.Size();
+      j.index_hasher = index_hasher.State();
+    }
+    j.merkle_size = merkle_file.Size();
+    j.merkle_hasher = merkle_hasher.State();
+    if ((j.phase < 3 && !index_file.Sync()) || !merkle_file.Sync() ||
+        !saveJournal(journal, j)) {
+      return false;
+    }
+    return !db_options.on_checkpoint || db_options.on_checkpoint();
+  };
+  auto due = [checkpoint_lines](uint64_t done) {
+    return checkpoint_lines > 0 && done % checkpoint_lines == 0;
+  };
+
+  std::vector<uint8_t> hv(j.last_node, j.last_node + node_size);
+  auto parse = [this](std::string_view line, uint64_t& id,
+                      std::vector<uint64_t>& balances) {
+    if (!parseRecord(line, id, balances) ||
+        balances.size() != db_options.assets) {
+      std::cerr << "user record doesn't have " << db_options.assets
+                << " balances: " << line << std::endl;
+      return false;
+    }
+    return true;
+  };
+  // the input ended before all users were read, or is corrupt
+  auto truncated = [&reader, &user_data]() {
+    std::cerr << user_data
+              << (reader.Failed() ? ": user data is corrupt"
+                                  : ": user data ends early")
+              << std::endl;
+    return false;
+  };
+  if (j.phase == 1) {
+    if (resume && !reader.Open(user_data, j.input_pos)) {
+      return false;
+    }
+
+    // a parser thread turns lines into index entries and leaf hashes batch
+    // by batch while this thread writes them out, so reading and inflating,
+    // parsing and hashing, and writing all run at the same time. Batches end
+    // at checkpoints, which record where the next batch starts.
+    struct leafbatch {
+      uint64_t lines = 0;
+      std::vector<uint64_t> entries;
+      std::vector<uint8_t> nodes;
+      // input position, record offset and balance total after the batch
+      uint64_t input_pos = 0;
+      uint64_t record_offset = 0;
+      uint64_t total_balance = 0;
+      bool ok = true;
+    };
+    const uint64_t kBatchLines = 4096;
+    BoundedQueue<leafbatch> leaves(4);
+    const uint64_t first = j.lines_done;
+    const uint64_t user_count = j.user_count;
+    const uint64_t first_offset = j.record_offset;
+    const uint64_t first_total = j.total_balance;
+    std::thread parser([&, first, user_count, first_offset, first_total]() {
+      TaggedHasher leaf_tag_hasher(kLeafTag);
+      std::string_view line;
+      uint64_t id = 0;
+      std::vector<uint64_t> balances;
+      uint64_t record_offset = first_offset;
+      uint64_t total_balance = first_total;
+      for (uint64_t i = first; i < user_count;) {
+        leafbatch batch;
+        batch.entries.reserve(2 * kBatchLines);
+        batch.nodes.reserve(node_size * kBatchLines);
+        do {
+          if (!reader.Next(line)) {
+            batch.ok = truncated();
+            break;
+          }
+          if (!parse(line, id, balances)) {
+            batch.ok = false;
+            break;
+          }
+          uint64_t balance = balances[0];
+
+          // assemble id and offset as index entry, or id and balance as
+          // binary record, which is only possible if the line can be
+          // rendered back
+          if (db_options.binary_records &&
+              line != renderRecord(id, balances.data(), balances.size())) {
+            std::cerr << "user record is not in canonical form: " << line
+                      << std::endl;
+            batch.ok = false;
+            break;
+          }
+          batch.entries.push_back(id);
+          batch.entries.push_back(db_options.binary_records ? balance
+                                                            : record_offset);
+
+          // put '\0' at the end of string
+          record_offset += line.size() + 1;
+
+          // calculate leaf hash
+          leaf_tag_hasher.Reset();
+          leaf_tag_hasher.Append(reinterpret_cast<const uint8_t*>(line.data()),
+                                 line.size());
+          auto leaf = leaf_tag_hasher.Hash();
+          batch.nodes.insert(batch.nodes.end(), leaf.begin(), leaf.end());
+
+          // in sum tree mode, leaf node carries the user's balance
+          if (db_options.sum_tree) {
+            if (total_balance + balance < total_balance) {
+              batch.ok = false;
+              break;
+            }
+            total_balance += balance;
+            batch.nodes.insert(batch.nodes.end(),
+                               reinterpret_cast<uint8_t*>(&balance),
+                               reinterpret_cast<uint8_t*>(&balance) + 8);
+          }
+          ++batch.lines;
+          ++i;
+        } while (i < user_count && batch.lines < kBatchLines && !due(i));
+
+        batch.input_pos = reader.Position();
+        batch.record_offset = record_offset;
+        batch.total_balance = total_balance;
+        const bool ok = batch.ok;
+        if (!leaves.Push(std::move(batch)) || !ok) {
+          break;
+        }
+      }
+      leaves.Close();
+    });
+
+    uint64_t done = first;
+    bool ok = true;
+    leafbatch batch;
+    while (ok && leaves.Pop(batch)) {
+      ok = batch.ok &&
+           write(index_file, index_hasher,
+                 reinterpret_cast<const uint8_t*>(batch.entries.data()),
+                 batch.entries.size() * 8) &&
+           write(merkle_file, merkle_hasher, batch.nodes.data(),
+                 batch.nodes.size());
+      if (!ok) {
+        break;
+      }
+      done += batch.lines;
+      j.record_offset = batch.record_offset;
+      j.total_balance = batch.total_balance;
+      hv.assign(batch.nodes.end() - node_size, batch.nodes.end());
+
+      if (due(done) && done < j.user_count) {
+        j.lines_done = done;
+        j.input_pos = batch.input_pos;
+        std::copy(hv.cbegin(), hv.cend(), j.last_node);
+        ok = checkpoint();
+      }
+    }
+    // stops the parser if this thread gave up first
+    leaves.Close();
+    parser.join();
+    reader.Close();
+    if (!ok || done != j.user_count) {
+      return false;
+    }
+
+    // in sum tree, odd levels are padded with an all-zero node instead of
+    // duplicating the last node, a duplicate would count its balance twice
+    // if count is an odd number greater than 1, duplicate the last hash
+    if (j.user_count > 1 && (j.user_count & 0x01) == 0x01) {
+      if (db_options.sum_tree) {
+        hv.assign(node_size, 0x00);
+      }
+      write(merkle_file, merkle_hasher, hv.data(), hv.size());
+    }
+
+    // rescan the user data file from the first user
+    j.phase = 2;
+    j.lines_done = 0;
+    j.input_pos = j.first_line_pos;
+    if (!checkpoint()) {
+      return false;
+    }
+  }
+
+  if (j.phase == 2) {
+    // copy user data to index, including '\0'. Binary records are complete,
+    // only the balance rows of more assets follow them.
+    const bool rows = db_options.binary_records && db_options.assets > 1;
+    const uint64_t copy_count =
+        db_options.binary_records && !rows ? 0 : j.user_count;
+    if (j.lines_done < copy_count && !reader.Open(user_data, j.input_pos)) {
+      return false;
+    }
+    std::string_view line;
+    std::string record;
+    uint64_t id = 0;
+    std::vector<uint64_t> balances;
+    for (uint64_t i = j.lines_done; i < copy_count; ++i) {
+      if (!reader.Next(line)) {
+        return truncated();
+      }
+      if (!rows) {
+        record.assign(line);
+        record.push_back('\0');
+        if (!write(index_file, index_hasher,
+                   reinterpret_cast<const uint8_t*>(record.data()),
+                   record.size())) {
+          return false;
+        }
+      } else if (!parse(line, id, balances) ||
+                 !write(index_file, index_hasher,
+                        reinterpret_cast<const uint8_t*>(balances.data() + 1),
+                        (balances.size() - 1) * 8)) {
+        return false;
+      }
+
+      if (due(i + 1) && i + 1 < copy_count) {
+        j.lines_done = i + 1;
+        j.input_pos = reader.Position();
+        if (!checkpoint()) {
+          return false;
+        }
+      }
+    }
+    reader.Close();
+
+    // write sha256 hash to the begining 32 bytes
+    if (!index_file.WriteAt(0, index_hasher.Hash()) || !index_file.Sync() ||
+        !index_file.Close()) {
+      return false;
+    }
+
+    // leaf level, including padding node
+    j.phase = 3;
+    j.read_offset = 48;
+    j.level_count = j.user_count + (j.user_count > 1 ? j.user_count & 0x01 : 0);
+    j.pairs_done = 0;
+    if (!checkpoint()) {
+      return false;
+    }
+  }
+
+  // construct merkle tree level by level, the lower level is read back in
+  // large chunks after it is flushed
+  int merkle_fd = open(merkle_tmp.c_str(), O_RDONLY);
+  if (merkle_fd < 0) {
+    return false;
+  }
+
+  TaggedHasher branch_tag_hasher(kBranchTag);
+  std::vector<uint8_t> children;
+  std::vector<uint8_t>& branch_hash = hv;
+  const uint64_t kChunkPairs = 16384;
+  uint64_t nodes = 0;
+  bool ok = true;
+  while (ok && j.level_count > 1) {
+    const uint64_t parents = j.level_count >> 1;
+    for (uint64_t i = j.pairs_done; ok && i < parents; i += kChunkPairs) {
+      uint64_t pairs = std::min(kChunkPairs, parents - i);
+      children.resize(pairs * 2 * node_size);
+      ok = pread(merkle_fd, children.data(), children.size(),
+                 j.read_offset + i * 2 * node_size) ==
+           static_cast<ssize_t>(children.size());
+
+      for (uint64_t k = 0; ok && k < pairs; ++k) {
+        // calculate branch tagged hash of 2 children, in sum tree mode the
+        // hash commits to both children's hash and balance sum
+        const uint8_t* left = children.data() + 2 * k * node_size;
+        const uint8_t* right = left + node_size;
+        branch_tag_hasher.Reset();
+        branch_tag_hasher.Append(left, 2 * node_size);
+        branch_hash = branch_tag_hasher.Hash();
+        if (db_options.sum_tree) {
+          uint64_t sum = *reinterpret_cast<const uint64_t*>(left + 32) +
+                         *reinterpret_cast<const uint64_t*>(right + 32);
+          branch_hash.insert(branch_hash.end(),
+                             reinterpret_cast<uint8_t*>(&sum),
+                             reinterpret_cast<uint8_t*>(&sum) + 8);
+        }
+        ok = write(merkle_file, merkle_hasher, branch_hash.data(),
+                   branch_hash.size());
+      }
+
+      nodes += pairs;
+      j.pairs_done = i + pairs;
+      if (ok && checkpoint_lines > 0 && nodes >= checkpoint_lines &&
+          j.pairs_done < parents) {
+        nodes = 0;
+        std::copy(branch_hash.cbegin(), branch_hash.cend(), j.last_node);
+        ok = checkpoint();
+      }
+    }
+
+    uint64_t count = parents;
+    if (ok && count > 1 && (count & 0x01) == 0x01) {
+      if (db_options.sum_tree) {
+        branch_hash.assign(node_size, 0x00);
+      }
+      ok = write(merkle_file, merkle_hasher, branch_hash.data(),
+                 branch_hash.size());
+      ++count;
+    }
+
+    // next level reads back what we just wrote
+    j.read_offset += node_size * j.level_count;
+    j.level_count = count;
+    j.pairs_done = 0;
+    ok = ok && checkpoint();
+  }
+  close(merkle_fd);
+
+  // write sha256 hash to the begining
+  if (!ok || !merkle_file.WriteAt(0, merkle_hasher.Hash()) ||
+      !merkle_file.Sync() || !merkle_file.Close()) {
+    return false;
+  }
+
+  // publish all files, then the journal is no longer needed
+  std::error_code ec;
+  if (db_options.id_filter) {
+    const std::string filter = user_data + ".filter";
+    if (!buildFilter(index_tmp, filter + ".tmp")) {
+      return false;
+    }
+    std::filesystem::rename(filter + ".tmp", filter, ec);
+  }
+  if (ec) {
+    return false;
+  }
+  if (db_options.compressed_index || learnedIndex()) {
+    std::string rewritten_tmp = index + ".rtmp";
+    if (!rewriteIndex(index_tmp, rewritten_tmp)) {
+      return false;
+    }
+    std::filesystem::rename(rewritten_tmp, index, ec);
+    if (!ec) {
+      std::filesystem::remove(index_tmp);
+    }
+  } else {
+    std::filesystem::rename(index_tmp, index, ec);
+  }
+  if (!ec && db_options.merkle_dropped_levels > 0) {
+    std::string pruned_tmp = merkle + ".ptmp";
+    if (!pruneMerkle(merkle_tmp, pruned_tmp)) {
+      return false;
+    }
+    std::filesystem::rename(pruned_tmp, merkle, ec);
+    if (!ec) {
+      std::filesystem::remove(merkle_tmp);
+    }
+  } else if (!ec) {
+    std::filesystem::rename(merkle_tmp, merkle, ec);
+  }
+  if (ec) {
+    return false;
+  }
+
+  std::filesystem::path dir = std::filesystem::path(index).parent_path();
+  int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  std::filesystem::remove(journal);
+  return true;
+}
+
+// The full index file is built first, then its id/offset entries are
+// re-encoded with Elias-Fano, or a model is learned from them and written in
+// front of them, and the user records are copied after them.
+bool PoRDB::rewriteIndex(const std::string& index,
+                         const std::string& rewritten) {
+  int fd = open(index.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat stats;
+  fstat(fd, &stats);
+  const void* map = mmap(0, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == (void*)-1) {
+    return false;
+  }
+
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(map);
+  const uint64_t count = *reinterpret_cast<const uint64_t*>(base + 40);
+  const struct indexentry* entries =
+      reinterpret_cast<const struct indexentry*>(base + 48);
+  const bool binary = db_options.binary_records;
+  const uint64_t old_records = binary ? 48 : 48 + count * 16;
+  const uint64_t records_size = stats.st_size - old_records;
+
+  // ids must be sorted, which binary search relies on as well
+  const bool learned = learnedIndex();
+  const uint64_t offset_count = binary || learned ? 0 : count;
+  EliasFano::Builder ids(learned ? 0 : count,
+                         count > 0 ? entries[count - 1].id : 0);
+  EliasFano::Builder offsets(
+      offset_count,
+      offset_count > 0 ? entries[count - 1].offset - old_records : 0);
+  LearnedIndex::Builder model(db_options.learned_index_epsilon);
+  bool ok = true;
+  for (uint64_t i = 0; ok && i < count; ++i) {
+    if (learned) {
+      ok = model.Add(entries[i].id);
+    } else {
+      ok = ids.Add(entries[i].id) &&
+           (binary || offsets.Add(entries[i].offset - old_records));
+    }
+  }
+
+  if (!ok) {
+    std::cerr << "user ids are not sorted, can't rewrite index" << std::endl;
+    munmap(const_cast<void*>(map), stats.st_size);
+    return false;
+  }
+
+  // learned index: | count | entries offset | model words No# | model |
+  // compressed index: | count | records offset | id words No# |
+  // offset words No# | ids | offsets |
+  std::vector<uint64_t> header;
+  std::vector<uint64_t> id_words;
+  std::vector<uint64_t> offset_words;
+  if (learned) {
+    id_words = model.Finish();
+    header = {count, 64 + id_words.size() * 8, id_words.size()};
+  } else {
+    id_words = ids.Finish();
+    offset_words = offsets.Finish();
+    header = {count, 72 + (id_words.size() + offset_words.size()) * 8,
+              id_words.size(), offset_words.size()};
+  }
+  sha256::StreamHasher hasher;
+  FileWriter file;
+  auto write = [&hasher, &file](const void* data, size_t size) {
+    hasher.Append(reinterpret_cast<const uint8_t*>(data), size);
+    return file.Append(reinterpret_cast<const uint8_t*>(data), size);
+  };
+
+  ok = file.Open(rewritten, db_options.direct_io, db_options.io_uring) &&
+       file.Append(std::vector<uint8_t>(32, 0x00)) &&
+       write(indexMagic().data(), indexMagic().size()) &&
+       write(header.data(), header.size() * 8) &&
+       write(id_words.data(), id_words.size() * 8) &&
+       write(offset_words.data(), offset_words.size() * 8);
+
+  // learned index keeps the entries, with record offsets moved by the model
+  const uint64_t shift = header[1] - 48;
+  for (uint64_t i = 0; ok && learned && !binary && i < count; ++i) {
+    uint64_t entry[2] = {entries[i].id, entries[i].offset + shift};
+    ok = write(entry, sizeof entry);
+  }
+
+  // copy user records in large chunks
+  const uint64_t kChunk = 1 << 20;
+  for (uint64_t done = 0; ok && done < records_size; done += kChunk) {
+    ok = write(base + old_records + done, std::min(kChunk, records_size - done));
+  }
+
+  munmap(const_cast<void*>(map), stats.st_size);
+  return ok && file.WriteAt(0, hasher.Hash()) && file.Sync() && file.Close();
+}
+
+// The bottom levels of a complete merkle file are skipped, the levels above
+// them are copied behind a header that records how many were dropped.
+bool PoRDB::pruneMerkle(const std::string& merkle, const std::string& pruned) {
+  int fd = open(merkle.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat stats;
+  fstat(fd, &stats);
+  const void* map = mmap(0, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == (void*)-1) {
+    return false;
+  }
+
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(map);
+  const uint64_t count = *reinterpret_cast<const uint64_t*>(base + 40);
+  const size_t node_size = merkleNodeSize();
+  uint64_t offset = 48;
+  uint64_t level_count = count;
+  uint64_t dropped = 0;
+  while (dropped < db_options.merkle_dropped_levels && level_count > 1) {
+    level_count += level_count & 0x01;
+    offset += level_count * node_size;
+    level_count >>= 1;
+    ++dropped;
+  }
+
+  const uint64_t header[2] = {count, dropped};
+  sha256::StreamHasher hasher;
+  FileWriter file;
+  auto write = [&hasher, &file](const void* data, size_t size) {
+    hasher.Append(reinterpret_cast<const uint8_t*>(data), size);
+    return file.Append(reinterpret_cast<const uint8_t*>(data), size);
+  };
+  bool ok = file.Open(pruned, db_options.direct_io, db_options.io_uring) &&
+            file.Append(std::vector<uint8_t>(32, 0x00)) &&
+            write(merkleMagic().data(), merkleMagic().size()) &&
+            write(header, sizeof header);
+
+  const uint64_t kChunk = 1 << 20;
+  for (uint64_t at = offset; ok && at < uint64_t(stats.st_size); at += kChunk) {
+    ok = write(base + at, std::min<uint64_t>(kChunk, stats.st_size - at));
+  }
+
+  munmap(const_cast<void*>(map), stats.st_size);
+  return ok && file.WriteAt(0, hasher.Hash()) && file.Sync() && file.Close();
+}
+
+bool PoRDB::buildFilter(const std::string& index, const std::string& filter) {
+  int fd = open(index.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat stats;
+  fstat(fd, &stats);
+  const void* map = mmap(0, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == (void*)-1) {
+    return false;
+  }
+
+  // index entries and binary records both start with the id
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(map);
+  const uint64_t count = *reinterpret_cast<const uint64_t*>(base + 40);
+  const struct indexentry* entries =
+      reinterpret_cast<const struct indexentry*>(base + 48);
+  BloomFilter bloom(count, db_options.id_filter_bits);
+  for (uint64_t i = 0; i < count; ++i) {
+    bloom.Add(entries[i].id);
+  }
+  munmap(const_cast<void*>(map), stats.st_size);
+
+  const uint64_t header[2] = {count, bloom.Blocks()};
+  sha256::StreamHasher hasher;
+  FileWriter file;
+  auto write = [&hasher, &file](const void* data, size_t size) {
+    hasher.Append(reinterpret_cast<const uint8_t*>(data), size);
+    return file.Append(reinterpret_cast<const uint8_t*>(data), size);
+  };
+  return file.Open(filter, db_options.direct_io, db_options.io_uring) &&
+         file.Append(std::vector<uint8_t>(32, 0x00)) &&
+         write(kFilterMagic.data(), kFilterMagic.size()) &&
+         write(header, sizeof header) && write(bloom.Data(), bloom.Bytes()) &&
+         file.WriteAt(0, hasher.Hash()) && file.Sync() && file.Close();
+}
+
+bool PoRDB::loadFilter(const std::string& filter) {
+  std::ifstream f(filter, std::ios::in | std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)),
+                            std::istreambuf_iterator<char>());
+  // skip sha256, magic and user count
+  return data.size() > 48 && this->filter.Assign(data.data() + 48,
+                                                  data.size() - 48);
+}
+
+bool PoRDB::saveJournal(const std::string& journal, const buildjournal& j) {
+  // journal file format:
+  //   sha256    magic     build progress
+  // | 256 bit | 64 bit | struct buildjournal |
+  std::vector<uint8_t> data(kJournalMagic);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&j);
+  data.insert(data.end(), p, p + sizeof j);
+  return replaceFile(journal, std::move(data));
+}
+
+bool PoRDB::replaceFile(const std::string& file, std::vector<uint8_t> data) {
+  sha256::StreamHasher hasher;
+  hasher.Append(data);
+  auto hv = hasher.Hash();
+  data.insert(data.begin(), hv.cbegin(), hv.cend());
+
+  // a crash leaves either the old or the new file
+  std::string tmp = file + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool ok = write(fd, data.data(), data.size()) ==
+                static_cast<ssize_t>(data.size()) &&
+            fdatasync(fd) == 0;
+  close(fd);
+  return ok && rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+bool PoRDB::loadJournal(const std::string& journal, buildjournal& j) {
+  if (!regularFileExists(journal) ||
+      std::filesystem::file_size(journal) != 40 + sizeof j ||
+      !verifyFileFingerPrint(journal, kJournalMagic)) {
+    return false;
+  }
+
+  std::ifstream f(journal, std::ios::in | std::ios::binary);
+  f.seekg(40);
+  f.read(reinterpret_cast<char*>(&j), sizeof j);
+  return f.gcount() == sizeof j;
+}
+
+// single file format:
+//   sha256    magic    version   section No#    section table
+// | 256 bit | 64 bit | 64 bit |    64 bit    | struct sectionentry | .. |
+// then the sections, each at a 4KB boundary. The sha256 covers magic to the
+// end of the table, each entry has the sha256 of its section. Index, merkle
+// and filter section are the bytes of the separate files. The level
+// directory holds file offset and node count of every stored merkle level,
+// bottom-up, the metadata user No#, node size, dropped and stored levels.
+// Readers skip sections of unknown kind, so new kinds need no new version.
+namespace {
+enum : uint64_t {
+  kIndexSection = 1,
+  kMerkleSection = 2,
+  kFilterSection = 3,
+  kLevelSection = 4,
+  kMetaSection = 5,
+};
+const uint64_t kDatabaseVersion = 1;
+const uint64_t kSectionAlign = 4096;
+
+struct sectionentry {
+  uint64_t kind;
+  uint64_t offset;
+  uint64_t size;
+  uint8_t sha256[32];
+};
+}  // namespace
+
+void PoRDB::unmapFiles() {
+  if (database_map.loaded()) {
+    // index and merkle map are views of the single file mapping
+    unmmapFile(database_map);
+    index_map = mmmapinfo();
+    merkle_map = mmmapinfo();
+    return;
+  }
+  unmmapFile(index_map);
+  unmmapFile(merkle_map);
+}
+
+bool PoRDB::packDatabase(const std::string& database,
+                         const std::string& filter_file) const {
+  if (index_map.file_map == (void*)-1 || merkle_map.file_map == (void*)-1) {
+    return false;
+  }
+
+  std::vector<uint8_t> filter_bytes;
+  if (db_options.id_filter) {
+    std::ifstream f(filter_file, std::ios::in | std::ios::binary);
+    filter_bytes.assign(std::istreambuf_iterator<char>(f),
+                        std::istreambuf_iterator<char>());
+    if (filter_bytes.empty()) {
+      return false;
+    }
+  }
+  const uint64_t count = userCount();
+  const auto levels = merkleLevels(count);
+  std::vector<uint64_t> meta = {count, merkleNodeSize(), dropped_levels,
+                                levels.size()};
+  std::vector<uint64_t> directory;
+
+  std::vector<std::pair<uint64_t, std::pair<const uint8_t*, uint64_t>>>
+      bodies = {
+          {kMetaSection,
+           {reinterpret_cast<const uint8_t*>(meta.data()), meta.size() * 8}},
+          {kLevelSection, {nullptr, levels.size() * 16}},
+          {kIndexSection,
+           {static_cast<const uint8_t*>(index_map.file_map),
+            index_map.file_size}},
+          {kMerkleSection,
+           {static_cast<const uint8_t*>(merkle_map.file_map),
+            merkle_map.file_size}}};
+  if (db_options.id_filter) {
+    bodies.push_back({kFilterSection,
+                      {filter_bytes.data(), filter_bytes.size()}});
+  }
+
+  // lay out the sections, the directory points into the merkle section
+  auto align = [](uint64_t offset) {
+    return (offset + kSectionAlign - 1) / kSectionAlign * kSectionAlign;
+  };
+  std::vector<sectionentry> sections(bodies.size());
+  uint64_t offset = align(56 + sections.size() * sizeof(sectionentry));
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    sections[i].kind = bodies[i].first;
+    sections[i].offset = offset;
+    sections[i].size = bodies[i].second.second;
+    offset = align(offset + sections[i].size);
+    if (bodies[i].first == kMerkleSection) {
+      for (const auto& level : levels) {
+        directory.push_back(sections[i].offset + level.first);
+        directory.push_back(level.second);
+      }
+    }
+  }
+  bodies[1].second.first = reinterpret_cast<const uint8_t*>(directory.data());
+
+  std::string tmp = database + ".tmp";
+  FileWriter writer;
+  if (!writer.Open(tmp, false, db_options.io_uring)) {
+    return false;
+  }
+  std::vector<uint8_t> padding(kSectionAlign, 0);
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    const uint8_t* body = bodies[i].second.first;
+    if (!writer.Append(padding.data(), sections[i].offset - writer.Size()) ||
+        !writer.Append(body, sections[i].size)) {
+      writer.Close();
+      return false;
+    }
+    sha256::StreamHasher hasher;
+    hasher.Append(body, sections[i].size);
+    auto hv = hasher.Hash();
+    std::copy(hv.begin(), hv.end(), sections[i].sha256);
+  }
+
+  std::vector<uint8_t> header(kDatabaseMagic);
+  const uint64_t words[2] = {kDatabaseVersion, sections.size()};
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(words);
+  header.insert(header.end(), p, p + sizeof words);
+  p = reinterpret_cast<const uint8_t*>(sections.data());
+  header.insert(header.end(), p, p + sections.size() * sizeof(sectionentry));
+  sha256::StreamHasher hasher;
+  hasher.Append(header);
+  auto hv = hasher.Hash();
+  header.insert(header.begin(), hv.cbegin(), hv.cend());
+
+  bool ok = writer.Flush() && writer.WriteAt(0, header) && writer.Sync();
+  ok = writer.Close() && ok;
+  return ok && rename(tmp.c_str(), database.c_str()) == 0;
+}
+
+bool PoRDB::mapDatabase(const std::string& database, bool shared) {
+  if (!regularFileExists(database)) {
+    return false;
+  }
+
+  database_map = shared ? attachFile(database) : mmapFile(database);
+  const uint8_t* base = static_cast<const uint8_t*>(database_map.file_map);
+  const uint64_t size = database_map.file_size;
+  auto fail = [this]() {
+    unmapFiles();
+    filter.Reset();
+    return false;
+  };
+  if (database_map.file_map == (void*)-1 || size < 56 ||
+      !std::equal(kDatabaseMagic.begin(), kDatabaseMagic.end(), base + 32)) {
+    return fail();
+  }
+  uint64_t words[2] = {0, 0};
+  std::memcpy(words, base + 40, sizeof words);
+  if (words[0] != kDatabaseVersion ||
+      words[1] > (size - 56) / sizeof(sectionentry)) {
+    return fail();
+  }
+  sha256::StreamHasher hasher;
+  hasher.Append(base + 32, 24 + words[1] * sizeof(sectionentry));
+  auto hv = hasher.Hash();
+  if (!std::equal(hv.begin(), hv.end(), base)) {
+    return fail();
+  }
+
+  // index and merkle map become views of their sections
+  auto view = [this, base](const sectionentry& section) {
+    mmmapinfo info;
+    info.file_map = base + section.offset;
+    info.file_size = section.size;
+    info.map_size = section.size;
+    info.strategy = database_map.strategy;
+    info.numa_interleaved = database_map.numa_interleaved;
+    info.shared = database_map.shared;
+    return info;
+  };
+  auto magic_is = [base](const sectionentry& section,
+                         const std::vector<uint8_t>& magic) {
+    return section.size >= 48 &&
+           std::equal(magic.begin(), magic.end(), base + section.offset + 32);
+  };
+  std::vector<uint64_t> directory;
+  std::vector<uint64_t> meta;
+  uint64_t merkle_section = 0;
+  bool has_filter = false;
+  for (uint64_t i = 0; i < words[1]; ++i) {
+    sectionentry section;
+    std::memcpy(&section, base + 56 + i * sizeof section, sizeof section);
+    if (section.offset > size || section.size > size - section.offset) {
+      return fail();
+    }
+    const uint8_t* body = base + section.offset;
+    if (!shared) {
+      hasher.Reset();
+      hasher.Append(body, section.size);
+      hv = hasher.Hash();
+      if (!std::equal(hv.begin(), hv.end(), section.sha256)) {
+        return fail();
+      }
+    }
+
+    switch (section.kind) {
+      case kIndexSection:
+        if (!magic_is(section, indexMagic()) ||
+            !columnsMatch(body, section.size)) {
+          return fail();
+        }
+        index_map = view(section);
+        break;
+      case kMerkleSection:
+        if (!magic_is(section, merkleMagic())) {
+          return fail();
+        }
+        merkle_map = view(section);
+        merkle_section = section.offset;
+        break;
+      case kFilterSection:
+        has_filter = db_options.id_filter && magic_is(section, kFilterMagic) &&
+                     filter.Assign(body + 48, section.size - 48);
+        break;
+      case kLevelSection:
+        directory.resize(section.size / 8);
+        std::memcpy(directory.data(), body, directory.size() * 8);
+        break;
+      case kMetaSection:
+        meta.resize(section.size / 8);
+        std::memcpy(meta.data(), body, meta.size() * 8);
+        break;
+    }
+  }
+  if (!index_map.loaded() || !merkle_map.loaded() ||
+      (db_options.id_filter && !has_filter) || meta.empty() ||
+      meta[0] != userCount()) {
+    return fail();
+  }
+
+  // the directory must describe the merkle section
+  parseMerkle();
+  std::vector<uint64_t> expected;
+  for (const auto& level : merkleLevels(meta[0])) {
+    expected.push_back(merkle_section + level.first);
+    expected.push_back(level.second);
+  }
+  return directory == expected ? true : fail();
+}
+
+std::string PoRDB::segmentPath(const std::string& name) {
+  if (name.empty() || name == "." || name == ".." ||
+      name.find('/') != std::string::npos) {
+    return "";
+  }
+  return "/dev/shm/" + name;
+}
+
+bool PoRDB::Publish(const std::string& name, bool huge_pages) const {
+  std::string segment = segmentPath(name);
+  if (segment.empty() || database_map.file_map == (void*)-1 ||
+      has_appended) {
+    return false;
+  }
+
+  // fill a new segment and rename it over the old one, so that attaching
+  // processes never see a partial copy
+  std::string tmp = segment + ".tmp";
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  const size_t size = database_map.file_size;
+  // reserve the pages up front, running out of tmpfs space while copying
+  // would be a SIGBUS
+  bool ok = posix_fallocate(fd, 0, size) == 0;
+  void* addr = ok ? mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                  : (void*)-1;
+  close(fd);
+  if (addr == (void*)-1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  if (huge_pages) {
+    madvise(addr, size, MADV_HUGEPAGE);
+  }
+  std::memcpy(addr, database_map.file_map, size);
+  munmap(addr, size);
+  if (rename(tmp.c_str(), segment.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool PoRDB::Unpublish(const std::string& name) {
+  std::string segment = segmentPath(name);
+  return !segment.empty() && unlink(segment.c_str()) == 0;
+}
+
+struct PoRDB::mmmapinfo PoRDB::attachFile(const std::string& name) {
+  PoRDB::mmmapinfo info;
+  int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat stats;
+  if (fd < 0 || fstat(fd, &stats) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return info;
+  }
+  info.file_size = stats.st_size;
+
+  // pages belong to the segment, the strategies can only prefault them or
+  // advise huge pages
+  auto strategy = db_options.map_strategy == MapStrategy::kPopulate
+                      ? MapStrategy::kPopulate
+                      : MapStrategy::kMmapLock;
+  int flags = MAP_SHARED;
+  if (strategy == MapStrategy::kPopulate) {
+    flags |= MAP_POPULATE;
+  }
+  info.file_map = mmap(0, info.file_size, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (info.file_map == (void*)-1) {
+    perror("mmap failure");
+    return info;
+  }
+  if (db_options.map_strategy == MapStrategy::kHugePage ||
+      db_options.map_strategy == MapStrategy::kHugeTlb) {
+    madvise(const_cast<void*>(info.file_map), info.file_size, MADV_HUGEPAGE);
+  }
+  mlock2(info.file_map, info.file_size, MLOCK_ONFAULT);
+  info.map_size = info.file_size;
+  info.strategy = strategy;
+  info.shared = true;
+  return info;
+}
+
+struct PoRDB::mmmapinfo PoRDB::mmapFile(const std::string& name) {
+  PoRDB::mmmapinfo info;
+  struct stat stats;
   stat(name.c_str(), &stats);
   info.file_size = stats.st_size;
+
+  if (db_options.map_strategy == MapStrategy::kBufferPool) {
+    // pages are read on demand through the buffer pool
+    info.fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    info.strategy = MapStrategy::kBufferPool;
+    return info;
+  }
+
+  // with multi-GB files, random lookups pay a TLB miss on nearly every level
+  // of 4KB pages. Copying the file into huge pages trades load time for
+  // query latency.
+  auto strategy = db_options.map_strategy;
+  if (strategy == MapStrategy::kHugeTlb || strategy == MapStrategy::kHugePage) {
+    if (copyFileToAnonymous(name, strategy == MapStrategy::kHugeTlb, info) ||
+        copyFileToAnonymous(name, false, info)) {
+      return info;
+    }
+
+    // fall back to file mapping
+    strategy = MapStrategy::kMmapLock;
+  }
+
+  int flags = MAP_PRIVATE;
+  if (strategy == MapStrategy::kPopulate) {
+    flags |= MAP_POPULATE;
+  }
+
   info.fd = open(name.c_str(), O_RDONLY);
-  info.file_map = mmap(0, info.file_size, PROT_READ, MAP_PRIVATE, info.fd, 0);
+  info.file_map = mmap(0, info.file_size, PROT_READ, flags, info.fd, 0);
+  info.map_size = info.file_size;
+  info.strategy = strategy;
   if (info.file_map == (void*)-1) {
     perror("mmap failure");
   }
 
-  // try to lock RAM, there are some other optimization techniques, e.g.
-  // MAP_HUGETLB, etc
+  // try to lock RAM
   mlock2(info.file_map, info.file_size, MLOCK_ONFAULT);
 
   // close file, it will not invalidate memory mapping
@@ -390,18 +2991,225 @@ struct PoRDB::mmmapinfo PoRDB::mmapFile(const std::string& name) {
   return info;
 }
 
+bool PoRDB::copyFileToAnonymous(const std::string& name, bool huge_tlb,
+                                struct PoRDB::mmmapinfo& info) {
+  // round up to 2MB huge page
+  const size_t kHugePageSize = 2 << 20;
+  size_t map_size =
+      (info.file_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  if (map_size == 0) {
+    map_size = kHugePageSize;
+  }
+
+  void* addr = (void*)-1;
+  if (huge_tlb) {
+    addr = mmap(0, map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr == (void*)-1) {
+      return false;
+    }
+  } else {
+    // over-allocate to align the mapping to huge page boundary, so that THP
+    // can back the whole range
+    size_t reserve = map_size + kHugePageSize;
+    void* raw = mmap(0, reserve, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (void*)-1) {
+      return false;
+    }
+
+    uintptr_t beg = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = (beg + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    if (aligned > beg) {
+      munmap(raw, aligned - beg);
+    }
+    if (beg + reserve > aligned + map_size) {
+      munmap(reinterpret_cast<void*>(aligned + map_size),
+             beg + reserve - aligned - map_size);
+    }
+
+    addr = reinterpret_cast<void*>(aligned);
+    madvise(addr, map_size, MADV_HUGEPAGE);
+  }
+
+  // memory policy must be set before the pages are faulted in
+  info.numa_interleaved = false;
+  if (db_options.numa_interleave) {
+    unsigned long node_mask = ~0UL;
+    info.numa_interleaved =
+        syscall(SYS_mbind, addr, map_size, MPOL_INTERLEAVE, &node_mask,
+                sizeof(node_mask) * 8, 0) == 0;
+  }
+
+  // read in the whole file with large sequential reads
+  int fd = open(name.c_str(), O_RDONLY);
+  size_t done = 0;
+  while (fd >= 0 && done < info.file_size) {
+    ssize_t n = pread(fd, reinterpret_cast<char*>(addr) + done,
+                      std::min<size_t>(info.file_size - done, 1 << 24), done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (done != info.file_size) {
+    munmap(addr, map_size);
+    return false;
+  }
+
+  mprotect(addr, map_size, PROT_READ);
+  if (!huge_tlb) {
+    // hugetlbfs pages are never swapped out
+    mlock2(addr, map_size, MLOCK_ONFAULT);
+  }
+
+  info.file_map = addr;
+  info.map_size = map_size;
+  info.strategy = huge_tlb ? MapStrategy::kHugeTlb : MapStrategy::kHugePage;
+  return true;
+}
+
 void PoRDB::unmmapFile(struct PoRDB::mmmapinfo& info) {
   if (info.file_map != (void*)-1) {
-    munmap((char*)info.file_map, info.file_size);
+    munmap((char*)info.file_map, info.map_size);
+    info.file_map = (void*)-1;
+  }
+  if (info.fd >= 0) {
+    close(info.fd);
+    info.fd = -1;
+  }
+}
+
+std::string PoRDB::Metrics() const { return metrics(""); }
+
+std::string PoRDB::metrics(const std::string& label) const {
+  std::string sep = label.empty() ? "" : ",";
+  std::stringstream ss;
+  const std::pair<const char*, const mmmapinfo*> maps[] = {
+      {"index", &index_map},
+      {"merkle", &merkle_map},
+      {"database", &database_map}};
+  for (const auto& [file, info] : maps) {
+    if (!info->loaded()) {
+      continue;
+    }
+
+    ss << "por_map_strategy{" << label << sep << "file=\"" << file
+       << "\",strategy=\"" << mapStrategyName(info->strategy) << "\"} 1\n";
+    ss << "por_map_bytes{" << label << sep << "file=\"" << file << "\"} "
+       << info->map_size << "\n";
+    ss << "por_map_numa_interleaved{" << label << sep << "file=\"" << file
+       << "\"} " << (info->numa_interleaved ? 1 : 0) << "\n";
+    ss << "por_map_shared{" << label << sep << "file=\"" << file << "\"} "
+       << (info->shared ? 1 : 0) << "\n";
+  }
+
+  if (index_map.loaded()) {
+    ss << "por_index_lookup_bytes{" << label << sep << "compressed=\""
+       << (db_options.compressed_index ? 1 : 0) << "\"} " << records_offset
+       << "\n";
+  }
+  if (db_options.id_filter) {
+    ss << "por_filter_bytes{" << label << "} " << filter.Bytes() << "\n";
+    ss << "por_filter_rejects_total{" << label << "} " << filter_rejects
+       << "\n";
+  }
+  if (buffer_pool) {
+    ss << "por_buffer_pool_bytes{" << label << "} " << buffer_pool->Bytes()
+       << "\n";
+    ss << "por_buffer_pool_pinned_bytes{" << label << "} "
+       << buffer_pool->PinnedBytes() << "\n";
+    ss << "por_buffer_pool_hits_total{" << label << "} "
+       << buffer_pool->Hits() << "\n";
+    ss << "por_buffer_pool_misses_total{" << label << "} "
+       << buffer_pool->Misses() << "\n";
+    ss << "por_buffer_pool_evictions_total{" << label << "} "
+       << buffer_pool->Evictions() << "\n";
+  }
+  if (response_cache) {
+    ss << "por_cache_hits_total{" << label << "} " << response_cache->Hits()
+       << "\n";
+    ss << "por_cache_misses_total{" << label << "} "
+       << response_cache->Misses() << "\n";
+    ss << "por_cache_coalesced_total{" << label << "} "
+       << response_cache->Coalesced() << "\n";
+    ss << "por_cache_evictions_total{" << label << "} "
+       << response_cache->Evictions() << "\n";
+    ss << "por_cache_bytes{" << label << "} " << response_cache->Bytes()
+       << "\n";
+  }
+  if (auto ext = appendedUsers()) {
+    ss << "por_appended_users{" << label << "} " << ext->size() << "\n";
   }
+  ss << "por_ready{" << label << "} " << (warm ? 1 : 0) << "\n";
+  ss << "por_warmup_seconds{" << label << "} " << warmup_us / 1e6 << "\n";
+  return ss.str();
+}
+
+const char* PoRDB::mapStrategyName(MapStrategy strategy) {
+  switch (strategy) {
+    case MapStrategy::kMmapLock:
+      return "mmap_lock";
+    case MapStrategy::kPopulate:
+      return "populate";
+    case MapStrategy::kHugePage:
+      return "hugepage";
+    case MapStrategy::kHugeTlb:
+      return "hugetlb";
+    case MapStrategy::kBufferPool:
+      return "buffer_pool";
+  }
+
+  return "unknown";
 }
 
 const std::vector<uint8_t> PoRDB::kIndexMagic = {0x38, 0x08, 0x0d, 0xf4,
                                                  0x4a, 0x0c, 0x38, 0x73};
 
+const std::vector<uint8_t> PoRDB::kCompressedIndexMagic = {
+    0xe7, 0x52, 0x1c, 0x9b, 0x30, 0x6f, 0xa4, 0x0d};
+
+const std::vector<uint8_t> PoRDB::kBinaryIndexMagic = {
+    0x91, 0x3a, 0xc6, 0x58, 0x0e, 0xb7, 0x24, 0x6d};
+
+const std::vector<uint8_t> PoRDB::kCompressedBinaryIndexMagic = {
+    0x2f, 0xd8, 0x65, 0xa1, 0x7c, 0x13, 0xe9, 0x46};
+
+const std::vector<uint8_t> PoRDB::kLearnedIndexMagic = {
+    0x63, 0xb0, 0x4e, 0xf2, 0x19, 0x8d, 0x37, 0xca};
+
+const std::vector<uint8_t> PoRDB::kLearnedBinaryIndexMagic = {
+    0xd4, 0x0b, 0x7a, 0x36, 0xe5, 0x92, 0x5f, 0x18};
+
+const std::vector<uint8_t> PoRDB::kFilterMagic = {0x0c, 0x85, 0xf3, 0x6e,
+                                                  0xb1, 0x2a, 0xd9, 0x47};
+
 const std::vector<uint8_t> PoRDB::kMerkleMagic = {0x68, 0xba, 0x80, 0xa5,
                                                   0x91, 0xd5, 0xf6, 0x43};
 
+const std::vector<uint8_t> PoRDB::kJournalMagic = {0x4e, 0x91, 0x2a, 0xd7,
+                                                   0x06, 0xbf, 0x73, 0xe1};
+
+const std::vector<uint8_t> PoRDB::kAppendMagic = {0xb6, 0x4f, 0x1d, 0x84,
+                                                  0x7a, 0xe0, 0x25, 0xca};
+
+const std::vector<uint8_t> PoRDB::kDatabaseMagic = {0x1a, 0xe5, 0x7c, 0x30,
+                                                    0x94, 0x6b, 0xd2, 0x8f};
+
+const std::vector<uint8_t> PoRDB::kSumMerkleMagic = {0x5d, 0x2e, 0x91, 0x07,
+                                                     0xc4, 0x6b, 0x1f, 0xa8};
+
+const std::vector<uint8_t> PoRDB::kPrunedMerkleMagic = {
+    0xa3, 0x17, 0x6c, 0xe8, 0x52, 0x0f, 0xb9, 0x34};
+
+const std::vector<uint8_t> PoRDB::kPrunedSumMerkleMagic = {
+    0x7e, 0xc2, 0x09, 0x5b, 0xd1, 0x86, 0x3a, 0xf5};
+
 const std::string PoRDB::kLeafHashTagStr = "ProofOfReserve_Leaf";
 const std::vector<uint8_t> PoRDB::kLeafTag(kLeafHashTagStr.cbegin(),
                                            kLeafHashTagStr.cend());
@@ -0,0 +1,560 @@
+#include "por_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+
+namespace crypto {
+namespace {
+constexpr std::string_view kJsonContentType = "application/json; charset=utf-8";
+constexpr std::string_view kTextContentType = "text/plain; charset=utf-8";
+constexpr size_t kReadChunk = 64 * 1024;
+constexpr int kMaxEvents = 256;
+
+uint64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string_view statusText(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 413:
+      return "Payload Too Large";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Internal Server Error";
+  }
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// decodes a query component like net/url: '+' is a space, %XX a byte
+bool queryUnescape(std::string_view s, std::string& out) {
+  out.clear();
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '+') {
+      out.push_back(' ');
+    } else if (s[i] == '%') {
+      if (i + 2 >= s.size()) {
+        return false;
+      }
+      int high = hexValue(s[i + 1]);
+      int low = hexValue(s[i + 2]);
+      if (high < 0 || low < 0) {
+        return false;
+      }
+      out.push_back(static_cast<char>(high << 4 | low));
+      i += 2;
+    } else {
+      out.push_back(s[i]);
+    }
+  }
+  return true;
+}
+
+// first value of key in query, like gin's Context.Query
+std::string_view queryValue(std::string_view query, std::string_view key,
+                            std::string& scratch) {
+  while (!query.empty()) {
+    size_t end = query.find('&');
+    std::string_view pair = query.substr(0, end);
+    query = end == std::string_view::npos ? std::string_view()
+                                          : query.substr(end + 1);
+    size_t eq = pair.find('=');
+    std::string_view name = pair.substr(0, eq);
+    std::string_view value =
+        eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+    if (name.find_first_of("%+") != std::string_view::npos) {
+      if (!queryUnescape(name, scratch) || scratch != key) {
+        continue;
+      }
+    } else if (name != key) {
+      continue;
+    }
+    if (value.find_first_of("%+") == std::string_view::npos) {
+      return value;
+    }
+    if (!queryUnescape(value, scratch)) {
+      return {};
+    }
+    return scratch;
+  }
+  return {};
+}
+
+// strict decimal like strconv.ParseUint(s, 10, 64)
+bool parseId(std::string_view s, uint64_t& id) {
+  if (s.empty()) {
+    return false;
+  }
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), id);
+  return ec == std::errc() && end == s.data() + s.size();
+}
+}  // namespace
+
+PoRServer::PoRServer(Lookup lookup, Ready ready)
+    : lookup_(std::move(lookup)), ready_(std::move(ready)) {}
+
+PoRServer::~PoRServer() { Stop(); }
+
+bool PoRServer::Start(const PoRServerOptions& options) {
+  if (running_) {
+    return false;
+  }
+
+  options_ = options;
+  size_t count = options.reactors;
+  if (count == 0) {
+    count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // the first socket binds the requested (maybe ephemeral) port, the others
+  // join it through SO_REUSEPORT
+  port_ = options.port;
+  for (size_t i = 0; i < count; ++i) {
+    auto r = std::make_unique<reactor>();
+    bool opened = openReactor(*r, options_);
+    reactors_.push_back(std::move(r));
+    if (!opened) {
+      Stop();
+      return false;
+    }
+  }
+
+  running_ = true;
+  for (auto& r : reactors_) {
+    reactor* loop = r.get();
+    r->thread = std::thread([this, loop]() { run(*loop); });
+  }
+  return true;
+}
+
+bool PoRServer::openReactor(reactor& r, const PoRServerOptions& options) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port_);
+  if (inet_pton(AF_INET, options.address.c_str(), &address.sin_addr) != 1) {
+    return false;
+  }
+
+  r.listen_fd =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (r.listen_fd < 0) {
+    return false;
+  }
+  int on = 1;
+  if (setsockopt(r.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) !=
+          0 ||
+      setsockopt(r.listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) !=
+          0) {
+    return false;
+  }
+  if (bind(r.listen_fd, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(r.listen_fd, SOMAXCONN) != 0) {
+    return false;
+  }
+  if (port_ == 0) {
+    socklen_t length = sizeof(address);
+    if (getsockname(r.listen_fd, reinterpret_cast<sockaddr*>(&address),
+                    &length) != 0) {
+      return false;
+    }
+    port_ = ntohs(address.sin_port);
+  }
+
+  r.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  r.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r.epoll_fd < 0 || r.event_fd < 0) {
+    return false;
+  }
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = r.listen_fd;
+  if (epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, r.listen_fd, &event) != 0) {
+    return false;
+  }
+  event.data.fd = r.event_fd;
+  return epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, r.event_fd, &event) == 0;
+}
+
+void PoRServer::Stop() {
+  running_ = false;
+  for (auto& r : reactors_) {
+    if (r->event_fd >= 0) {
+      uint64_t one = 1;
+      ssize_t written = write(r->event_fd, &one, sizeof(one));
+      (void)written;
+    }
+  }
+  for (auto& r : reactors_) {
+    if (r->thread.joinable()) {
+      r->thread.join();
+    }
+    for (auto& [fd, c] : r->connections) {
+      ::close(fd);
+    }
+    r->connections.clear();
+    for (int fd : {r->listen_fd, r->epoll_fd, r->event_fd}) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+  reactors_.clear();
+}
+
+void PoRServer::run(reactor& r) {
+  epoll_event events[kMaxEvents];
+  int timeout = options_.idle_timeout_ms == 0
+                    ? -1
+                    : static_cast<int>(
+                          std::min<uint32_t>(options_.idle_timeout_ms, 1000));
+  uint64_t last_sweep_ms = nowMs();
+  while (running_) {
+    int n = epoll_wait(r.epoll_fd, events, kMaxEvents, timeout);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == r.event_fd) {
+        continue;
+      }
+      if (fd == r.listen_fd) {
+        acceptConnections(r);
+        continue;
+      }
+
+      auto it = r.connections.find(fd);
+      if (it == r.connections.end()) {
+        continue;
+      }
+      connection& c = *it->second;
+      bool alive = true;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        alive = false;
+      } else if (c.writing) {
+        alive = (events[i].events & EPOLLOUT) ? flush(r, c) : true;
+      } else if (events[i].events & EPOLLIN) {
+        alive = onReadable(r, c);
+      }
+      if (!alive) {
+        closeConnection(r, fd);
+      }
+    }
+
+    if (options_.idle_timeout_ms == 0) {
+      continue;
+    }
+    uint64_t now = nowMs();
+    if (now - last_sweep_ms < 1000) {
+      continue;
+    }
+    last_sweep_ms = now;
+    std::vector<int> idle;
+    for (auto& [fd, c] : r.connections) {
+      if (!c->writing && now - c->last_active_ms >= options_.idle_timeout_ms) {
+        idle.push_back(fd);
+      }
+    }
+    for (int fd : idle) {
+      closeConnection(r, fd);
+    }
+  }
+}
+
+void PoRServer::acceptConnections(reactor& r) {
+  while (true) {
+    int fd = accept4(r.listen_fd, nullptr, nullptr,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      // EAGAIN: backlog drained, otherwise (EMFILE...) retry on next event
+      return;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      ::close(fd);
+      continue;
+    }
+
+    auto c = std::make_unique<connection>();
+    c->fd = fd;
+    c->last_active_ms = nowMs();
+    r.connections[fd] = std::move(c);
+    ++connections_;
+  }
+}
+
+void PoRServer::closeConnection(reactor& r, int fd) {
+  epoll_ctl(r.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  ::close(fd);
+  r.connections.erase(fd);
+}
+
+bool PoRServer::onReadable(reactor& r, connection& c) {
+  // read into the reactor's buffer so idle connections hold no read buffer
+  r.read_buffer.resize(kReadChunk);
+  ssize_t n = read(c.fd, r.read_buffer.data(), r.read_buffer.size());
+  if (n <= 0) {
+    // peer closed, or spurious wake up
+    return n < 0 && (errno == EAGAIN || errno == EINTR);
+  }
+  c.last_active_ms = nowMs();
+
+  // serve pipelined requests in order, straight from the read buffer unless
+  // part of a request is waiting
+  std::string_view pending(r.read_buffer.data(), n);
+  const bool buffered = !c.in.empty();
+  if (buffered) {
+    c.in.append(pending);
+    pending = c.in;
+  }
+  while (!c.close_after && !pending.empty()) {
+    size_t consumed = serve(c, pending);
+    if (consumed == 0) {
+      break;
+    }
+    pending.remove_prefix(consumed);
+  }
+  if (buffered) {
+    c.in.erase(0, c.in.size() - pending.size());
+  } else {
+    c.in.assign(pending);
+  }
+  if (c.in.empty()) {
+    // a large request may have grown it
+    c.in.shrink_to_fit();
+  }
+  return flush(r, c);
+}
+
+bool PoRServer::flush(reactor& r, connection& c) {
+  while (c.out_offset < c.out.size()) {
+    ssize_t n = send(c.fd, c.out.data() + c.out_offset,
+                     c.out.size() - c.out_offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        return false;
+      }
+
+      // socket buffer full: wait for EPOLLOUT and stop reading meanwhile
+      if (!c.writing) {
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.fd = c.fd;
+        epoll_ctl(r.epoll_fd, EPOLL_CTL_MOD, c.fd, &event);
+        c.writing = true;
+      }
+      return true;
+    }
+    c.out_offset += n;
+  }
+
+  c.out.clear();
+  c.out_offset = 0;
+  c.last_active_ms = nowMs();
+  if (c.close_after) {
+    return false;
+  }
+  if (c.writing) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = c.fd;
+    epoll_ctl(r.epoll_fd, EPOLL_CTL_MOD, c.fd, &event);
+    c.writing = false;
+  }
+  return true;
+}
+
+size_t PoRServer::serve(connection& c, std::string_view input) {
+  size_t header_end = input.find("\r\n\r\n");
+  if (header_end == std::string_view::npos) {
+    if (input.size() > options_.max_header_bytes) {
+      respond(c, 431, kTextContentType, "", false);
+      return input.size();
+    }
+    return 0;
+  }
+  if (header_end > options_.max_header_bytes) {
+    respond(c, 431, kTextContentType, "", false);
+    return input.size();
+  }
+
+  // request line: METHOD SP TARGET SP VERSION
+  std::string_view head = input.substr(0, header_end + 2);
+  size_t line_end = head.find("\r\n");
+  std::string_view line = head.substr(0, line_end);
+  head.remove_prefix(line_end + 2);
+  size_t first_space = line.find(' ');
+  size_t last_space = line.rfind(' ');
+  if (first_space == std::string_view::npos || first_space == last_space) {
+    respond(c, 400, kTextContentType, "", false);
+    return input.size();
+  }
+  std::string_view method = line.substr(0, first_space);
+  std::string_view target =
+      line.substr(first_space + 1, last_space - first_space - 1);
+  std::string_view version = line.substr(last_space + 1);
+  if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+    respond(c, 400, kTextContentType, "", false);
+    return input.size();
+  }
+
+  bool keep_alive = version == "HTTP/1.1";
+  size_t content_length = 0;
+  while (!head.empty()) {
+    line_end = head.find("\r\n");
+    line = head.substr(0, line_end);
+    head.remove_prefix(line_end + 2);
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      continue;
+    }
+    std::string_view name = line.substr(0, colon);
+    std::string_view value = trim(line.substr(colon + 1));
+    if (equalsIgnoreCase(name, "connection")) {
+      if (equalsIgnoreCase(value, "close")) {
+        keep_alive = false;
+      } else if (equalsIgnoreCase(value, "keep-alive")) {
+        keep_alive = true;
+      }
+    } else if (equalsIgnoreCase(name, "content-length")) {
+      auto [end, ec] = std::from_chars(
+          value.data(), value.data() + value.size(), content_length);
+      if (ec != std::errc() || end != value.data() + value.size()) {
+        respond(c, 400, kTextContentType, "", false);
+        return input.size();
+      }
+    } else if (equalsIgnoreCase(name, "transfer-encoding")) {
+      // request bodies are not expected, chunked ones aren't supported
+      respond(c, 400, kTextContentType, "", false);
+      return input.size();
+    }
+  }
+
+  // a body is ignored but has to be skipped
+  if (content_length > options_.max_header_bytes) {
+    respond(c, 413, kTextContentType, "", false);
+    return input.size();
+  }
+  size_t consumed = header_end + 4 + content_length;
+  if (input.size() < consumed) {
+    return 0;
+  }
+
+  ++requests_;
+  size_t query_start = target.find('?');
+  std::string_view path = target.substr(0, query_start);
+  std::string_view query = query_start == std::string_view::npos
+                               ? std::string_view()
+                               : target.substr(query_start + 1);
+  if (method == "GET" && path == "/por") {
+    // reactor thread rendering buffers keep their capacity between requests
+    thread_local std::string scratch;
+    thread_local std::string json;
+    uint64_t id = 0;
+    if (!parseId(queryValue(query, "id", scratch), id)) {
+      respond(c, 400, kJsonContentType, R"({"error_message":"Invalid ID"})",
+              keep_alive);
+    } else if (!lookup_(id, json)) {
+      respond(c, 404, kJsonContentType, R"({"error_message":"Not Found"})",
+              keep_alive);
+    } else {
+      respond(c, 200, kJsonContentType, json, keep_alive);
+    }
+  } else if (method == "GET" && path == "/ready") {
+    if (ready_()) {
+      respond(c, 200, kJsonContentType, R"({"ready":true})", keep_alive);
+    } else {
+      respond(c, 503, kJsonContentType, R"({"ready":false})", keep_alive);
+    }
+  } else {
+    respond(c, 404, kTextContentType, "404 page not found", keep_alive);
+  }
+  return consumed;
+}
+
+void PoRServer::respond(connection& c, int status,
+                        std::string_view content_type, std::string_view body,
+                        bool keep_alive) {
+  char number[20];
+  c.out.append("HTTP/1.1 ");
+  c.out.append(number, std::to_chars(number, number + 20, status).ptr);
+  c.out.push_back(' ');
+  c.out.append(statusText(status));
+  c.out.append("\r\nContent-Type: ");
+  c.out.append(content_type);
+  c.out.append("\r\nContent-Length: ");
+  c.out.append(number, std::to_chars(number, number + 20, body.size()).ptr);
+  if (!keep_alive) {
+    c.out.append("\r\nConnection: close");
+    c.close_after = true;
+  }
+  c.out.append("\r\n\r\n");
+  c.out.append(body);
+}
+}  // namespace crypto
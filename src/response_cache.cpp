@@ -0,0 +1,168 @@
+#include "response_cache.h"
+
+namespace crypto {
+ResponseCache::ResponseCache(size_t byte_budget, size_t shard_count) {
+  if (shard_count == 0) {
+    shard_count = 1;
+  }
+  shard_budget_ = byte_budget / shard_count;
+  for (size_t i = 0; i < shard_count; ++i) {
+    shards_.push_back(std::make_unique<shard>());
+  }
+}
+
+size_t ResponseCache::entrySize(const std::string& info,
+                                const std::string& proof) {
+  // strings plus entry and hash map node
+  return info.size() + proof.size() + sizeof(entry) + 32;
+}
+
+std::string ResponseCache::Get(
+    uint64_t snapshot, uint64_t id, std::string& proof,
+    const std::function<std::string(std::string&)>& load, uint32_t format) {
+  // sequential ids spread over shards
+  shard& s = *shards_[(id * 0x9e3779b97f4a7c15ULL >> 32) % shards_.size()];
+  const key k{id, format};
+  std::unique_lock<std::mutex> lock(s.mutex);
+  auto it = s.slots.find(k);
+  if (it != s.slots.end() && s.entries[it->second].snapshot == snapshot) {
+    entry& e = s.entries[it->second];
+    e.referenced = true;
+    proof = e.proof;
+    ++hits_;
+    return e.info;
+  }
+
+  ++misses_;
+  auto flying = s.flights.find(k);
+  if (flying != s.flights.end() && flying->second->snapshot == snapshot) {
+    // wait for the caller that is rendering the same response
+    std::shared_ptr<flight> f = flying->second;
+    lock.unlock();
+    std::unique_lock<std::mutex> flight_lock(f->mutex);
+    f->done_cv.wait(flight_lock, [&f]() { return f->done; });
+    ++coalesced_;
+    proof = f->proof;
+    return f->info;
+  }
+
+  // a rendering of another snapshot can't be shared, a newer one takes its
+  // place for the callers that come after it
+  auto f = std::make_shared<flight>();
+  f->snapshot = snapshot;
+  if (flying == s.flights.end()) {
+    s.flights.emplace(k, f);
+  } else if (flying->second->snapshot < snapshot) {
+    flying->second = f;
+  }
+  lock.unlock();
+
+  std::string info = load(proof);
+
+  lock.lock();
+  if (!info.empty()) {
+    insert(s, snapshot, k, info, proof);
+  }
+  flying = s.flights.find(k);
+  if (flying != s.flights.end() && flying->second == f) {
+    s.flights.erase(flying);
+  }
+  lock.unlock();
+
+  {
+    std::lock_guard<std::mutex> flight_lock(f->mutex);
+    f->info = info;
+    f->proof = proof;
+    f->done = true;
+  }
+  f->done_cv.notify_all();
+  return info;
+}
+
+void ResponseCache::insert(shard& s, uint64_t snapshot, const key& id,
+                           const std::string& info, const std::string& proof) {
+  size_t size = entrySize(info, proof);
+  if (size > shard_budget_) {
+    return;
+  }
+
+  // an entry of an older snapshot is replaced, a late rendering of an older
+  // snapshot never replaces a newer entry
+  auto it = s.slots.find(id);
+  if (it != s.slots.end()) {
+    entry& e = s.entries[it->second];
+    if (e.snapshot > snapshot) {
+      return;
+    }
+    s.bytes -= entrySize(e.info, e.proof);
+    e = entry{snapshot, id, info, proof, false};
+    s.bytes += size;
+  } else {
+    while (s.bytes + size > shard_budget_ && !s.slots.empty()) {
+      evict(s);
+    }
+
+    size_t slot;
+    if (!s.free_slots.empty()) {
+      slot = s.free_slots.back();
+      s.free_slots.pop_back();
+      s.entries[slot] = entry{snapshot, id, info, proof, false};
+    } else {
+      slot = s.entries.size();
+      s.entries.push_back(entry{snapshot, id, info, proof, false});
+    }
+    s.slots.emplace(id, slot);
+    s.bytes += size;
+  }
+
+  while (s.bytes > shard_budget_ && !s.slots.empty()) {
+    evict(s);
+  }
+}
+
+// CLOCK: sweep the slots, give referenced entries a second chance and evict
+// the first unreferenced one
+void ResponseCache::evict(shard& s) {
+  while (true) {
+    if (s.hand >= s.entries.size()) {
+      s.hand = 0;
+    }
+
+    entry& e = s.entries[s.hand];
+    auto it = s.slots.find(e.id);
+    bool live = it != s.slots.end() && it->second == s.hand;
+    if (live && e.referenced) {
+      e.referenced = false;
+    } else if (live) {
+      s.bytes -= entrySize(e.info, e.proof);
+      s.slots.erase(it);
+      e = entry{0, key{0, 0}, std::string(), std::string(), false};
+      s.free_slots.push_back(s.hand);
+      ++evictions_;
+      ++s.hand;
+      return;
+    }
+    ++s.hand;
+  }
+}
+
+void ResponseCache::Clear() {
+  for (auto& s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->slots.clear();
+    s->entries.clear();
+    s->free_slots.clear();
+    s->hand = 0;
+    s->bytes = 0;
+  }
+}
+
+size_t ResponseCache::Bytes() const {
+  size_t bytes = 0;
+  for (const auto& s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    bytes += s->bytes;
+  }
+  return bytes;
+}
+}  // namespace crypto
@@ -2,35 +2,25 @@
 
 #include <algorithm>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POR_SHA_X86 1
+#endif
+
 #include "bit_operation.h"
 
 namespace crypto::sha256 {
 std::vector<uint8_t> BlockHasher::Hash(const std::vector<uint8_t>& data) {
   auto hv = h;
-  auto cursor = data.cbegin();
 
   // calculate hash value by processing each 512 bit data chunk
-  std::array<uint8_t, 64> one_chunk = {0};
-  while ((data.cend() - cursor) >= 64) {
-    std::copy(cursor, cursor + 64, one_chunk.begin());
-    auto w = GenerateMessageSchedule(one_chunk);
-    UpdateHash(hv, k, w);
-
-    cursor += 64;
-  }
+  size_t chunks = data.size() / 64;
+  Compress(hv, data.data(), chunks);
 
   // process the last chunk of data
-  std::vector<uint8_t> last_chunk;
-  std::copy(cursor, data.cend(), std::back_inserter(last_chunk));
+  std::vector<uint8_t> last_chunk(data.cbegin() + chunks * 64, data.cend());
   PreProcess(last_chunk, 8 * data.size());
-  cursor = last_chunk.cbegin();
-  while ((last_chunk.cend() - cursor) >= 64) {
-    std::copy(cursor, cursor + 64, one_chunk.begin());
-    auto w = GenerateMessageSchedule(one_chunk);
-    UpdateHash(hv, k, w);
-
-    cursor += 64;
-  }
+  Compress(hv, last_chunk.data(), last_chunk.size() / 64);
 
   return HashInByte(hv);
 }
@@ -39,38 +29,41 @@ StreamHasher::StreamHasher() : h_(h), total_bytes_(0) {}
 
 // return the total bytes accumulated in the stream
 size_t StreamHasher::Append(const std::vector<uint8_t>& data_chunk) {
-  auto it = data_chunk.cbegin();
-  while (it != data_chunk.cend()) {
-    size_t offset = total_bytes_ % 64;
-    size_t copy_byte =
-        std::min(static_cast<size_t>(data_chunk.cend() - it), 64 - offset);
+  return Append(data_chunk.data(), data_chunk.size());
+}
+
+size_t StreamHasher::Append(const uint8_t* data, size_t size) {
+  const uint8_t* it = data;
+  const uint8_t* end = data + size;
+
+  // complete the cached chunk first
+  size_t offset = total_bytes_ % 64;
+  if (offset > 0) {
+    size_t copy_byte = std::min(static_cast<size_t>(end - it), 64 - offset);
     std::copy(it, it + copy_byte, chunk_cache_.begin() + offset);
     if ((offset + copy_byte) == 64) {
-      auto w = GenerateMessageSchedule(chunk_cache_);
-      UpdateHash(h_, k, w);
+      Compress(h_, chunk_cache_.data(), 1);
     }
 
     total_bytes_ += copy_byte;
     it += copy_byte;
   }
 
+  // whole chunks are hashed in place, the rest is cached
+  size_t chunks = (end - it) / 64;
+  Compress(h_, it, chunks);
+  std::copy(it + chunks * 64, end, chunk_cache_.begin());
+  total_bytes_ += end - it;
+
   return total_bytes_;
 }
 
 std::vector<uint8_t> StreamHasher::Hash() {
   // process the last chunk of data
-  std::vector<uint8_t> last_chunk;
-  std::copy(chunk_cache_.cbegin(), chunk_cache_.cbegin() + (total_bytes_ % 64),
-            std::back_inserter(last_chunk));
+  std::vector<uint8_t> last_chunk(chunk_cache_.cbegin(),
+                                  chunk_cache_.cbegin() + (total_bytes_ % 64));
   PreProcess(last_chunk, 8 * total_bytes_);
-  auto it = last_chunk.cbegin();
-  while ((last_chunk.cend() - it) >= 64) {
-    std::copy(it, it + 64, chunk_cache_.begin());
-    auto w = GenerateMessageSchedule(chunk_cache_);
-    UpdateHash(h_, k, w);
-
-    it += 64;
-  }
+  Compress(h_, last_chunk.data(), last_chunk.size() / 64);
 
   return HashInByte(h_);
 }
@@ -80,6 +73,102 @@ void StreamHasher::Reset() {
   total_bytes_ = 0;
 }
 
+std::array<uint8_t, StreamHasher::kStateSize> StreamHasher::State() const {
+  std::array<uint8_t, kStateSize> state;
+  auto it = std::copy(reinterpret_cast<const uint8_t*>(h_.data()),
+                      reinterpret_cast<const uint8_t*>(h_.data()) + 32,
+                      state.begin());
+  it = std::copy(chunk_cache_.cbegin(), chunk_cache_.cend(), it);
+  std::copy(reinterpret_cast<const uint8_t*>(&total_bytes_),
+            reinterpret_cast<const uint8_t*>(&total_bytes_) + 8, it);
+  return state;
+}
+
+void StreamHasher::Restore(const std::array<uint8_t, kStateSize>& state) {
+  std::copy(state.cbegin(), state.cbegin() + 32,
+            reinterpret_cast<uint8_t*>(h_.data()));
+  std::copy(state.cbegin() + 32, state.cbegin() + 96, chunk_cache_.begin());
+  std::copy(state.cbegin() + 96, state.cend(),
+            reinterpret_cast<uint8_t*>(&total_bytes_));
+}
+
+namespace {
+void compressScalar(std::array<uint32_t, 8>& hv, const uint8_t* data,
+                    size_t count) {
+  std::array<uint8_t, 64> chunk;
+  for (size_t i = 0; i < count; ++i) {
+    std::copy(data + 64 * i, data + 64 * (i + 1), chunk.begin());
+    UpdateHash(hv, k, GenerateMessageSchedule(chunk));
+  }
+}
+
+#ifdef POR_SHA_X86
+// Two rounds per sha256rnds2 on the state split into ABEF and CDGH halves,
+// the message schedule is extended 4 words at a time with sha256msg1/2.
+__attribute__((target("sha,sse4.1"))) void compressShaNi(
+    std::array<uint32_t, 8>& hv, const uint8_t* data, size_t count) {
+  // big endian words of each chunk
+  const __m128i swap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&hv[0]));
+  __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&hv[4]));
+  __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+  __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+  __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+  for (size_t i = 0; i < count; ++i, data += 64) {
+    const __m128i abef_save = abef;
+    const __m128i cdgh_save = cdgh;
+    // words 4g..4g+3 of the schedule, group g at g % 4
+    __m128i w[4];
+    for (int g = 0; g < 16; ++g) {
+      if (g < 4) {
+        w[g] = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * g)),
+            swap);
+      } else {
+        __m128i x = _mm_sha256msg1_epu32(w[g % 4], w[(g + 1) % 4]);
+        x = _mm_add_epi32(x, _mm_alignr_epi8(w[(g + 3) % 4], w[(g + 2) % 4], 4));
+        w[g % 4] = _mm_sha256msg2_epu32(x, w[(g + 3) % 4]);
+      }
+      __m128i wk = _mm_add_epi32(
+          w[g % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&k[4 * g])));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+    }
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+  __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&hv[0]),
+                   _mm_blend_epi16(feba, dchg, 0xf0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&hv[4]),
+                   _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+using compressor = void (*)(std::array<uint32_t, 8>&, const uint8_t*, size_t);
+
+compressor selectCompressor() {
+#ifdef POR_SHA_X86
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    return compressShaNi;
+  }
+#endif
+  return compressScalar;
+}
+}  // namespace
+
+void Compress(std::array<uint32_t, 8>& hv, const uint8_t* data, size_t count) {
+  static const compressor compress = selectCompressor();
+  if (count > 0) {
+    compress(hv, data, count);
+  }
+}
+
 // Preprocess the last chunk of data by padding, such that the size of the
 // resulting data is a multiple of 512 bit. suppose the original data is L-bit
 // sized.
@@ -0,0 +1,417 @@
+#include "sharded_por_db.h"
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+#include "line_reader.h"
+#include "merkle_proof.h"
+#include "sha256.h"
+#include "tagged_hash.h"
+
+namespace crypto {
+ShardedPoRDB& ShardedPoRDB::Instance() {
+  static ShardedPoRDB db;
+  return db;
+}
+
+// Sharded layout of user data file "users.txt":
+//   users.txt.shards          manifest, first user id of every shard
+//   users.txt.shard<i>        user data of shard i, same format as users.txt
+//   users.txt.shard<i>.index  index file of shard i
+//   users.txt.shard<i>.merkle merkle file of shard i
+//
+// manifest file format:
+//   sha256    magic    shard No# requested  shard No#   first id of shard
+// | 256 bit | 64 bit |      64 bit        |  64 bit   | 64 bit | .. |
+//
+// ASSUMPTION: users in the user data file are sorted by id, so each shard
+// covers a contiguous id range.
+bool ShardedPoRDB::Load(const std::string& user_data, size_t shard_count,
+                        const PoROptions& options) {
+  if (!PoRDB::regularFileExists(user_data) || shard_count == 0) {
+    return false;
+  }
+
+  user_data_file = user_data;
+  db_options = options;
+
+  // re-split user data file if manifest is missing, invalid or created for a
+  // different number of shards
+  std::string manifest = user_data + ".shards";
+  std::vector<uint64_t> first_ids;
+  bool valid = PoRDB::regularFileExists(manifest) &&
+               PoRDB::verifyFileFingerPrint(manifest, kManifestMagic);
+  if (valid) {
+    std::ifstream f(manifest, std::ios::in | std::ios::binary);
+    uint64_t requested = 0;
+    f.seekg(40);
+    f.read(reinterpret_cast<char*>(&requested), sizeof requested);
+    valid = requested == shard_count && readManifest(manifest, first_ids);
+  }
+
+  for (size_t i = 0; valid && i < first_ids.size(); ++i) {
+    valid = PoRDB::regularFileExists(shardFile(i));
+  }
+
+  if (!valid) {
+    if (!splitUserFile(user_data, shard_count, first_ids)) {
+      return false;
+    }
+
+    if (!writeManifest(manifest, shard_count, first_ids)) {
+      return false;
+    }
+  }
+
+  // complete responses are cached here, not in the shards
+  ++snapshot;
+  response_cache.reset();
+  if (db_options.response_cache_bytes > 0) {
+    response_cache = std::make_unique<ResponseCache>(
+        db_options.response_cache_bytes, db_options.response_cache_shards);
+  }
+
+  // shards are independent from each other, build/load them in parallel
+  shards.clear();
+  for (size_t i = 0; i < first_ids.size(); ++i) {
+    shards.push_back(std::unique_ptr<PoRDB>(new PoRDB()));
+  }
+
+  std::vector<char> results(shards.size(), 0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    threads.push_back(std::thread([this, i, &results]() {
+      results[i] = shards[i]->Load(shardFile(i), shardOptions());
+    }));
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  if (std::find(results.cbegin(), results.cend(), 0) != results.cend()) {
+    shards.clear();
+    return false;
+  }
+
+  shard_first_ids = first_ids;
+  buildTopTree();
+  return true;
+}
+
+std::string ShardedPoRDB::UserInfo(uint64_t id, std::string& proof) const {
+  if (response_cache) {
+    return response_cache->Get(
+        snapshot, id, proof,
+        [this, id](std::string& proof) { return userInfo(id, proof); },
+        ResponseCache::kText);
+  }
+
+  return userInfo(id, proof);
+}
+
+bool ShardedPoRDB::UserInfoJson(uint64_t id, std::string& json) const {
+  if (response_cache) {
+    std::string unused;
+    json = response_cache->Get(
+        snapshot, id, unused,
+        [this, id](std::string&) {
+          std::string json;
+          userInfoJson(id, json);
+          return json;
+        },
+        ResponseCache::kJson);
+    return !json.empty();
+  }
+
+  return userInfoJson(id, json);
+}
+
+std::string ShardedPoRDB::userInfo(uint64_t id, std::string& proof) const {
+  MerkleProof generator;
+  std::string user_info = findUser(id, generator);
+  if (user_info.empty()) {
+    return "";
+  }
+
+  const auto& root = top_levels.back()[0];
+  if (db_options.sum_tree) {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, root.first, root.second);
+  } else {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, root.first);
+  }
+
+  return user_info;
+}
+
+bool ShardedPoRDB::userInfoJson(uint64_t id, std::string& json) const {
+  MerkleProof generator;
+  std::string user_info = findUser(id, generator);
+  if (user_info.empty()) {
+    json.clear();
+    return false;
+  }
+
+  const auto& root = top_levels.back()[0];
+  return PoRDB::renderJson(user_info, generator, root.first, root.second,
+                           db_options.sum_tree, json);
+}
+
+std::string ShardedPoRDB::findUser(uint64_t id,
+                                   MerkleProof& generator) const {
+  // route the lookup to the shard whose id range covers the user
+  auto it =
+      std::upper_bound(shard_first_ids.cbegin(), shard_first_ids.cend(), id);
+  if (it == shard_first_ids.cbegin()) {
+    return "";
+  }
+
+  size_t shard = it - shard_first_ids.cbegin() - 1;
+  uint64_t order = 0;
+  std::string user_info = shards[shard]->findUser(id, order);
+  if (user_info.empty()) {
+    return "";
+  }
+
+  // path from leaf to shard root
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  shards[shard]->generateProof(order, path, sums, root_sum);
+
+  // followed by path from shard root to top root, odd levels of top tree are
+  // already padded, so the sibling always exists
+  size_t index = shard;
+  for (size_t level = 0; level + 1 < top_levels.size(); ++level) {
+    const auto& sibling = top_levels[level][index ^ 0x01];
+    path.push_back(std::make_pair((index & 0x01) == 0x01, sibling.first));
+    sums.push_back(sibling.second);
+    index >>= 1;
+  }
+
+  for (size_t i = 0; i < path.size(); ++i) {
+    generator.AddSibling(path[i].second, path[i].first, sums[i]);
+  }
+
+  return user_info;
+}
+
+uint64_t ShardedPoRDB::TotalLiabilities() const {
+  if (!db_options.sum_tree || top_levels.empty()) {
+    return 0;
+  }
+
+  return top_levels.back()[0].second;
+}
+
+std::string ShardedPoRDB::Metrics() const {
+  std::string metrics = "por_shards " + std::to_string(shards.size()) + "\n";
+  for (size_t i = 0; i < shards.size(); ++i) {
+    metrics += shards[i]->metrics("shard=\"" + std::to_string(i) + "\"");
+  }
+
+  return metrics;
+}
+
+bool ShardedPoRDB::Ready() const {
+  return std::all_of(shards.cbegin(), shards.cend(),
+                     [](const auto& shard) { return shard->Ready(); });
+}
+
+bool ShardedPoRDB::RebuildShard(size_t shard) {
+  if (shard >= shards.size()) {
+    return false;
+  }
+
+  // the loaded shard keeps its mapping of the removed files, and serves on
+  // if the rebuild fails
+  for (const char* suffix : {".index", ".merkle", ".filter", ".por"}) {
+    std::filesystem::remove(shardFile(shard) + suffix);
+  }
+  std::unique_ptr<PoRDB> rebuilt(new PoRDB());
+  if (!rebuilt->Load(shardFile(shard), shardOptions())) {
+    return false;
+  }
+
+  // lookups are routed by the first ids of the manifest, the users must
+  // stay within the id range of the shard. Ids are sorted, see Load.
+  const uint64_t count = rebuilt->userCount();
+  if (count == 0 || rebuilt->idAt(0) < shard_first_ids[shard] ||
+      (shard + 1 < shard_first_ids.size() &&
+       rebuilt->idAt(count - 1) >= shard_first_ids[shard + 1])) {
+    return false;
+  }
+
+  shards[shard] = std::move(rebuilt);
+  buildTopTree();
+  ++snapshot;
+  if (response_cache) {
+    response_cache->Clear();
+  }
+  return true;
+}
+
+PoROptions ShardedPoRDB::shardOptions() const {
+  PoROptions options = db_options;
+  options.response_cache_bytes = 0;
+  // shards share the memory cap
+  options.buffer_pool_bytes /= std::max<size_t>(1, shards.size());
+  return options;
+}
+
+bool ShardedPoRDB::splitUserFile(const std::string& user_data,
+                                 size_t shard_count,
+                                 std::vector<uint64_t>& first_ids) {
+  // plain or compressed, the shard files are always plain text
+  LineReader user_file;
+  if (!user_file.Open(user_data)) {
+    return false;
+  }
+  uint64_t count = 0;
+  std::string_view line;
+  if (user_file.Next(line)) {
+    size_t blanks = line.find_first_not_of(" \t");
+    if (blanks != std::string_view::npos) {
+      std::from_chars(line.data() + blanks, line.data() + line.size(), count);
+    }
+  }
+
+  // every shard holds at least one user
+  shard_count = std::min<uint64_t>(shard_count, count);
+  first_ids.clear();
+  for (size_t shard = 0; shard < shard_count; ++shard) {
+    uint64_t beg = count * shard / shard_count;
+    uint64_t end = count * (shard + 1) / shard_count;
+    std::ofstream shard_file(shardFile(shard),
+                             std::ios::out | std::ios::trunc);
+    shard_file << (end - beg) << "\n";
+    for (uint64_t i = beg; i < end; ++i) {
+      if (!user_file.Next(line)) {
+        return false;
+      }
+
+      if (i == beg) {
+        char unused;
+        uint64_t id;
+        std::stringstream ss{std::string(line)};
+        ss >> unused >> id;
+        first_ids.push_back(id);
+      }
+      shard_file << line << "\n";
+    }
+
+    // user data of this shard changed, drop its stale index and merkle
+    std::filesystem::remove(shardFile(shard) + ".index");
+    std::filesystem::remove(shardFile(shard) + ".merkle");
+  }
+
+  return true;
+}
+
+bool ShardedPoRDB::writeManifest(const std::string& manifest,
+                                 size_t shard_count,
+                                 const std::vector<uint64_t>& first_ids) {
+  std::ofstream f(manifest, std::ios::out | std::ios::binary | std::ios::trunc);
+
+  // magic, requested shard count, actual shard count and first id of each
+  // shard all go after the 32 byte sha256
+  std::vector<uint8_t> data(kManifestMagic);
+  uint64_t requested = shard_count;
+  uint64_t count = first_ids.size();
+  auto append = [&data](uint64_t v) {
+    data.insert(data.end(), reinterpret_cast<uint8_t*>(&v),
+                reinterpret_cast<uint8_t*>(&v) + 8);
+  };
+  append(requested);
+  append(count);
+  for (auto id : first_ids) {
+    append(id);
+  }
+
+  sha256::StreamHasher hasher;
+  hasher.Append(data);
+  auto hv = hasher.Hash();
+  f.write(reinterpret_cast<char*>(hv.data()), hv.size());
+  f.write(reinterpret_cast<char*>(data.data()), data.size());
+  return f.good();
+}
+
+bool ShardedPoRDB::readManifest(const std::string& manifest,
+                                std::vector<uint64_t>& first_ids) {
+  std::ifstream f(manifest, std::ios::in | std::ios::binary);
+
+  // jump through 32 byte hash, 8 byte magic number and requested shard count
+  f.seekg(48);
+  uint64_t count = 0;
+  f.read(reinterpret_cast<char*>(&count), sizeof count);
+  first_ids.resize(count);
+  f.read(reinterpret_cast<char*>(first_ids.data()), count * 8);
+  return static_cast<uint64_t>(f.gcount()) == count * 8;
+}
+
+std::string ShardedPoRDB::shardFile(size_t shard) const {
+  return user_data_file + ".shard" + std::to_string(shard);
+}
+
+void ShardedPoRDB::buildTopTree() {
+  top_levels.clear();
+  if (shards.empty()) {
+    return;
+  }
+
+  // shard roots are the bottom level of top tree
+  std::vector<std::pair<std::vector<uint8_t>, uint64_t>> level;
+  for (const auto& shard : shards) {
+    std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+    std::vector<uint64_t> sums;
+    uint64_t root_sum = 0;
+    auto root = shard->generateProof(0, path, sums, root_sum);
+    level.push_back(std::make_pair(root, root_sum));
+  }
+
+  // same rules as the merkle tree in each shard: odd level is padded by
+  // duplicating the last node, or by a zero node in sum tree mode
+  TaggedHasher hasher(PoRDB::kBranchTag);
+  while (level.size() > 1) {
+    if ((level.size() & 0x01) == 0x01) {
+      if (db_options.sum_tree) {
+        level.push_back(std::make_pair(std::vector<uint8_t>(32, 0), 0));
+      } else {
+        level.push_back(level.back());
+      }
+    }
+    top_levels.push_back(level);
+
+    std::vector<std::pair<std::vector<uint8_t>, uint64_t>> parent;
+    for (size_t i = 0; i < level.size(); i += 2) {
+      hasher.Reset();
+      hasher.Append(level[i].first);
+      if (db_options.sum_tree) {
+        hasher.Append(std::vector<uint8_t>(
+            reinterpret_cast<uint8_t*>(&level[i].second),
+            reinterpret_cast<uint8_t*>(&level[i].second) + 8));
+      }
+      hasher.Append(level[i + 1].first);
+      if (db_options.sum_tree) {
+        hasher.Append(std::vector<uint8_t>(
+            reinterpret_cast<uint8_t*>(&level[i + 1].second),
+            reinterpret_cast<uint8_t*>(&level[i + 1].second) + 8));
+      }
+      parent.push_back(
+          std::make_pair(hasher.Hash(), level[i].second + level[i + 1].second));
+    }
+
+    level.swap(parent);
+  }
+
+  top_levels.push_back(level);
+}
+
+const std::vector<uint8_t> ShardedPoRDB::kManifestMagic = {
+    0xa3, 0x17, 0x6e, 0x52, 0x0b, 0xd9, 0x84, 0x3c};
+}  // namespace crypto
@@ -0,0 +1,517 @@
+#include "snapshot_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "merkle_proof.h"
+#include "sha256.h"
+#include "tagged_hash.h"
+
+namespace crypto {
+// Store at "snapshots.db":
+//   snapshots.db        node file, append-only
+//   snapshots.db.roots  snapshot table, replaced atomically on every publish
+//
+// node file format:
+//    magic    node size   entries
+// | 64 bit |   64 bit  | nodeheader + branchlinks or record | .. |
+//
+// snapshot table format:
+//   sha256    magic   snapshot No#  node file size  node No#
+// | 256 bit | 64 bit |   64 bit   |    64 bit     |  64 bit  |
+// then per snapshot:
+//    root     user No#  name size   name padded to 8 bytes
+// | 64 bit |  64 bit  |  64 bit  | .. |
+//
+// Entries past the node file size of the table belong to no snapshot, they
+// are cut off on Open.
+namespace {
+const uint64_t kNodeFileHeader = 16;
+// pending entries are written out in chunks of this size
+const size_t kFlushBytes = 4 << 20;
+
+uint64_t hashPrefix(const uint8_t* hash) {
+  uint64_t prefix = 0;
+  std::memcpy(&prefix, hash, sizeof prefix);
+  return prefix;
+}
+
+uint64_t padded(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+}  // namespace
+
+struct SnapshotStore::ingest {
+  const PoRDB& db;
+  uint64_t users;
+  // lowest stored level, and offset and unpadded node count of every stored
+  // level from there
+  uint64_t dropped;
+  std::vector<std::pair<uint64_t, uint64_t>> levels;
+  // rehashed levels below the lowest stored one of the subtree at
+  // subtree_index, and its records
+  std::vector<std::vector<uint8_t>> subtree;
+  uint64_t subtree_index = 0;
+  std::vector<std::string> records;
+};
+
+SnapshotStore::~SnapshotStore() { Close(); }
+
+bool SnapshotStore::Open(const std::string& path, bool sum_tree) {
+  Close();
+  node_file = path;
+  node_size = sum_tree ? 40 : 32;
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat stats;
+  fstat(fd, &stats);
+  uint64_t header[2] = {0, node_size};
+  std::memcpy(header, kNodeMagic.data(), 8);
+  if (static_cast<uint64_t>(stats.st_size) < kNodeFileHeader) {
+    if (pwrite(fd, header, sizeof header, 0) != sizeof header) {
+      Close();
+      return false;
+    }
+    std::filesystem::remove(node_file + ".roots");
+  } else {
+    uint64_t stored[2] = {0, 0};
+    if (pread(fd, stored, sizeof stored, 0) != sizeof stored ||
+        std::memcmp(stored, header, sizeof header) != 0) {
+      Close();
+      return false;
+    }
+  }
+
+  committed_size = kNodeFileHeader;
+  node_count = 0;
+  if (PoRDB::regularFileExists(node_file + ".roots") && !loadRoots()) {
+    Close();
+    return false;
+  }
+  fstat(fd, &stats);
+  if (static_cast<uint64_t>(stats.st_size) < committed_size ||
+      ftruncate(fd, committed_size) != 0 || !remap()) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void SnapshotStore::Close() {
+  if (node_map != nullptr) {
+    munmap(const_cast<uint8_t*>(node_map), map_size);
+    node_map = nullptr;
+    map_size = 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  snapshots.clear();
+  nodes_by_hash.clear();
+  indexed = false;
+  pending.clear();
+  committed_size = 0;
+  node_count = 0;
+}
+
+bool SnapshotStore::AddSnapshot(const std::string& name, const PoRDB& db) {
+  if (fd < 0 || !db.merkle_map.loaded() || !db.index_map.loaded() ||
+      db.merkleNodeSize() != node_size || db.appendedUsers() ||
+      std::any_of(snapshots.begin(), snapshots.end(),
+                  [&name](const snapshot& s) { return s.name == name; })) {
+    return false;
+  }
+  if (!indexed) {
+    indexNodes();
+  }
+
+  // a tree lower than the dropped levels is stored as its root only
+  ingest tree{db, db.userCount(), 0, {}, {}, 0, {}};
+  uint64_t height = 0;
+  for (uint64_t count = tree.users; count > 1; count = (count + 1) >> 1) {
+    ++height;
+  }
+  tree.dropped = std::min(db.dropped_levels, height);
+  tree.levels = db.merkleLevels(tree.users);
+
+  pending_offset = committed_size;
+  const uint64_t previous_nodes = node_count;
+  uint64_t root = 0;
+  if (tree.users > 0) {
+    root = insert(tree, height, 0);
+    if (root == 0) {
+      rollback(previous_nodes);
+      return false;
+    }
+  }
+
+  // nodes must be durable before the table points at them
+  snapshots.push_back(snapshot{name, root, tree.users});
+  uint64_t size = pending_offset + pending.size();
+  if (!flush() || fdatasync(fd) != 0) {
+    snapshots.pop_back();
+    rollback(previous_nodes);
+    return false;
+  }
+  uint64_t previous_size = committed_size;
+  committed_size = size;
+  if (!saveRoots()) {
+    committed_size = previous_size;
+    snapshots.pop_back();
+    rollback(previous_nodes);
+    return false;
+  }
+  return remap();
+}
+
+std::vector<std::string> SnapshotStore::Snapshots() const {
+  std::vector<std::string> names;
+  for (const auto& s : snapshots) {
+    names.push_back(s.name);
+  }
+  return names;
+}
+
+std::vector<uint8_t> SnapshotStore::Root(const std::string& name) const {
+  for (const auto& s : snapshots) {
+    if (s.name == name && s.root != 0) {
+      const nodeheader* root = nodeAt(s.root);
+      return std::vector<uint8_t>(root->hash, root->hash + 32);
+    }
+  }
+  return {};
+}
+
+std::string SnapshotStore::UserInfo(const std::string& name, uint64_t id,
+                                    std::string& proof) const {
+  auto s = std::find_if(snapshots.begin(), snapshots.end(),
+                        [&name](const snapshot& s) { return s.name == name; });
+  if (s == snapshots.end() || s->root == 0) {
+    return "";
+  }
+
+  // siblings from the root down, and whether the path turned right
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  const nodeheader* node = nodeAt(s->root);
+  const std::vector<uint8_t> root(node->hash, node->hash + 32);
+  const uint64_t root_sum = node->sum;
+  while (node->record_size == 0) {
+    const branchlinks* links = reinterpret_cast<const branchlinks*>(node + 1);
+    bool padding = links->right == 0 || links->right == links->left;
+    bool right = !padding && id >= links->right_first_id;
+    std::vector<uint8_t> sibling(32, 0);
+    uint64_t sibling_sum = 0;
+    uint64_t sibling_offset = right ? links->left : links->right;
+    if (sibling_offset != 0) {
+      const nodeheader* n = nodeAt(sibling_offset);
+      std::copy(n->hash, n->hash + 32, sibling.begin());
+      sibling_sum = n->sum;
+    }
+    path.push_back(std::make_pair(right, std::move(sibling)));
+    sums.push_back(sibling_sum);
+    node = nodeAt(right ? links->right : links->left);
+  }
+  if (node->first_id != id) {
+    return "";
+  }
+
+  // same path as PoRDB::generateProof: the leaf, then siblings bottom-up
+  MerkleProof generator;
+  generator.AddSibling(std::vector<uint8_t>(node->hash, node->hash + 32),
+                       path.empty() || !path.back().first, node->sum);
+  for (size_t i = path.size(); i > 0; --i) {
+    generator.AddSibling(path[i - 1].second, path[i - 1].first, sums[i - 1]);
+  }
+  if (node_size == 40) {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, root, root_sum);
+  } else {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, root);
+  }
+  return std::string(reinterpret_cast<const char*>(node + 1),
+                     node->record_size);
+}
+
+bool SnapshotStore::loadRoots() {
+  const std::string roots = node_file + ".roots";
+  if (!PoRDB::verifyFileFingerPrint(roots, kRootsMagic)) {
+    return false;
+  }
+  std::ifstream f(roots, std::ios::in | std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() < 64) {
+    return false;
+  }
+  auto word = [&data](uint64_t offset) {
+    uint64_t value = 0;
+    std::memcpy(&value, data.data() + offset, sizeof value);
+    return value;
+  };
+
+  uint64_t count = word(40);
+  committed_size = word(48);
+  node_count = word(56);
+  uint64_t offset = 64;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (offset + 24 > data.size()) {
+      return false;
+    }
+    snapshot s;
+    s.root = word(offset);
+    s.users = word(offset + 8);
+    uint64_t name_size = word(offset + 16);
+    offset += 24;
+    if (offset + padded(name_size) > data.size()) {
+      return false;
+    }
+    s.name.assign(reinterpret_cast<const char*>(data.data() + offset),
+                  name_size);
+    offset += padded(name_size);
+    snapshots.push_back(s);
+  }
+  return committed_size >= kNodeFileHeader;
+}
+
+bool SnapshotStore::saveRoots() const {
+  std::vector<uint8_t> data(kRootsMagic);
+  auto appendWord = [&data](uint64_t value) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+    data.insert(data.end(), p, p + sizeof value);
+  };
+  appendWord(snapshots.size());
+  appendWord(committed_size);
+  appendWord(node_count);
+  for (const auto& s : snapshots) {
+    appendWord(s.root);
+    appendWord(s.users);
+    appendWord(s.name.size());
+    data.insert(data.end(), s.name.begin(), s.name.end());
+    data.resize(data.size() + padded(s.name.size()) - s.name.size(), 0);
+  }
+  sha256::StreamHasher hasher;
+  hasher.Append(data);
+  auto hv = hasher.Hash();
+  data.insert(data.begin(), hv.cbegin(), hv.cend());
+
+  // replace the table atomically, a crash leaves either old or new one
+  const std::string roots = node_file + ".roots";
+  const std::string tmp = roots + ".tmp";
+  int tmp_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (tmp_fd < 0) {
+    return false;
+  }
+  bool ok = write(tmp_fd, data.data(), data.size()) ==
+                static_cast<ssize_t>(data.size()) &&
+            fdatasync(tmp_fd) == 0;
+  close(tmp_fd);
+  return ok && rename(tmp.c_str(), roots.c_str()) == 0;
+}
+
+bool SnapshotStore::remap() {
+  if (node_map != nullptr) {
+    munmap(const_cast<uint8_t*>(node_map), map_size);
+    node_map = nullptr;
+    map_size = 0;
+  }
+  void* p = mmap(nullptr, committed_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  node_map = static_cast<const uint8_t*>(p);
+  map_size = committed_size;
+  return true;
+}
+
+const SnapshotStore::nodeheader* SnapshotStore::nodeAt(
+    uint64_t offset) const {
+  return reinterpret_cast<const nodeheader*>(node_map + offset);
+}
+
+uint64_t SnapshotStore::find(const uint8_t* hash) const {
+  auto range = nodes_by_hash.equal_range(hashPrefix(hash));
+  uint8_t stored[32];
+  for (auto it = range.first; it != range.second; ++it) {
+    readHash(it->second, stored);
+    if (std::memcmp(stored, hash, sizeof stored) == 0) {
+      return it->second;
+    }
+  }
+  return 0;
+}
+
+void SnapshotStore::readHash(uint64_t offset, uint8_t* hash) const {
+  if (offset + 32 <= map_size) {
+    std::memcpy(hash, node_map + offset, 32);
+  } else if (offset >= pending_offset) {
+    std::memcpy(hash, pending.data() + (offset - pending_offset), 32);
+  } else if (pread(fd, hash, 32, offset) != 32) {
+    std::memset(hash, 0, 32);
+  }
+}
+
+void SnapshotStore::indexNodes() {
+  nodes_by_hash.clear();
+  nodes_by_hash.reserve(node_count);
+  uint64_t offset = kNodeFileHeader;
+  while (offset + sizeof(nodeheader) <= committed_size) {
+    const nodeheader* node = nodeAt(offset);
+    nodes_by_hash.emplace(hashPrefix(node->hash), offset);
+    offset += sizeof(nodeheader) + (node->record_size == 0
+                                        ? sizeof(branchlinks)
+                                        : padded(node->record_size));
+  }
+  indexed = true;
+}
+
+uint64_t SnapshotStore::append(const nodeheader& header, const void* body,
+                               size_t size) {
+  if (pending.size() >= kFlushBytes && !flush()) {
+    return 0;
+  }
+  uint64_t offset = pending_offset + pending.size();
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&header);
+  pending.insert(pending.end(), p, p + sizeof header);
+  p = static_cast<const uint8_t*>(body);
+  pending.insert(pending.end(), p, p + size);
+  pending.resize(pending.size() + padded(size) - size, 0);
+  nodes_by_hash.emplace(hashPrefix(header.hash), offset);
+  ++node_count;
+  return offset;
+}
+
+bool SnapshotStore::flush() {
+  size_t written = 0;
+  while (written < pending.size()) {
+    ssize_t n = pwrite(fd, pending.data() + written, pending.size() - written,
+                       pending_offset + written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  pending_offset += pending.size();
+  pending.clear();
+  return true;
+}
+
+void SnapshotStore::rollback(uint64_t nodes) {
+  // appending resumes over the dropped entries, Open cuts off what is left
+  pending.clear();
+  pending_offset = committed_size;
+  node_count = nodes;
+  for (auto it = nodes_by_hash.begin(); it != nodes_by_hash.end();) {
+    it = it->second >= committed_size ? nodes_by_hash.erase(it) : ++it;
+  }
+}
+
+uint64_t SnapshotStore::insert(ingest& tree, uint64_t height, uint64_t index) {
+  const PoRDB& db = tree.db;
+  uint8_t node[40];
+  if (height >= tree.dropped) {
+    const auto& level = tree.levels[height - tree.dropped];
+    alignas(8) uint8_t scratch[40];
+    const uint8_t* p =
+        index < level.second
+            ? db.merkleBytes(level.first + index * node_size, node_size,
+                             scratch)
+            : nullptr;
+    if (p == nullptr) {
+      return 0;
+    }
+    std::memcpy(node, p, node_size);
+  } else {
+    uint64_t at = index - (tree.subtree_index << (tree.dropped - height));
+    std::memcpy(node, tree.subtree[height].data() + at * node_size, node_size);
+  }
+  uint64_t stored = find(node);
+  if (stored != 0) {
+    return stored;
+  }
+  if (height == tree.dropped && height > 0 && !rehashSubtree(tree, index)) {
+    return 0;
+  }
+
+  nodeheader header{};
+  std::memcpy(header.hash, node, 32);
+  if (node_size == 40) {
+    std::memcpy(&header.sum, node + 32, sizeof header.sum);
+  }
+  header.first_id = db.idAt(index << height);
+  if (height == 0) {
+    std::string record =
+        tree.dropped > 0
+            ? tree.records[index - (tree.subtree_index << tree.dropped)]
+            : db.recordAt(index);
+    if (record.empty()) {
+      return 0;
+    }
+    header.record_size = record.size();
+    return append(header, record.data(), record.size());
+  }
+
+  branchlinks links{};
+  links.left = insert(tree, height - 1, 2 * index);
+  if (links.left == 0) {
+    return 0;
+  }
+  if (2 * index + 1 < PoRDB::levelCount(tree.users, height - 1)) {
+    links.right = insert(tree, height - 1, 2 * index + 1);
+    if (links.right == 0) {
+      return 0;
+    }
+    links.right_first_id = db.idAt((2 * index + 1) << (height - 1));
+  } else if (node_size == 32) {
+    links.right = links.left;
+  }
+  return append(header, &links, sizeof links);
+}
+
+bool SnapshotStore::rehashSubtree(ingest& tree, uint64_t index) {
+  const PoRDB& db = tree.db;
+  tree.subtree_index = index;
+  tree.subtree.assign(tree.dropped, std::vector<uint8_t>());
+  tree.records.clear();
+
+  uint64_t first = index << tree.dropped;
+  uint64_t end = std::min(tree.users, (index + 1) << tree.dropped);
+  TaggedHasher leaf_tag_hasher(PoRDB::kLeafTag);
+  TaggedHasher branch_tag_hasher(PoRDB::kBranchTag);
+  std::vector<uint8_t> nodes;
+  for (uint64_t i = first; i < end; ++i) {
+    tree.records.push_back(db.recordAt(i));
+    if (tree.records.back().empty()) {
+      return false;
+    }
+    db.appendLeaf(tree.records.back(), leaf_tag_hasher, nodes);
+  }
+
+  uint64_t count = tree.users;
+  for (uint64_t height = 0; height < tree.dropped; ++height) {
+    db.padLevel(nodes, first, count);
+    tree.subtree[height] = nodes;
+    nodes.clear();
+    db.hashParents(tree.subtree[height].data(),
+                   tree.subtree[height].size() / node_size / 2,
+                   branch_tag_hasher, nodes);
+    count = PoRDB::levelCount(count, 1);
+    first >>= 1;
+  }
+  return true;
+}
+
+const std::vector<uint8_t> SnapshotStore::kNodeMagic = {
+    0x93, 0x4b, 0xe0, 0x1d, 0x6a, 0xc7, 0x58, 0x2f};
+
+const std::vector<uint8_t> SnapshotStore::kRootsMagic = {
+    0x2c, 0xd6, 0x75, 0xb8, 0x0e, 0x41, 0x9a, 0x63};
+}  // namespace crypto
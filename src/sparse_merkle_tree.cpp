@@ -0,0 +1,242 @@
+#include "sparse_merkle_tree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <limits>
+
+#include "merkle_proof.h"
+
+namespace crypto {
+namespace {
+// changed nodes per thread at least, small updates stay on the calling thread
+const uint64_t kGrain = 256;
+}  // namespace
+
+SparseMerkleTree::SparseMerkleTree(bool sum_tree)
+    : sum_tree(sum_tree), levels(kHeight + 1), empty(kHeight + 1) {
+  empty[0].hash.fill(0x00);
+  empty[0].sum = 0;
+  TaggedHasher hasher(PoRDB::kBranchTag);
+  for (uint64_t height = 0; height < kHeight; ++height) {
+    empty[height + 1] = hashBranch(empty[height], empty[height], hasher);
+  }
+}
+
+// A node at height h and index i covers the ids with i as their top 64 - h
+// bits. Updated leaves are collected as indices, each level hashes the
+// parents of the indices below it, so every changed node is hashed once per
+// batch.
+bool SparseMerkleTree::Update(
+    const std::vector<std::pair<uint64_t, uint64_t>>& users,
+    const std::vector<uint64_t>& removed, size_t threads) {
+  // no node sum is above the root sum, which the batch changes by the
+  // balances after it less those before it
+  if (sum_tree) {
+    std::unordered_map<uint64_t, uint64_t> changed;
+    for (uint64_t id : removed) {
+      changed[id] = 0;
+    }
+    for (const auto& [id, balance] : users) {
+      changed[id] = balance;
+    }
+    uint64_t total = RootSum();
+    for (const auto& [id, balance] : changed) {
+      if (auto it = balances.find(id); it != balances.end()) {
+        total -= it->second;
+      }
+    }
+    for (const auto& [id, balance] : changed) {
+      if (balance > std::numeric_limits<uint64_t>::max() - total) {
+        return false;
+      }
+      total += balance;
+    }
+  }
+
+  std::vector<uint64_t> dirty;
+  dirty.reserve(users.size() + removed.size());
+  for (uint64_t id : removed) {
+    if (balances.erase(id) > 0) {
+      levels[0].erase(id);
+      dirty.push_back(id);
+    }
+  }
+
+  std::vector<node> nodes(users.size());
+  size_t workers =
+      PoRDB::workerCount((users.size() + kGrain - 1) / kGrain, threads);
+  PoRDB::parallelFor(users.size(), workers,
+                     [&](size_t, uint64_t begin, uint64_t end) {
+                       TaggedHasher hasher(PoRDB::kLeafTag);
+                       for (uint64_t i = begin; i < end; ++i) {
+                         nodes[i] = hashLeaf(users[i].first, users[i].second,
+                                             hasher);
+                       }
+                     });
+  for (size_t i = 0; i < users.size(); ++i) {
+    balances[users[i].first] = users[i].second;
+    levels[0][users[i].first] = nodes[i];
+    dirty.push_back(users[i].first);
+  }
+  std::sort(dirty.begin(), dirty.end());
+
+  // a parent without users beneath it is dropped
+  std::vector<uint8_t> occupied;
+  for (uint64_t height = 0; height < kHeight; ++height) {
+    for (auto& index : dirty) {
+      index >>= 1;
+    }
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    nodes.resize(dirty.size());
+    occupied.assign(dirty.size(), 0);
+    workers =
+        PoRDB::workerCount((dirty.size() + kGrain - 1) / kGrain, threads);
+    PoRDB::parallelFor(
+        dirty.size(), workers, [&](size_t, uint64_t begin, uint64_t end) {
+          TaggedHasher hasher(PoRDB::kBranchTag);
+          const auto& children = levels[height];
+          for (uint64_t i = begin; i < end; ++i) {
+            const uint64_t left = 2 * dirty[i];
+            if (children.count(left) == 0 && children.count(left + 1) == 0) {
+              continue;
+            }
+            occupied[i] = 1;
+            nodes[i] = hashBranch(nodeAt(height, left),
+                                  nodeAt(height, left + 1), hasher);
+          }
+        });
+
+    auto& parents = levels[height + 1];
+    for (size_t i = 0; i < dirty.size(); ++i) {
+      if (occupied[i]) {
+        parents[dirty[i]] = nodes[i];
+      } else {
+        parents.erase(dirty[i]);
+      }
+    }
+  }
+  return true;
+}
+
+bool SparseMerkleTree::Build(const PoRDB& db, size_t threads) {
+  // leaves are rendered from a single balance
+  if (!db.merkle_map.loaded() || !db.index_map.loaded() ||
+      db.db_options.assets != 1) {
+    return false;
+  }
+  auto appended = db.appendedUsers();
+  const uint64_t count =
+      db.userCount() + (appended ? appended->size() : 0);
+
+  // record is "(id,balance)"
+  std::vector<std::pair<uint64_t, uint64_t>> users(count);
+  std::atomic<bool> ok{true};
+  PoRDB::parallelFor(
+      count, PoRDB::workerCount((count + kGrain - 1) / kGrain, threads),
+      [&](size_t, uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; ++i) {
+          std::string record = db.recordAt(i);
+          if (record.empty()) {
+            ok = false;
+            return;
+          }
+          const char* last = record.data() + record.size();
+          auto [p, ec] =
+              std::from_chars(record.data() + 1, last, users[i].first);
+          if (ec != std::errc() || p == last ||
+              std::from_chars(p + 1, last, users[i].second).ec !=
+                  std::errc()) {
+            ok = false;
+            return;
+          }
+        }
+      });
+  if (!ok) {
+    return false;
+  }
+
+  balances.clear();
+  levels.assign(kHeight + 1, {});
+  return Update(users, {}, threads);
+}
+
+std::string SparseMerkleTree::UserInfo(uint64_t id, std::string& proof) const {
+  MerkleProof generator;
+  const node& leaf = nodeAt(0, id);
+  generator.AddSibling(std::vector<uint8_t>(leaf.hash.begin(), leaf.hash.end()),
+                       (id & 0x01) == 0x00, leaf.sum);
+  for (uint64_t height = 0; height < kHeight; ++height) {
+    const uint64_t index = id >> height;
+    const node& sibling = nodeAt(height, index ^ 0x01);
+    generator.AddSibling(
+        std::vector<uint8_t>(sibling.hash.begin(), sibling.hash.end()),
+        (index & 0x01) == 0x01, sibling.sum);
+  }
+
+  if (sum_tree) {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, Root(), RootSum());
+  } else {
+    proof = generator.GenerateProof(PoRDB::kBranchTag, Root());
+  }
+
+  auto it = balances.find(id);
+  return it == balances.end() ? "" : PoRDB::renderRecord(id, it->second);
+}
+
+std::vector<uint8_t> SparseMerkleTree::Root() const {
+  const node& root = nodeAt(kHeight, 0);
+  return std::vector<uint8_t>(root.hash.begin(), root.hash.end());
+}
+
+uint64_t SparseMerkleTree::RootSum() const { return nodeAt(kHeight, 0).sum; }
+
+uint64_t SparseMerkleTree::NodeCount() const {
+  uint64_t count = 0;
+  for (const auto& level : levels) {
+    count += level.size();
+  }
+  return count;
+}
+
+const SparseMerkleTree::node& SparseMerkleTree::nodeAt(uint64_t height,
+                                                       uint64_t index) const {
+  auto it = levels[height].find(index);
+  return it == levels[height].end() ? empty[height] : it->second;
+}
+
+SparseMerkleTree::node SparseMerkleTree::hashLeaf(uint64_t id,
+                                                  uint64_t balance,
+                                                  TaggedHasher& hasher) const {
+  std::string record = PoRDB::renderRecord(id, balance);
+  hasher.Reset();
+  hasher.Append(reinterpret_cast<const uint8_t*>(record.data()),
+                record.size());
+  auto hash = hasher.Hash();
+  node leaf;
+  std::copy(hash.begin(), hash.end(), leaf.hash.begin());
+  leaf.sum = sum_tree ? balance : 0;
+  return leaf;
+}
+
+// same as PoRDB::hashParents: hash(left hash | left sum | right hash | right
+// sum), without the sums if not in sum tree mode
+SparseMerkleTree::node SparseMerkleTree::hashBranch(
+    const node& left, const node& right, TaggedHasher& hasher) const {
+  hasher.Reset();
+  for (const node* child : {&left, &right}) {
+    hasher.Append(child->hash.data(), child->hash.size());
+    if (sum_tree) {
+      hasher.Append(reinterpret_cast<const uint8_t*>(&child->sum),
+                    sizeof child->sum);
+    }
+  }
+  auto hash = hasher.Hash();
+  node branch;
+  std::copy(hash.begin(), hash.end(), branch.hash.begin());
+  branch.sum = left.sum + right.sum;
+  return branch;
+}
+
+const std::vector<uint8_t> SparseMerkleTree::kEmptyLeaf(32, 0x00);
+}  // namespace crypto
@@ -18,6 +18,12 @@ size_t TaggedHasher::Append(const std::vector<uint8_t>& data_chunk) {
   return size - 64;
 }
 
+size_t TaggedHasher::Append(const uint8_t* data, size_t size) {
+  auto total = hasher_.Append(data, size);
+  // 64 is the twiced "tag hash"
+  return total - 64;
+}
+
 std::vector<uint8_t> TaggedHasher::Hash() { return hasher_.Hash(); }
 
 void TaggedHasher::Reset() { doReset(); }
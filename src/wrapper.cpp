@@ -1,18 +1,77 @@
 #include "wrapper.h"
 
 #include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include "por_db.h"
+#include "sharded_por_db.h"
+
+namespace {
+// set when the database is loaded as sharded database
+bool use_sharded_db = false;
+}  // namespace
 
 int LoadDB(const char* path) {
   std::string db_path = path;
   return crypto::PoRDB::Instance().Load(db_path);
 }
 
+int LoadDBWithOptions(const char* path, const struct PoRLoadOptions* options) {
+  std::string db_path = path;
+  crypto::PoROptions db_options;
+  int shards = 0;
+  if (options != nullptr) {
+    db_options.sum_tree = options->sum_tree != 0;
+    shards = options->shards;
+    if (options->map_strategy >= 0 && options->map_strategy <= 3) {
+      db_options.map_strategy =
+          static_cast<crypto::MapStrategy>(options->map_strategy);
+    }
+    db_options.numa_interleave = options->numa_interleave != 0;
+    db_options.warmup = options->warmup != 0;
+    db_options.compressed_index = options->compressed_index != 0;
+    db_options.binary_records = options->binary_records != 0;
+    db_options.learned_index = options->learned_index != 0;
+    db_options.id_filter = options->id_filter != 0;
+    db_options.single_file = options->single_file != 0;
+    if (options->assets > 0) {
+      db_options.assets = options->assets;
+    }
+    if (options->shared_memory != nullptr) {
+      db_options.shared_memory = options->shared_memory;
+    }
+    if (options->response_cache_mb > 0) {
+      db_options.response_cache_bytes =
+          static_cast<size_t>(options->response_cache_mb) << 20;
+    }
+    if (options->buffer_pool_mb > 0) {
+      db_options.map_strategy = crypto::MapStrategy::kBufferPool;
+      db_options.buffer_pool_bytes =
+          static_cast<size_t>(options->buffer_pool_mb) << 20;
+    }
+    if (options->merkle_dropped_levels > 0) {
+      db_options.merkle_dropped_levels = options->merkle_dropped_levels;
+    }
+    if (options->learned_index_epsilon > 0) {
+      db_options.learned_index_epsilon = options->learned_index_epsilon;
+    }
+  }
+
+  // a published segment is one database
+  use_sharded_db = shards > 1 && db_options.shared_memory.empty();
+  if (use_sharded_db) {
+    return crypto::ShardedPoRDB::Instance().Load(db_path, shards, db_options);
+  }
+
+  return crypto::PoRDB::Instance().Load(db_path, db_options);
+}
+
 const char* UserInfo(uint64_t id) {
   std::string proof;
-  auto info = crypto::PoRDB::Instance().UserInfo(id, proof);
+  auto info = use_sharded_db
+                  ? crypto::ShardedPoRDB::Instance().UserInfo(id, proof)
+                  : crypto::PoRDB::Instance().UserInfo(id, proof);
   if (info.empty()) {
     return 0;
   }
@@ -22,6 +81,51 @@ const char* UserInfo(uint64_t id) {
   size_t size = info.size() + 1;
   char* result = reinterpret_cast<char*>(malloc(size * (sizeof(char))));
   std::copy(info.cbegin(), info.cend(), result);
-  result[size] = '\0';
+  result[size - 1] = '\0';
   return result;
-}
\ No newline at end of file
+}
+
+size_t UserInfoJSON(uint64_t id, char** buffer, size_t* capacity) {
+  // rendering buffer of this thread keeps its capacity between calls
+  thread_local std::string json;
+  bool found = use_sharded_db
+                   ? crypto::ShardedPoRDB::Instance().UserInfoJson(id, json)
+                   : crypto::PoRDB::Instance().UserInfoJson(id, json);
+  if (!found) {
+    return 0;
+  }
+
+  if (*buffer == nullptr || *capacity < json.size()) {
+    char* grown = reinterpret_cast<char*>(realloc(*buffer, json.size()));
+    if (grown == nullptr) {
+      return 0;
+    }
+    *buffer = grown;
+    *capacity = json.size();
+  }
+
+  std::memcpy(*buffer, json.data(), json.size());
+  return json.size();
+}
+
+uint64_t TotalLiabilities() {
+  if (use_sharded_db) {
+    return crypto::ShardedPoRDB::Instance().TotalLiabilities();
+  }
+
+  return crypto::PoRDB::Instance().TotalLiabilities();
+}
+
+int DBReady() {
+  return use_sharded_db ? crypto::ShardedPoRDB::Instance().Ready()
+                        : crypto::PoRDB::Instance().Ready();
+}
+
+const char* DBMetrics() {
+  auto metrics = use_sharded_db ? crypto::ShardedPoRDB::Instance().Metrics()
+                                : crypto::PoRDB::Instance().Metrics();
+  char* result = reinterpret_cast<char*>(malloc(metrics.size() + 1));
+  std::copy(metrics.cbegin(), metrics.cend(), result);
+  result[metrics.size()] = '\0';
+  return result;
+}
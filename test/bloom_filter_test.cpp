@@ -0,0 +1,59 @@
+#include "bloom_filter.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+TEST(BloomFilter, no_false_negative) {
+  std::mt19937_64 rng(5);
+  crypto::BloomFilter filter(100000, 10);
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 50000; ++i) {
+    keys.push_back(i * 3);
+  }
+  for (int i = 0; i < 50000; ++i) {
+    keys.push_back(rng());
+  }
+  for (auto key : keys) {
+    filter.Add(key);
+  }
+  for (auto key : keys) {
+    ASSERT_TRUE(filter.MayContain(key)) << key;
+  }
+
+  // about 1% false positive rate at 10 bits per key
+  uint64_t positives = 0;
+  for (uint64_t i = 0; i < 100000; ++i) {
+    positives += filter.MayContain(i * 3 + 1) ? 1 : 0;
+    positives += filter.MayContain(rng()) ? 1 : 0;
+  }
+  EXPECT_LT(positives, 200000 * 2 / 100);
+}
+
+TEST(BloomFilter, assign) {
+  crypto::BloomFilter filter(1000, 10);
+  for (uint64_t key = 0; key < 1000; ++key) {
+    filter.Add(key * 7);
+  }
+
+  std::vector<uint8_t> data(8 + filter.Bytes());
+  uint64_t blocks = filter.Blocks();
+  std::memcpy(data.data(), &blocks, 8);
+  std::memcpy(data.data() + 8, filter.Data(), filter.Bytes());
+
+  crypto::BloomFilter copy;
+  // an empty filter rejects nothing
+  EXPECT_TRUE(copy.MayContain(1));
+  EXPECT_FALSE(copy.Assign(data.data(), data.size() - 1));
+  ASSERT_TRUE(copy.Assign(data.data(), data.size()));
+  EXPECT_EQ(copy.Blocks(), filter.Blocks());
+  for (uint64_t key = 0; key < 7000; ++key) {
+    EXPECT_EQ(copy.MayContain(key), filter.MayContain(key));
+  }
+
+  copy.Reset();
+  EXPECT_EQ(copy.Bytes(), 0);
+  EXPECT_TRUE(copy.MayContain(1));
+}
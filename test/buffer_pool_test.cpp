@@ -0,0 +1,141 @@
+#include "buffer_pool.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+// file of size bytes where byte i is i % 251, open for reading
+class TestFile {
+ public:
+  TestFile(const std::string& path, size_t size) : path_(path) {
+    std::ofstream f(path, std::ios::binary);
+    for (size_t i = 0; i < size; ++i) {
+      f.put(static_cast<char>(i % 251));
+    }
+    f.close();
+    fd_ = open(path.c_str(), O_RDONLY);
+  }
+  ~TestFile() {
+    close(fd_);
+    std::filesystem::remove(path_);
+  }
+
+  int Fd() const { return fd_; }
+
+ private:
+  std::string path_;
+  int fd_;
+};
+
+bool expected(const std::vector<uint8_t>& data, uint64_t offset) {
+  for (size_t i = 0; i < data.size(); ++i) {
+    if (data[i] != (offset + i) % 251) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+TEST(BufferPool, read_across_pages) {
+  TestFile file("buffer_pool_read.bin", 1000);
+  crypto::BufferPool pool(1 << 16, 64, 4);
+  EXPECT_EQ(pool.PageSize(), 64);
+
+  std::vector<uint8_t> data(200);
+  ASSERT_TRUE(pool.Read(file.Fd(), 50, data.size(), data.data()));
+  EXPECT_TRUE(expected(data, 50));
+  // pages 0-3 missed once, then hit
+  EXPECT_EQ(pool.Misses(), 4);
+  ASSERT_TRUE(pool.Read(file.Fd(), 70, 10, data.data()));
+  EXPECT_EQ(pool.Hits(), 1);
+
+  // the last page is short, reads past the end of file fail
+  data.resize(40);
+  ASSERT_TRUE(pool.Read(file.Fd(), 960, 40, data.data()));
+  EXPECT_TRUE(expected(data, 960));
+  EXPECT_FALSE(pool.Read(file.Fd(), 961, 40, data.data()));
+  EXPECT_FALSE(pool.Read(file.Fd(), 5000, 1, data.data()));
+  EXPECT_FALSE(pool.Read(-1, 0, 1, data.data()));
+  EXPECT_TRUE(pool.Read(file.Fd(), 5000, 0, data.data()));
+
+  EXPECT_EQ(pool.Bytes(), 1 << 16);
+  pool.Clear();
+  uint64_t misses = pool.Misses();
+  ASSERT_TRUE(pool.Read(file.Fd(), 0, 1, data.data()));
+  EXPECT_EQ(pool.Misses(), misses + 1);
+}
+
+TEST(BufferPool, clock_eviction) {
+  TestFile file("buffer_pool_evict.bin", 64 * 100);
+  // four frames in one shard
+  crypto::BufferPool pool(256, 64, 1);
+  EXPECT_EQ(pool.Bytes(), 256);
+
+  std::vector<uint8_t> data(8);
+  for (uint64_t page = 1; page < 100; ++page) {
+    ASSERT_TRUE(pool.Read(file.Fd(), page * 64, data.size(), data.data()));
+    ASSERT_TRUE(expected(data, page * 64));
+    // page 0 stays hot and keeps its reference bit
+    ASSERT_TRUE(pool.Read(file.Fd(), 3, data.size(), data.data()));
+    ASSERT_TRUE(expected(data, 3));
+  }
+  EXPECT_EQ(pool.Misses(), 100);
+  EXPECT_EQ(pool.Hits(), 98);
+  EXPECT_EQ(pool.Evictions(), 96);
+  EXPECT_EQ(pool.Bytes(), 256);
+}
+
+TEST(BufferPool, pin) {
+  TestFile file("buffer_pool_pin.bin", 1000);
+  crypto::BufferPool pool(64, 64, 1);
+  ASSERT_TRUE(pool.Pin(file.Fd(), 900, 100));
+  EXPECT_EQ(pool.PinnedBytes(), 104);
+  EXPECT_EQ(pool.Bytes(), 168);
+  EXPECT_FALSE(pool.Pin(file.Fd(), 2000, 1));
+
+  // pages are pinned up to the end of file, they are served in one copy
+  // without a read while the frame keeps cycling
+  std::vector<uint8_t> data(100);
+  for (int round = 0; round < 3; ++round) {
+    ASSERT_TRUE(pool.Read(file.Fd(), 900, data.size(), data.data()));
+    EXPECT_TRUE(expected(data, 900));
+    ASSERT_TRUE(pool.Read(file.Fd(), round * 64, 1, data.data()));
+  }
+  EXPECT_EQ(pool.Misses(), 3);
+  EXPECT_EQ(pool.Hits(), 3);
+  EXPECT_FALSE(pool.Read(file.Fd(), 990, 20, data.data()));
+}
+
+TEST(BufferPool, concurrent_reads) {
+  TestFile file("buffer_pool_threads.bin", 64 * 1000);
+  crypto::BufferPool pool(64 * 64, 64, 4);
+  std::vector<std::thread> threads;
+  std::vector<int> ok(4, 0);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&pool, &file, &ok, t]() {
+      std::vector<uint8_t> data(100);
+      for (uint64_t i = 0; i < 5000; ++i) {
+        uint64_t offset = (i * 7919 + t * 104729) % (64 * 1000 - 100);
+        if (pool.Read(file.Fd(), offset, data.size(), data.data()) &&
+            expected(data, offset)) {
+          ++ok[t];
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int count : ok) {
+    EXPECT_EQ(count, 5000);
+  }
+  EXPECT_GT(pool.Evictions(), 0);
+}
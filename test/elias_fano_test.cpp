@@ -0,0 +1,92 @@
+#include "elias_fano.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+std::vector<uint64_t> encode(const std::vector<uint64_t>& values,
+                             uint64_t universe) {
+  crypto::EliasFano::Builder builder(values.size(), universe);
+  for (auto value : values) {
+    EXPECT_TRUE(builder.Add(value));
+  }
+  return builder.Finish();
+}
+}  // namespace
+
+TEST(EliasFano, empty) {
+  auto words = encode({}, 0);
+  crypto::EliasFano ef(words.data());
+  EXPECT_EQ(ef.Size(), 0);
+  EXPECT_EQ(ef.Words(), words.size());
+  EXPECT_EQ(ef.LowerBound(0), 0);
+  EXPECT_EQ(ef.LowerBound(100), 0);
+
+  // universe doesn't matter without values
+  EXPECT_EQ(encode({}, 1ULL << 62).size(), words.size());
+}
+
+TEST(EliasFano, reject_unsorted) {
+  crypto::EliasFano::Builder builder(3, 10);
+  EXPECT_TRUE(builder.Add(5));
+  EXPECT_FALSE(builder.Add(4));
+  EXPECT_FALSE(builder.Add(11));
+  EXPECT_TRUE(builder.Finish().empty());
+}
+
+TEST(EliasFano, get_lower_bound) {
+  std::mt19937_64 rng(7);
+  // dense, sparse and duplicated values, sizes around select sample rate
+  for (uint64_t n : {1ULL, 2ULL, 255ULL, 256ULL, 257ULL, 1000ULL, 20000ULL}) {
+    for (uint64_t spread : {1ULL, 3ULL, 1000ULL, 1ULL << 40}) {
+      std::vector<uint64_t> values(n);
+      for (auto& value : values) {
+        value = rng() % (n * spread);
+      }
+      std::sort(values.begin(), values.end());
+
+      auto words = encode(values, values.back());
+      crypto::EliasFano ef(words.data());
+      ASSERT_EQ(ef.Size(), n);
+      EXPECT_EQ(ef.Words(), words.size());
+      for (uint64_t i = 0; i < n; ++i) {
+        ASSERT_EQ(ef.Get(i), values[i]);
+      }
+
+      for (int k = 0; k < 2000; ++k) {
+        uint64_t v = rng() % (n * spread + 2);
+        uint64_t expected =
+            std::lower_bound(values.begin(), values.end(), v) - values.begin();
+        ASSERT_EQ(ef.LowerBound(v), expected) << v;
+      }
+      for (auto v : values) {
+        uint64_t expected =
+            std::lower_bound(values.begin(), values.end(), v) - values.begin();
+        ASSERT_EQ(ef.LowerBound(v), expected) << v;
+      }
+    }
+  }
+}
+
+TEST(EliasFano, skewed_lower_bound) {
+  // a dense cluster and one far outlier put the cluster in a single bucket
+  // of high bits, lookups must still search it in logarithmic time
+  std::vector<uint64_t> values;
+  for (uint64_t id = 0; id < 200000; ++id) {
+    values.push_back(id * 3);
+  }
+  values.push_back(1ULL << 50);
+  auto words = encode(values, values.back());
+  crypto::EliasFano ef(words.data());
+
+  std::mt19937_64 rng(11);
+  for (int k = 0; k < 200000; ++k) {
+    uint64_t v = k % 2 == 0 ? rng() % 600010 : rng() % ((1ULL << 50) + 2);
+    uint64_t expected =
+        std::lower_bound(values.begin(), values.end(), v) - values.begin();
+    ASSERT_EQ(ef.LowerBound(v), expected) << v;
+  }
+}
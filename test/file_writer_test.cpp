@@ -0,0 +1,85 @@
+#include "file_writer.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+std::vector<uint8_t> readFile(const std::string& file) {
+  std::ifstream f(file, std::ios::in | std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(f),
+                              std::istreambuf_iterator<char>());
+}
+}  // namespace
+
+TEST(FileWriter, append_flush_write_at) {
+  std::string file = "../test/data/file_writer_test.bin";
+
+  // small buffers so that data spans many buffers and unaligned flushes
+  for (bool direct_io : {false, true}) {
+    for (bool use_io_uring : {false, true}) {
+      crypto::FileWriter writer(4096, 3);
+      ASSERT_TRUE(writer.Open(file, direct_io, use_io_uring));
+
+      std::vector<uint8_t> expected(32, 0);
+      EXPECT_TRUE(writer.Append(expected));
+      for (size_t i = 0; i < 5000; ++i) {
+        std::vector<uint8_t> chunk(i % 37 + 1, static_cast<uint8_t>(i));
+        EXPECT_TRUE(writer.Append(chunk));
+        expected.insert(expected.end(), chunk.cbegin(), chunk.cend());
+
+        // flushed data can be read back, later data continues after it
+        if (i % 1000 == 999) {
+          EXPECT_TRUE(writer.Flush());
+          auto content = readFile(file);
+          EXPECT_EQ(content.size() >= expected.size(), true);
+          EXPECT_TRUE(
+              std::equal(expected.cbegin(), expected.cend(), content.cbegin()));
+        }
+      }
+
+      std::vector<uint8_t> header(32, 0xab);
+      EXPECT_TRUE(writer.WriteAt(0, header));
+      std::copy(header.cbegin(), header.cend(), expected.begin());
+      EXPECT_EQ(writer.Size(), expected.size());
+      EXPECT_TRUE(writer.Close());
+      EXPECT_EQ(readFile(file), expected);
+    }
+  }
+
+  std::filesystem::remove(file);
+}
+
+TEST(FileWriter, write_at_small_file) {
+  std::string file = "../test/data/file_writer_small.bin";
+
+  // a file under one direct io block, its header is written after the data
+  // like the fingerprint of index and merkle files
+  for (bool direct_io : {false, true}) {
+    for (bool use_io_uring : {false, true}) {
+      crypto::FileWriter writer;
+      ASSERT_TRUE(writer.Open(file, direct_io, use_io_uring));
+      std::vector<uint8_t> expected(32, 0);
+      EXPECT_TRUE(writer.Append(expected));
+      std::vector<uint8_t> data(500, 0x5a);
+      EXPECT_TRUE(writer.Append(data));
+      expected.insert(expected.end(), data.cbegin(), data.cend());
+
+      std::vector<uint8_t> header(32, 0xcd);
+      EXPECT_TRUE(writer.WriteAt(0, header));
+      std::copy(header.cbegin(), header.cend(), expected.begin());
+      // the tail block is written again by these
+      EXPECT_TRUE(writer.Sync());
+      EXPECT_TRUE(writer.Append(data));
+      expected.insert(expected.end(), data.cbegin(), data.cend());
+      EXPECT_TRUE(writer.Close());
+      EXPECT_EQ(readFile(file), expected) << direct_io << use_io_uring;
+    }
+  }
+
+  std::filesystem::remove(file);
+}
@@ -0,0 +1,33 @@
+#include "hex.h"
+
+#include <gtest/gtest.h>
+
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+TEST(Hex, encode) {
+  std::mt19937 rng(9);
+  // sizes around the 16 and 32 byte vector widths
+  for (size_t size = 0; size < 100; ++size) {
+    std::vector<uint8_t> data(size);
+    for (auto& b : data) {
+      b = rng();
+    }
+    data.push_back(0xff);
+    data.insert(data.begin(), 0x00);
+
+    std::stringstream ss;
+    ss << std::hex << std::setfill('0');
+    for (auto b : data) {
+      ss << std::setw(2) << static_cast<unsigned>(b);
+    }
+
+    // the byte after the output is left alone
+    std::string out(data.size() * 2 + 1, '#');
+    crypto::HexEncode(data.data(), data.size(), &out[0]);
+    EXPECT_EQ(out, ss.str() + "#");
+  }
+}
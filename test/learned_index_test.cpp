@@ -0,0 +1,92 @@
+#include "learned_index.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace {
+std::vector<uint64_t> build(const std::vector<uint64_t>& keys,
+                            uint64_t epsilon) {
+  crypto::LearnedIndex::Builder builder(epsilon);
+  for (auto key : keys) {
+    EXPECT_TRUE(builder.Add(key));
+  }
+  return builder.Finish();
+}
+}  // namespace
+
+TEST(LearnedIndex, empty) {
+  auto words = build({}, 8);
+  crypto::LearnedIndex index(words.data());
+  EXPECT_EQ(index.Size(), 0);
+  EXPECT_EQ(index.Words(), words.size());
+  EXPECT_EQ(index.LowerBound(5, [](uint64_t) { return 0; }), 0);
+}
+
+TEST(LearnedIndex, reject_unsorted) {
+  crypto::LearnedIndex::Builder builder(8);
+  EXPECT_TRUE(builder.Add(5));
+  EXPECT_FALSE(builder.Add(5));
+  EXPECT_FALSE(builder.Add(4));
+}
+
+TEST(LearnedIndex, lower_bound) {
+  std::mt19937_64 rng(11);
+  // evenly spaced, uniformly random and clustered keys from several ranges
+  std::vector<std::vector<uint64_t>> sequences;
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 5000; ++i) {
+    keys.push_back(i * 3 + 1);
+  }
+  sequences.push_back(keys);
+
+  std::set<uint64_t> unique;
+  while (unique.size() < 20000) {
+    unique.insert(rng() >> 1);
+  }
+  sequences.emplace_back(unique.cbegin(), unique.cend());
+
+  unique.clear();
+  for (uint64_t cluster = 0; cluster < 20; ++cluster) {
+    uint64_t base = rng() % (1ULL << 50);
+    uint64_t spread = 1 + rng() % 1000;
+    for (int i = 0; i < 1000; ++i) {
+      unique.insert(base + rng() % (spread * 1000));
+    }
+  }
+  sequences.emplace_back(unique.cbegin(), unique.cend());
+
+  for (const auto& keys : sequences) {
+    for (uint64_t epsilon : {1, 8, 64}) {
+      auto words = build(keys, epsilon);
+      crypto::LearnedIndex index(words.data());
+      ASSERT_EQ(index.Size(), keys.size());
+      EXPECT_EQ(index.Epsilon(), epsilon);
+      EXPECT_EQ(index.Words(), words.size());
+      EXPECT_GT(index.Segments(), 0);
+      auto key_at = [&keys](uint64_t i) { return keys[i]; };
+
+      std::vector<uint64_t> probes = {0, keys.front(), keys.back(),
+                                      keys.back() + 1, ~0ULL};
+      for (int i = 0; i < 5000; ++i) {
+        uint64_t key = keys[rng() % keys.size()];
+        probes.push_back(key);
+        probes.push_back(key - 1);
+        probes.push_back(key + 1);
+        probes.push_back(rng());
+      }
+      for (auto key : probes) {
+        uint64_t expected =
+            std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        ASSERT_EQ(index.LowerBound(key, key_at), expected) << key;
+      }
+    }
+  }
+
+  // evenly spaced keys fit a single segment
+  auto words = build(sequences[0], 1);
+  EXPECT_EQ(crypto::LearnedIndex(words.data()).Segments(), 1);
+}
@@ -0,0 +1,141 @@
+#include "line_reader.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#ifdef POR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+void writeFile(const std::string& file, const std::string& content) {
+  std::ofstream f(file, std::ios::out | std::ios::binary | std::ios::trunc);
+  f << content;
+}
+
+#ifdef POR_HAVE_ZLIB
+// content compressed as one gzip member per part, concatenated
+void writeGzip(const std::string& file,
+               const std::vector<std::string>& parts) {
+  std::filesystem::remove(file);
+  for (const auto& part : parts) {
+    gzFile gz = gzopen(file.c_str(), "ab");
+    gzwrite(gz, part.data(), part.size());
+    gzclose(gz);
+  }
+}
+#endif
+
+// all lines from offset, and the position after each of them
+std::vector<std::string> readLines(crypto::LineReader& reader,
+                                   const std::string& file, uint64_t offset,
+                                   std::vector<uint64_t>* positions = nullptr) {
+  std::vector<std::string> lines;
+  if (!reader.Open(file, offset)) {
+    return lines;
+  }
+  std::string_view line;
+  while (reader.Next(line)) {
+    lines.emplace_back(line);
+    if (positions != nullptr) {
+      positions->push_back(reader.Position());
+    }
+  }
+  return lines;
+}
+}  // namespace
+
+TEST(LineReader, plain_and_gzip) {
+  const std::string file = "../test/data/line_reader_test.txt";
+  std::string text;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 500; ++i) {
+    // short and long lines, the long ones span several blocks
+    expected.push_back(std::string(i % 7 == 0 ? 40 : i % 5, 'a' + i % 26));
+    text += expected.back() + "\n";
+  }
+  // the last line may end without '\n'
+  expected.push_back("(1,2)");
+  text += expected.back();
+
+  std::vector<std::vector<std::string>> parts = {{text}};
+#ifdef POR_HAVE_ZLIB
+  parts.push_back({text});
+  parts.push_back({text.substr(0, 1000), text.substr(1000, 3),
+                   text.substr(1003)});
+#endif
+  for (size_t k = 0; k < parts.size(); ++k) {
+    if (k == 0) {
+      writeFile(file, text);
+    } else {
+#ifdef POR_HAVE_ZLIB
+      writeGzip(file, parts[k]);
+#endif
+    }
+
+    // tiny blocks and queue to exercise lines spanning blocks
+    crypto::LineReader reader(16, 2);
+    std::vector<uint64_t> positions;
+    EXPECT_EQ(readLines(reader, file, 0, &positions), expected) << k;
+    EXPECT_EQ(reader.Compressed(), k > 0);
+    EXPECT_FALSE(reader.Failed());
+    ASSERT_EQ(positions.size(), expected.size());
+    EXPECT_EQ(positions.back(), text.size());
+
+    // reopen after any line continues with the next one
+    for (size_t i : {size_t(0), size_t(99), size_t(499)}) {
+      auto rest = readLines(reader, file, positions[i]);
+      EXPECT_EQ(rest, std::vector<std::string>(expected.begin() + i + 1,
+                                               expected.end()))
+          << k << " " << i;
+    }
+  }
+
+  std::filesystem::remove(file);
+}
+
+TEST(LineReader, corrupt_and_unsupported) {
+  const std::string file = "../test/data/line_reader_test.txt";
+  crypto::LineReader reader(64, 2);
+  EXPECT_FALSE(reader.Open(file + ".missing"));
+
+  // zstd magic
+  writeFile(file, std::string("\x28\xb5\x2f\xfd\x00\x00", 6));
+  EXPECT_FALSE(reader.Open(file));
+
+#ifdef POR_HAVE_ZLIB
+  std::string text;
+  for (int i = 0; i < 1000; ++i) {
+    text += "(" + std::to_string(i) + "," + std::to_string(i * i) + ")\n";
+  }
+  writeGzip(file, {text});
+  std::ifstream f(file, std::ios::in | std::ios::binary);
+  std::string gz((std::istreambuf_iterator<char>(f)),
+                 std::istreambuf_iterator<char>());
+  f.close();
+
+  // a truncated stream fails instead of ending early, and so does garbage
+  // in the middle of it
+  std::string corrupt = gz;
+  corrupt[gz.size() / 2] ^= 0x5a;
+  for (const auto& content : {gz.substr(0, gz.size() / 2), corrupt}) {
+    writeFile(file, content);
+    ASSERT_TRUE(reader.Open(file));
+    std::string_view line;
+    while (reader.Next(line)) {
+    }
+    EXPECT_TRUE(reader.Failed());
+  }
+#else
+  // gzip can't be read without zlib
+  writeFile(file, std::string("\x1f\x8b\x08\x00", 4));
+  EXPECT_FALSE(reader.Open(file));
+#endif
+
+  std::filesystem::remove(file);
+}
@@ -1,13 +1,99 @@
 #include "por_db.h"
 
 #include <gtest/gtest.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
 #include <thread>
 
+#include "sha256.h"
 #include "tagged_hash.h"
 
+#ifdef POR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+// the JSON body the web service built from the text response
+std::string serviceJson(const std::string& info, const std::string& proof) {
+  auto number = [](const std::string& s) {
+    return std::to_string(std::stoull(s));
+  };
+  // "hash" or "hash,sum"
+  auto node = [&number](const std::string& s, const std::string& hash_key,
+                        const std::string& sum_key) {
+    size_t comma = s.find(',');
+    std::string json = "\"" + hash_key + "\":\"" + s.substr(0, comma) + "\"";
+    if (comma != std::string::npos && !sum_key.empty()) {
+      json += ",\"" + sum_key + "\":" + number(s.substr(comma + 1));
+    }
+    return json;
+  };
+
+  std::vector<std::string> fields;
+  std::stringstream ss(proof);
+  for (std::string field; ss >> field;) {
+    fields.push_back(field);
+  }
+
+  // the service drops the sum of the user hash
+  size_t comma = info.find(',');
+  std::string json = "{\"error_message\":\"Success\",\"user\":{\"id\":" +
+                     number(info.substr(1, comma - 1)) + ",\"balance\":" +
+                     number(info.substr(comma + 1)) + ",\"proof\":{" +
+                     node(fields.back(), "merkle_root", "root_sum") + "," +
+                     node(fields.front(), "UserHash", "") + ",\"merkle_path\":";
+  if (fields.size() == 2) {
+    return json + "null}}}";
+  }
+
+  std::string path;
+  for (size_t i = 1; i + 1 < fields.size(); ++i) {
+    std::string sibling = fields[i].substr(1, fields[i].size() - 2);
+    size_t comma = sibling.find(',');
+    path += std::string(path.empty() ? "" : ",") + "{\"position\":\"" +
+            sibling.substr(0, comma) + "\"," +
+            node(sibling.substr(comma + 1), "node_hash", "node_sum") + "}";
+  }
+  return json + "[" + path + "]}}}";
+}
+
+// overwrite bytes of a file at offset and renew its fingerprint, so that
+// only an audit notices
+void patchFile(const std::string& file, uint64_t offset,
+               const std::string& bytes) {
+  {
+    std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(offset);
+    f.write(bytes.data(), bytes.size());
+  }
+  std::ifstream in(file, std::ios::binary);
+  std::vector<uint8_t> content((std::istreambuf_iterator<char>(in)),
+                               std::istreambuf_iterator<char>());
+  crypto::sha256::StreamHasher hasher;
+  hasher.Append(content.data() + 32, content.size() - 32);
+  auto hash = hasher.Hash();
+  std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+  f.write(reinterpret_cast<const char*>(hash.data()), hash.size());
+}
+
+// user data file of (id, balance) records in id order
+void writeUsers(const std::string& file,
+                const std::map<uint64_t, uint64_t>& users) {
+  std::ofstream f(file);
+  f << users.size() << std::endl;
+  for (const auto& user : users) {
+    f << "(" << user.first << "," << user.second << ")" << std::endl;
+  }
+}
+}  // namespace
+
 TEST(PoRDB, preprocess) {
   std::string user_data_file = "../test/data/user_data/five_users.txt";
   std::string index_file = user_data_file + ".index";
@@ -294,6 +380,1549 @@ TEST(PoRDB, merkle_proot_three_user) {
   std::filesystem::remove(index_file);
   std::filesystem::remove(merkle_file);
 }
+
+TEST(PoRDB, merkle_sum_tree_three_user) {
+  std::string user_data_file = "../test/data/user_data/three_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+
+  // make sure index and merkle is re-generated
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+
+  crypto::PoROptions options;
+  options.sum_tree = true;
+  crypto::PoRDB db;
+  db.Load(user_data_file, options);
+  EXPECT_TRUE(
+      db.verifyFileFingerPrint(merkle_file, crypto::PoRDB::kSumMerkleMagic));
+  // 32 byte hash + 8 byte magic + 8 byte count + 7*(32 byte hash + 8 byte sum)
+  EXPECT_EQ(std::filesystem::file_size(merkle_file), 328);
+  EXPECT_EQ(db.TotalLiabilities(), 1111 + 2222 + 3333);
+
+  // calculate merkle sum tree by hand
+  auto node = [](const std::vector<uint8_t>& hash, uint64_t sum) {
+    std::vector<uint8_t> n(hash);
+    n.insert(n.end(), reinterpret_cast<uint8_t*>(&sum),
+             reinterpret_cast<uint8_t*>(&sum) + 8);
+    return n;
+  };
+  auto leaf = [](const std::string& detail) {
+    crypto::TaggedHasher hasher(crypto::PoRDB::kLeafTag);
+    hasher.Append(std::vector<uint8_t>(detail.cbegin(), detail.cend()));
+    return hasher.Hash();
+  };
+  auto branch = [](const std::vector<uint8_t>& left,
+                   const std::vector<uint8_t>& right) {
+    crypto::TaggedHasher hasher(crypto::PoRDB::kBranchTag);
+    hasher.Append(left);
+    hasher.Append(right);
+    return hasher.Hash();
+  };
+
+  auto leaf1 = leaf("(1,1111)");
+  auto leaf2 = leaf("(2,2222)");
+  auto leaf3 = leaf("(3,3333)");
+  // odd level is padded with a zero node, which adds nothing to the sum
+  std::vector<uint8_t> zero(32, 0);
+  auto parent_hash1 = branch(node(leaf1, 1111), node(leaf2, 2222));
+  auto parent_hash2 = branch(node(leaf3, 3333), node(zero, 0));
+  auto root = branch(node(parent_hash1, 3333), node(parent_hash2, 3333));
+
+  std::vector<std::pair<bool, std::vector<uint8_t>>> path;
+  std::vector<uint64_t> sums;
+  uint64_t root_sum = 0;
+  EXPECT_EQ(db.generateProof(2, path, sums, root_sum), root);
+  EXPECT_EQ(root_sum, 6666);
+  EXPECT_EQ(path.size(), 3);
+  EXPECT_EQ(path[0].second, leaf3);
+  EXPECT_EQ(sums[0], 3333);
+  EXPECT_EQ(path[1].second, zero);
+  EXPECT_EQ(sums[1], 0);
+  EXPECT_EQ(path[2].second, parent_hash1);
+  EXPECT_EQ(sums[2], 3333);
+
+  // proof is verified against the root hash and root sum
+  std::string proof;
+  EXPECT_EQ(db.UserInfo(1, proof), "(1,1111)");
+  EXPECT_FALSE(proof.empty());
+  EXPECT_NE(proof.find(",6666"), std::string::npos);
+
+  // loading the same file without sum tree rebuilds a plain merkle tree
+  crypto::PoRDB plain_db;
+  plain_db.Load(user_data_file);
+  EXPECT_TRUE(
+      plain_db.verifyFileFingerPrint(merkle_file, crypto::PoRDB::kMerkleMagic));
+  EXPECT_EQ(plain_db.TotalLiabilities(), 0);
+
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
+
+TEST(PoRDB, map_strategy) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+
+  std::map<crypto::MapStrategy, std::string> strategies{
+      {crypto::MapStrategy::kMmapLock, "mmap_lock"},
+      {crypto::MapStrategy::kPopulate, "populate"},
+      {crypto::MapStrategy::kHugePage, "hugepage"},
+      {crypto::MapStrategy::kHugeTlb, "hugetlb"}};
+  for (const auto& [strategy, name] : strategies) {
+    crypto::PoROptions options;
+    options.map_strategy = strategy;
+    options.numa_interleave = true;
+    crypto::PoRDB db;
+    EXPECT_TRUE(db.Load(user_data_file, options));
+
+    std::string proof;
+    EXPECT_EQ(db.UserInfo(3, proof), "(3,3333)");
+    EXPECT_FALSE(proof.empty());
+    EXPECT_EQ(db.UserInfo(9, proof), "");
+
+    // hugetlb falls back to transparent huge page if no huge page is reserved
+    auto metrics = db.Metrics();
+    if (strategy == crypto::MapStrategy::kHugeTlb &&
+        metrics.find("strategy=\"hugetlb\"") == std::string::npos) {
+      EXPECT_NE(metrics.find("strategy=\"hugepage\""), std::string::npos);
+    } else {
+      EXPECT_NE(metrics.find("strategy=\"" + name + "\""), std::string::npos);
+    }
+  }
+
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
+
+TEST(PoRDB, background_warmup) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+
+  crypto::PoRDB db;
+  EXPECT_TRUE(db.Load(user_data_file));
+  EXPECT_TRUE(db.Ready());
+
+  crypto::PoROptions options;
+  options.warmup = true;
+  options.warmup_threads = 2;
+  EXPECT_TRUE(db.Load(user_data_file, options));
+
+  // queries are served while warming up
+  std::string proof;
+  EXPECT_EQ(db.UserInfo(8, proof), "(8,8888)");
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!db.Ready() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(db.Ready());
+  EXPECT_NE(db.Metrics().find("por_ready{} 1"), std::string::npos);
+
+  // reloading stops the running warm-up before unmapping
+  EXPECT_TRUE(db.Load(user_data_file, options));
+  EXPECT_EQ(db.UserInfo(1, proof), "(1,1111)");
+
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
+
+TEST(PoRDB, resume_interrupted_preprocess) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::string journal = index_file + ".journal";
+  auto read_file = [](const std::string& file) {
+    std::ifstream f(file, std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f),
+                       std::istreambuf_iterator<char>());
+  };
+
+  for (bool sum_tree : {false, true}) {
+    crypto::PoROptions options;
+    options.sum_tree = sum_tree;
+    options.checkpoint_lines = 2;
+
+    // reference files built without interruption
+    crypto::PoRDB reference;
+    reference.db_options = options;
+    EXPECT_TRUE(
+        reference.preprocessUserFile(user_data_file, index_file, merkle_file));
+    EXPECT_FALSE(std::filesystem::exists(journal));
+    auto expected_index = read_file(index_file);
+    auto expected_merkle = read_file(merkle_file);
+    std::filesystem::remove(index_file);
+    std::filesystem::remove(merkle_file);
+
+    // interrupt the build after every possible checkpoint, then resume
+    for (uint64_t k = 1; k < 20; ++k) {
+      crypto::PoRDB interrupted;
+      interrupted.db_options = options;
+      uint64_t checkpoints = 0;
+      interrupted.db_options.on_checkpoint = [&checkpoints, k]() {
+        return ++checkpoints < k;
+      };
+      if (interrupted.preprocessUserFile(user_data_file, index_file,
+                                         merkle_file)) {
+        break;
+      }
+      EXPECT_TRUE(std::filesystem::exists(journal));
+      EXPECT_FALSE(std::filesystem::exists(index_file));
+
+      crypto::PoRDB resumed;
+      resumed.db_options = options;
+      EXPECT_TRUE(
+          resumed.preprocessUserFile(user_data_file, index_file, merkle_file));
+      EXPECT_FALSE(std::filesystem::exists(journal));
+      EXPECT_EQ(read_file(index_file), expected_index);
+      EXPECT_EQ(read_file(merkle_file), expected_merkle);
+      std::filesystem::remove(index_file);
+      std::filesystem::remove(merkle_file);
+    }
+  }
+}
+
+TEST(PoRDB, compressed_index) {
+  // enough users for the encoding to pay off its fixed header
+  std::string user_data_file = "../test/data/user_data/compressed_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  {
+    std::ofstream f(user_data_file);
+    f << 1000 << std::endl;
+    for (uint64_t id = 1; id <= 1000; ++id) {
+      f << "(" << id * 7 << "," << id << ")" << std::endl;
+    }
+  }
+
+  std::vector<std::string> records, proofs;
+  uintmax_t plain_size = 0;
+  for (bool compressed : {false, true}) {
+    std::filesystem::remove(index_file);
+    std::filesystem::remove(merkle_file);
+    crypto::PoROptions options;
+    options.compressed_index = compressed;
+    crypto::PoRDB db;
+    EXPECT_TRUE(db.Load(user_data_file, options));
+
+    // ids present in the file and ids in the gaps around them
+    for (uint64_t id = 0; id < 7010; ++id) {
+      std::string proof;
+      std::string record = db.UserInfo(id, proof);
+      if (compressed) {
+        ASSERT_EQ(record, records[id]);
+        ASSERT_EQ(proof, proofs[id]);
+      } else {
+        records.push_back(record);
+        proofs.push_back(proof);
+      }
+    }
+    EXPECT_EQ(records[21], "(21,3)");
+    EXPECT_EQ(records[22], "");
+
+    if (compressed) {
+      EXPECT_LT(std::filesystem::file_size(index_file), plain_size);
+    } else {
+      plain_size = std::filesystem::file_size(index_file);
+    }
+  }
+
+  std::filesystem::remove(user_data_file);
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
+
+TEST(PoRDB, binary_records) {
+  std::string user_data_file = "../test/data/user_data/binary_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  {
+    std::ofstream f(user_data_file);
+    f << 1000 << std::endl;
+    for (uint64_t id = 1; id <= 1000; ++id) {
+      f << "(" << id * 7 << "," << id * id * 1000003 << ")" << std::endl;
+    }
+  }
+
+  // text records are the reference for every binary layout
+  for (bool sum_tree : {false, true}) {
+    std::vector<std::string> records, proofs;
+    uintmax_t text_size = 0;
+    for (int mode = 0; mode < 3; ++mode) {
+      std::filesystem::remove(index_file);
+      std::filesystem::remove(merkle_file);
+      crypto::PoROptions options;
+      options.sum_tree = sum_tree;
+      options.binary_records = mode > 0;
+      options.compressed_index = mode > 1;
+      crypto::PoRDB db;
+      EXPECT_TRUE(db.Load(user_data_file, options));
+
+      for (uint64_t id = 0; id < 7010; ++id) {
+        std::string proof;
+        std::string record = db.UserInfo(id, proof);
+        if (mode > 0) {
+          ASSERT_EQ(record, records[id]);
+          ASSERT_EQ(proof, proofs[id]);
+        } else {
+          records.push_back(record);
+          proofs.push_back(proof);
+        }
+      }
+      EXPECT_EQ(records[21], "(21,9000027)");
+
+      if (mode == 0) {
+        text_size = std::filesystem::file_size(index_file);
+      } else {
+        EXPECT_LT(std::filesystem::file_size(index_file), text_size);
+      }
+    }
+  }
+
+  // a record that can't be rendered back can't be stored in binary
+  {
+    std::ofstream f(user_data_file);
+    f << 2 << std::endl << "(1,1111)" << std::endl << "(2,02222)" << std::endl;
+  }
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+  crypto::PoROptions options;
+  options.binary_records = true;
+  crypto::PoRDB db;
+  EXPECT_FALSE(db.Load(user_data_file, options));
+
+  std::filesystem::remove(user_data_file);
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+  std::filesystem::remove(index_file + ".tmp");
+  std::filesystem::remove(merkle_file + ".tmp");
+  std::filesystem::remove(index_file + ".journal");
+}
+
+TEST(PoRDB, learned_index) {
+  // ids in a few clusters of different density, as merged from several
+  // legacy systems
+  std::string user_data_file = "../test/data/user_data/learned_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::vector<uint64_t> ids;
+  for (uint64_t i = 0; i < 300; ++i) {
+    ids.push_back(10 + i);
+  }
+  for (uint64_t i = 0; i < 300; ++i) {
+    ids.push_back(100000 + i * i * 13);
+  }
+  for (uint64_t i = 0; i < 300; ++i) {
+    ids.push_back(1ULL << 40 | (i * 977));
+  }
+  {
+    std::ofstream f(user_data_file);
+    f << ids.size() << std::endl;
+    for (auto id : ids) {
+      f << "(" << id << "," << id % 1000 << ")" << std::endl;
+    }
+  }
+
+  // probe every id and its neighbours
+  std::vector<uint64_t> probes = {0, ~0ULL};
+  for (auto id : ids) {
+    probes.push_back(id - 1);
+    probes.push_back(id);
+    probes.push_back(id + 1);
+  }
+
+  // binary search is the reference
+  std::vector<std::string> records, proofs;
+  for (int mode = 0; mode < 4; ++mode) {
+    std::filesystem::remove(index_file);
+    std::filesystem::remove(merkle_file);
+    crypto::PoROptions options;
+    options.learned_index = mode > 0;
+    options.learned_index_epsilon = mode == 1 ? 1 : 16;
+    options.binary_records = mode == 3;
+    crypto::PoRDB db;
+    EXPECT_TRUE(db.Load(user_data_file, options));
+    if (mode > 0) {
+      EXPECT_GT(db.index_model.Segments(), 0);
+    }
+
+    for (size_t i = 0; i < probes.size(); ++i) {
+      std::string proof;
+      std::string record = db.UserInfo(probes[i], proof);
+      if (mode > 0) {
+        ASSERT_EQ(record, records[i]);
+        ASSERT_EQ(proof, proofs[i]);
+      } else {
+        records.push_back(record);
+        proofs.push_back(proof);
+      }
+    }
+    EXPECT_EQ(records[2], "");
+    EXPECT_EQ(records[3], "(10,10)");
+  }
+
+  std::filesystem::remove(user_data_file);
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
+
+TEST(PoRDB, id_filter) {
+  std::string user_data_file = "../test/data/user_data/filter_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::string filter_file = user_data_file + ".filter";
+  {
+    std::ofstream f(user_data_file);
+    f << 1000 << std::endl;
+    for (uint64_t id = 1; id <= 1000; ++id) {
+      f << "(" << id * 5 << "," << id << ")" << std::endl;
+    }
+  }
+
+  std::vector<std::string> records, proofs;
+  for (bool id_filter : {false, true}) {
+    std::filesystem::remove(index_file);
+    std::filesystem::remove(merkle_file);
+    crypto::PoROptions options;
+    options.id_filter = id_filter;
+    options.binary_records = id_filter;
+    crypto::PoRDB db;
+    EXPECT_TRUE(db.Load(user_data_file, options));
+    EXPECT_EQ(std::filesystem::exists(filter_file), id_filter);
+
+    for (uint64_t id = 0; id < 5010; ++id) {
+      std::string proof;
+      std::string record = db.UserInfo(id, proof);
+      if (id_filter) {
+        ASSERT_EQ(record, records[id]);
+        ASSERT_EQ(proof, proofs[id]);
+      } else {
+        records.push_back(record);
+        proofs.push_back(proof);
+      }
+    }
+
+    // 4010 unknown ids, about 1% pass the filter
+    if (id_filter) {
+      EXPECT_GT(db.filter_rejects, 3900);
+      EXPECT_NE(db.Metrics().find("por_filter_rejects_total"),
+                std::string::npos);
+    }
+  }
+
+  // a damaged filter is rebuilt with the database
+  {
+    std::fstream f(filter_file, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(60);
+    f.put(0x5a);
+  }
+  crypto::PoROptions options;
+  options.id_filter = true;
+  options.binary_records = true;
+  crypto::PoRDB db;
+  EXPECT_TRUE(db.Load(user_data_file, options));
+  std::string proof;
+  EXPECT_EQ(db.UserInfo(5000, proof), "(5000,1000)");
+  EXPECT_EQ(proof, proofs[5000]);
+
+  std::filesystem::remove(user_data_file);
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+  std::filesystem::remove(filter_file);
+}
+
+TEST(PoRDB, response_cache) {
+  std::string eight_users = "../test/data/user_data/eight_users.txt";
+  std::string three_users = "../test/data/user_data/three_users.txt";
+  crypto::PoRDB reference;
+  EXPECT_TRUE(reference.Load(eight_users));
+  std::vector<std::string> records, proofs;
+  for (uint64_t id = 0; id < 10; ++id) {
+    std::string proof;
+    records.push_back(reference.UserInfo(id, proof));
+    proofs.push_back(proof);
+  }
+
+  crypto::PoROptions options;
+  options.response_cache_bytes = 1 << 20;
+  crypto::PoRDB db;
+  EXPECT_TRUE(db.Load(eight_users, options));
+  for (int round = 0; round < 3; ++round) {
+    for (uint64_t id = 0; id < 10; ++id) {
+      std::string proof;
+      EXPECT_EQ(db.UserInfo(id, proof), records[id]);
+      EXPECT_EQ(proof, proofs[id]);
+    }
+  }
+  EXPECT_EQ(db.response_cache->Hits(), 16);
+  EXPECT_NE(db.Metrics().find("por_cache_hits_total{} 16"), std::string::npos);
+
+  // a new snapshot doesn't serve responses of the old one
+  EXPECT_TRUE(reference.Load(three_users));
+  std::string expected_proof;
+  std::string expected = reference.UserInfo(1, expected_proof);
+  EXPECT_TRUE(db.Load(three_users, options));
+  std::string proof;
+  EXPECT_EQ(db.UserInfo(1, proof), expected);
+  EXPECT_EQ(proof, expected_proof);
+  EXPECT_NE(proof, proofs[1]);
+  EXPECT_EQ(db.response_cache->Hits(), 0);
+
+  for (const auto& file : {eight_users, three_users}) {
+    std::filesystem::remove(file + ".index");
+    std::filesystem::remove(file + ".merkle");
+  }
+}
+
+TEST(PoRDB, json_response) {
+  for (const std::string name : {"one_user", "three_users", "eight_users"}) {
+    std::string user_data_file = "../test/data/user_data/" + name + ".txt";
+    for (bool sum_tree : {false, true}) {
+      for (size_t cache : {0, 1 << 20}) {
+        crypto::PoROptions options;
+        options.sum_tree = sum_tree;
+        options.response_cache_bytes = cache;
+        crypto::PoRDB db;
+        EXPECT_TRUE(db.Load(user_data_file, options));
+
+        std::string json = "stale";
+        for (int round = 0; round < 2; ++round) {
+          for (uint64_t id = 0; id < 10; ++id) {
+            std::string proof;
+            std::string info = db.UserInfo(id, proof);
+            EXPECT_EQ(db.UserInfoJson(id, json), !info.empty());
+            EXPECT_EQ(json, info.empty() ? "" : serviceJson(info, proof));
+          }
+        }
+      }
+
+      std::filesystem::remove(user_data_file + ".index");
+      std::filesystem::remove(user_data_file + ".merkle");
+    }
+  }
+}
+
+TEST(PoRDB, buffer_pool) {
+  std::string user_data_file = "../test/data/user_data/pool_users.txt";
+  {
+    std::ofstream f(user_data_file);
+    f << 3000 << std::endl;
+    for (uint64_t id = 1; id <= 3000; ++id) {
+      f << "(" << id * 3 << "," << id << ")" << std::endl;
+    }
+  }
+
+  enum mode { kPlain, kSumTree, kCompressed, kBinary, kLearned, kFilter };
+  for (mode m :
+       {kPlain, kSumTree, kCompressed, kBinary, kLearned, kFilter}) {
+    for (const char* suffix : {".index", ".merkle", ".filter"}) {
+      std::filesystem::remove(user_data_file + suffix);
+    }
+    crypto::PoROptions options;
+    options.sum_tree = m == kSumTree;
+    options.compressed_index = m == kCompressed || m == kFilter;
+    options.binary_records = m == kBinary || m == kFilter;
+    options.learned_index = m == kLearned;
+    options.id_filter = m == kFilter;
+    crypto::PoRDB reference;
+    ASSERT_TRUE(reference.Load(user_data_file, options));
+
+    // too small for the files, pages keep being evicted
+    options.map_strategy = crypto::MapStrategy::kBufferPool;
+    options.buffer_pool_bytes = 64 << 10;
+    crypto::PoRDB db;
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    ASSERT_TRUE(db.buffer_pool);
+    EXPECT_GT(db.buffer_pool->PinnedBytes(), 0);
+    EXPECT_EQ(db.TotalLiabilities(), reference.TotalLiabilities());
+
+    for (uint64_t id = 0; id < 9010; id += 7) {
+      std::string proof, expected_proof;
+      ASSERT_EQ(db.UserInfo(id, proof), reference.UserInfo(id, expected_proof))
+          << m << " " << id;
+      ASSERT_EQ(proof, expected_proof);
+      std::string json, expected_json;
+      ASSERT_EQ(db.UserInfoJson(id, json),
+                reference.UserInfoJson(id, expected_json));
+      ASSERT_EQ(json, expected_json);
+    }
+    EXPECT_GT(db.buffer_pool->Evictions(), 0);
+    auto metrics = db.Metrics();
+    EXPECT_NE(metrics.find("strategy=\"buffer_pool\""), std::string::npos);
+    EXPECT_NE(metrics.find("por_buffer_pool_misses_total"), std::string::npos);
+  }
+
+  for (const char* suffix : {"", ".index", ".merkle", ".filter"}) {
+    std::filesystem::remove(user_data_file + suffix);
+  }
+}
+
+TEST(PoRDB, dropped_merkle_levels) {
+  std::string user_data_file = "../test/data/user_data/pruned_users.txt";
+  std::string merkle_file = user_data_file + ".merkle";
+  // odd and even levels, with padding inside and at the end of subtrees
+  for (uint64_t users : {1, 2, 3, 5, 13, 1000, 1001}) {
+    {
+      // blanks after the comma are accepted, and rehashed the same way
+      std::ofstream f(user_data_file);
+      f << users << std::endl;
+      for (uint64_t id = 1; id <= users; ++id) {
+        f << "(" << id * 2 << (id % 3 == 0 ? ", " : ",") << id * 7 << ")"
+          << std::endl;
+      }
+    }
+    for (bool sum_tree : {false, true}) {
+      std::filesystem::remove(user_data_file + ".index");
+      std::filesystem::remove(merkle_file);
+      crypto::PoROptions options;
+      options.sum_tree = sum_tree;
+      crypto::PoRDB reference;
+      ASSERT_TRUE(reference.Load(user_data_file, options));
+      uint64_t full_size = std::filesystem::file_size(merkle_file);
+      std::vector<std::string> records, proofs;
+      for (uint64_t id = 0; id <= users * 2 + 1; ++id) {
+        std::string proof;
+        records.push_back(reference.UserInfo(id, proof));
+        proofs.push_back(proof);
+      }
+
+      // 64 drops everything but the root, each proof rehashes the tree
+      for (uint64_t k : {1, 3, 64}) {
+        if (k == 64 && users > 13) {
+          continue;
+        }
+        std::filesystem::remove(user_data_file + ".index");
+        std::filesystem::remove(merkle_file);
+        options.merkle_dropped_levels = k;
+        for (auto strategy : {crypto::MapStrategy::kMmapLock,
+                              crypto::MapStrategy::kBufferPool}) {
+          options.map_strategy = strategy;
+          crypto::PoRDB db;
+          ASSERT_TRUE(db.Load(user_data_file, options));
+          if (users > 1) {
+            EXPECT_LT(std::filesystem::file_size(merkle_file), full_size);
+          }
+          EXPECT_EQ(db.TotalLiabilities(), reference.TotalLiabilities());
+          for (uint64_t id = 0; id <= users * 2 + 1; id += users > 13 ? 5 : 1) {
+            std::string proof;
+            ASSERT_EQ(db.UserInfo(id, proof), records[id]);
+            ASSERT_EQ(proof, proofs[id])
+                << users << " " << sum_tree << " " << k << " " << id;
+            ASSERT_EQ(proof.empty(), records[id].empty());
+          }
+        }
+      }
+    }
+  }
+
+  // a full merkle file is rebuilt when levels are to be dropped
+  crypto::PoROptions options;
+  crypto::PoRDB db;
+  std::filesystem::remove(user_data_file + ".index");
+  std::filesystem::remove(merkle_file);
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  uint64_t full_size = std::filesystem::file_size(merkle_file);
+  options.merkle_dropped_levels = 2;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  EXPECT_LT(std::filesystem::file_size(merkle_file), full_size / 3);
+
+  for (const char* suffix : {"", ".index", ".merkle"}) {
+    std::filesystem::remove(user_data_file + suffix);
+  }
+}
+
+TEST(PoRDB, audit) {
+  std::string user_data_file = "../test/data/user_data/audit_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  const uint64_t users = 1001;
+  {
+    std::ofstream f(user_data_file);
+    f << users << std::endl;
+    for (uint64_t id = 1; id <= users; ++id) {
+      f << "(" << id * 2 << "," << id * 7 << ")" << std::endl;
+    }
+  }
+  auto reset = [&]() {
+    std::filesystem::remove(index_file);
+    std::filesystem::remove(merkle_file);
+  };
+
+  std::vector<crypto::PoROptions> modes(7);
+  modes[1].sum_tree = true;
+  modes[2].compressed_index = true;
+  modes[3].binary_records = true;
+  modes[3].sum_tree = true;
+  modes[4].learned_index = true;
+  modes[5].merkle_dropped_levels = 3;
+  modes[5].sum_tree = true;
+  modes[6].map_strategy = crypto::MapStrategy::kBufferPool;
+  modes[6].merkle_dropped_levels = 2;
+  std::vector<uint8_t> root;
+  for (const auto& options : modes) {
+    reset();
+    crypto::PoRDB db;
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    for (size_t threads : {1, 3}) {
+      crypto::AuditReport report;
+      EXPECT_TRUE(db.Audit(report, threads)) << report.error;
+      EXPECT_TRUE(report.ok);
+      EXPECT_EQ(report.users, users);
+      EXPECT_EQ(report.root.size(), 32);
+      if (options.sum_tree) {
+        EXPECT_EQ(report.root_sum, db.TotalLiabilities());
+      }
+      if (!options.sum_tree) {
+        if (root.empty()) {
+          root = report.root;
+        }
+        EXPECT_EQ(report.root, root);
+      }
+    }
+  }
+
+  crypto::AuditReport report;
+  crypto::PoRDB db;
+  EXPECT_FALSE(db.Audit(report));
+  EXPECT_FALSE(report.error.empty());
+
+  // nothing is rebuilt without rebuild, a bad fingerprint fails Load
+  reset();
+  crypto::PoROptions options;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  ASSERT_TRUE(db.Audit(report, 2, root));
+  std::vector<uint8_t> wrong_root = root;
+  wrong_root[0] ^= 0x01;
+  EXPECT_FALSE(db.Audit(report, 2, wrong_root));
+  options.rebuild = false;
+  {
+    std::fstream f(merkle_file, std::ios::in | std::ios::out);
+    f.seekp(100);
+    f.put('x');
+  }
+  EXPECT_FALSE(db.Load(user_data_file, options));
+
+  // a leaf and a branch of 1001 users: the leaf level holds 1002 nodes
+  const uint64_t leaf_level = 48;
+  const uint64_t branch_level = leaf_level + 1002 * 32;
+  reset();
+  options.rebuild = true;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  patchFile(merkle_file, leaf_level + 5 * 32, "x");
+  patchFile(merkle_file, branch_level + 300 * 32 + 31, "y");
+  options.rebuild = false;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  EXPECT_FALSE(db.Audit(report, 3));
+  EXPECT_EQ(report.height, 0);
+  EXPECT_EQ(report.index, 5);
+  EXPECT_FALSE(report.error.empty());
+
+  reset();
+  options.rebuild = true;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  patchFile(merkle_file, branch_level + 300 * 32 + 31, "y");
+  options.rebuild = false;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  EXPECT_FALSE(db.Audit(report, 3));
+  EXPECT_EQ(report.height, 1);
+  EXPECT_EQ(report.index, 300);
+
+  // padding of the odd leaf level is a copy of the last leaf
+  reset();
+  options.rebuild = true;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  patchFile(merkle_file, leaf_level + 1001 * 32, "z");
+  options.rebuild = false;
+  ASSERT_TRUE(db.Load(user_data_file, options));
+  EXPECT_FALSE(db.Audit(report));
+  EXPECT_EQ(report.height, 0);
+  EXPECT_EQ(report.index, 1001);
+
+  // a record that no longer hashes to its leaf, or to its subtree
+  for (uint64_t dropped : {0, 2}) {
+    reset();
+    options.rebuild = true;
+    options.merkle_dropped_levels = dropped;
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    std::ifstream in(index_file, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+    size_t at = content.find("(614,2149)");
+    ASSERT_NE(at, std::string::npos);
+    patchFile(index_file, at + 6, "3");
+    options.rebuild = false;
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    EXPECT_FALSE(db.Audit(report, 2));
+    EXPECT_EQ(report.height, dropped);
+    EXPECT_EQ(report.index, 306 >> dropped);
+
+    // a record of another id
+    patchFile(index_file, at + 1, "7");
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    EXPECT_FALSE(db.Audit(report, 2));
+    EXPECT_EQ(report.index, 306 >> dropped);
+    EXPECT_NE(report.error.find("index id"), std::string::npos);
+  }
+
+  // records with blanks around the balance are valid, in sum tree too
+  {
+    std::ofstream f(user_data_file);
+    f << 3 << std::endl << "(1, 10)" << std::endl;
+    f << "(2,20 )" << std::endl << "(3,\t30)" << std::endl;
+  }
+  for (uint64_t dropped : {0, 1}) {
+    reset();
+    options = crypto::PoROptions();
+    options.sum_tree = true;
+    options.merkle_dropped_levels = dropped;
+    ASSERT_TRUE(db.Load(user_data_file, options));
+    EXPECT_TRUE(db.Audit(report, 2)) << report.error;
+    EXPECT_EQ(report.root_sum, 60);
+  }
+
+  for (const char* suffix : {"", ".index", ".merkle"}) {
+    std::filesystem::remove(user_data_file + suffix);
+  }
+}
+
+TEST(PoRDB, snapshot_diff) {
+  std::string old_file = "../test/data/user_data/diff_old_users.txt";
+  std::string new_file = "../test/data/user_data/diff_new_users.txt";
+  auto reset = [&]() {
+    for (const std::string& file : {old_file, new_file}) {
+      std::filesystem::remove(file + ".index");
+      std::filesystem::remove(file + ".merkle");
+    }
+  };
+  auto record = [](uint64_t id, uint64_t balance) {
+    return "(" + std::to_string(id) + "," + std::to_string(balance) + ")";
+  };
+  std::map<uint64_t, uint64_t> old_users;
+  for (uint64_t id = 1; id <= 1001; ++id) {
+    old_users[id * 2] = id * 7;
+  }
+
+  // balance changes in place, users appended and removed from the end, and
+  // an insertion that shifts every position after it
+  std::vector<std::map<uint64_t, uint64_t>> snapshots(4, old_users);
+  snapshots[1][2] = 1;
+  snapshots[1][1000] = 1;
+  snapshots[1][2002] = 1;
+  snapshots[2][4000] = 5;
+  snapshots[2][4002] = 5;
+  snapshots[2][20] = 0;
+  snapshots[3].erase(2002);
+  snapshots[3].erase(2000);
+  snapshots[3][1001] = 3;
+  snapshots[3][7] = 3;
+  writeUsers(old_file, old_users);
+
+  for (uint64_t dropped : {0, 2}) {
+    for (bool sum_tree : {false, true}) {
+      crypto::PoROptions options;
+      options.sum_tree = sum_tree;
+      options.merkle_dropped_levels = dropped;
+      reset();
+      crypto::PoRDB older;
+      ASSERT_TRUE(older.Load(old_file, options));
+
+      for (const auto& snapshot : snapshots) {
+        std::vector<crypto::UserChange> expected;
+        for (const auto& user : old_users) {
+          auto it = snapshot.find(user.first);
+          if (it == snapshot.end()) {
+            expected.push_back(
+                {user.first, record(user.first, user.second), ""});
+          } else if (it->second != user.second) {
+            expected.push_back({user.first, record(user.first, user.second),
+                                record(it->first, it->second)});
+          }
+        }
+        for (const auto& user : snapshot) {
+          if (old_users.count(user.first) == 0) {
+            expected.push_back(
+                {user.first, "", record(user.first, user.second)});
+          }
+        }
+        std::sort(expected.begin(), expected.end(),
+                  [](const auto& a, const auto& b) { return a.id < b.id; });
+
+        writeUsers(new_file, snapshot);
+        std::filesystem::remove(new_file + ".index");
+        std::filesystem::remove(new_file + ".merkle");
+        crypto::PoROptions new_options = options;
+        // the lowest stored levels needn't agree
+        new_options.merkle_dropped_levels = dropped == 0 ? 1 : 0;
+        crypto::PoRDB newer;
+        ASSERT_TRUE(newer.Load(new_file, new_options));
+        for (size_t threads : {1, 3}) {
+          std::vector<crypto::UserChange> changes;
+          ASSERT_TRUE(older.Diff(newer, changes, threads));
+          ASSERT_EQ(changes.size(), expected.size());
+          for (size_t i = 0; i < changes.size(); ++i) {
+            EXPECT_EQ(changes[i].id, expected[i].id);
+            EXPECT_EQ(changes[i].before, expected[i].before);
+            EXPECT_EQ(changes[i].after, expected[i].after);
+          }
+        }
+      }
+    }
+  }
+
+  // formats of the tree must agree, both must be loaded
+  reset();
+  crypto::PoROptions options;
+  crypto::PoRDB older, newer, empty;
+  ASSERT_TRUE(older.Load(old_file, options));
+  options.sum_tree = true;
+  ASSERT_TRUE(newer.Load(new_file, options));
+  std::vector<crypto::UserChange> changes;
+  EXPECT_FALSE(older.Diff(newer, changes));
+  EXPECT_FALSE(older.Diff(empty, changes));
+  EXPECT_TRUE(older.Diff(older, changes));
+  EXPECT_TRUE(changes.empty());
+
+  for (const std::string& file : {old_file, new_file}) {
+    for (const char* suffix : {"", ".index", ".merkle"}) {
+      std::filesystem::remove(file + suffix);
+    }
+  }
+}
+
+TEST(PoRDB, append_users) {
+  std::string user_file = "../test/data/user_data/append_users.txt";
+  std::string full_file = "../test/data/user_data/append_full_users.txt";
+  auto reset = [](const std::string& file) {
+    for (const char* suffix :
+         {".index", ".merkle", ".filter", ".append", ".append.merged"}) {
+      std::filesystem::remove(file + suffix);
+    }
+  };
+
+  std::vector<crypto::PoROptions> modes(9);
+  modes[1].sum_tree = true;
+  modes[2].merkle_dropped_levels = 2;
+  modes[3].sum_tree = true;
+  modes[3].merkle_dropped_levels = 3;
+  modes[4].compressed_index = true;
+  modes[5].binary_records = true;
+  modes[6].id_filter = true;
+  modes[6].learned_index = true;
+  modes[7].map_strategy = crypto::MapStrategy::kBufferPool;
+  modes[7].buffer_pool_bytes = 1 << 16;
+  modes[8].response_cache_bytes = 1 << 20;
+  // batches grow the tree by one or more levels, the last one spans chunks
+  const std::vector<uint64_t> batches = {1, 2, 5, 30, 100, 2100};
+
+  for (uint64_t base : {1, 37, 64}) {
+    for (size_t m = 0; m < modes.size(); ++m) {
+      std::map<uint64_t, uint64_t> users;
+      for (uint64_t id = 1; id <= base; ++id) {
+        users[id * 2] = id * 7;
+      }
+      writeUsers(user_file, users);
+      reset(user_file);
+      crypto::PoRDB db;
+      ASSERT_TRUE(db.Load(user_file, modes[m]));
+
+      for (uint64_t batch : batches) {
+        std::string proof;
+        uint64_t next_id = users.rbegin()->first + 3;
+        EXPECT_EQ(db.UserInfo(next_id, proof), "");
+
+        std::vector<std::pair<uint64_t, uint64_t>> appended;
+        for (uint64_t i = 0; i < batch; ++i) {
+          appended.push_back(std::make_pair(next_id + i * 3, i + 1));
+          users[next_id + i * 3] = i + 1;
+        }
+        ASSERT_TRUE(db.Append(appended));
+
+        // same records and proofs as the database built from all users
+        writeUsers(full_file, users);
+        reset(full_file);
+        crypto::PoRDB expected;
+        ASSERT_TRUE(expected.Load(full_file, modes[m]));
+        EXPECT_EQ(db.TotalLiabilities(), expected.TotalLiabilities());
+        for (uint64_t id = 0; id <= users.rbegin()->first + 1; ++id) {
+          std::string expected_proof;
+          std::string record = expected.UserInfo(id, expected_proof);
+          ASSERT_EQ(db.UserInfo(id, proof), record)
+              << base << " " << m << " " << id;
+          if (!record.empty()) {
+            ASSERT_EQ(proof, expected_proof) << base << " " << m << " " << id;
+          }
+          std::string json, expected_json;
+          EXPECT_EQ(db.UserInfoJson(id, json),
+                    expected.UserInfoJson(id, expected_json));
+          EXPECT_EQ(json, expected_json);
+        }
+      }
+    }
+  }
+
+  // ids must ascend above the largest one, a rejected batch changes nothing
+  crypto::PoRDB db;
+  std::map<uint64_t, uint64_t> users = {{2, 1}, {4, 2}, {6, 3}};
+  writeUsers(user_file, users);
+  reset(user_file);
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_FALSE(db.Append({}));
+  EXPECT_FALSE(db.Append({{6, 1}}));
+  EXPECT_FALSE(db.Append({{8, 1}, {8, 2}}));
+  EXPECT_FALSE(db.Append({{10, 1}, {9, 2}}));
+  std::string proof;
+  EXPECT_EQ(db.UserInfo(10, proof), "");
+  ASSERT_TRUE(db.Append({{8, 4}, {10, 5}}));
+  EXPECT_FALSE(db.Append({{9, 1}}));
+  ASSERT_TRUE(db.Append({{11, 6}}));
+  EXPECT_NE(db.Metrics().find("por_appended_users{} 3"), std::string::npos);
+  std::vector<crypto::UserChange> changes;
+  EXPECT_FALSE(db.Diff(db, changes));
+  crypto::AuditReport report;
+  EXPECT_FALSE(db.Audit(report));
+
+  // appended users survive a reload
+  users[8] = 4;
+  users[10] = 5;
+  users[11] = 6;
+  writeUsers(full_file, users);
+  reset(full_file);
+  crypto::PoRDB expected;
+  ASSERT_TRUE(expected.Load(full_file));
+  std::string expected_proof;
+  EXPECT_EQ(expected.UserInfo(10, expected_proof), "(10,5)");
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_EQ(db.UserInfo(10, proof), "(10,5)");
+  EXPECT_EQ(proof, expected_proof);
+
+  // a torn record of an unfinished Append is ignored and written over,
+  // a damaged one before the last fails the Load
+  const std::string append_file = user_file + ".append";
+  const auto append_size = std::filesystem::file_size(append_file);
+  {
+    std::ofstream f(append_file, std::ios::out | std::ios::binary |
+                                     std::ios::app);
+    f << std::string(30, 'x');
+  }
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_EQ(db.UserInfo(10, proof), "(10,5)");
+  EXPECT_EQ(proof, expected_proof);
+  ASSERT_TRUE(db.Append({{12, 7}}));
+  EXPECT_EQ(std::filesystem::file_size(append_file), append_size + 56);
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_EQ(db.UserInfo(12, proof), "(12,7)");
+  std::filesystem::copy_file(append_file, user_file + ".saved");
+  {
+    std::fstream f(append_file, std::ios::in | std::ios::out |
+                                    std::ios::binary);
+    f.seekp(48 + 8);
+    f.put(9);
+  }
+  EXPECT_FALSE(db.Load(user_file));
+  std::filesystem::rename(user_file + ".saved", append_file);
+  std::filesystem::resize_file(append_file, append_size);
+
+  // an identical rebuild keeps the appended users
+  std::filesystem::remove(user_file + ".merkle");
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_EQ(db.UserInfo(10, proof), "(10,5)");
+  EXPECT_EQ(proof, expected_proof);
+
+  // after a rebuild which doesn't have them, Load fails and the append file
+  // is kept. Once they are in the user data file, it is moved aside.
+  std::filesystem::copy_file(append_file, user_file + ".saved");
+  users.erase(11);
+  writeUsers(user_file, users);
+  std::filesystem::remove(user_file + ".merkle");
+  EXPECT_FALSE(db.Load(user_file));
+  EXPECT_TRUE(std::filesystem::exists(append_file));
+  users[11] = 6;
+  writeUsers(user_file, users);
+  std::filesystem::remove(user_file + ".merkle");
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_FALSE(std::filesystem::exists(append_file));
+  EXPECT_TRUE(std::filesystem::exists(append_file + ".merged"));
+  EXPECT_EQ(db.UserInfo(10, proof), "(10,5)");
+  EXPECT_EQ(proof, expected_proof);
+  EXPECT_TRUE(db.Audit(report));
+  std::filesystem::rename(user_file + ".saved", append_file);
+  ASSERT_TRUE(db.Load(user_file));
+  EXPECT_FALSE(std::filesystem::exists(append_file));
+  EXPECT_EQ(db.UserInfo(10, proof), "(10,5)");
+
+  // the total liabilities of a sum tree can't overflow
+  crypto::PoROptions sum_tree;
+  sum_tree.sum_tree = true;
+  writeUsers(user_file, {{1, 10}, {2, 20}});
+  reset(user_file);
+  ASSERT_TRUE(db.Load(user_file, sum_tree));
+  EXPECT_FALSE(db.Append({{3, UINT64_MAX}}));
+  EXPECT_FALSE(db.Append({{3, 1}, {4, UINT64_MAX - 30}}));
+  EXPECT_EQ(db.TotalLiabilities(), 30u);
+  ASSERT_TRUE(db.Append({{3, UINT64_MAX - 31}}));
+  EXPECT_FALSE(db.Append({{4, 2}}));
+  ASSERT_TRUE(db.Append({{4, 1}}));
+  EXPECT_EQ(db.TotalLiabilities(), UINT64_MAX);
+
+  for (const std::string& file : {user_file, full_file}) {
+    reset(file);
+    std::filesystem::remove(file);
+  }
+}
+
+TEST(PoRDB, single_file) {
+  std::string user_file = "../test/data/user_data/single_file_users.txt";
+  std::string split_file = "../test/data/user_data/split_file_users.txt";
+  auto reset = [](const std::string& file) {
+    for (const char* suffix :
+         {".index", ".merkle", ".filter", ".append", ".por"}) {
+      std::filesystem::remove(file + suffix);
+    }
+  };
+  for (const std::string& file : {user_file, split_file}) {
+    std::ofstream f(file);
+    f << 1500 << std::endl;
+    for (uint64_t id = 1; id <= 1500; ++id) {
+      f << "(" << id * 5 << "," << id % 97 << ")" << std::endl;
+    }
+  }
+
+  std::vector<crypto::PoROptions> modes(5);
+  modes[1].sum_tree = true;
+  modes[1].merkle_dropped_levels = 2;
+  modes[2].compressed_index = true;
+  modes[2].id_filter = true;
+  modes[3].binary_records = true;
+  modes[3].learned_index = true;
+  modes[4].map_strategy = crypto::MapStrategy::kHugePage;
+  for (size_t m = 0; m < modes.size(); ++m) {
+    reset(user_file);
+    reset(split_file);
+    crypto::PoRDB split;
+    ASSERT_TRUE(split.Load(split_file, modes[m]));
+    crypto::PoROptions options = modes[m];
+    options.single_file = true;
+    for (int round = 0; round < 2; ++round) {
+      // the first load packs the separate files, the second maps the result
+      crypto::PoRDB db;
+      ASSERT_TRUE(db.Load(user_file, options)) << m;
+      EXPECT_TRUE(std::filesystem::exists(user_file + ".por"));
+      EXPECT_FALSE(std::filesystem::exists(user_file + ".index"));
+      EXPECT_FALSE(std::filesystem::exists(user_file + ".merkle"));
+      EXPECT_FALSE(std::filesystem::exists(user_file + ".filter"));
+      EXPECT_NE(db.Metrics().find("file=\"database\""), std::string::npos);
+      EXPECT_EQ(db.TotalLiabilities(), split.TotalLiabilities());
+      for (uint64_t id = 0; id <= 7510; id += 7) {
+        std::string proof, split_proof;
+        ASSERT_EQ(db.UserInfo(id, proof), split.UserInfo(id, split_proof))
+            << m << " " << id;
+        ASSERT_EQ(proof, split_proof);
+      }
+      crypto::AuditReport report;
+      EXPECT_TRUE(db.Audit(report, 2)) << report.error;
+
+      // the level directory locates every stored merkle level in the file
+      std::ifstream f(user_file + ".por", std::ios::binary);
+      std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(f)),
+                                 std::istreambuf_iterator<char>());
+      uint64_t sections = *reinterpret_cast<const uint64_t*>(&bytes[48]);
+      std::vector<uint64_t> directory;
+      for (uint64_t i = 0; i < sections; ++i) {
+        const uint64_t* entry =
+            reinterpret_cast<const uint64_t*>(&bytes[56 + i * 56]);
+        EXPECT_EQ(entry[1] % 4096, 0);
+        if (entry[0] == 4) {
+          directory.assign(
+              reinterpret_cast<const uint64_t*>(&bytes[entry[1]]),
+              reinterpret_cast<const uint64_t*>(&bytes[entry[1] + entry[2]]));
+        }
+      }
+      auto levels = db.merkleLevels(db.userCount());
+      ASSERT_EQ(directory.size(), 2 * levels.size());
+      const size_t node_size = options.sum_tree ? 40 : 32;
+      for (size_t i = 0; i < levels.size(); ++i) {
+        EXPECT_EQ(directory[2 * i + 1], levels[i].second);
+        // the first node of a level is in the file at its offset
+        EXPECT_TRUE(std::equal(bytes.begin() + directory[2 * i],
+                               bytes.begin() + directory[2 * i] + node_size,
+                               db.merkleBytes(levels[i].first, node_size,
+                                              nullptr)));
+      }
+    }
+  }
+
+  // a damaged section or table is rebuilt, or fails the load without
+  // rebuild. The tree format must match the options.
+  crypto::PoROptions options;
+  options.single_file = true;
+  crypto::PoRDB db;
+  std::string proof, expected_proof;
+  reset(user_file);
+  ASSERT_TRUE(db.Load(user_file, options));
+  std::string expected = db.UserInfo(50, expected_proof);
+  for (uint64_t offset : {uint64_t(60), uint64_t(4096 * 3 + 100)}) {
+    {
+      std::fstream f(user_file + ".por",
+                     std::ios::in | std::ios::out | std::ios::binary);
+      f.seekp(offset);
+      f.put('x');
+    }
+    options.rebuild = false;
+    EXPECT_FALSE(db.Load(user_file, options));
+    options.rebuild = true;
+    ASSERT_TRUE(db.Load(user_file, options));
+    EXPECT_EQ(db.UserInfo(50, proof), expected);
+    EXPECT_EQ(proof, expected_proof);
+  }
+  options.sum_tree = true;
+  options.rebuild = false;
+  EXPECT_FALSE(db.Load(user_file, options));
+  options.rebuild = true;
+  ASSERT_TRUE(db.Load(user_file, options));
+  uint64_t total = 0;
+  for (uint64_t id = 1; id <= 1500; ++id) {
+    total += id % 97;
+  }
+  EXPECT_EQ(db.TotalLiabilities(), total);
+
+  // appended users are kept next to the single file
+  ASSERT_TRUE(db.Append({{8000, 3}}));
+  ASSERT_TRUE(db.Load(user_file, options));
+  EXPECT_EQ(db.UserInfo(8000, proof), "(8000,3)");
+
+  options.map_strategy = crypto::MapStrategy::kBufferPool;
+  EXPECT_FALSE(db.Load(user_file, options));
+
+  for (const std::string& file : {user_file, split_file}) {
+    reset(file);
+    std::filesystem::remove(file);
+  }
+}
+
+TEST(PoRDB, shared_memory) {
+  std::string user_file = "../test/data/user_data/shared_memory_users.txt";
+  const std::string name = "por_db_test_segment";
+  auto write_users = [&user_file](uint64_t balance) {
+    for (const char* suffix : {"", ".index", ".merkle", ".append", ".por"}) {
+      std::filesystem::remove(user_file + suffix);
+    }
+    std::ofstream f(user_file);
+    f << 1000 << std::endl;
+    for (uint64_t id = 1; id <= 1000; ++id) {
+      f << "(" << id * 3 << "," << id % 89 + balance << ")" << std::endl;
+    }
+  };
+  write_users(0);
+
+  crypto::PoROptions options;
+  options.sum_tree = true;
+  crypto::PoRDB loader;
+  ASSERT_TRUE(loader.Load(user_file, options));
+  // only a single file can be published
+  EXPECT_FALSE(loader.Publish(name));
+  options.single_file = true;
+  ASSERT_TRUE(loader.Load(user_file, options));
+  EXPECT_FALSE(loader.Publish(""));
+  EXPECT_FALSE(loader.Publish("../" + name));
+  ASSERT_TRUE(loader.Publish(name, true));
+
+  // attaching needs no user data file, and the tree format must match
+  crypto::PoROptions attach;
+  attach.shared_memory = name;
+  crypto::PoRDB client;
+  EXPECT_FALSE(client.Load("", attach));
+  attach.sum_tree = true;
+  ASSERT_TRUE(client.Load("", attach));
+  EXPECT_NE(client.Metrics().find("por_map_shared{file=\"database\"} 1"),
+            std::string::npos);
+  EXPECT_EQ(client.TotalLiabilities(), loader.TotalLiabilities());
+  for (uint64_t id = 0; id <= 3005; id += 5) {
+    std::string proof, expected_proof;
+    ASSERT_EQ(client.UserInfo(id, proof), loader.UserInfo(id, expected_proof))
+        << id;
+    ASSERT_EQ(proof, expected_proof);
+  }
+  crypto::AuditReport report;
+  EXPECT_TRUE(client.Audit(report, 2)) << report.error;
+  EXPECT_FALSE(client.Append({{4000, 1}}));
+
+  // another process attaches to the same segment
+  std::string expected_proof;
+  std::string expected = loader.UserInfo(300, expected_proof);
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    crypto::PoRDB db;
+    std::string proof;
+    bool ok = db.Load("", attach) && db.UserInfo(300, proof) == expected &&
+              proof == expected_proof;
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // republishing replaces the segment for new attaches, the attached client
+  // keeps the old one
+  write_users(1000);
+  ASSERT_TRUE(loader.Load(user_file, options));
+  ASSERT_TRUE(loader.Publish(name));
+  std::string proof, new_proof;
+  EXPECT_EQ(client.UserInfo(300, proof), expected);
+  EXPECT_EQ(proof, expected_proof);
+  crypto::PoRDB updated;
+  ASSERT_TRUE(updated.Load("", attach));
+  EXPECT_EQ(updated.UserInfo(300, new_proof), "(300,1011)");
+  EXPECT_EQ(updated.TotalLiabilities(), loader.TotalLiabilities());
+
+  // a damaged section table fails the attach
+  {
+    std::fstream f("/dev/shm/" + name,
+                   std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(60);
+    f.put('x');
+  }
+  EXPECT_FALSE(updated.Load("", attach));
+
+  attach.map_strategy = crypto::MapStrategy::kBufferPool;
+  ASSERT_TRUE(loader.Publish(name));
+  EXPECT_FALSE(updated.Load("", attach));
+  attach.map_strategy = crypto::MapStrategy::kPopulate;
+  ASSERT_TRUE(updated.Load("", attach));
+  EXPECT_EQ(updated.UserInfo(300, new_proof), "(300,1011)");
+
+  EXPECT_TRUE(crypto::PoRDB::Unpublish(name));
+  EXPECT_FALSE(crypto::PoRDB::Unpublish(name));
+  EXPECT_FALSE(client.Load("", attach));
+  write_users(0);
+  std::filesystem::remove(user_file);
+}
+
+TEST(PoRDB, multi_asset) {
+  std::string user_file = "../test/data/user_data/multi_asset_users.txt";
+  // failed builds leave their temporary files
+  auto reset = [&user_file]() {
+    for (const char* suffix : {".index", ".merkle", ".filter", ".append",
+                               ".por", ".index.tmp", ".merkle.tmp"}) {
+      std::filesystem::remove(user_file + suffix);
+    }
+  };
+  auto write_users = [&user_file](const std::string& last) {
+    std::ofstream f(user_file);
+    f << 700 << std::endl;
+    for (uint64_t id = 1; id < 700; ++id) {
+      f << "(" << id * 2 << "," << id % 13 << "," << id * 1000 << ",0)"
+        << std::endl;
+    }
+    f << last << std::endl;
+  };
+  write_users("(1400,1,2,3)");
+
+  std::vector<crypto::PoROptions> modes(7);
+  modes[1].binary_records = true;
+  modes[2].binary_records = true;
+  modes[2].compressed_index = true;
+  modes[3].binary_records = true;
+  modes[3].learned_index = true;
+  modes[3].id_filter = true;
+  modes[4].binary_records = true;
+  modes[4].map_strategy = crypto::MapStrategy::kBufferPool;
+  modes[4].buffer_pool_bytes = 64 << 10;
+  modes[5].merkle_dropped_levels = 3;
+  modes[6].binary_records = true;
+  modes[6].single_file = true;
+  std::map<uint64_t, std::pair<std::string, std::string>> expected;
+  for (size_t m = 0; m < modes.size(); ++m) {
+    reset();
+    crypto::PoROptions options = modes[m];
+    options.assets = 3;
+    crypto::PoRDB db;
+    ASSERT_TRUE(db.Load(user_file, options)) << m;
+    for (uint64_t id = 0; id <= 1401; ++id) {
+      std::string proof;
+      std::string record = db.UserInfo(id, proof);
+      if (m == 0) {
+        if (!record.empty()) {
+          expected[id] = std::make_pair(record, proof);
+        }
+        continue;
+      }
+      auto it = expected.find(id);
+      if (it == expected.end()) {
+        ASSERT_EQ(record, "") << m << " " << id;
+        continue;
+      }
+      // every mode commits to the same leaves
+      ASSERT_EQ(record, it->second.first) << m << " " << id;
+      ASSERT_EQ(proof, it->second.second) << m << " " << id;
+    }
+    crypto::AuditReport report;
+    EXPECT_TRUE(db.Audit(report, 2)) << m << " " << report.error;
+
+    std::string json;
+    ASSERT_TRUE(db.UserInfoJson(14, json));
+    EXPECT_EQ(json.rfind("{\"error_message\":\"Success\",\"user\":{\"id\":14,"
+                         "\"balances\":[7,7000,0],\"proof\":{",
+                         0),
+              0)
+        << json;
+    EXPECT_FALSE(db.Append({{2000, 1}}));
+  }
+  ASSERT_EQ(expected.size(), 700);
+  EXPECT_EQ(expected[1400].first, "(1400,1,2,3)");
+
+  // the leaf commits to all balances of the record
+  crypto::TaggedHasher hasher(crypto::PoRDB::kLeafTag);
+  const std::string& record = expected[6].first;
+  EXPECT_EQ(record, "(6,3,3000,0)");
+  hasher.Append(reinterpret_cast<const uint8_t*>(record.data()),
+                record.size());
+  const char* kDigits = "0123456789abcdef";
+  std::string leaf = "0x";
+  for (uint8_t b : hasher.Hash()) {
+    leaf.push_back(kDigits[b >> 4]);
+    leaf.push_back(kDigits[b & 0x0f]);
+  }
+  EXPECT_EQ(expected[6].second.rfind(leaf, 0), 0);
+
+  // binary balance rows: 8 more bytes per user and asset
+  crypto::PoROptions options;
+  options.assets = 3;
+  options.binary_records = true;
+  reset();
+  crypto::PoRDB db;
+  ASSERT_TRUE(db.Load(user_file, options));
+  EXPECT_EQ(std::filesystem::file_size(user_file + ".index"),
+            48 + 700 * 32);
+
+  // the asset count is part of the format, a mismatch is rebuilt or fails
+  options.rebuild = false;
+  options.assets = 2;
+  EXPECT_FALSE(db.Load(user_file, options));
+  options.rebuild = true;
+  EXPECT_FALSE(db.Load(user_file, options));
+  options.assets = 3;
+  ASSERT_TRUE(db.Load(user_file, options));
+  options.sum_tree = true;
+  EXPECT_FALSE(db.Load(user_file, options));
+  options.sum_tree = false;
+  options.assets = 0;
+  EXPECT_FALSE(db.Load(user_file, options));
+
+  // every line needs all balances
+  options.assets = 3;
+  for (const char* last : {"(1400,1,2)", "(1400,1,2,3,4)", "(1400,1,,3)"}) {
+    write_users(last);
+    reset();
+    EXPECT_FALSE(db.Load(user_file, options)) << last;
+  }
+  reset();
+  std::filesystem::remove(user_file);
+}
+
+#ifdef POR_HAVE_ZLIB
+TEST(PoRDB, compressed_input) {
+  std::string plain_file = "../test/data/user_data/gzip_users.txt";
+  std::string gz_file = plain_file + ".gz";
+  auto write_users = [&plain_file, &gz_file](uint64_t assets) {
+    std::string text = "1000\n";
+    for (uint64_t id = 1; id <= 1000; ++id) {
+      text += "(" + std::to_string(id * 5) + "," + std::to_string(id % 17);
+      for (uint64_t a = 1; a < assets; ++a) {
+        text += "," + std::to_string(id * a);
+      }
+      text += ")\n";
+    }
+    std::ofstream f(plain_file);
+    f << text;
+    f.close();
+
+    // two concatenated members, like appended gzip logs
+    std::filesystem::remove(gz_file);
+    for (const auto& part : {text.substr(0, 7000), text.substr(7000)}) {
+      gzFile gz = gzopen(gz_file.c_str(), "ab");
+      gzwrite(gz, part.data(), part.size());
+      gzclose(gz);
+    }
+  };
+  auto read_file = [](const std::string& file) {
+    std::ifstream f(file, std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f),
+                       std::istreambuf_iterator<char>());
+  };
+  auto build = [](const std::string& file, const crypto::PoROptions& options,
+                  uint64_t interrupt) {
+    crypto::PoRDB db;
+    db.db_options = options;
+    // stop the build after interrupt checkpoints, 0 means never
+    uint64_t checkpoints = 0;
+    db.db_options.on_checkpoint = [&checkpoints, interrupt]() {
+      return interrupt == 0 || ++checkpoints < interrupt;
+    };
+    return db.preprocessUserFile(file, file + ".index", file + ".merkle");
+  };
+
+  std::vector<crypto::PoROptions> modes(3);
+  modes[0].assets = 2;
+  modes[1].sum_tree = true;
+  modes[1].binary_records = true;
+  modes[2].binary_records = true;
+  modes[2].assets = 3;
+  for (size_t m = 0; m < modes.size(); ++m) {
+    crypto::PoROptions options = modes[m];
+    options.checkpoint_lines = 300;
+    write_users(options.assets);
+    ASSERT_TRUE(build(plain_file, options, 0)) << m;
+    auto expected_index = read_file(plain_file + ".index");
+    auto expected_merkle = read_file(plain_file + ".merkle");
+
+    // the same files whether the input is inflated or not, also when the
+    // build resumes in the middle of the compressed input
+    for (uint64_t k = 0; k < 12; ++k) {
+      if (k > 0 && build(gz_file, options, k)) {
+        break;
+      }
+      ASSERT_TRUE(build(gz_file, options, 0)) << m << " " << k;
+      EXPECT_EQ(read_file(gz_file + ".index"), expected_index)
+          << m << " " << k;
+      EXPECT_EQ(read_file(gz_file + ".merkle"), expected_merkle)
+          << m << " " << k;
+    }
+  }
+
+  // loaded and served like plain input
+  write_users(1);
+  crypto::PoRDB plain, gz;
+  ASSERT_TRUE(plain.Load(plain_file, crypto::PoROptions()));
+  ASSERT_TRUE(gz.Load(gz_file, crypto::PoROptions()));
+  for (uint64_t id : {0, 5, 2500, 5000}) {
+    std::string plain_proof, gz_proof;
+    EXPECT_EQ(gz.UserInfo(id, gz_proof), plain.UserInfo(id, plain_proof));
+    EXPECT_EQ(gz_proof, plain_proof);
+  }
+
+  // a truncated stream fails the build instead of committing to fewer users
+  std::string gz_data = read_file(gz_file);
+  {
+    std::ofstream f(gz_file, std::ios::out | std::ios::binary);
+    f << gz_data.substr(0, gz_data.size() - 20);
+  }
+  EXPECT_FALSE(build(gz_file, crypto::PoROptions(), 0));
+
+  for (const auto& file : {plain_file, gz_file}) {
+    for (const char* suffix : {"", ".index", ".merkle", ".index.tmp",
+                               ".merkle.tmp", ".index.journal"}) {
+      std::filesystem::remove(file + suffix);
+    }
+  }
+}
+#endif
+
 /*
 TEST(PoRDB, parallel_preprocess) {
   std::vector<std::string> users = {
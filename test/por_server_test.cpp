@@ -0,0 +1,275 @@
+#include "por_server.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "por_db.h"
+
+namespace {
+// blocking localhost client
+class Client {
+ public:
+  explicit Client(uint16_t port) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connected_ = connect(fd_, reinterpret_cast<sockaddr*>(&address),
+                         sizeof(address)) == 0;
+  }
+  ~Client() { close(fd_); }
+
+  bool Connected() const { return connected_; }
+
+  void Send(const std::string& request) {
+    size_t sent = 0;
+    while (sent < request.size()) {
+      ssize_t n = send(fd_, request.data() + sent, request.size() - sent, 0);
+      ASSERT_GT(n, 0);
+      sent += n;
+    }
+  }
+
+  // next complete response (head and body), empty if the server closed
+  std::string Receive() {
+    while (true) {
+      size_t head_end = buffer_.find("\r\n\r\n");
+      if (head_end != std::string::npos) {
+        size_t length_at = buffer_.find("Content-Length: ");
+        size_t length = std::stoul(buffer_.substr(length_at + 16));
+        if (buffer_.size() >= head_end + 4 + length) {
+          std::string response = buffer_.substr(0, head_end + 4 + length);
+          buffer_.erase(0, response.size());
+          return response;
+        }
+      }
+      char chunk[4096];
+      ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        return "";
+      }
+      buffer_.append(chunk, n);
+    }
+  }
+
+  std::string Get(const std::string& target) {
+    Send("GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    return Receive();
+  }
+
+ private:
+  int fd_;
+  bool connected_;
+  std::string buffer_;
+};
+
+std::string body(const std::string& response) {
+  return response.substr(response.find("\r\n\r\n") + 4);
+}
+
+std::string statusLine(const std::string& response) {
+  return response.substr(0, response.find("\r\n"));
+}
+
+crypto::PoRServer::Lookup evenUsers() {
+  return [](uint64_t id, std::string& json) {
+    if (id % 2 != 0) {
+      return false;
+    }
+    json = "{\"id\":" + std::to_string(id) + "}";
+    return true;
+  };
+}
+
+crypto::PoRServerOptions localOptions(size_t reactors) {
+  crypto::PoRServerOptions options;
+  options.address = "127.0.0.1";
+  options.port = 0;
+  options.reactors = reactors;
+  return options;
+}
+}  // namespace
+
+TEST(PoRServer, por_endpoint) {
+  crypto::PoRServer server(evenUsers(), []() { return true; });
+  ASSERT_TRUE(server.Start(localOptions(1)));
+  ASSERT_NE(server.Port(), 0);
+
+  Client client(server.Port());
+  ASSERT_TRUE(client.Connected());
+  std::string response = client.Get("/por?id=42");
+  EXPECT_EQ(statusLine(response), "HTTP/1.1 200 OK");
+  EXPECT_NE(response.find("Content-Type: application/json; charset=utf-8"),
+            std::string::npos);
+  EXPECT_EQ(body(response), R"({"id":42})");
+
+  response = client.Get("/por?id=43");
+  EXPECT_EQ(statusLine(response), "HTTP/1.1 404 Not Found");
+  EXPECT_EQ(body(response), R"({"error_message":"Not Found"})");
+
+  // first id of the query counts, escaped digits are decoded
+  EXPECT_EQ(body(client.Get("/por?x=1&id=4&id=6")), R"({"id":4})");
+  EXPECT_EQ(body(client.Get("/por?id=%31%30")), R"({"id":10})");
+
+  for (std::string id : {"", "abc", "-2", "+2", "2x", " 2",
+                         "18446744073709551616", "%zz"}) {
+    response = client.Get("/por?id=" + id);
+    EXPECT_EQ(statusLine(response), "HTTP/1.1 400 Bad Request") << id;
+    EXPECT_EQ(body(response), R"({"error_message":"Invalid ID"})");
+  }
+  EXPECT_EQ(statusLine(client.Get("/por")), "HTTP/1.1 400 Bad Request");
+  EXPECT_EQ(body(client.Get("/por?id=18446744073709551614")),
+            R"({"id":18446744073709551614})");
+
+  response = client.Get("/unknown");
+  EXPECT_EQ(statusLine(response), "HTTP/1.1 404 Not Found");
+  EXPECT_EQ(body(response), "404 page not found");
+  EXPECT_EQ(server.Requests(), 15);
+  EXPECT_EQ(server.Connections(), 1);
+}
+
+TEST(PoRServer, ready_endpoint) {
+  std::atomic<bool> ready{false};
+  crypto::PoRServer server(evenUsers(), [&ready]() { return ready.load(); });
+  ASSERT_TRUE(server.Start(localOptions(1)));
+
+  Client client(server.Port());
+  std::string response = client.Get("/ready");
+  EXPECT_EQ(statusLine(response), "HTTP/1.1 503 Service Unavailable");
+  EXPECT_EQ(body(response), R"({"ready":false})");
+  ready = true;
+  response = client.Get("/ready");
+  EXPECT_EQ(statusLine(response), "HTTP/1.1 200 OK");
+  EXPECT_EQ(body(response), R"({"ready":true})");
+}
+
+TEST(PoRServer, keep_alive_and_pipelining) {
+  crypto::PoRServer server(evenUsers(), []() { return true; });
+  ASSERT_TRUE(server.Start(localOptions(1)));
+
+  Client client(server.Port());
+  // pipelined requests, split at arbitrary points, are answered in order
+  std::string requests;
+  for (int id = 0; id < 64; id += 2) {
+    requests += "GET /por?id=" + std::to_string(id) + " HTTP/1.1\r\n\r\n";
+  }
+  client.Send(requests.substr(0, 10));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  client.Send(requests.substr(10));
+  for (int id = 0; id < 64; id += 2) {
+    EXPECT_EQ(body(client.Receive()), "{\"id\":" + std::to_string(id) + "}");
+  }
+
+  // a request body is skipped
+  client.Send("GET /por?id=2 HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody");
+  EXPECT_EQ(body(client.Receive()), R"({"id":2})");
+
+  client.Send("GET /por?id=4 HTTP/1.1\r\nConnection: close\r\n\r\n");
+  std::string response = client.Receive();
+  EXPECT_NE(response.find("Connection: close"), std::string::npos);
+  EXPECT_EQ(client.Receive(), "");
+
+  // HTTP/1.0 closes unless asked to keep alive
+  Client old_client(server.Port());
+  old_client.Send("GET /por?id=6 HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+  EXPECT_EQ(body(old_client.Receive()), R"({"id":6})");
+  old_client.Send("GET /por?id=8 HTTP/1.0\r\n\r\n");
+  EXPECT_EQ(body(old_client.Receive()), R"({"id":8})");
+  EXPECT_EQ(old_client.Receive(), "");
+  EXPECT_EQ(server.Connections(), 2);
+}
+
+TEST(PoRServer, malformed_requests) {
+  crypto::PoRServerOptions options = localOptions(1);
+  options.max_header_bytes = 256;
+  crypto::PoRServer server(evenUsers(), []() { return true; });
+  ASSERT_TRUE(server.Start(options));
+
+  Client oversized(server.Port());
+  oversized.Send("GET /por?id=2 HTTP/1.1\r\nX: " + std::string(512, 'x'));
+  EXPECT_EQ(statusLine(oversized.Receive()),
+            "HTTP/1.1 431 Request Header Fields Too Large");
+  EXPECT_EQ(oversized.Receive(), "");
+
+  Client garbage(server.Port());
+  garbage.Send("hello\r\n\r\n");
+  EXPECT_EQ(statusLine(garbage.Receive()), "HTTP/1.1 400 Bad Request");
+  EXPECT_EQ(garbage.Receive(), "");
+
+  Client chunked(server.Port());
+  chunked.Send(
+      "GET /por?id=2 HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n");
+  EXPECT_EQ(statusLine(chunked.Receive()), "HTTP/1.1 400 Bad Request");
+}
+
+TEST(PoRServer, reactors) {
+  crypto::PoRServer server(evenUsers(), []() { return true; });
+  ASSERT_TRUE(server.Start(localOptions(4)));
+
+  std::vector<std::thread> threads;
+  std::atomic<int> ok{0};
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&server, &ok, t]() {
+      Client client(server.Port());
+      for (int i = 0; i < 100; ++i) {
+        uint64_t id = (t * 100 + i) * 2;
+        if (body(client.Get("/por?id=" + std::to_string(id))) ==
+            "{\"id\":" + std::to_string(id) + "}") {
+          ++ok;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(ok, 800);
+  EXPECT_EQ(server.Connections(), 8);
+
+  // port stays taken by this server until it is stopped
+  crypto::PoRServer other(evenUsers(), []() { return true; });
+  crypto::PoRServerOptions options = localOptions(1);
+  server.Stop();
+  options.port = server.Port();
+  EXPECT_TRUE(other.Start(options));
+}
+
+TEST(PoRServer, serve_por_db) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  std::string index_file = user_data_file + ".index";
+  std::string merkle_file = user_data_file + ".merkle";
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+  crypto::PoRDB db;
+  ASSERT_TRUE(db.Load(user_data_file));
+
+  crypto::PoRServer server(
+      [&db](uint64_t id, std::string& json) {
+        return db.UserInfoJson(id, json);
+      },
+      [&db]() { return db.Ready(); });
+  ASSERT_TRUE(server.Start(localOptions(2)));
+
+  Client client(server.Port());
+  for (uint64_t id = 1; id <= 8; ++id) {
+    std::string json;
+    ASSERT_TRUE(db.UserInfoJson(id, json));
+    EXPECT_EQ(body(client.Get("/por?id=" + std::to_string(id))), json);
+  }
+  EXPECT_EQ(statusLine(client.Get("/por?id=9")), "HTTP/1.1 404 Not Found");
+
+  server.Stop();
+  std::filesystem::remove(index_file);
+  std::filesystem::remove(merkle_file);
+}
@@ -0,0 +1,164 @@
+#include "response_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+std::function<std::string(std::string&)> render(uint64_t id,
+                                                std::atomic<int>& calls) {
+  return [id, &calls](std::string& proof) {
+    ++calls;
+    proof = "proof" + std::to_string(id);
+    return id % 2 == 0 ? "(" + std::to_string(id) + ")" : std::string();
+  };
+}
+}  // namespace
+
+TEST(ResponseCache, hit_and_snapshot) {
+  crypto::ResponseCache cache(1 << 20, 4);
+  std::atomic<int> calls{0};
+  std::string proof;
+  EXPECT_EQ(cache.Get(1, 2, proof, render(2, calls)), "(2)");
+  EXPECT_EQ(proof, "proof2");
+  proof.clear();
+  EXPECT_EQ(cache.Get(1, 2, proof, render(2, calls)), "(2)");
+  EXPECT_EQ(proof, "proof2");
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.Hits(), 1);
+
+  // unknown ids are not cached
+  EXPECT_EQ(cache.Get(1, 3, proof, render(3, calls)), "");
+  EXPECT_EQ(cache.Get(1, 3, proof, render(3, calls)), "");
+  EXPECT_EQ(calls, 3);
+
+  // another snapshot misses
+  EXPECT_EQ(cache.Get(2, 2, proof, render(2, calls)), "(2)");
+  EXPECT_EQ(calls, 4);
+  EXPECT_GT(cache.Bytes(), 0);
+  cache.Clear();
+  EXPECT_EQ(cache.Bytes(), 0);
+  EXPECT_EQ(cache.Get(2, 2, proof, render(2, calls)), "(2)");
+  EXPECT_EQ(calls, 5);
+}
+
+TEST(ResponseCache, clock_eviction) {
+  // room for a few entries per shard
+  crypto::ResponseCache cache(1000, 1);
+  std::atomic<int> calls{0};
+  std::string proof;
+  for (uint64_t id = 0; id < 200; id += 2) {
+    cache.Get(1, id, proof, render(id, calls));
+    // id 0 stays hot and keeps its reference bit
+    cache.Get(1, 0, proof, render(0, calls));
+    EXPECT_LE(cache.Bytes(), 1000);
+  }
+  EXPECT_GT(cache.Evictions(), 0);
+  EXPECT_EQ(calls, 100);
+}
+
+TEST(ResponseCache, single_flight) {
+  crypto::ResponseCache cache(1 << 20, 4);
+  std::atomic<int> calls{0};
+  auto slow = [&calls](std::string& proof) {
+    ++calls;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    proof = "proof";
+    return std::string("(4)");
+  };
+
+  std::vector<std::thread> threads;
+  std::atomic<int> correct{0};
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&]() {
+      std::string proof;
+      if (cache.Get(1, 4, proof, slow) == "(4)" && proof == "proof") {
+        ++correct;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(correct, 8);
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.Coalesced() + cache.Hits(), 7);
+}
+
+TEST(ResponseCache, newer_snapshot_during_flight) {
+  crypto::ResponseCache cache(1 << 20, 4);
+  std::atomic<bool> started{false};
+  auto stale = [&started](std::string& proof) {
+    started = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    proof = "old proof";
+    return std::string("(6,1)");
+  };
+  auto fresh = [](std::string& proof) {
+    proof = "new proof";
+    return std::string("(6,2)");
+  };
+
+  std::thread slow([&]() {
+    std::string proof;
+    EXPECT_EQ(cache.Get(1, 6, proof, stale), "(6,1)");
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+
+  // a caller of the newer snapshot doesn't wait for the older rendering
+  std::string proof;
+  EXPECT_EQ(cache.Get(2, 6, proof, fresh), "(6,2)");
+  EXPECT_EQ(proof, "new proof");
+  slow.join();
+  EXPECT_EQ(cache.Coalesced(), 0);
+
+  // and the older rendering that finished last doesn't replace its entry
+  EXPECT_EQ(cache.Get(2, 6, proof, stale), "(6,2)");
+  EXPECT_EQ(proof, "new proof");
+  EXPECT_EQ(cache.Hits(), 1);
+}
+
+TEST(ResponseCache, formats) {
+  crypto::ResponseCache cache(1 << 20, 4);
+  std::atomic<bool> started{false};
+  auto text = [&started](std::string& proof) {
+    started = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    proof = "proof";
+    return std::string("(7,700)");
+  };
+  auto json = [](std::string&) { return std::string("{\"id\":7}"); };
+
+  // a JSON lookup while the text response of the same id is rendered
+  std::thread slow([&]() {
+    std::string proof;
+    EXPECT_EQ(cache.Get(1, 7, proof, text, crypto::ResponseCache::kText),
+              "(7,700)");
+    EXPECT_EQ(proof, "proof");
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  std::string unused;
+  EXPECT_EQ(cache.Get(1, 7, unused, json, crypto::ResponseCache::kJson),
+            "{\"id\":7}");
+  slow.join();
+  EXPECT_EQ(cache.Coalesced(), 0);
+
+  // both stay cached, alternating lookups hit
+  for (int i = 0; i < 2; ++i) {
+    std::string proof;
+    EXPECT_EQ(cache.Get(1, 7, proof, text, crypto::ResponseCache::kText),
+              "(7,700)");
+    EXPECT_EQ(cache.Get(1, 7, unused, json, crypto::ResponseCache::kJson),
+              "{\"id\":7}");
+  }
+  EXPECT_EQ(cache.Hits(), 4);
+}
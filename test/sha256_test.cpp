@@ -131,6 +131,26 @@ TEST(sha256, StreamMode) {
   }
 }
 
+TEST(sha256, StreamState) {
+  // "BlockChainBlockChainBlockChainBlockChainBlockChainBlock"
+  std::string text = "BlockChainBlockChainBlockChainBlockChainBlockChainBlock";
+  std::vector<uint8_t> data(text.cbegin(), text.cend());
+  crypto::sha256::BlockHasher block_hasher;
+  auto expected = block_hasher.Hash(data);
+
+  // stop at every position, restore the state into another hasher and finish
+  for (size_t i = 0; i <= data.size(); ++i) {
+    crypto::sha256::StreamHasher hasher;
+    hasher.Append(data.data(), i);
+    auto state = hasher.State();
+
+    crypto::sha256::StreamHasher resumed;
+    resumed.Restore(state);
+    resumed.Append(data.data() + i, data.size() - i);
+    EXPECT_EQ(resumed.Hash(), expected);
+  }
+}
+
 TEST(sha256, preprocess) {
   // empty data
   std::vector<uint8_t> empty = {};
@@ -283,4 +303,42 @@ TEST(sha256, update_hash) {
                                       0x53df2660, 0xab9b91ae};
   crypto::sha256::UpdateHash(h, k, w);
   EXPECT_EQ(h, expected);
-}
\ No newline at end of file
+}
+
+TEST(sha256, compress) {
+  // the accelerated path must match the reference rounds, chunk by chunk
+  std::vector<uint8_t> data(64 * 9);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t>(i * 131 + (i >> 3));
+  }
+  for (size_t count = 0; count <= 9; ++count) {
+    auto expected = crypto::sha256::h;
+    std::array<uint8_t, 64> chunk;
+    for (size_t i = 0; i < count; ++i) {
+      std::copy(data.begin() + 64 * i, data.begin() + 64 * (i + 1),
+                chunk.begin());
+      crypto::sha256::UpdateHash(expected, crypto::sha256::k,
+                                 crypto::sha256::GenerateMessageSchedule(chunk));
+    }
+
+    auto hv = crypto::sha256::h;
+    crypto::sha256::Compress(hv, data.data(), count);
+    EXPECT_EQ(hv, expected) << count;
+  }
+
+  // streams split anywhere hash the same as one block
+  crypto::sha256::BlockHasher block_hasher;
+  auto expected = block_hasher.Hash(data);
+  for (size_t first = 0; first <= data.size(); first += 7) {
+    for (size_t second : {0, 1, 63, 64, 65, 200}) {
+      second = std::min(second, data.size() - first);
+      crypto::sha256::StreamHasher hasher;
+      hasher.Append(data.data(), first);
+      hasher.Append(data.data() + first, second);
+      EXPECT_EQ(hasher.Append(data.data() + first + second,
+                              data.size() - first - second),
+                data.size());
+      EXPECT_EQ(hasher.Hash(), expected);
+    }
+  }
+}
@@ -0,0 +1,144 @@
+#include "sharded_por_db.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "tagged_hash.h"
+
+namespace {
+void removeShardFiles(const std::string& user_data_file, size_t shard_count) {
+  std::filesystem::remove(user_data_file + ".shards");
+  for (size_t i = 0; i < shard_count; ++i) {
+    std::string shard = user_data_file + ".shard" + std::to_string(i);
+    std::filesystem::remove(shard);
+    std::filesystem::remove(shard + ".index");
+    std::filesystem::remove(shard + ".merkle");
+  }
+}
+
+std::vector<uint8_t> leafHash(const std::string& detail) {
+  crypto::TaggedHasher hasher(crypto::PoRDB::kLeafTag);
+  hasher.Append(std::vector<uint8_t>(detail.cbegin(), detail.cend()));
+  return hasher.Hash();
+}
+
+std::vector<uint8_t> branchHash(const std::vector<uint8_t>& left,
+                                const std::vector<uint8_t>& right) {
+  crypto::TaggedHasher hasher(crypto::PoRDB::kBranchTag);
+  hasher.Append(left);
+  hasher.Append(right);
+  return hasher.Hash();
+}
+}  // namespace
+
+TEST(ShardedPoRDB, retrieve_user_info) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  removeShardFiles(user_data_file, 3);
+
+  crypto::ShardedPoRDB db;
+  EXPECT_TRUE(db.Load(user_data_file, 3));
+  EXPECT_EQ(db.ShardCount(), 3);
+
+  std::map<uint64_t, std::string> user_data{
+      {1, "(1,1111)"}, {2, "(2,2222)"}, {3, "(3,3333)"}, {4, "(4,4444)"},
+      {5, "(5,5555)"}, {6, "(6,6666)"}, {7, "(7,7777)"}, {8, "(8,8888)"},
+      {0, ""},         {9, ""}};
+
+  for (const auto& [id, content] : user_data) {
+    std::string proof;
+    EXPECT_EQ(db.UserInfo(id, proof), content);
+    EXPECT_EQ(proof.empty(), content.empty());
+  }
+
+  // shards hold users [1, 2], [3, 4, 5], [6, 7, 8], the top tree is built
+  // over the 3 shard roots with the last one duplicated
+  auto shard0 = branchHash(leafHash("(1,1111)"), leafHash("(2,2222)"));
+  auto shard1 =
+      branchHash(branchHash(leafHash("(3,3333)"), leafHash("(4,4444)")),
+                 branchHash(leafHash("(5,5555)"), leafHash("(5,5555)")));
+  auto shard2 =
+      branchHash(branchHash(leafHash("(6,6666)"), leafHash("(7,7777)")),
+                 branchHash(leafHash("(8,8888)"), leafHash("(8,8888)")));
+  auto root = branchHash(branchHash(shard0, shard1), branchHash(shard2, shard2));
+
+  std::string proof;
+  db.UserInfo(4, proof);
+  std::string root_str = "0x";
+  for (auto b : root) {
+    char hex[3];
+    snprintf(hex, sizeof hex, "%02x", b);
+    root_str += hex;
+  }
+  EXPECT_EQ(proof.substr(proof.size() - root_str.size()), root_str);
+
+  // JSON response carries the same root and leaf, from the top level cache
+  crypto::PoROptions options;
+  options.response_cache_bytes = 1 << 20;
+  crypto::ShardedPoRDB cached;
+  EXPECT_TRUE(cached.Load(user_data_file, 3, options));
+  std::string json;
+  for (int round = 0; round < 2; ++round) {
+    EXPECT_TRUE(cached.UserInfoJson(4, json));
+    EXPECT_EQ(json.find("{\"error_message\":\"Success\",\"user\":{\"id\":4,"
+                        "\"balance\":4444,\"proof\":{\"merkle_root\":\"" +
+                        root_str + "\",\"UserHash\":\"" +
+                        proof.substr(0, proof.find(' ')) + "\""),
+              0);
+    EXPECT_FALSE(cached.UserInfoJson(9, json));
+    EXPECT_EQ(json, "");
+  }
+  EXPECT_EQ(cached.response_cache->Hits(), 1);
+
+  removeShardFiles(user_data_file, 3);
+}
+
+TEST(ShardedPoRDB, rebuild_one_shard) {
+  std::string user_data_file = "../test/data/user_data/eight_users.txt";
+  removeShardFiles(user_data_file, 4);
+
+  crypto::PoROptions options;
+  options.sum_tree = true;
+  crypto::ShardedPoRDB db;
+  EXPECT_TRUE(db.Load(user_data_file, 4, options));
+  EXPECT_EQ(db.TotalLiabilities(), 39996);
+
+  // a shard whose files become invalid is rebuilt alone on next load
+  std::string shard0_index = user_data_file + ".shard0.index";
+  std::string shard2_index = user_data_file + ".shard2.index";
+  auto shard0_time = std::filesystem::last_write_time(shard0_index);
+  std::filesystem::resize_file(shard2_index, 48);
+
+  crypto::ShardedPoRDB reloaded;
+  EXPECT_TRUE(reloaded.Load(user_data_file, 4, options));
+  EXPECT_EQ(std::filesystem::last_write_time(shard0_index), shard0_time);
+  EXPECT_TRUE(crypto::PoRDB::verifyFileFingerPrint(
+      shard2_index, crypto::PoRDB::kIndexMagic));
+
+  EXPECT_TRUE(reloaded.RebuildShard(1));
+  EXPECT_EQ(reloaded.TotalLiabilities(), 39996);
+  std::string proof;
+  EXPECT_EQ(reloaded.UserInfo(5, proof), "(5,5555)");
+  EXPECT_NE(proof.find(",39996"), std::string::npos);
+
+  // users outside the id range [3, 5) of shard 1 are rejected, the loaded
+  // shard keeps serving
+  std::string shard1 = user_data_file + ".shard1";
+  for (const char* users : {"2\n(2,1)\n(4,1)\n", "2\n(3,1)\n(5,1)\n"}) {
+    std::ofstream(shard1, std::ios::out | std::ios::trunc) << users;
+    EXPECT_FALSE(reloaded.RebuildShard(1)) << users;
+    EXPECT_EQ(reloaded.TotalLiabilities(), 39996);
+    EXPECT_EQ(reloaded.UserInfo(4, proof), "(4,4444)");
+  }
+  std::ofstream(shard1, std::ios::out | std::ios::trunc)
+      << "2\n(3,3333)\n(4,4440)\n";
+  EXPECT_TRUE(reloaded.RebuildShard(1));
+  EXPECT_EQ(reloaded.TotalLiabilities(), 39992);
+  EXPECT_EQ(reloaded.UserInfo(4, proof), "(4,4440)");
+
+  removeShardFiles(user_data_file, 4);
+}
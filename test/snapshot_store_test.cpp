@@ -0,0 +1,179 @@
+#include "snapshot_store.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "por_db.h"
+
+namespace {
+const std::string kStoreFile = "snapshot_store_test.db";
+
+void writeUsers(const std::string& file,
+                const std::map<uint64_t, uint64_t>& users) {
+  std::ofstream f(file);
+  f << users.size() << std::endl;
+  for (const auto& user : users) {
+    f << "(" << user.first << "," << user.second << ")" << std::endl;
+  }
+}
+
+void removeDB(const std::string& file) {
+  for (const char* suffix : {"", ".index", ".merkle"}) {
+    std::filesystem::remove(file + suffix);
+  }
+}
+
+void removeStore() {
+  std::filesystem::remove(kStoreFile);
+  std::filesystem::remove(kStoreFile + ".roots");
+}
+
+// monthly snapshots: a few balances change, users join and leave
+std::vector<std::map<uint64_t, uint64_t>> monthlySnapshots() {
+  std::vector<std::map<uint64_t, uint64_t>> months(1);
+  for (uint64_t id = 1; id <= 1001; ++id) {
+    months[0][id * 2] = id * 7;
+  }
+  months.push_back(months.back());
+  months.back()[10] = 1;
+  months.back()[1500] = 2;
+  months.push_back(months.back());
+  months.back()[2004] = 3;
+  months.back()[2006] = 4;
+  months.push_back(months.back());
+  months.back().erase(2006);
+  months.back()[999] = 5;
+  months.push_back(std::map<uint64_t, uint64_t>{{42, 1}});
+  return months;
+}
+}  // namespace
+
+TEST(SnapshotStore, historical_lookups) {
+  const std::string user_file = "snapshot_store_users.txt";
+  auto months = monthlySnapshots();
+  // a tree lower than the dropped levels is stored from its records
+  for (uint64_t dropped : {0, 3}) {
+    for (bool sum_tree : {false, true}) {
+      removeStore();
+      crypto::SnapshotStore store;
+      ASSERT_TRUE(store.Open(kStoreFile, sum_tree));
+
+      // expected record and proof of every id of every month
+      std::vector<std::map<uint64_t, std::pair<std::string, std::string>>>
+          expected(months.size());
+      std::vector<std::vector<uint8_t>> roots;
+      uint64_t first_size = 0;
+      for (size_t m = 0; m < months.size(); ++m) {
+        removeDB(user_file);
+        writeUsers(user_file, months[m]);
+        crypto::PoROptions options;
+        options.sum_tree = sum_tree;
+        options.merkle_dropped_levels = dropped;
+        crypto::PoRDB db;
+        ASSERT_TRUE(db.Load(user_file, options));
+        for (uint64_t id = 0; id <= 2010; ++id) {
+          std::string proof;
+          std::string record = db.UserInfo(id, proof);
+          if (!record.empty()) {
+            expected[m][id] = std::make_pair(record, proof);
+          }
+        }
+        uint64_t size = store.Bytes();
+        ASSERT_TRUE(store.AddSnapshot("month" + std::to_string(m), db));
+        EXPECT_FALSE(store.AddSnapshot("month" + std::to_string(m), db));
+        roots.push_back(store.Root("month" + std::to_string(m)));
+        if (m == 0) {
+          first_size = store.Bytes() - size;
+        } else if (m < 3) {
+          // only the paths of changed and appended users are added, an
+          // insertion shifts the positions of all users after it
+          EXPECT_LT(store.Bytes() - size, first_size / 10) << m;
+        }
+      }
+
+      // every month stays queryable, also after reopening the store
+      for (int round = 0; round < 2; ++round) {
+        ASSERT_EQ(store.Snapshots().size(), months.size());
+        for (size_t m = 0; m < months.size(); ++m) {
+          std::string name = "month" + std::to_string(m);
+          EXPECT_EQ(store.Root(name), roots[m]);
+          for (uint64_t id = 0; id <= 2010; ++id) {
+            std::string proof;
+            std::string record = store.UserInfo(name, id, proof);
+            auto it = expected[m].find(id);
+            if (it == expected[m].end()) {
+              ASSERT_EQ(record, "") << m << " " << id;
+              continue;
+            }
+            ASSERT_EQ(record, it->second.first) << m << " " << id;
+            ASSERT_EQ(proof, it->second.second)
+                << dropped << " " << sum_tree << " " << m << " " << id;
+          }
+        }
+        std::string proof;
+        EXPECT_EQ(store.UserInfo("month9", 2, proof), "");
+        uint64_t nodes = store.NodeCount();
+        ASSERT_TRUE(store.Open(kStoreFile, sum_tree));
+        EXPECT_EQ(store.NodeCount(), nodes);
+      }
+    }
+  }
+  removeDB(user_file);
+  removeStore();
+}
+
+TEST(SnapshotStore, unpublished_nodes) {
+  const std::string user_file = "snapshot_store_crash.txt";
+  removeStore();
+  removeDB(user_file);
+  auto months = monthlySnapshots();
+  writeUsers(user_file, months[0]);
+  crypto::PoRDB db;
+  ASSERT_TRUE(db.Load(user_file));
+
+  crypto::SnapshotStore store;
+  ASSERT_TRUE(store.Open(kStoreFile));
+  ASSERT_TRUE(store.AddSnapshot("first", db));
+  uint64_t size = store.Bytes();
+  store.Close();
+
+  // entries of an interrupted AddSnapshot are cut off
+  {
+    std::ofstream f(kStoreFile, std::ios::app | std::ios::binary);
+    f << std::string(100, 'x');
+  }
+  ASSERT_TRUE(store.Open(kStoreFile));
+  EXPECT_EQ(std::filesystem::file_size(kStoreFile), size);
+  std::string proof;
+  EXPECT_EQ(store.UserInfo("first", 4, proof), "(4,14)");
+  ASSERT_TRUE(store.AddSnapshot("second", db));
+  EXPECT_EQ(store.Bytes(), size);
+
+  // the tree format is fixed, and the table must be intact
+  EXPECT_FALSE(store.Open(kStoreFile, true));
+  {
+    std::fstream f(kStoreFile + ".roots",
+                   std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(50);
+    f.put('x');
+  }
+  EXPECT_FALSE(store.Open(kStoreFile));
+
+  crypto::PoROptions options;
+  options.sum_tree = true;
+  removeDB(user_file);
+  writeUsers(user_file, months[0]);
+  ASSERT_TRUE(db.Load(user_file, options));
+  removeStore();
+  ASSERT_TRUE(store.Open(kStoreFile));
+  EXPECT_FALSE(store.AddSnapshot("sum", db));
+  EXPECT_TRUE(store.Snapshots().empty());
+
+  removeDB(user_file);
+  removeStore();
+}
@@ -0,0 +1,230 @@
+#include "sparse_merkle_tree.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "por_db.h"
+#include "tagged_hash.h"
+
+namespace {
+std::vector<uint8_t> unhex(const std::string& s) {
+  std::vector<uint8_t> bytes;
+  for (size_t i = 2; i + 1 < s.size(); i += 2) {
+    bytes.push_back(static_cast<uint8_t>(std::stoul(s.substr(i, 2), 0, 16)));
+  }
+  return bytes;
+}
+
+// "hash" or "hash,sum"
+void parseNode(const std::string& s, std::vector<uint8_t>& hash,
+               uint64_t& sum) {
+  size_t comma = s.find(',');
+  hash = unhex(s.substr(0, comma));
+  sum = comma == std::string::npos ? 0 : std::stoull(s.substr(comma + 1));
+}
+
+// hash a proof up to its root like a client, the positions of the siblings
+// must spell the id. Returns the leaf hash, empty if the proof is invalid.
+std::vector<uint8_t> verifyProof(uint64_t id, const std::string& proof,
+                                 bool sum_tree) {
+  std::vector<std::string> fields;
+  std::stringstream ss(proof);
+  for (std::string field; ss >> field;) {
+    fields.push_back(field);
+  }
+  if (fields.size() != 66) {
+    return {};
+  }
+
+  std::vector<uint8_t> leaf, hash, root;
+  uint64_t sum = 0, root_sum = 0;
+  parseNode(fields.front(), leaf, sum);
+  parseNode(fields.back(), root, root_sum);
+  hash = leaf;
+  crypto::TaggedHasher hasher(crypto::PoRDB::kBranchTag);
+  for (size_t i = 1; i + 1 < fields.size(); ++i) {
+    // "(left,hash[,sum])"
+    std::string sibling = fields[i].substr(1, fields[i].size() - 2);
+    size_t comma = sibling.find(',');
+    bool left = sibling.substr(0, comma) == "left";
+    if (left != (((id >> (i - 1)) & 0x01) == 0x01)) {
+      return {};
+    }
+    std::vector<uint8_t> sibling_hash;
+    uint64_t sibling_sum = 0;
+    parseNode(sibling.substr(comma + 1), sibling_hash, sibling_sum);
+    hasher.Reset();
+    for (int side = 0; side < 2; ++side) {
+      bool own = (side == 0) != left;
+      hasher.Append(own ? hash : sibling_hash);
+      if (sum_tree) {
+        uint64_t s = own ? sum : sibling_sum;
+        hasher.Append(reinterpret_cast<const uint8_t*>(&s), sizeof s);
+      }
+    }
+    hash = hasher.Hash();
+    sum += sibling_sum;
+  }
+  return hash == root && sum == root_sum ? leaf : std::vector<uint8_t>();
+}
+
+// tree of users built in one batch
+crypto::SparseMerkleTree rebuilt(const std::map<uint64_t, uint64_t>& users,
+                                 bool sum_tree) {
+  crypto::SparseMerkleTree tree(sum_tree);
+  EXPECT_TRUE(tree.Update(std::vector<std::pair<uint64_t, uint64_t>>(
+      users.begin(), users.end())));
+  return tree;
+}
+}  // namespace
+
+TEST(SparseMerkleTree, batched_updates) {
+  std::mt19937_64 rng(7);
+  for (bool sum_tree : {false, true}) {
+    crypto::SparseMerkleTree tree(sum_tree);
+    const auto empty_root = tree.Root();
+    EXPECT_EQ(tree.RootSum(), 0);
+    std::string proof;
+    EXPECT_EQ(tree.UserInfo(5, proof), "");
+    EXPECT_EQ(verifyProof(5, proof, sum_tree),
+              crypto::SparseMerkleTree::kEmptyLeaf);
+
+    // dense ids, the extremes of the id space, and sparse ones
+    std::map<uint64_t, uint64_t> users;
+    for (int round = 0; round < 8; ++round) {
+      std::vector<std::pair<uint64_t, uint64_t>> batch;
+      std::vector<uint64_t> removed;
+      for (int i = 0; i < 300; ++i) {
+        uint64_t id = round % 2 == 0 ? rng() % 2000 : rng();
+        batch.push_back(std::make_pair(id, rng() % 1000));
+      }
+      batch.push_back(std::make_pair(0, round));
+      batch.push_back(std::make_pair(UINT64_MAX, round));
+      for (int i = 0; i < 100 && round > 0; ++i) {
+        auto it = users.lower_bound(rng() % 2000);
+        removed.push_back(it == users.end() ? rng() : it->first);
+      }
+
+      for (uint64_t id : removed) {
+        users.erase(id);
+      }
+      for (const auto& user : batch) {
+        users[user.first] = user.second;
+      }
+      ASSERT_TRUE(tree.Update(batch, removed, round % 2 == 0 ? 1 : 4));
+
+      auto expected = rebuilt(users, sum_tree);
+      ASSERT_EQ(tree.Root(), expected.Root()) << sum_tree << " " << round;
+      EXPECT_EQ(tree.Users(), users.size());
+      EXPECT_EQ(tree.NodeCount(), expected.NodeCount());
+      uint64_t total = 0;
+      for (const auto& user : users) {
+        total += user.second;
+      }
+      EXPECT_EQ(tree.RootSum(), sum_tree ? total : 0);
+
+      // members and absent ids, around and between the users
+      for (uint64_t id : {uint64_t(0), uint64_t(1), uint64_t(1999),
+                          users.rbegin()->first - 1, rng()}) {
+        std::string record = tree.UserInfo(id, proof);
+        auto leaf = verifyProof(id, proof, sum_tree);
+        ASSERT_FALSE(leaf.empty()) << id;
+        auto it = users.find(id);
+        if (it == users.end()) {
+          EXPECT_EQ(record, "");
+          EXPECT_EQ(leaf, crypto::SparseMerkleTree::kEmptyLeaf);
+        } else {
+          EXPECT_EQ(record, "(" + std::to_string(id) + "," +
+                                std::to_string(it->second) + ")");
+          EXPECT_NE(leaf, crypto::SparseMerkleTree::kEmptyLeaf);
+        }
+      }
+    }
+
+    // removing everyone leaves the empty tree
+    std::vector<uint64_t> removed;
+    for (const auto& user : users) {
+      removed.push_back(user.first);
+    }
+    ASSERT_TRUE(tree.Update({}, removed, 3));
+    EXPECT_EQ(tree.Root(), empty_root);
+    EXPECT_EQ(tree.NodeCount(), 0);
+    EXPECT_EQ(tree.Users(), 0);
+  }
+}
+
+TEST(SparseMerkleTree, sum_overflow) {
+  crypto::SparseMerkleTree tree(true);
+  ASSERT_TRUE(tree.Update({{1, 10}, {2, 20}}));
+  const auto root = tree.Root();
+  EXPECT_FALSE(tree.Update({{3, UINT64_MAX}}));
+  EXPECT_FALSE(tree.Update({{3, 1}, {4, UINT64_MAX - 30}}));
+  EXPECT_EQ(tree.Root(), root);
+  EXPECT_EQ(tree.RootSum(), 30u);
+  EXPECT_EQ(tree.Users(), 2u);
+
+  // balances replaced or removed by the batch make room
+  ASSERT_TRUE(tree.Update({{2, UINT64_MAX - 10}}));
+  EXPECT_EQ(tree.RootSum(), UINT64_MAX);
+  EXPECT_FALSE(tree.Update({{3, 1}}));
+  ASSERT_TRUE(tree.Update({{3, 5}}, {1}));
+  EXPECT_EQ(tree.RootSum(), UINT64_MAX - 5);
+  ASSERT_TRUE(tree.Update({{1, 4}, {1, 5}}));
+  EXPECT_EQ(tree.RootSum(), UINT64_MAX);
+
+  // without sums any balance fits
+  crypto::SparseMerkleTree plain;
+  EXPECT_TRUE(plain.Update({{1, UINT64_MAX}, {2, UINT64_MAX}}));
+}
+
+TEST(SparseMerkleTree, build_from_db) {
+  const std::string user_file = "../test/data/user_data/smt_users.txt";
+  std::map<uint64_t, uint64_t> users;
+  for (uint64_t id = 1; id <= 1000; ++id) {
+    users[id * 3] = id * 11;
+  }
+  {
+    std::ofstream f(user_file);
+    f << users.size() << std::endl;
+    for (const auto& user : users) {
+      f << "(" << user.first << "," << user.second << ")" << std::endl;
+    }
+  }
+
+  for (bool sum_tree : {false, true}) {
+    for (const char* suffix : {".index", ".merkle", ".append"}) {
+      std::filesystem::remove(user_file + suffix);
+    }
+    crypto::PoROptions options;
+    options.sum_tree = sum_tree;
+    options.binary_records = sum_tree;
+    crypto::PoRDB db;
+    ASSERT_TRUE(db.Load(user_file, options));
+    ASSERT_TRUE(db.Append({{4000, 5}, {4003, 6}}));
+    crypto::SparseMerkleTree tree(sum_tree);
+    ASSERT_TRUE(tree.Build(db, 4));
+    users[4000] = 5;
+    users[4003] = 6;
+    EXPECT_EQ(tree.Root(), rebuilt(users, sum_tree).Root());
+    EXPECT_EQ(tree.RootSum(), db.TotalLiabilities());
+
+    for (uint64_t id = 0; id <= 4004; ++id) {
+      std::string proof, db_proof;
+      EXPECT_EQ(tree.UserInfo(id, proof), db.UserInfo(id, db_proof));
+    }
+  }
+
+  crypto::PoRDB empty;
+  crypto::SparseMerkleTree tree;
+  EXPECT_FALSE(tree.Build(empty));
+  for (const char* suffix : {"", ".index", ".merkle", ".append"}) {
+    std::filesystem::remove(user_file + suffix);
+  }
+}
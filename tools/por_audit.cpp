@@ -0,0 +1,164 @@
+// Offline audit of a PoR database: re-parses every user record and recomputes
+// the whole merkle tree with threads, cross-checking each stored node. The
+// index and merkle file are never rebuilt, a missing file or bad fingerprint
+// fails the audit.
+//
+//   ./por_audit -p users.txt [-root HEX] [-threads N] [database flags]
+//
+// Exits 0 if the tree is consistent, 1 with the first mismatching node
+// otherwise.
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "por_db.h"
+
+namespace {
+void usage() {
+  std::cout
+      << "usage: por_audit -p path [options]\n"
+         "  -root HEX     expected merkle root\n"
+         "  -threads N    audit threads, default one per hardware thread\n"
+         "  -sum          merkle sum tree\n"
+         "  -compress     user ids of index in Elias-Fano encoding\n"
+         "  -binary       user records as fixed-width binary\n"
+         "  -learned N    learned model of error bound N\n"
+         "  -pool MB      read por db with pread into a buffer pool of this "
+         "many MB\n"
+         "  -prune K      K bottom merkle levels dropped\n"
+         "  -single       por db in one file of page-aligned sections\n"
+         "  -assets N     N balance columns per user record, one per asset\n";
+}
+
+std::string hex(const std::vector<uint8_t>& bytes) {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string s;
+  for (uint8_t b : bytes) {
+    s.push_back(kDigits[b >> 4]);
+    s.push_back(kDigits[b & 0x0f]);
+  }
+  return s;
+}
+
+// empty if s is not hex
+std::vector<uint8_t> unhex(const std::string& s) {
+  auto digit = [](char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+  std::vector<uint8_t> bytes;
+  if (s.size() % 2 != 0) {
+    return bytes;
+  }
+  for (size_t i = 0; i < s.size(); i += 2) {
+    int high = digit(s[i]);
+    int low = digit(s[i + 1]);
+    if (high < 0 || low < 0) {
+      return {};
+    }
+    bytes.push_back(static_cast<uint8_t>(high << 4 | low));
+  }
+  return bytes;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path;
+  std::vector<uint8_t> expected_root;
+  size_t threads = 0;
+  crypto::PoROptions options;
+  options.rebuild = false;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    // accept -flag and --flag, values as -flag value or -flag=value
+    if (flag.rfind("--", 0) == 0) {
+      flag.erase(0, 1);
+    }
+    std::string value;
+    size_t eq = flag.find('=');
+    if (eq != std::string::npos) {
+      value = flag.substr(eq + 1);
+      flag.resize(eq);
+    }
+    auto next = [&]() {
+      if (eq == std::string::npos && i + 1 < argc) {
+        value = argv[++i];
+      }
+      return value;
+    };
+
+    if (flag == "-p") {
+      path = next();
+    } else if (flag == "-root") {
+      expected_root = unhex(next());
+      if (expected_root.size() != 32) {
+        std::cout << "Invalid merkle root: " << value << std::endl;
+        return 2;
+      }
+    } else if (flag == "-threads") {
+      threads = std::stoul(next());
+    } else if (flag == "-sum") {
+      options.sum_tree = true;
+    } else if (flag == "-compress") {
+      options.compressed_index = true;
+    } else if (flag == "-binary") {
+      options.binary_records = true;
+    } else if (flag == "-learned") {
+      options.learned_index_epsilon = std::stoul(next());
+      options.learned_index = options.learned_index_epsilon > 0;
+    } else if (flag == "-pool") {
+      options.buffer_pool_bytes = std::stoul(next()) << 20;
+      options.map_strategy = crypto::MapStrategy::kBufferPool;
+    } else if (flag == "-prune") {
+      options.merkle_dropped_levels = std::stoul(next());
+    } else if (flag == "-single") {
+      options.single_file = true;
+    } else if (flag == "-assets") {
+      options.assets = std::stoul(next());
+    } else {
+      usage();
+      return flag == "-h" || flag == "-help" ? 0 : 2;
+    }
+  }
+  if (path.empty()) {
+    std::cout << "Please specify Proof of Preserve DB path: ./por_audit -p path"
+              << std::endl;
+    return 2;
+  }
+
+  std::string absolute_path = std::filesystem::absolute(path).string();
+  auto& db = crypto::PoRDB::Instance();
+  if (!db.Load(absolute_path, options)) {
+    std::cout << "Fail to load Proof of Preserve DB, index, merkle or single "
+                 "file is missing or doesn't match its fingerprint"
+              << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  crypto::AuditReport report;
+  bool ok = db.Audit(report, threads, expected_root);
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  std::cout << "users: " << report.users << ", nodes: " << report.nodes
+            << ", " << seconds << " s" << std::endl;
+  if (!ok) {
+    std::cout << "mismatch at height " << report.height << ", index "
+              << report.index << ": " << report.error << std::endl;
+    return 1;
+  }
+  std::cout << "root: " << hex(report.root);
+  if (options.sum_tree) {
+    std::cout << ", total liabilities: " << report.root_sum;
+  }
+  std::cout << std::endl;
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Loader of a PoR database shared by the service processes of a host: builds
+// or verifies the single file once and publishes it into the shared memory
+// segment /dev/shm/NAME, which por_server -shm NAME and the PoR service
+// attach to read-only, so its pages are paid once per host.
+//
+//   ./por_loader -p users.txt -name NAME [-hugepage] [-watch S] [flags]
+//   ./por_loader -name NAME -unlink
+//
+// With -watch the loader stays up and rebuilds and republishes the database
+// whenever the user data file changes. Processes attached to the previous
+// segment keep serving it until they are restarted.
+#include <signal.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "por_db.h"
+
+namespace {
+void usage() {
+  std::cout
+      << "usage: por_loader -p path -name NAME [options]\n"
+         "  -name NAME    segment name under /dev/shm\n"
+         "  -hugepage     advise transparent huge pages for the segment\n"
+         "  -watch S      republish when the user data file changes, checked "
+         "every S seconds\n"
+         "  -unlink       remove the segment and exit\n"
+         "  -sum          build merkle sum tree\n"
+         "  -compress     store user ids of index in Elias-Fano encoding\n"
+         "  -binary       store user records as fixed-width binary\n"
+         "  -learned N    locate ids with a learned model of error bound N\n"
+         "  -filter       reject unknown ids with an in-memory Bloom filter\n"
+         "  -prune K      drop K bottom merkle levels, rehash them per proof\n"
+         "  -assets N     N balance columns per user record, one per asset\n";
+}
+
+volatile sig_atomic_t stopped = 0;
+
+void onSignal(int) { stopped = 1; }
+
+// load, rebuilding the single file if it doesn't match the options, and
+// publish
+bool publish(const std::string& path, const crypto::PoROptions& options,
+             const std::string& name, bool huge_pages) {
+  auto start = std::chrono::steady_clock::now();
+  auto& db = crypto::PoRDB::Instance();
+  if (!db.Load(path, options) || !db.Publish(name, huge_pages)) {
+    std::cout << "Fail to publish Proof of Preserve DB " << path << " as "
+              << name << std::endl;
+    return false;
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  std::cout << "Published " << path << " as /dev/shm/" << name << ", "
+            << std::filesystem::file_size("/dev/shm/" + name) << " bytes, "
+            << seconds << " s" << std::endl;
+  return true;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path;
+  std::string name;
+  bool huge_pages = false;
+  bool unpublish = false;
+  int watch_seconds = 0;
+  crypto::PoROptions options;
+  options.single_file = true;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    // accept -flag and --flag, values as -flag value or -flag=value
+    if (flag.rfind("--", 0) == 0) {
+      flag.erase(0, 1);
+    }
+    std::string value;
+    size_t eq = flag.find('=');
+    if (eq != std::string::npos) {
+      value = flag.substr(eq + 1);
+      flag.resize(eq);
+    }
+    auto next = [&]() {
+      if (eq == std::string::npos && i + 1 < argc) {
+        value = argv[++i];
+      }
+      return value;
+    };
+
+    if (flag == "-p") {
+      path = next();
+    } else if (flag == "-name") {
+      name = next();
+    } else if (flag == "-hugepage") {
+      huge_pages = true;
+    } else if (flag == "-watch") {
+      watch_seconds = std::stoi(next());
+    } else if (flag == "-unlink") {
+      unpublish = true;
+    } else if (flag == "-sum") {
+      options.sum_tree = true;
+    } else if (flag == "-compress") {
+      options.compressed_index = true;
+    } else if (flag == "-binary") {
+      options.binary_records = true;
+    } else if (flag == "-learned") {
+      options.learned_index_epsilon = std::stoul(next());
+      options.learned_index = options.learned_index_epsilon > 0;
+    } else if (flag == "-filter") {
+      options.id_filter = true;
+    } else if (flag == "-prune") {
+      options.merkle_dropped_levels = std::stoul(next());
+    } else if (flag == "-assets") {
+      options.assets = std::stoul(next());
+    } else {
+      usage();
+      return flag == "-h" || flag == "-help" ? 0 : 2;
+    }
+  }
+  if (name.empty()) {
+    usage();
+    return 2;
+  }
+  if (unpublish) {
+    return crypto::PoRDB::Unpublish(name) ? 0 : 1;
+  }
+  if (path.empty()) {
+    std::cout << "Please specify Proof of Preserve DB path: ./por_loader -p "
+                 "path -name NAME"
+              << std::endl;
+    return 2;
+  }
+
+  std::string absolute_path = std::filesystem::absolute(path).string();
+  if (!publish(absolute_path, options, name, huge_pages)) {
+    return 1;
+  }
+  if (watch_seconds <= 0) {
+    return 0;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  std::error_code ec;
+  auto mtime = std::filesystem::last_write_time(absolute_path, ec);
+  while (!stopped) {
+    std::this_thread::sleep_for(std::chrono::seconds(watch_seconds));
+    auto changed = std::filesystem::last_write_time(absolute_path, ec);
+    if (ec || changed == mtime) {
+      continue;
+    }
+    // the single file only checks its own fingerprint, drop it to rebuild
+    // from the new user data
+    mtime = changed;
+    std::filesystem::remove(absolute_path + ".por", ec);
+    publish(absolute_path, options, name, huge_pages);
+  }
+  return 0;
+}
@@ -0,0 +1,316 @@
+// Closed-loop HTTP load generator for the /por endpoint (por_server or
+// app/porwebapi.go). Each thread drives its share of keep-alive connections
+// from one epoll loop, keeping -pipeline requests in flight per connection.
+//
+//   ./por_loadgen -port 8080 -c 64 -t 4 -d 10 -u users.txt
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct options {
+  std::string host = "127.0.0.1";
+  uint16_t port = 8080;
+  size_t connections = 16;
+  size_t threads = 1;
+  size_t pipeline = 1;
+  double seconds = 10;
+  // ids are drawn from the users file if given, else uniformly below max_id
+  std::string users_file;
+  uint64_t max_id = 1000000;
+};
+
+struct connection {
+  int fd = -1;
+  std::string in;
+  // send times of requests in flight
+  std::deque<Clock::time_point> sent;
+};
+
+struct result {
+  uint64_t responses = 0;
+  uint64_t not_found = 0;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+  // latency of each response in microseconds
+  std::vector<uint32_t> latencies;
+};
+
+void usage() {
+  std::cout << "usage: por_loadgen [options]\n"
+               "  -host A       server address, default 127.0.0.1\n"
+               "  -port N       server port, default 8080\n"
+               "  -c N          connections, default 16\n"
+               "  -t N          threads, default 1\n"
+               "  -pipeline N   requests in flight per connection, default 1\n"
+               "  -d SECONDS    duration, default 10\n"
+               "  -u FILE       draw ids from this user file\n"
+               "  -ids N        draw ids uniformly below N, default 1000000\n";
+}
+
+// ids of "(id,balance)" lines
+std::vector<uint64_t> readIds(const std::string& path) {
+  std::vector<uint64_t> ids;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    uint64_t id = 0;
+    if (line.size() > 1 &&
+        std::from_chars(line.data() + 1, line.data() + line.size(), id).ec ==
+            std::errc()) {
+      ids.push_back(id);
+    }
+  }
+  return ids;
+}
+
+int connectTo(const options& opts) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opts.port);
+  if (inet_pton(AF_INET, opts.host.c_str(), &address.sin_addr) != 1) {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+      0) {
+    close(fd);
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+// parses one response at the front of in, returns its size or 0
+size_t parseResponse(const std::string& in, int& status) {
+  size_t head_end = in.find("\r\n\r\n");
+  if (head_end == std::string::npos) {
+    return 0;
+  }
+  size_t length = 0;
+  size_t length_at = in.find("Content-Length: ");
+  if (length_at != std::string::npos && length_at < head_end) {
+    std::from_chars(in.data() + length_at + 16, in.data() + head_end, length);
+  }
+  if (in.size() < head_end + 4 + length) {
+    return 0;
+  }
+  status = 0;
+  if (in.size() > 12) {
+    std::from_chars(in.data() + 9, in.data() + 12, status);
+  }
+  return head_end + 4 + length;
+}
+
+void drive(const options& opts, const std::vector<uint64_t>& ids,
+           size_t connection_count, uint64_t seed, Clock::time_point deadline,
+           result& out) {
+  std::mt19937_64 random(seed);
+  auto nextRequest = [&]() {
+    uint64_t id = ids.empty() ? random() % opts.max_id
+                              : ids[random() % ids.size()];
+    return "GET /por?id=" + std::to_string(id) + " HTTP/1.1\r\nHost: " +
+           opts.host + "\r\n\r\n";
+  };
+  auto sendRequest = [&](connection& c) {
+    std::string request = nextRequest();
+    c.sent.push_back(Clock::now());
+    return send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+           static_cast<ssize_t>(request.size());
+  };
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  std::vector<connection> connections(connection_count);
+  size_t open = 0;
+  for (size_t i = 0; i < connection_count; ++i) {
+    connection& c = connections[i];
+    c.fd = connectTo(opts);
+    if (c.fd < 0) {
+      ++out.errors;
+      continue;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &event);
+    ++open;
+    for (size_t k = 0; k < opts.pipeline; ++k) {
+      sendRequest(c);
+    }
+  }
+
+  epoll_event events[256];
+  char chunk[64 * 1024];
+  while (open > 0) {
+    auto now = Clock::now();
+    // after the deadline in-flight requests are drained for a second
+    if (now > deadline + std::chrono::seconds(1)) {
+      break;
+    }
+    int n = epoll_wait(epoll_fd, events, 256, 100);
+    for (int i = 0; i < n; ++i) {
+      connection& c = connections[events[i].data.u64];
+      ssize_t size = read(c.fd, chunk, sizeof(chunk));
+      if (size <= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        ++out.errors;
+        --open;
+        continue;
+      }
+      c.in.append(chunk, size);
+      out.bytes += size;
+
+      int status = 0;
+      size_t consumed = 0;
+      while ((consumed = parseResponse(c.in, status)) > 0) {
+        c.in.erase(0, consumed);
+        now = Clock::now();
+        out.latencies.push_back(static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                now - c.sent.front())
+                .count()));
+        c.sent.pop_front();
+        ++out.responses;
+        if (status == 404) {
+          ++out.not_found;
+        } else if (status != 200) {
+          ++out.errors;
+        }
+        if (now < deadline) {
+          sendRequest(c);
+        }
+      }
+      if (now >= deadline && c.sent.empty()) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        --open;
+      }
+    }
+  }
+
+  for (auto& c : connections) {
+    if (c.fd >= 0) {
+      close(c.fd);
+    }
+  }
+  close(epoll_fd);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    if (flag.rfind("--", 0) == 0) {
+      flag.erase(0, 1);
+    }
+    if (flag == "-h" || flag == "-help" || i + 1 >= argc) {
+      usage();
+      return flag == "-h" || flag == "-help" ? 0 : 2;
+    }
+    std::string value = argv[++i];
+    bool known = true;
+    if (flag == "-host") {
+      opts.host = value;
+    } else if (flag == "-port") {
+      opts.port = static_cast<uint16_t>(std::stoi(value));
+    } else if (flag == "-c") {
+      opts.connections = std::stoul(value);
+    } else if (flag == "-t") {
+      opts.threads = std::stoul(value);
+    } else if (flag == "-pipeline") {
+      opts.pipeline = std::stoul(value);
+    } else if (flag == "-d") {
+      opts.seconds = std::stod(value);
+    } else if (flag == "-u") {
+      opts.users_file = value;
+    } else if (flag == "-ids") {
+      opts.max_id = std::stoull(value);
+    } else {
+      known = false;
+    }
+    if (!known) {
+      usage();
+      return 2;
+    }
+  }
+  opts.threads = std::max<size_t>(1, std::min(opts.threads, opts.connections));
+  opts.pipeline = std::max<size_t>(1, opts.pipeline);
+  opts.max_id = std::max<uint64_t>(1, opts.max_id);
+
+  std::vector<uint64_t> ids;
+  if (!opts.users_file.empty()) {
+    ids = readIds(opts.users_file);
+    if (ids.empty()) {
+      std::cout << "No user ids in " << opts.users_file << std::endl;
+      return 1;
+    }
+  }
+
+  auto start = Clock::now();
+  auto deadline =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(opts.seconds));
+  std::vector<result> results(opts.threads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < opts.threads; ++t) {
+    // connections split as evenly as possible over threads
+    size_t count = opts.connections / opts.threads +
+                   (t < opts.connections % opts.threads ? 1 : 0);
+    threads.emplace_back([&, t, count]() {
+      drive(opts, ids, count, t + 1, deadline, results[t]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  result total;
+  for (auto& r : results) {
+    total.responses += r.responses;
+    total.not_found += r.not_found;
+    total.errors += r.errors;
+    total.bytes += r.bytes;
+    total.latencies.insert(total.latencies.end(), r.latencies.begin(),
+                           r.latencies.end());
+  }
+  std::sort(total.latencies.begin(), total.latencies.end());
+  auto percentile = [&total](double p) -> uint32_t {
+    if (total.latencies.empty()) {
+      return 0;
+    }
+    size_t index = static_cast<size_t>(p * (total.latencies.size() - 1));
+    return total.latencies[index];
+  };
+
+  std::cout << "responses: " << total.responses
+            << " (not found: " << total.not_found
+            << ", errors: " << total.errors << ")\n"
+            << "throughput: " << static_cast<uint64_t>(total.responses / elapsed)
+            << " req/s, " << total.bytes / elapsed / (1 << 20) << " MB/s\n"
+            << "latency us: p50 " << percentile(0.5) << ", p90 "
+            << percentile(0.9) << ", p99 " << percentile(0.99) << ", p99.9 "
+            << percentile(0.999) << ", max " << percentile(1) << std::endl;
+  return total.errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+// Native frontend of the PoR service: serves GET /por?id= and GET /ready like
+// app/porwebapi.go, without the cgo and goroutine hop per request.
+//
+//   ./por_server -p users.txt [-port 8080] [-reactors N] [database flags]
+//
+// Database flags are the ones of app/porwebapi.go.
+#include <signal.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "por_db.h"
+#include "por_server.h"
+#include "sharded_por_db.h"
+#include "wrapper.h"
+
+namespace {
+void usage() {
+  std::cout
+      << "usage: por_server -p path [options]\n"
+         "  -port N       listen port, default $PORT or 8080\n"
+         "  -address A    listen address, default 0.0.0.0\n"
+         "  -reactors N   epoll loops, default one per hardware thread\n"
+         "  -sum          build merkle sum tree\n"
+         "  -shards N     split por db into shards by user id range\n"
+         "  -map N        0: mmap+mlock, 1: MAP_POPULATE, 2: transparent huge "
+         "page, 3: hugetlbfs\n"
+         "  -numa         interleave huge page copies over NUMA nodes\n"
+         "  -warmup       prefault por db in background, /ready reports 503 "
+         "until done\n"
+         "  -compress     store user ids of index in Elias-Fano encoding\n"
+         "  -binary       store user records as fixed-width binary\n"
+         "  -learned N    locate ids with a learned model of error bound N\n"
+         "  -filter       reject unknown ids with an in-memory Bloom filter\n"
+         "  -cache MB     cache responses of hot users within this many MB\n"
+         "  -pool MB      read por db with pread into a buffer pool of this "
+         "many MB\n"
+         "  -prune K      drop K bottom merkle levels, rehash them per proof\n"
+         "  -single       keep por db in one file of page-aligned sections\n"
+         "  -assets N     N balance columns per user record, one per asset\n"
+         "  -shm NAME     attach to the por db por_loader published as NAME, "
+         "-p is not needed\n";
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path;
+  std::string shared_memory;
+  PoRLoadOptions load_options{};
+  crypto::PoRServerOptions server_options;
+  if (const char* port = std::getenv("PORT")) {
+    server_options.port = static_cast<uint16_t>(std::atoi(port));
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    // accept -flag and --flag, values as -flag value or -flag=value
+    if (flag.rfind("--", 0) == 0) {
+      flag.erase(0, 1);
+    }
+    std::string value;
+    size_t eq = flag.find('=');
+    if (eq != std::string::npos) {
+      value = flag.substr(eq + 1);
+      flag.resize(eq);
+    }
+    auto next = [&]() {
+      if (eq == std::string::npos && i + 1 < argc) {
+        value = argv[++i];
+      }
+      return value;
+    };
+
+    if (flag == "-p") {
+      path = next();
+    } else if (flag == "-port") {
+      server_options.port = static_cast<uint16_t>(std::stoi(next()));
+    } else if (flag == "-address") {
+      server_options.address = next();
+    } else if (flag == "-reactors") {
+      server_options.reactors = std::stoul(next());
+    } else if (flag == "-sum") {
+      load_options.sum_tree = 1;
+    } else if (flag == "-shards") {
+      load_options.shards = std::stoi(next());
+    } else if (flag == "-map") {
+      load_options.map_strategy = std::stoi(next());
+    } else if (flag == "-numa") {
+      load_options.numa_interleave = 1;
+    } else if (flag == "-warmup") {
+      load_options.warmup = 1;
+    } else if (flag == "-compress") {
+      load_options.compressed_index = 1;
+    } else if (flag == "-binary") {
+      load_options.binary_records = 1;
+    } else if (flag == "-learned") {
+      load_options.learned_index_epsilon = std::stoi(next());
+      load_options.learned_index = load_options.learned_index_epsilon > 0;
+    } else if (flag == "-filter") {
+      load_options.id_filter = 1;
+    } else if (flag == "-cache") {
+      load_options.response_cache_mb = std::stoi(next());
+    } else if (flag == "-pool") {
+      load_options.buffer_pool_mb = std::stoi(next());
+    } else if (flag == "-prune") {
+      load_options.merkle_dropped_levels = std::stoi(next());
+    } else if (flag == "-single") {
+      load_options.single_file = 1;
+    } else if (flag == "-assets") {
+      load_options.assets = std::stoi(next());
+    } else if (flag == "-shm") {
+      shared_memory = next();
+    } else {
+      usage();
+      return flag == "-h" || flag == "-help" ? 0 : 2;
+    }
+  }
+  if (path.empty() && shared_memory.empty()) {
+    std::cout << "Please specify Proof of Preserve DB path: ./por_server -p path"
+              << std::endl;
+    return 1;
+  }
+
+  std::string absolute_path;
+  if (!shared_memory.empty()) {
+    load_options.shared_memory = shared_memory.c_str();
+    load_options.shards = 0;
+    absolute_path = "/dev/shm/" + shared_memory;
+  } else {
+    absolute_path = std::filesystem::absolute(path).string();
+  }
+  if (LoadDBWithOptions(absolute_path.c_str(), &load_options) == 0) {
+    std::cout << "Fail to load Proof of Preserve DB" << std::endl;
+    return 1;
+  }
+  std::cout << "Sucessfully load Proof of Preserve DB: " << absolute_path
+            << std::endl;
+
+  crypto::PoRServer::Lookup lookup;
+  if (load_options.shards > 1) {
+    lookup = [](uint64_t id, std::string& json) {
+      return crypto::ShardedPoRDB::Instance().UserInfoJson(id, json);
+    };
+  } else {
+    lookup = [](uint64_t id, std::string& json) {
+      return crypto::PoRDB::Instance().UserInfoJson(id, json);
+    };
+  }
+
+  // reactor threads inherit the blocked signals, main waits for them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  crypto::PoRServer server(lookup, []() { return DBReady() != 0; });
+  if (!server.Start(server_options)) {
+    std::cout << "Fail to listen on " << server_options.address << ":"
+              << server_options.port << std::endl;
+    return 1;
+  }
+  std::cout << "Listening on " << server_options.address << ":"
+            << server.Port() << std::endl;
+
+  int signal = 0;
+  sigwait(&signals, &signal);
+  server.Stop();
+  std::cout << "Served " << server.Requests() << " requests over "
+            << server.Connections() << " connections" << std::endl;
+  return 0;
+}